@@ -0,0 +1,207 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <algorithm> // std::min
+#include <cstdlib>   // std::abs
+#include <string>    // std::string, std::to_string
+
+#include "zepto8.h"
+#include "ansi.h"
+
+namespace z8
+{
+
+void ansi_encoder::set_size(lol::ivec2 size)
+{
+    m_size = size;
+    invalidate();
+}
+
+void ansi_encoder::set_truecolor(bool enable)
+{
+    m_truecolor = enable;
+    m_codes.clear();
+    invalidate();
+}
+
+void ansi_encoder::invalidate()
+{
+    m_valid = false;
+}
+
+std::string const &ansi_encoder::encode(vm_base const &vm)
+{
+    int const width = std::min(128, m_size.x), height = std::min(64, m_size.y);
+
+    m_buf.clear();
+    m_pixels.resize(128 * 128);
+    vm.render_xrgb8888(m_pixels.data());
+
+    if (!m_valid)
+    {
+        // Clear with the default colours, then hide the cursor
+        m_buf += "\x1b[0m\x1b[2J\x1b[?25l";
+        m_cells.assign(128 * 64, ~cell(0));
+        m_fg = m_bg = unknown;
+        m_x = m_y = -1;
+        m_valid = true;
+    }
+
+    for (int y = 0; y < height; ++y)
+    {
+        uint32_t const *top = &m_pixels[2 * y * 128], *bottom = top + 128;
+
+        for (int x = 0; x < width; ++x)
+        {
+            uint32_t const t = top[x], b = bottom[x];
+            cell const c = cell(t) << 32 | b;
+            if (m_cells[y * 128 + x] == c)
+                continue;
+            m_cells[y * 128 + x] = c;
+
+            move_to(x, y);
+
+            // Pick the glyph that needs the fewest colour changes: a space
+            // only needs a background
+            if (t == b)
+            {
+                if (m_bg == t)
+                    m_buf += ' ';
+                else if (m_fg == t)
+                    m_buf += "█";
+                else
+                {
+                    set_colors(m_fg, t);
+                    m_buf += ' ';
+                }
+            }
+            else if ((m_fg != t) + (m_bg != b) <= (m_fg != b) + (m_bg != t))
+            {
+                set_colors(t, b);
+                m_buf += "▀";
+            }
+            else
+            {
+                set_colors(b, t);
+                m_buf += "▄";
+            }
+
+            // After the last column the cursor position depends on the
+            // terminal’s wrapping behaviour
+            m_x = x + 1 < m_size.x ? x + 1 : -1;
+        }
+    }
+
+    return m_buf;
+}
+
+std::string const &ansi_encoder::finish()
+{
+    m_buf = "\x1b[0m\x1b[?25h";
+    if (m_valid)
+        m_buf += "\x1b[" + std::to_string(std::min(64, m_size.y)) + "H\r\n";
+    invalidate();
+    return m_buf;
+}
+
+void ansi_encoder::move_to(int x, int y)
+{
+    if (m_x == x && m_y == y)
+        return;
+
+    if (m_y == y && m_x >= 0 && x > m_x)
+    {
+        // Overwriting a few unchanged cells with spaces is cheaper than a
+        // cursor movement, if their colour is already the right one
+        int const n = x - m_x;
+        bool spaces = n <= 3 && m_bg != unknown;
+        for (int i = m_x; spaces && i < x; ++i)
+            spaces = m_cells[y * 128 + i] == (cell(m_bg) << 32 | m_bg);
+
+        if (spaces)
+            m_buf.append(n, ' ');
+        else
+            m_buf += n == 1 ? "\x1b[C" : "\x1b[" + std::to_string(n) + "C";
+    }
+    else if (x == 0 && m_y >= 0 && y == m_y + 1)
+        m_buf += "\r\n";
+    else if (x == 0)
+        m_buf += "\x1b[" + std::to_string(y + 1) + "H";
+    else
+        m_buf += "\x1b[" + std::to_string(y + 1) + ";" + std::to_string(x + 1) + "H";
+
+    m_x = x;
+    m_y = y;
+}
+
+void ansi_encoder::set_colors(uint32_t fg, uint32_t bg)
+{
+    bool const set_fg = fg != m_fg && fg != unknown, set_bg = bg != m_bg;
+    if (!set_fg && !set_bg)
+        return;
+
+    m_buf += "\x1b[";
+    if (set_fg)
+        m_buf += "38;" + color_code(fg);
+    if (set_fg && set_bg)
+        m_buf += ';';
+    if (set_bg)
+        m_buf += "48;" + color_code(bg);
+    m_buf += 'm';
+
+    m_fg = fg;
+    m_bg = bg;
+}
+
+// The SGR parameters for a colour, without the 38 or 48 prefix
+std::string const &ansi_encoder::color_code(uint32_t rgb)
+{
+    auto it = m_codes.find(rgb);
+    if (it != m_codes.end())
+        return it->second;
+
+    int const r = rgb >> 16 & 0xff, g = rgb >> 8 & 0xff, b = rgb & 0xff;
+    if (m_truecolor)
+        return m_codes[rgb] = "2;" + std::to_string(r) + ";" + std::to_string(g) + ";" + std::to_string(b);
+
+    // Nearest colour of the xterm 6×6×6 cube or of its grey ramp
+    static int const levels[] = { 0, 95, 135, 175, 215, 255 };
+    auto sq = [](int x) { return x * x; };
+    auto nearest = [&](int v)
+    {
+        int best = 0;
+        for (int i = 1; i < 6; ++i)
+            if (std::abs(levels[i] - v) < std::abs(levels[best] - v))
+                best = i;
+        return best;
+    };
+
+    int const cr = nearest(r), cg = nearest(g), cb = nearest(b);
+    int index = 16 + 36 * cr + 6 * cg + cb;
+    int dist = sq(levels[cr] - r) + sq(levels[cg] - g) + sq(levels[cb] - b);
+
+    for (int i = 0; i < 24; ++i)
+    {
+        int const v = 8 + 10 * i, d = sq(v - r) + sq(v - g) + sq(v - b);
+        if (d < dist)
+            index = 232 + i, dist = d;
+    }
+
+    return m_codes[rgb] = "5;" + std::to_string(index);
+}
+
+} // namespace z8
+
@@ -0,0 +1,76 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <lol/vector>    // lol::ivec2
+#include <string>        // std::string
+#include <unordered_map> // std::unordered_map
+#include <vector>        // std::vector
+#include <cstdint>       // uint32_t, uint64_t
+
+// The ansi_encoder class
+// ——————————————————————
+// Draws the screen of a VM in a terminal using ANSI escape sequences, with
+// two pixels per character cell. The encoder remembers what the terminal
+// shows, so that each frame only sends the cells that changed: the cursor
+// jumps over unchanged runs, and colours are only set when they differ
+// from the current ones, even across rows. Colours are either the nearest
+// of the 256 xterm colours, or 24-bit for terminals that support it.
+
+namespace z8
+{
+
+class vm_base;
+
+class ansi_encoder
+{
+public:
+    // Terminal size in characters; this forces a full redraw
+    void set_size(lol::ivec2 size);
+
+    void set_truecolor(bool enable);
+
+    // Forget what the terminal shows; the next frame clears the terminal
+    // and draws everything
+    void invalidate();
+
+    // Escape sequences that draw the current VM screen; the buffer is
+    // reused by the next call
+    std::string const &encode(vm_base const &vm);
+
+    // Escape sequences that restore the terminal colours and cursor
+    std::string const &finish();
+
+private:
+    using cell = uint64_t; // top pixel << 32 | bottom pixel
+
+    void move_to(int x, int y);
+    void set_colors(uint32_t fg, uint32_t bg);
+    std::string const &color_code(uint32_t rgb);
+
+    static uint32_t const unknown = 0xffffffffu;
+
+    lol::ivec2 m_size = lol::ivec2(128, 64);
+    bool m_truecolor = false, m_valid = false;
+
+    std::vector<uint32_t> m_pixels; // current frame
+    std::vector<cell> m_cells;      // what the terminal shows
+    uint32_t m_fg = unknown, m_bg = unknown;
+    int m_x = -1, m_y = -1;         // cursor position, or -1 if unknown
+
+    std::string m_buf;
+    std::unordered_map<uint32_t, std::string> m_codes;
+};
+
+} // namespace z8
+
@@ -0,0 +1,145 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <lol/utils> // lol::ends_with
+#include <algorithm> // std::max
+#include <deque>     // std::deque
+#include <fstream>   // std::ifstream
+#include <mutex>     // std::mutex
+#include <thread>    // std::thread
+
+#include "batch.h"
+#include "pico8/vm.h"
+#include "raccoon/vm.h"
+
+namespace z8
+{
+
+batch::batch(int threads)
+  : m_threads(threads > 0 ? threads : std::max(1, (int)std::thread::hardware_concurrency()))
+{
+}
+
+// Jobs are dealt round-robin to per-worker queues. A worker takes jobs
+// from the back of its own queue, and when it runs out, steals from the
+// front of the others, so that long jobs do not leave threads idle.
+void batch::run(std::vector<batch_job> const &jobs)
+{
+    struct queue
+    {
+        std::mutex mutex;
+        std::deque<size_t> jobs;
+    };
+
+    int const count = std::min(m_threads, std::max(1, (int)jobs.size()));
+    std::unique_ptr<queue[]> queues(new queue[count]);
+    for (size_t i = 0; i < jobs.size(); ++i)
+        queues[i % count].jobs.push_back(i);
+
+    auto next = [&](int self, size_t &job)
+    {
+        for (int k = 0; k < count; ++k)
+        {
+            auto &q = queues[(self + k) % count];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (q.jobs.empty())
+                continue;
+            if (k == 0)
+            {
+                job = q.jobs.back();
+                q.jobs.pop_back();
+            }
+            else
+            {
+                job = q.jobs.front();
+                q.jobs.pop_front();
+            }
+            return true;
+        }
+        return false;
+    };
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < count; ++i)
+        workers.emplace_back([&, i]()
+        {
+            // No job is ever added, so once all queues are empty we are done
+            for (size_t job; next(i, job); )
+                run_job(jobs[job]);
+        });
+
+    for (auto &t : workers)
+        t.join();
+}
+
+void batch::run_job(batch_job const &job)
+{
+    std::unique_ptr<vm_base> vm;
+    if (lol::ends_with(job.cart, ".rcn.json"))
+        vm.reset((vm_base *)new raccoon::vm());
+    else
+        vm.reset((vm_base *)new pico8::vm());
+    vm->load(job.cart);
+    vm->set_deterministic(job.seed);
+    vm->run();
+
+    std::vector<int16_t> audio;
+    uint64_t buttons = 0;
+    int frame = 0;
+
+    while (frame < job.frames)
+    {
+        auto it = job.input.find(frame);
+        if (it != job.input.end())
+            buttons = it->second;
+        for (int i = 0; i < 64; ++i)
+            if ((buttons >> i) & 1)
+                vm->button(i, 1);
+
+        bool running = vm->step(1.f / 60.f);
+
+        // Audio is pulled at a fixed rate so that output only depends on
+        // the frame number
+        int64_t const rate = vm->get_audio_rate();
+        int const count = int((frame + 1) * rate / 60 - frame * rate / 60);
+        audio.resize(count);
+        vm->get_audio(job.sink ? audio.data() : nullptr, count, false);
+
+        if (job.sink)
+            job.sink->frame(frame, *vm, audio.data(), count);
+
+        ++frame;
+        if (!running)
+            break;
+    }
+
+    if (job.sink)
+        job.sink->done(frame);
+}
+
+std::map<int, uint64_t> batch::load_input(std::string const &name)
+{
+    std::map<int, uint64_t> ret;
+    std::ifstream f(name);
+    int frame;
+    std::string mask;
+    while (f >> frame >> mask)
+        ret[frame] = std::stoull(mask, nullptr, 0);
+    return ret;
+}
+
+} // namespace z8
+
@@ -0,0 +1,78 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <string> // std::string
+#include <vector> // std::vector
+#include <map>    // std::map
+#include <memory> // std::shared_ptr
+
+#include "zepto8.h"
+
+// The batch class
+// ———————————————
+// Runs many independent headless VMs on a pool of worker threads. Each job
+// runs one cart deterministically for a number of frames, with its own
+// input script, and reports its output to its own sink.
+
+namespace z8
+{
+
+// Receives the output of a batch job. The calls for a given job come from
+// a single worker thread, but different jobs run concurrently.
+class batch_sink
+{
+public:
+    virtual ~batch_sink() = default;
+
+    // Called after each frame, with the audio generated during it
+    virtual void frame(int frame, vm_base const &vm, int16_t const *audio, int count) {}
+
+    // Called once the job is finished; frames is the number of frames run,
+    // which is less than requested if the cart stopped
+    virtual void done(int frames) {}
+};
+
+struct batch_job
+{
+    std::string cart;
+
+    // Buttons held from each listed frame on, where bit n is button(n)
+    std::map<int, uint64_t> input;
+
+    int frames = 1800;
+    uint32_t seed = 0;
+    std::shared_ptr<batch_sink> sink;
+};
+
+class batch
+{
+public:
+    // Use all hardware threads if threads is 0
+    batch(int threads = 0);
+
+    // Run all jobs and return when they are finished
+    void run(std::vector<batch_job> const &jobs);
+
+    // Load an input script: each line has a frame number and a mask of
+    // the buttons held from that frame on
+    static std::map<int, uint64_t> load_input(std::string const &name);
+
+private:
+    void run_job(batch_job const &job);
+
+    int m_threads;
+};
+
+} // namespace z8
+
@@ -14,7 +14,9 @@
 #   include "config.h"
 #endif
 
-#include <optional>
+#include <optional> // std::optional
+#include <cmath>    // std::signbit
+#include <cstdint>  // INT32_MIN, INT32_MAX
 
 extern "C" {
 #include "3rdparty/quickjs/quickjs.h"
@@ -31,7 +33,17 @@ namespace z8::bindings
 
 static JSValue js_box(JSContext *ctx, bool x) { return JS_NewBool(ctx, (int)x); }
 static JSValue js_box(JSContext *ctx, int x) { return JS_NewInt32(ctx, x); }
-static JSValue js_box(JSContext *ctx, double x) { return JS_NewFloat64(ctx, x); }
+
+// Integral numbers are returned as tagged ints, like QuickJS does for the
+// results of its own arithmetic, so that the code using them stays on the
+// integer fast paths
+static JSValue js_box(JSContext *ctx, double x)
+{
+    if (x >= INT32_MIN && x <= INT32_MAX && x == (int32_t)x && (x != 0 || !std::signbit(x)))
+        return JS_NewInt32(ctx, (int32_t)x);
+    return JS_NewFloat64(ctx, x);
+}
+
 static JSValue js_box(JSContext* ctx, std::string s) { return JS_NewStringLen(ctx, s.c_str(), s.length()); }
 
 //
@@ -40,8 +52,30 @@ static JSValue js_box(JSContext* ctx, std::string s) { return JS_NewStringLen(ct
 
 template<typename T> static void js_unbox(JSContext *ctx, T &, JSValueConst jsval);
 
-template<> void js_unbox(JSContext *ctx, int &arg, JSValueConst jsval) { JS_ToInt32(ctx, &arg, jsval); }
-template<> void js_unbox(JSContext *ctx, double &arg, JSValueConst jsval) { JS_ToFloat64(ctx, &arg, jsval); }
+// Numbers are read directly from tagged values, and only other types, or
+// doubles that need the modular conversion, go through the library
+template<> void js_unbox(JSContext *ctx, int &arg, JSValueConst jsval)
+{
+    int const tag = JS_VALUE_GET_TAG(jsval);
+    if (tag == JS_TAG_INT)
+        arg = JS_VALUE_GET_INT(jsval);
+    else if (JS_TAG_IS_FLOAT64(tag) && JS_VALUE_GET_FLOAT64(jsval) > INT32_MIN - 1.0
+                                    && JS_VALUE_GET_FLOAT64(jsval) < INT32_MAX + 1.0)
+        arg = (int)JS_VALUE_GET_FLOAT64(jsval);
+    else
+        JS_ToInt32(ctx, &arg, jsval);
+}
+
+template<> void js_unbox(JSContext *ctx, double &arg, JSValueConst jsval)
+{
+    int const tag = JS_VALUE_GET_TAG(jsval);
+    if (tag == JS_TAG_INT)
+        arg = JS_VALUE_GET_INT(jsval);
+    else if (JS_TAG_IS_FLOAT64(tag))
+        arg = JS_VALUE_GET_FLOAT64(jsval);
+    else
+        JS_ToFloat64(ctx, &arg, jsval);
+}
 template<> void js_unbox(JSContext *ctx, std::string &str, JSValueConst jsval)
 {
     char const *data = JS_ToCString(ctx, jsval);
@@ -60,6 +94,21 @@ template<typename T> static T js_unbox(JSContext *ctx, JSValueConst jsval)
     T ret; js_unbox(ctx, ret, jsval); return ret;
 }
 
+// Argument getters for dispatch(), which knows the argument count: when
+// argument i is known to be present, there is no comparison with argc
+template<typename T> struct js_arg
+{
+    static inline T get(JSContext *ctx, JSValueConst *argv, int i)
+    {
+        return js_unbox<T>(ctx, argv[i]);
+    }
+
+    static inline T get(JSContext *ctx, JSValueConst *argv, int i, int argc)
+    {
+        return i < argc ? get(ctx, argv, i) : T();
+    }
+};
+
 //
 // JavaScript binding mechanism
 //
@@ -112,18 +161,29 @@ public:
 
 private:
     template<typename T, typename R, typename... A, size_t... IS>
-    static JSValue dispatch(JSContext *ctx, int argc, JSValueConst *argv,
-                            R (T::*f)(A...), std::index_sequence<IS...>)
+    static inline JSValue dispatch(JSContext *ctx, int argc, JSValueConst *argv,
+                                   R (T::*f)(A...), std::index_sequence<IS...>)
     {
-        // Retrieve “this” from the JS context.
+        // Retrieve “this” from the JS context; this is a single pointer
+        // stored once by init(), with no property or class lookup.
         T *that = (T *)JS_GetContextOpaque(ctx);
 
-        // Call the API function with the loaded arguments. Some specialization
-        // is needed when the wrapped function returns void.
+        // When the call provides at least as many arguments as the function
+        // takes (the usual case in hot code), no presence check is needed.
+        if (argc >= (int)sizeof...(A))
+            return call(ctx, that, f, js_arg<A>::get(ctx, argv, IS)...);
+        return call(ctx, that, f, js_arg<A>::get(ctx, argv, IS, argc)...);
+    }
+
+    // Call the API function with the loaded arguments. Some specialization
+    // is needed when the wrapped function returns void.
+    template<typename T, typename R, typename... A, typename... B>
+    static inline JSValue call(JSContext *ctx, T *that, R (T::*f)(A...), B&&... args)
+    {
         if constexpr (std::is_same<R, void>::value)
-            return (that->*f)(((int)IS < argc ? js_unbox<A>(ctx, argv[IS]) : A())...), JS_UNDEFINED;
+            return (that->*f)(std::forward<B>(args)...), JS_UNDEFINED;
         else
-            return js_box(ctx, (that->*f)(((int)IS < argc ? js_unbox<A>(ctx, argv[IS]) : A())...));
+            return js_box(ctx, (that->*f)(std::forward<B>(args)...));
     }
 };
 
@@ -16,6 +16,9 @@
 
 #include <optional>
 #include <variant>
+#include <vector>
+#include <chrono>
+#include <mutex>
 
 #include "3rdparty/z8lua/lua.h"
 #include "3rdparty/z8lua/lauxlib.h"
@@ -37,10 +40,14 @@ template<> int lua_push(lua_State *l, fix32 const &x) { lua_pushnumber(l, x); re
 template<> int lua_push(lua_State *l, std::string const &s) { lua_pushlstring(l, s.c_str(), (int)s.size()); return 1; }
 template<> int lua_push(lua_State *l, std::nullptr_t const &) { lua_pushnil(l); return 1; }
 
-// Boxing an std::variant pushes the active alternative
-template<typename... T> int lua_push(lua_State *l, std::variant<T...> const &x)
+// Boxing an std::variant pushes the active alternative; test each index
+// in turn, which compiles to a short branch chain instead of std::visit
+template<size_t N = 0, typename... T> int lua_push(lua_State *l, std::variant<T...> const &x)
 {
-    return std::visit([l](auto&& arg) -> int { return lua_push(l, arg); }, x);
+    if constexpr (N + 1 < sizeof...(T))
+        if (x.index() != N)
+            return lua_push<N + 1>(l, x);
+    return lua_push(l, *std::get_if<N>(&x));
 }
 
 // Boxing an std::optional returns 0 or 1 depending on whether there is an object
@@ -81,6 +88,28 @@ template<typename T> static T lua_get(lua_State *l, int i)
     T ret; lua_get(l, i, ret); return ret;
 }
 
+// Argument getters for dispatch(), which knows the argument count: when
+// argument i is known to be present, std::optional is built directly,
+// otherwise the check is a comparison with argc instead of lua_isnone().
+template<typename T> struct lua_arg
+{
+    static inline T get(lua_State *l, int i) { return lua_get<T>(l, i); }
+    static inline T get(lua_State *l, int i, int) { return lua_get<T>(l, i); }
+};
+
+template<typename T> struct lua_arg<std::optional<T>>
+{
+    static inline std::optional<T> get(lua_State *l, int i)
+    {
+        return std::optional<T>(lua_get<T>(l, i));
+    }
+
+    static inline std::optional<T> get(lua_State *l, int i, int argc)
+    {
+        return i <= argc ? get(l, i) : std::nullopt;
+    }
+};
+
 //
 // Lua binding mechanism
 //
@@ -91,29 +120,47 @@ public:
     template<typename T>
     static void init(lua_State *l, T *that)
     {
-        // Store a pointer to the caller in the global state
-#if HAVE_LUA_GETEXTRASPACE
-        *static_cast<vm**>(lua_getextraspace(l)) = that;
-#else
-        lua_pushlightuserdata(l, that);
-        lua_setglobal(l, "\x01");
-#endif
-
+        // Store a pointer to the caller as the allocator userdata; Lua 5.2
+        // has no lua_getextraspace(), and reading it back is a single load.
+        // The allocator must either ignore its userdata or expect it to be
+        // that pointer.
+        lua_setallocf(l, lua_getallocf(l, nullptr), that);
+
+        // Building the API assigns binding ids the first time; VMs may
+        // be created on several threads at once
+        static std::mutex mutex;
+        std::unique_lock<std::mutex> lock(mutex);
         auto lib = typename T::template exported_api<lua>().data;
+        lock.unlock();
         lib.push_back({});
 
         lua_pushglobaltable(l);
         luaL_setfuncs(l, lib.data(), 0);
     }
 
+    // Retrieve the pointer stored by init(), from any thread of the state
+    template<typename T>
+    static inline T *get_this(lua_State *l)
+    {
+        void *ud;
+        lua_getallocf(l, &ud);
+        return static_cast<T *>(ud);
+    }
+
+    // Names of the bound functions, indexed by bind<FN>::id
+    static inline std::vector<char const *> names;
+
     // Helper to dispatch C++ functions to Lua C bindings
     template<auto FN> struct bind
     {
         static int wrap(lua_State *l)
         {
-            return dispatch(l, FN, make_seq(FN));
+            return dispatch(l, FN, make_seq(FN), id);
         }
 
+        // Unique index for this function, assigned at registration
+        static inline int id = -1;
+
         // Create an index sequence from a member function’s signature
         template<typename T, typename R, typename... A>
         static constexpr auto make_seq(R (T::*)(A...))
@@ -129,9 +176,15 @@ public:
         {}
 
         template<auto FN>
-        bind_desc(char const *str, bind<FN> b)
-          : luaL_Reg({ str, &b.wrap })
-        {}
+        bind_desc(char const *str, bind<FN>)
+          : luaL_Reg({ str, &bind<FN>::wrap })
+        {
+            if (bind<FN>::id < 0)
+            {
+                bind<FN>::id = (int)names.size();
+                names.push_back(str);
+            }
+        }
     };
 
 private:
@@ -139,26 +192,50 @@ private:
     // and push the result to the Lua stack.
     template<typename T, typename R, typename... A, size_t... IS>
     static inline int dispatch(lua_State *l, R (T::*f)(A...),
-                               std::index_sequence<IS...>)
+                               std::index_sequence<IS...> seq, int id)
     {
         // Retrieve “this” from the Lua state.
-    #if HAVE_LUA_GETEXTRASPACE
-        T *that = *static_cast<T**>(lua_getextraspace(l));
-    #else
-        lua_getglobal(l, "\x01");
-        T *that = (T *)lua_touserdata(l, -1);
-        lua_remove(l, -1);
-    #endif
+        T *that = get_this<T>(l);
 
         // Store this for API functions that we don’t know yet how to wrap
         that->m_sandbox_lua = l;
 
-        // Call the API function with the loaded arguments. Some specialization
-        // is needed when the wrapped function returns void.
+        // Time the call if the caller is profiling itself
+        if (that->is_profiling())
+        {
+            auto start = std::chrono::steady_clock::now();
+            int ret = unpack(l, that, f, seq);
+            std::chrono::duration<float> time = std::chrono::steady_clock::now() - start;
+            that->profile_call(id, time.count());
+            return ret;
+        }
+
+        return unpack(l, that, f, seq);
+    }
+
+    template<typename T, typename R, typename... A, size_t... IS>
+    static inline int unpack(lua_State *l, T *that, R (T::*f)(A...),
+                             std::index_sequence<IS...>)
+    {
+
+        // Read the argument count once; when the call provides at least as
+        // many arguments as the function takes (the usual case in hot
+        // code), no per-argument presence check is needed.
+        int const argc = lua_gettop(l);
+        if (argc >= (int)sizeof...(A))
+            return call(l, that, f, lua_arg<A>::get(l, IS + 1)...);
+        return call(l, that, f, lua_arg<A>::get(l, IS + 1, argc)...);
+    }
+
+    // Call the API function with the loaded arguments and push the result.
+    // Some specialization is needed when the wrapped function returns void.
+    template<typename T, typename R, typename... A, typename... B>
+    static inline int call(lua_State *l, T *that, R (T::*f)(A...), B&&... args)
+    {
         if constexpr (std::is_same<R, void>::value)
-            return (that->*f)(lua_get<A>(l, IS + 1)...), 0;
+            return (that->*f)(std::forward<B>(args)...), 0;
         else
-            return lua_push(l, (that->*f)(lua_get<A>(l, IS + 1)...));
+            return lua_push(l, (that->*f)(std::forward<B>(args)...));
     }
 };
 
@@ -16,7 +16,10 @@
 
 #include <lol/msg> // lol::msg
 
+#include "zepto8.h"
 #include "bios.h"
+#include "bindings/lua.h"
+#include "startup.h"
 
 namespace z8::pico8
 {
@@ -28,6 +31,47 @@ bios::bios()
     // Initialize BIOS
     if (!m_cart.load(filename))
         lol::msg::error("unable to load BIOS file %s\n", filename);
+    startup::mark("bios cart");
+
+    for (int ch = 0; ch < 256; ++ch)
+    {
+        int const w = ch < 0x80 ? 4 : 8;
+        int const offset = ch < 0x80 ? ch : 2 * ch - 0x80;
+        int const font_x = offset % 32 * 4;
+        int const font_y = offset / 32 * 6;
+
+        for (int16_t dy = 0; dy < 5; ++dy)
+        {
+            m_glyphs[ch][dy] = 0;
+            for (int16_t dx = 0; dx < w; ++dx)
+                if (get_spixel(font_x + dx, font_y + dy))
+                    m_glyphs[ch][dy] |= 1 << dx;
+        }
+    }
+
+    // Compile in a scratch state; errors are reported when a VM runs the
+    // source instead
+    lua_State *l = luaL_newstate();
+    auto const &code = m_cart.get_code();
+    if (luaL_loadbuffer(l, code.c_str(), code.length(), "=bios.p8") == LUA_OK)
+    {
+        lua_dump(l, [](lua_State *, void const *p, size_t size, void *ud)
+        {
+            ((std::string *)ud)->append((char const *)p, size);
+            return 0;
+        }, &m_bytecode);
+    }
+    lua_close(l);
+    startup::mark("bios compiled");
+
+    m_hash = hash64(m_bytecode.data(), m_bytecode.length());
+}
+
+std::shared_ptr<bios const> bios::get()
+{
+    // Initialisation of function-local statics is thread safe
+    static std::shared_ptr<bios const> const instance(new bios());
+    return instance;
 }
 
 } // namespace z8
@@ -12,12 +12,18 @@
 
 #pragma once
 
+#include <memory> // std::shared_ptr
+#include <string> // std::string
+
 #include "pico8/cart.h"
 
 // The bios class
 // ——————————————
 // The actual ZEPTO-8 BIOS: contains the font and the startup code, loaded
 // from a regular .p8 cartridge file.
+//
+// The BIOS never changes, so it is loaded once per process and shared by
+// all VMs. Its code is also compiled once, and VMs load the bytecode.
 
 namespace z8::pico8
 {
@@ -25,13 +31,27 @@ namespace z8::pico8
 class bios
 {
 public:
-    bios();
+    // The process-wide BIOS, loaded on first use
+    static std::shared_ptr<bios const> get();
 
     std::string const &get_code() const
     {
         return m_cart.get_code();
     }
 
+    // The compiled BIOS code, as produced by lua_dump(), or an empty string
+    // if compilation failed
+    std::string const &get_bytecode() const
+    {
+        return m_bytecode;
+    }
+
+    // A hash of the bytecode, which changes with the BIOS and Lua versions
+    uint64_t get_hash() const
+    {
+        return m_hash;
+    }
+
     uint8_t get_spixel(int16_t x, int16_t y) const
     {
         if (x < 0 || x >= 128 || y < 0 || y >= 128)
@@ -40,8 +60,21 @@ public:
         return m_cart.get_rom().gfx.get(x, y);
     }
 
+    // Font glyphs, rasterised when the BIOS is loaded: bit n of row y is
+    // set if pixel (n, y) of the glyph is lit. Glyphs are 4 pixels wide,
+    // or 8 for characters above 0x80.
+    uint8_t get_glyph_row(uint8_t ch, int16_t y) const
+    {
+        return m_glyphs[ch][y];
+    }
+
 private:
+    bios();
+
     cart m_cart;
+    uint8_t m_glyphs[256][5];
+    std::string m_bytecode;
+    uint64_t m_hash = 0;
 };
 
 } // namespace z8
@@ -14,9 +14,11 @@
 #   include "config.h"
 #endif
 
-#include <string> // std::string
-#include <vector> // std::vector
-#include <array>  // std::array
+#include <string>  // std::string
+#include <vector>  // std::vector
+#include <array>   // std::array
+#include <atomic>  // std::atomic
+#include <thread>  // std::thread
 
 #include <lol/engine.h> // lol::old_image
 #include <lol/color>    // lol::color
@@ -53,7 +55,9 @@ struct ditherer
         if (palette == "all")
             max_color_count = 32;
 
-        // Add at least a few elements
+        // There are only 32 colours, and add at least a few elements
+        if (colors.size() > 32)
+            colors.resize(32);
         if (colors.size() < 2)
             colors.push_back(7);
         if (colors.size() < 2)
@@ -61,6 +65,7 @@ struct ditherer
 
         // Sort palette by luminance
         std::sort(colors.begin(), colors.end(), compare_colors);
+        update();
     }
 
     // Current number of colours
@@ -70,9 +75,9 @@ struct ditherer
     size_t max_count() { return max_color_count; }
 
     // Return the nth colour (PICO-8 value 0…31)
-    lol::vec3 get_color(uint8_t n)
+    lol::vec3 get_color(uint8_t n) const
     {
-        return pico8::palette::get(colors[n]).rgb;
+        return values[n];
     }
 
     // Remove the least used color using a histogram
@@ -86,25 +91,13 @@ struct ditherer
         //auto c = lol::dot(lol::ivec3(get_color(best) * 255.99f), lol::ivec3(0x1, 0x100, 0x10000));
         //printf("Remove color %d (#%06x), used for %d pixels\n", colors[best], c, int(hist[best]));
         lol::remove_at(colors, best);
+        update();
     }
 
     // Return best color index from the list of available ones
-    uint8_t best_color_index(lol::vec3 color)
+    uint8_t best_color_index(lol::vec3 color) const
     {
-        float best_dist = FLT_MAX;
-        int best = -1;
-        for (size_t i = 0; i < colors.size(); ++i)
-        {
-            // FIXME: this works in sRGB space
-            float dist = lol::distance(get_color(i), color);
-            if (dist < best_dist)
-            {
-                best = i;
-                best_dist = dist;
-            }
-        }
-
-        return best;
+        return lut.find(color);
     }
 
 private:
@@ -116,12 +109,22 @@ private:
         return lol::color::rgb_to_yuv(ca)[0] > lol::color::rgb_to_yuv(cb)[0];
     }
 
+    // Cache the colour values, and the lookup cube for the current colours
+    void update()
+    {
+        for (size_t i = 0; i < colors.size(); ++i)
+            values[i] = pico8::palette::get(colors[i]).rgb;
+        lut = pico8::palette::lut(colors);
+    }
+
     std::vector<uint8_t> colors;
     size_t max_color_count = 16;
+    lol::vec3 values[32];
+    pico8::palette::lut lut;
 };
 
-void dither(std::string const &src, std::string const &out, std::string const &palette,
-            bool hicolor, bool error_diffusion)
+bool dither(std::string const &src, std::string const &out, std::string const &palette,
+            bool hicolor, bool error_diffusion, int jobs)
 {
     struct ditherer d(palette);
 
@@ -142,7 +145,11 @@ void dither(std::string const &src, std::string const &out, std::string const &p
 
     // Load image
     lol::old_image im;
-    im.load(src);
+    if (!im.load(src))
+    {
+        lol::msg::error("cannot load %s\n", src.c_str());
+        return false;
+    }
     im = im.Resize(lol::ivec2(128,128), lol::ResampleAlgorithm::Bicubic);
 
     lol::ivec2 size(im.size());
@@ -171,22 +178,23 @@ void dither(std::string const &src, std::string const &out, std::string const &p
     auto kernel = lol::old_image::kernel::bayer(lol::ivec2(32));
     auto original_image = im;
 
+    int const threads = jobs > 0 ? jobs : std::max(1, (int)std::thread::hardware_concurrency());
+
     for (;;)
     {
         im = original_image;
-        pixels.clear();
+        pixels.assign(size.x * size.y, 0);
 
         auto &curdata = im.lock2d<lol::PixelFormat::RGBA_F32>();
         auto &dstdata = dst.lock2d<lol::PixelFormat::RGBA_F32>();
-        for (int j = 0; j < size.y; ++j)
-        for (int i = 0; i < size.x; ++i)
-        {
-            lol::vec3 pixel = curdata[i][j].rgb;
-            uint8_t nearest = 0;
 
-            if (error_diffusion || d.count() > d.max_count())
+        if (error_diffusion || d.count() > d.max_count())
+        {
+            for (int j = 0; j < size.y; ++j)
+            for (int i = 0; i < size.x; ++i)
             {
-                nearest = d.best_color_index(pixel);
+                lol::vec3 pixel = curdata[i][j].rgb;
+                uint8_t nearest = d.best_color_index(pixel);
                 auto error = lol::vec4(pixel - d.get_color(nearest), 0.f) / 18.f;
                 if (i < size.x - 1)
                     curdata[i + 1][j] += 7.f * error;
@@ -198,36 +206,61 @@ void dither(std::string const &src, std::string const &out, std::string const &p
                     if (i < size.x - 1)
                         curdata[i + 1][j + 1] += 3.f * error;
                 }
+
+                pixels[j * size.x + i] = nearest;
+                dstdata[i][j] = lol::vec4(d.get_color(nearest), 255.f);
             }
-            else
+        }
+        else
+        {
+            // Without error diffusion every pixel is independent, so rows
+            // are shared between threads
+            std::atomic<int> next_row { 0 };
+            auto worker = [&]()
             {
-                // Dither pixel DEPTH times with error diffusion and build a histogram
-                std::vector<size_t> histogram(d.count(), 0);
-                auto candidate = pixel;
-                for (int n = 0; n < DEPTH; ++n)
-                {
-                    auto c = d.best_color_index(candidate);
-                    ++histogram[c];
-                    // FIXME: make the 0.5 here configurable
-                    candidate = pixel + 0.9f * (candidate - d.get_color(c));
-                }
+                std::vector<size_t> histogram(d.count());
 
-                // If colors are sorted by luminance, we just accumulate the histogram
-                // values and stop when the threshold is hit.
-                size_t threshold = size_t(kernel[i % kernel.sizes().x][j % kernel.sizes().y] * DEPTH);
-                for (size_t n = 0, total = 0; n < d.count(); ++n)
+                for (int j; (j = next_row++) < size.y; )
+                for (int i = 0; i < size.x; ++i)
                 {
-                    total += histogram[n];
-                    if (total > threshold)
+                    lol::vec3 pixel = curdata[i][j].rgb;
+                    uint8_t nearest = 0;
+
+                    // Dither pixel DEPTH times with error diffusion and build a histogram
+                    std::fill(histogram.begin(), histogram.end(), 0);
+                    auto candidate = pixel;
+                    for (int n = 0; n < DEPTH; ++n)
                     {
-                        nearest = n;
-                        break;
+                        auto c = d.best_color_index(candidate);
+                        ++histogram[c];
+                        // FIXME: make the 0.5 here configurable
+                        candidate = pixel + 0.9f * (candidate - d.get_color(c));
+                    }
+
+                    // If colors are sorted by luminance, we just accumulate the histogram
+                    // values and stop when the threshold is hit.
+                    size_t threshold = size_t(kernel[i % kernel.sizes().x][j % kernel.sizes().y] * DEPTH);
+                    for (size_t n = 0, total = 0; n < d.count(); ++n)
+                    {
+                        total += histogram[n];
+                        if (total > threshold)
+                        {
+                            nearest = n;
+                            break;
+                        }
                     }
-                }
-            }
 
-            pixels.push_back(nearest);
-            dstdata[i][j] = lol::vec4(d.get_color(nearest), 255.f);
+                    pixels[j * size.x + i] = nearest;
+                    dstdata[i][j] = lol::vec4(d.get_color(nearest), 255.f);
+                }
+            };
+
+            std::vector<std::thread> pool;
+            for (int n = 1; n < std::min(threads, size.y); ++n)
+                pool.emplace_back(worker);
+            worker();
+            for (auto &t : pool)
+                t.join();
         }
 
         im.unlock2d(curdata);
@@ -246,7 +279,11 @@ void dither(std::string const &src, std::string const &out, std::string const &p
 #if 1
     /* Save image */
     dst = dst.Resize(size * 3, lol::ResampleAlgorithm::Bresenham);
-    dst.save("test.png");
+    if (!dst.save(out.length() ? out : "test.png"))
+    {
+        lol::msg::error("cannot save %s\n", out.length() ? out.c_str() : "test.png");
+        return false;
+    }
 #else
     // TODO: write cart
     std::vector<uint8_t> rawdata;
@@ -278,6 +315,8 @@ void dither(std::string const &src, std::string const &out, std::string const &p
     if (out.length())
         fclose(s);
 #endif
+
+    return true;
 }
 
 } // namespace z8
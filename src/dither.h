@@ -17,8 +17,10 @@
 namespace z8
 {
 
-void dither(std::string const &src, std::string const &out, std::string const &palette,
-            bool hicolor, bool error_diffusion);
+// Dither an image to the PICO-8 palette; the Bayer path uses this many
+// threads, or all cores if zero
+bool dither(std::string const &src, std::string const &out, std::string const &palette,
+            bool hicolor, bool error_diffusion, int jobs = 0);
 
 } // namespace z8
 
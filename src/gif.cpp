@@ -0,0 +1,328 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <lol/msg>   // lol::msg
+#include <algorithm> // std::min, std::max
+#include <cmath>     // std::round
+
+#include "gif.h"
+
+namespace z8
+{
+
+// Frames queued beyond this make add_frame() wait for the encoder
+static size_t const max_queue = 64;
+
+static int const fps = 30;
+
+// Number of bits of a colour table that holds count colours
+static int table_bits(size_t count)
+{
+    int bits = 1;
+    while ((size_t(1) << bits) < count)
+        ++bits;
+    return bits;
+}
+
+static void put16(std::string &out, int n)
+{
+    out += char(n & 0xff);
+    out += char(n >> 8 & 0xff);
+}
+
+static void put_table(std::string &out, std::vector<uint32_t> const &palette)
+{
+    size_t const size = size_t(1) << table_bits(palette.size());
+    for (size_t i = 0; i < size; ++i)
+    {
+        uint32_t const c = i < palette.size() ? palette[i] : 0;
+        out += char(c >> 16 & 0xff);
+        out += char(c >> 8 & 0xff);
+        out += char(c & 0xff);
+    }
+}
+
+// LZW image data, cut into sub-blocks of at most 255 bytes
+static void put_lzw(std::string &out, uint8_t const *data, size_t count, int min_bits)
+{
+    int const clear = 1 << min_bits, eoi = clear + 1;
+
+    // Open addressing table from (prefix code, next index) to code
+    size_t const mask = (1 << 14) - 1;
+    std::vector<uint32_t> keys(mask + 1);
+    std::vector<uint16_t> codes(mask + 1);
+
+    int next = clear + 2, bits = min_bits + 1;
+    uint32_t acc = 0;
+    int pending = 0;
+
+    out += char(min_bits);
+    size_t block = out.size();
+    out += '\0';
+
+    auto put_byte = [&](uint8_t byte)
+    {
+        if (out.size() - block > 255)
+        {
+            out[block] = char(255);
+            block = out.size();
+            out += '\0';
+        }
+        out += char(byte);
+    };
+
+    auto emit = [&](int code)
+    {
+        acc |= uint32_t(code) << pending;
+        for (pending += bits; pending >= 8; pending -= 8, acc >>= 8)
+            put_byte(uint8_t(acc));
+    };
+
+    emit(clear);
+
+    int prefix = count ? data[0] : 0;
+    for (size_t i = 1; i < count; ++i)
+    {
+        uint32_t const key = uint32_t(prefix) << 8 | data[i];
+        size_t h = (key * 2654435761u >> 18) & mask;
+        while (keys[h] && keys[h] != key + 1)
+            h = (h + 1) & mask;
+
+        if (keys[h])
+        {
+            prefix = codes[h];
+            continue;
+        }
+
+        emit(prefix);
+        prefix = data[i];
+
+        keys[h] = key + 1;
+        codes[h] = uint16_t(next);
+        if (next == 4095)
+        {
+            // The table is full: start again
+            emit(clear);
+            std::fill(keys.begin(), keys.end(), 0);
+            next = clear + 2;
+            bits = min_bits + 1;
+        }
+        else if (next++ == 1 << bits)
+            ++bits;
+    }
+
+    if (count)
+        emit(prefix);
+    emit(eoi);
+    if (pending)
+        put_byte(uint8_t(acc));
+
+    // Close the last sub-block, then add the empty block terminator
+    out[block] = char(out.size() - block - 1);
+    out += '\0';
+}
+
+gif_recorder::~gif_recorder()
+{
+    stop();
+}
+
+bool gif_recorder::start(std::string const &filename, int scale, float max_length)
+{
+    stop();
+
+    m_file.open(filename, std::ios::binary);
+    if (!m_file)
+    {
+        lol::msg::error("cannot open %s for writing\n", filename.c_str());
+        return false;
+    }
+
+    m_filename = filename;
+    m_scale = std::max(scale, 1);
+    m_time = m_next = 0.;
+    m_max_length = max_length;
+    m_global_palette.clear();
+    m_thread = std::thread(&gif_recorder::encode, this);
+    return true;
+}
+
+void gif_recorder::add_frame(vm_base const &vm, float seconds)
+{
+    if (!recording())
+        return;
+
+    // Only capture the frames shown at the start of each GIF frame
+    if (m_time + 1e-6 >= m_next)
+    {
+        m_next += 1. / fps;
+        if (m_next < m_time)
+            m_next = m_time + 1. / fps;
+
+        frame f;
+        f.pixels.resize(128 * 128);
+        f.palette.resize(256);
+        f.palette.resize(vm.render_indexed(f.pixels.data(), f.palette.data()));
+        f.time = (int)std::round(m_time * 100);
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv.wait(lock, [&]() { return m_queue.size() < max_queue; });
+        m_queue.push_back(std::move(f));
+        m_cv.notify_all();
+    }
+
+    m_time += seconds;
+    if (m_max_length > 0 && m_time >= m_max_length)
+        stop();
+}
+
+bool gif_recorder::stop()
+{
+    if (!recording())
+        return true;
+
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_queue.push_back(frame { {}, {}, (int)std::round(m_time * 100) });
+        m_cv.notify_all();
+    }
+    m_thread.join();
+
+    m_file << ';'; // trailer
+    m_file.close();
+    if (!m_file)
+    {
+        lol::msg::error("cannot write %s\n", m_filename.c_str());
+        return false;
+    }
+    return true;
+}
+
+void gif_recorder::encode()
+{
+    frame prev;
+    int x0 = 0, y0 = 0, x1 = 128, y1 = 128;
+
+    for (;;)
+    {
+        frame f;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [&]() { return m_queue.size() > 0; });
+            f = std::move(m_queue.front());
+            m_queue.pop_front();
+            m_cv.notify_all();
+        }
+
+        if (f.pixels.empty())
+        {
+            if (prev.pixels.size())
+                write_frame(prev, x0, y0, x1, y1, f.time - prev.time);
+            return;
+        }
+
+        if (prev.pixels.empty())
+        {
+            write_header(f);
+            prev = std::move(f);
+            continue;
+        }
+
+        // Bounding box of the pixels that changed; a new palette changes
+        // everything
+        int nx0 = 128, ny0 = 128, nx1 = 0, ny1 = 0;
+        if (f.palette != prev.palette)
+            nx0 = ny0 = 0, nx1 = ny1 = 128;
+        else
+        {
+            for (int y = 0; y < 128; ++y)
+            {
+                uint8_t const *a = &prev.pixels[y * 128], *b = &f.pixels[y * 128];
+                if (std::equal(a, a + 128, b))
+                    continue;
+                ny0 = std::min(ny0, y);
+                ny1 = y + 1;
+                for (int x = 0; x < 128; ++x)
+                    if (a[x] != b[x])
+                        nx0 = std::min(nx0, x), nx1 = std::max(nx1, x + 1);
+            }
+        }
+
+        if (nx0 >= nx1)
+            continue;
+
+        write_frame(prev, x0, y0, x1, y1, f.time - prev.time);
+        x0 = nx0, y0 = ny0, x1 = nx1, y1 = ny1;
+        prev = std::move(f);
+    }
+}
+
+void gif_recorder::write_header(frame const &f)
+{
+    m_global_palette = f.palette;
+
+    m_buf = "GIF89a";
+    put16(m_buf, 128 * m_scale);
+    put16(m_buf, 128 * m_scale);
+    m_buf += char(0xf0 | (table_bits(f.palette.size()) - 1)); // global table, 8 bits per channel
+    m_buf += '\0'; // background colour
+    m_buf += '\0'; // square pixels
+    put_table(m_buf, f.palette);
+
+    // Loop forever
+    m_buf += "\x21\xff\x0b" "NETSCAPE2.0" "\x03\x01";
+    put16(m_buf, 0);
+    m_buf += '\0';
+
+    m_file.write(m_buf.data(), m_buf.size());
+}
+
+void gif_recorder::write_frame(frame const &f, int x0, int y0, int x1, int y1, int delay)
+{
+    int const s = m_scale, w = (x1 - x0) * s, h = (y1 - y0) * s;
+    bool const local = f.palette != m_global_palette;
+    int const bits = table_bits(f.palette.size());
+
+    m_buf.clear();
+
+    // Graphic control extension: keep the previous frame under this one
+    m_buf += "\x21\xf9\x04\x04";
+    put16(m_buf, std::min(std::max(delay, 1), 65535));
+    m_buf += '\0';
+    m_buf += '\0';
+
+    // Image descriptor
+    m_buf += '\x2c';
+    put16(m_buf, x0 * s);
+    put16(m_buf, y0 * s);
+    put16(m_buf, w);
+    put16(m_buf, h);
+    m_buf += char(local ? 0x80 | (bits - 1) : 0);
+    if (local)
+        put_table(m_buf, f.palette);
+
+    std::vector<uint8_t> pixels;
+    pixels.reserve(w * h);
+    for (int y = y0 * s; y < y1 * s; ++y)
+        for (int x = x0 * s; x < x1 * s; ++x)
+            pixels.push_back(f.pixels[y / s * 128 + x / s]);
+    put_lzw(m_buf, pixels.data(), pixels.size(), std::max(bits, 2));
+
+    m_file.write(m_buf.data(), m_buf.size());
+}
+
+} // namespace z8
+
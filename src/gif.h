@@ -0,0 +1,86 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <condition_variable> // std::condition_variable
+#include <deque>              // std::deque
+#include <fstream>            // std::ofstream
+#include <mutex>              // std::mutex
+#include <string>             // std::string
+#include <thread>             // std::thread
+#include <vector>             // std::vector
+
+#include "zepto8.h"
+
+// The gif_recorder class
+// ——————————————————————
+// Records the screen of a VM to an animated GIF file. Frames are captured
+// as palette indices with vm_base::render_indexed(), and encoded by a
+// worker thread so that the VM thread never waits for the encoder.
+//
+// Each frame only stores the rectangle that changed since the previous
+// one, and frames identical to the previous one only extend its delay.
+// Captures are limited to 30 frames per second, because browsers slow
+// down GIF delays shorter than 2 centiseconds.
+
+namespace z8
+{
+
+class gif_recorder
+{
+public:
+    ~gif_recorder();
+
+    // Start recording to a file; pixels are scaled up by an integer factor,
+    // and recording stops by itself after max_length seconds unless zero
+    bool start(std::string const &filename, int scale = 1, float max_length = 0.f);
+
+    // Capture the VM screen, which will be shown for the given time
+    void add_frame(vm_base const &vm, float seconds);
+
+    // Wait for the encoder and close the file; returns false if writing
+    // the file failed
+    bool stop();
+
+    bool recording() const { return m_thread.joinable(); }
+
+private:
+    struct frame
+    {
+        std::vector<uint8_t> pixels; // empty for the end of the recording
+        std::vector<uint32_t> palette;
+        int time; // centiseconds since the start
+    };
+
+    void encode();
+    void write_header(frame const &f);
+    void write_frame(frame const &f, int x0, int y0, int x1, int y1, int delay);
+
+    std::string m_filename;
+    int m_scale = 1;
+    double m_time = 0., m_next = 0., m_max_length = 0.;
+
+    // Frames waiting for the encoder
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<frame> m_queue;
+
+    // Encoder state, only used by the worker thread
+    std::ofstream m_file;
+    std::vector<uint32_t> m_global_palette;
+    std::string m_buf;
+};
+
+} // namespace z8
+
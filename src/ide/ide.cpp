@@ -31,6 +31,9 @@
 namespace z8
 {
 
+// Lua instructions between two samples of the profiler
+static int const sample_period = 10000;
+
 ide::ide()
 {
     lol::gui::init();
@@ -62,14 +65,22 @@ void ide::load(std::string const &name)
 {
     m_player = new z8::player(true, lol::ends_with(name, ".rcn.json"));
     m_player->get_texture(); // HACK: disable player rendering
+    m_player->set_watch(true);
+    m_player->set_tracking(true);
+    if (m_sampling)
+        m_player->set_sampling(sample_period);
     m_player->load(name);
     m_player->run();
 
     m_vm = m_player->get_vm();
 
     m_text_editor->attach(m_vm);
-    m_ram_editor->attach(m_vm->ram());
-    m_rom_editor->attach(m_vm->rom());
+    // The VM runs on the player thread, so the memory views show the copies
+    // sent with each frame, and edits go through the player
+    m_ram_editor->attach(m_player->get_ram(), &m_player->get_tracker(),
+                         [this](size_t addr, uint8_t value) { m_player->poke(addr, value); });
+    m_rom_editor->attach(m_player->get_rom(), nullptr,
+                         [this](size_t addr, uint8_t value) { m_player->poke_rom(addr, value); });
 }
 
 void ide::apply_scale()
@@ -286,6 +297,8 @@ void ide::render_menu()
                 ImGui::Separator();
                 ImGui::MenuItem("ROM", nullptr, &m_show.rom, true);
                 ImGui::MenuItem("RAM", nullptr, &m_show.ram, true);
+                ImGui::Separator();
+                ImGui::MenuItem("Profiler", nullptr, &m_show.profiler, true);
                 ImGui::EndMenu();
             }
             ImGui::Separator();
@@ -411,6 +424,15 @@ void ide::render_windows()
         ImGui::End();
     }
 
+    if (m_show.profiler)
+    {
+        ImGui::SetNextWindowDockID(m_dock.bottom_right, ImGuiCond_FirstUseEver);
+        ImGui::SetNextWindowSize(lol::ivec2(320, 246), ImGuiCond_FirstUseEver);
+        if (ImGui::Begin("Profiler", &m_show.profiler))
+            render_profiler();
+        ImGui::End();
+    }
+
     if (m_show.player)
     {
         ImGui::SetNextWindowPos(lol::ivec2(800, 100), ImGuiCond_FirstUseEver);
@@ -433,6 +455,30 @@ void ide::render_windows()
     }
 }
 
+// The functions the cart spends most time in, from the stack samples of
+// the player; all the stacks can be copied in the folded format of flame
+// graph tools
+void ide::render_profiler()
+{
+    if (!m_player)
+        return;
+
+    if (ImGui::Checkbox("sample", &m_sampling))
+        m_player->set_sampling(m_sampling ? sample_period : 0);
+
+    auto const samples = m_player->get_samples();
+    if (!samples || !samples->total)
+        return;
+
+    ImGui::SameLine();
+    if (ImGui::Button("copy folded stacks"))
+        ImGui::SetClipboardText(samples->folded().c_str());
+
+    ImGui::Text("%d samples", int(samples->total));
+    for (auto const &f : samples->top(20))
+        ImGui::Text("%5.1f%%  %s", 100.f * f.second / samples->total, f.first.c_str());
+}
+
 void ide::tick_draw(float seconds, lol::Scene &scene)
 {
     WorldEntity::tick_draw(seconds, scene);
@@ -443,11 +489,13 @@ void ide::tick_draw(float seconds, lol::Scene &scene)
         m_commands[1] = false;
     }
 
+    // The VM runs on the player thread; only upload its new frames
     std::vector<lol::u8vec4> buf(128 * 128);
-    if (m_vm)
-        m_vm->render(buf.data());
-    m_screen->Bind();
-    m_screen->SetData(buf.data());
+    if (m_player && m_player->render(buf.data()))
+    {
+        m_screen->Bind();
+        m_screen->SetData(buf.data());
+    }
 }
 
 } // namespace z8
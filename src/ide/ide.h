@@ -42,6 +42,7 @@ private:
     void render_menu();
     void render_toolbar();
     void render_windows();
+    void render_profiler();
 
     bool m_commands[5] = { false };
 
@@ -55,9 +56,12 @@ private:
         bool ram = true;
         bool rom = true;
         bool palette = true;
+        bool profiler = false;
     }
     m_show;
 
+    bool m_sampling = false;
+
     struct
     {
         ImGuiID root;
@@ -67,7 +71,7 @@ private:
     m_dock;
 
     int m_scale = 2;
-    player *m_player; // FIXME: this reference should disappear because player is a lol::entity
+    player *m_player = nullptr; // FIXME: this reference should disappear because player is a lol::entity
     std::unique_ptr<text_editor> m_text_editor;
     std::unique_ptr<memory_editor> m_ram_editor, m_rom_editor;
 
@@ -14,6 +14,9 @@
 #   include "config.h"
 #endif
 
+#include <algorithm> // std::max
+#include <cmath>     // std::floor
+
 #include "zepto8.h"
 #include "memory-editor.h"
 #include "pico8/pico8.h"
@@ -21,26 +24,143 @@
 namespace z8
 {
 
+// Writes fade out of the heatmap after this many generations
+static uint32_t const heat_frames = 60;
+
+// The view being drawn, for the highlight and write callbacks
+static memory_editor const *current = nullptr;
+
 memory_editor::memory_editor()
   : m_area({ nullptr, 0 })
 {
     m_editor.OptShowAscii = false;
     m_editor.OptUpperCaseHex = false;
     m_editor.OptShowOptions = false;
+    m_editor.HighlightColor = IM_COL32(255, 0, 77, 80);
 }
 
 memory_editor::~memory_editor()
 {
 }
 
-void memory_editor::attach(std::tuple<uint8_t *, size_t> area)
+void memory_editor::attach(std::tuple<uint8_t *, size_t> area, write_tracker *tracker,
+                           std::function<void(size_t, uint8_t)> write)
 {
     m_area = area;
+    m_tracker = tracker;
+    m_write = write;
+    m_editor.HighlightFn = tracker ? highlight : nullptr;
+    m_editor.WriteFn = write ? memory_editor::write : nullptr;
 }
 
 void memory_editor::render()
 {
+    if (m_tracker)
+    {
+        render_heatmap();
+        ImGui::SameLine();
+        render_watchpoints();
+    }
+
+    current = this;
     m_editor.DrawContents(std::get<0>(m_area), std::get<1>(m_area));
+    current = nullptr;
+}
+
+bool memory_editor::highlight(ImU8 const *, size_t off)
+{
+    auto const *t = current ? current->m_tracker : nullptr;
+    size_t const line = off / write_tracker::line_size;
+    if (!t || line >= t->lines())
+        return false;
+
+    uint32_t const gen = t->line_generation(line), now = t->generation();
+    return gen && (gen > now || now - gen < heat_frames);
+}
+
+void memory_editor::write(ImU8 *, size_t off, ImU8 value)
+{
+    if (current && current->m_write)
+        current->m_write(off, value);
+}
+
+// One cell per line, in rows of 64 lines; only the lines the tracker
+// reports as written recently are visited, so an idle memory area costs
+// nothing
+void memory_editor::render_heatmap()
+{
+    int const columns = 64;
+    int const rows = int((m_tracker->lines() + columns - 1) / columns);
+    float const cell = std::max(1.f, std::floor(ImGui::GetFontSize() / 4.f));
+
+    lol::vec2 const origin = ImGui::GetCursorScreenPos();
+    lol::vec2 const size(columns * cell, rows * cell);
+    ImGui::InvisibleButton("heatmap", size);
+
+    auto *draw = ImGui::GetWindowDrawList();
+    draw->AddRectFilled(origin, origin + size, IM_COL32(0, 0, 0, 255));
+
+    uint32_t const now = m_tracker->generation();
+    for (size_t line : m_tracker->recent_lines(heat_frames))
+    {
+        // The line may have been written again since, even in the
+        // generation that is not finished yet
+        uint32_t const gen = m_tracker->line_generation(line);
+        uint32_t const age = gen > now ? 0 : now - gen;
+        if (age >= heat_frames)
+            continue;
+
+        int const alpha = int(255 * (heat_frames - age) / heat_frames);
+        lol::vec2 const pos = origin + cell * lol::vec2(float(line % columns), float(line / columns));
+        draw->AddRectFilled(pos, pos + lol::vec2(cell), IM_COL32(255, 0, 77, alpha));
+    }
+
+    // Clicking a cell shows its line in the hex view
+    if (ImGui::IsItemClicked())
+    {
+        lol::vec2 const p = (lol::vec2(ImGui::GetMousePos()) - origin) / cell;
+        size_t const addr = (size_t(p.y) * columns + size_t(p.x)) * write_tracker::line_size;
+        if (addr < std::get<1>(m_area))
+            m_editor.GotoAddrAndHighlight(addr, addr + write_tracker::line_size);
+    }
+}
+
+void memory_editor::render_watchpoints()
+{
+    ImGui::BeginGroup();
+
+    write_tracker::hit h;
+    if (m_tracker->stopped() && m_tracker->get_hit(h))
+    {
+        ImGui::TextColored(pico8::palette::get(8), "stopped: 0x%04x changed from 0x%02x to 0x%02x",
+                           int(h.address), h.old_value, h.new_value);
+        if (ImGui::Button("continue"))
+            m_tracker->resume();
+    }
+
+    ImGui::PushItemWidth(ImGui::GetFontSize() * 4.f);
+    ImGui::InputScalar("##start", ImGuiDataType_U32, &m_watch_start, nullptr, nullptr, "%04x",
+                       ImGuiInputTextFlags_CharsHexadecimal);
+    ImGui::SameLine();
+    ImGui::InputScalar("##end", ImGuiDataType_U32, &m_watch_end, nullptr, nullptr, "%04x",
+                       ImGuiInputTextFlags_CharsHexadecimal);
+    ImGui::PopItemWidth();
+    ImGui::SameLine();
+    if (ImGui::Button("watch"))
+        m_tracker->add_watchpoint(m_watch_start, std::max(m_watch_end, m_watch_start) + 1);
+
+    auto const watchpoints = m_tracker->get_watchpoints();
+    for (size_t i = 0; i < watchpoints.size(); ++i)
+    {
+        ImGui::PushID(int(i));
+        if (ImGui::SmallButton("x"))
+            m_tracker->remove_watchpoint(i);
+        ImGui::SameLine();
+        ImGui::Text("0x%04x–0x%04x", int(watchpoints[i].start), int(watchpoints[i].end - 1));
+        ImGui::PopID();
+    }
+
+    ImGui::EndGroup();
 }
 
 } // namespace z8
@@ -13,22 +13,44 @@
 #pragma once
 
 #include <lol/engine.h> // for the ImGui headers and much more stuff
+#include <functional>   // std::function
 #include "3rdparty/imgui-club/imgui_memory_editor/imgui_memory_editor.h"
 
+#include "tracker.h"
+
 namespace z8
 {
 
+// The memory_editor class
+// ———————————————————————
+// A hex view of a memory area. When the area comes with a write tracker,
+// the view also shows a heatmap of recent writes, with one cell per line
+// of the tracker, highlights the bytes of recently written lines, and
+// lets the user set watchpoints. When the area is a copy of memory owned
+// by another thread, edits are passed to a write function instead of
+// only changing the copy.
+
 class memory_editor
 {
 public:
     memory_editor();
     ~memory_editor();
 
-    void attach(std::tuple<uint8_t *, size_t> area);
+    void attach(std::tuple<uint8_t *, size_t> area, write_tracker *tracker = nullptr,
+                std::function<void(size_t, uint8_t)> write = nullptr);
     void render();
 
 private:
+    void render_heatmap();
+    void render_watchpoints();
+
+    static bool highlight(ImU8 const *data, size_t off);
+    static void write(ImU8 *data, size_t off, ImU8 value);
+
     std::tuple<uint8_t *, size_t> m_area;
+    write_tracker *m_tracker = nullptr;
+    std::function<void(size_t, uint8_t)> m_write;
+    uint32_t m_watch_start = 0, m_watch_end = 0;
     MemoryEditor m_editor;
 };
 
@@ -177,6 +177,10 @@ void text_editor::render()
         m_impl->HandleInput();
     }
 
+    // Live code budget; only the chunks that changed are lexed again
+    std::string const code = m_impl->m_buffer->GetText().string();
+    ImGui::Text("tokens: %d/8192  chars: %d/65535", m_tokens.count(code), int(code.length()));
+
     m_impl->UpdateWindowState();
     m_impl->SetDisplayRegion(Zep::toNVec2f(ImGui::GetCursorScreenPos()),
                              Zep::toNVec2f(ImGui::GetContentRegionAvail()) + Zep::toNVec2f(ImGui::GetCursorScreenPos()));
@@ -14,6 +14,8 @@
 
 #include <memory> // std::shared_ptr
 
+#include "pico8/tokens.h"
+
 namespace z8
 {
 
@@ -30,6 +32,9 @@ private:
     std::unique_ptr<class editor_impl> m_impl;
     std::shared_ptr<z8::vm_base> m_vm;
     float m_fontsize = 0.f;
+
+    // Token counts of the code being edited, updated every frame
+    pico8::token_cache m_tokens;
 };
 
 } // namespace z8
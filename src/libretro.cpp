@@ -17,6 +17,7 @@
 #include <lol/msg>    // lol::msg
 #include <lol/narray> // lol::array2d
 #include <array>      // std::array
+#include <chrono>     // std::chrono
 #include <cstring>    // std::memset
 #include <memory>     // std::shared_ptr
 #include <vector>     // std::vector
@@ -41,8 +42,13 @@ static retro_input_state_t input_state_cb;
 // Global core state
 static bool is_raccoon;
 static std::shared_ptr<z8::vm_base> vm;
-static lol::array2d<lol::u8vec4> fb32;
+static lol::array2d<uint32_t> fb32;
 static lol::array2d<uint16_t> fb16;
+static bool use_xrgb8888 = false;
+static bool can_dupe = false;
+static std::vector<int16_t> audio_buffer;
+static int const audio_rate = 48000;
+static int audio_remainder = 0;
 
 EXPORT void retro_set_environment(retro_environment_t cb)
 {
@@ -53,6 +59,9 @@ EXPORT void retro_set_environment(retro_environment_t cb)
     // Looks good to me
     char const *system_dir;
     enviro_cb(RETRO_ENVIRONMENT_GET_SYSTEM_DIRECTORY, &system_dir);
+    // If the frontend can duplicate frames, do not send unchanged ones
+    if (!enviro_cb(RETRO_ENVIRONMENT_GET_CAN_DUPE, &can_dupe))
+        can_dupe = false;
 }
 
 EXPORT void retro_set_video_refresh(retro_video_refresh_t cb) { video_cb = cb; }
@@ -67,12 +76,14 @@ EXPORT void retro_init()
     vm.reset((z8::vm_base *)new z8::pico8::vm());
     fb32.resize(lol::ivec2(128, 128));
     fb16.resize(lol::ivec2(128, 128));
+    vm->set_audio_rate(audio_rate);
 }
 
 EXPORT void retro_deinit()
 {
     fb32.clear();
     fb16.clear();
+    audio_buffer.clear();
 }
 
 EXPORT unsigned retro_api_version()
@@ -98,10 +109,17 @@ EXPORT void retro_get_system_av_info(struct retro_system_av_info *info)
     info->geometry.max_height = 128;
     info->geometry.aspect_ratio = 1.f;
     info->timing.fps = 60.f;
-    info->timing.sample_rate = 44100.f;
-
-    retro_pixel_format pf = RETRO_PIXEL_FORMAT_RGB565;
-    enviro_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &pf);
+    info->timing.sample_rate = (double)vm->get_audio_rate();
+
+    // Prefer XRGB8888, which the frontend can use without conversion,
+    // and fall back to RGB565.
+    retro_pixel_format pf = RETRO_PIXEL_FORMAT_XRGB8888;
+    use_xrgb8888 = enviro_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &pf);
+    if (!use_xrgb8888)
+    {
+        pf = RETRO_PIXEL_FORMAT_RGB565;
+        enviro_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &pf);
+    }
 }
 
 EXPORT void retro_set_controller_port_device(unsigned port, unsigned device)
@@ -134,30 +152,77 @@ EXPORT void retro_run()
     // Step VM
     vm->step(1.f / 60);
 
-    // Render video, convert to RGB565, send back to frontend
-    vm->render(fb32.data());
-    for (int y = 0; y < 128; ++y)
-    for (int x = 0; x < 128; ++x)
-        fb16(x, y) = uint16_t(lol::dot(lol::ivec3(fb32(x, y).rgb) / lol::ivec3(8, 4, 8),
-                                       lol::ivec3(2048, 32, 1)));
-    video_cb(fb16.data(), 128, 128, 2 * 128);
-
-    // Render audio
+    // During run-ahead, the frontend disables output for the frames it
+    // will discard; skip rendering and synthesis for these.
+    int av = 3;
+    if (!enviro_cb(RETRO_ENVIRONMENT_GET_AUDIO_VIDEO_ENABLE, &av))
+        av = 3;
+    bool const video = av & 1, audio = av & 2;
+
+    // Render video in the negotiated format, send back to frontend. When
+    // video is disabled, dirty rows accumulate until the next real frame.
+    if (video)
+    {
+        if (can_dupe && vm->get_dirty().none())
+            video_cb(nullptr, 128, 128, 0);
+        else if (use_xrgb8888)
+        {
+            vm->render_xrgb8888(fb32.data());
+            video_cb(fb32.data(), 128, 128, 4 * 128);
+        }
+        else
+        {
+            vm->render_rgb565(fb16.data());
+            video_cb(fb16.data(), 128, 128, 2 * 128);
+        }
+        vm->clear_dirty();
+    }
+
+    // Render audio; the rate does not always divide evenly into 60 frames
+    // per second, so carry the remainder over to the next frame. The
+    // audio state must advance even when audio is disabled, since music
+    // timing is part of the emulated state.
+    int const rate = vm->get_audio_rate();
+    int frames = (rate + audio_remainder) / 60;
+    audio_remainder = (rate + audio_remainder) % 60;
+    if (audio)
+    {
+        audio_buffer.resize(2 * frames);
+        vm->get_audio(audio_buffer.data(), frames, true);
+        audio_batch_cb(audio_buffer.data(), frames);
+    }
+    else
+        vm->get_audio(nullptr, frames, true);
 }
 
+// The state size is an upper bound that does not change while a game is
+// loaded, as required by the libretro API. The audio remainder is saved
+// before the VM state, since it decides how many samples each frame gets.
 EXPORT size_t retro_serialize_size()
 {
-    return 0;
+    return vm ? sizeof(audio_remainder) + vm->state_size() : 0;
 }
 
 EXPORT bool retro_serialize(void *data, size_t size)
 {
-    return false;
+    if (!vm || size < sizeof(audio_remainder))
+        return false;
+    memcpy(data, &audio_remainder, sizeof(audio_remainder));
+    return vm->save_state((uint8_t *)data + sizeof(audio_remainder),
+                          size - sizeof(audio_remainder)) > 0;
 }
 
 EXPORT bool retro_unserialize(const void *data, size_t size)
 {
-    return false;
+    int remainder;
+    if (!vm || size < sizeof(remainder))
+        return false;
+    memcpy(&remainder, data, sizeof(remainder));
+    if (!vm->load_state((uint8_t const *)data + sizeof(remainder),
+                        size - sizeof(remainder)))
+        return false;
+    audio_remainder = remainder;
+    return true;
 }
 
 EXPORT void retro_cheat_reset()
@@ -175,7 +240,13 @@ EXPORT bool retro_load_game(struct retro_game_info const *info)
         vm.reset((z8::vm_base *)new z8::raccoon::vm());
     else
         vm.reset((z8::vm_base *)new z8::pico8::vm());
+    vm->set_audio_rate(audio_rate);
     vm->load(info->path);
+
+    // Run-ahead and rewind replay frames from savestates, so time() must
+    // come from the frame count and not from the wall clock
+    auto now = std::chrono::high_resolution_clock::now();
+    vm->set_deterministic((uint32_t)now.time_since_epoch().count());
     vm->run();
     return true;
 }
@@ -195,13 +266,19 @@ EXPORT unsigned retro_get_region()
     return 0;
 }
 
+// The cart persistent data is the save RAM; the frontend restores it after
+// retro_load_game(), before the cart gets to call cartdata()
 EXPORT void *retro_get_memory_data(unsigned id)
 {
-    return nullptr;
+    if (!vm || id != RETRO_MEMORY_SAVE_RAM)
+        return nullptr;
+    return std::get<0>(vm->save_ram());
 }
 
 EXPORT size_t retro_get_memory_size(unsigned id)
 {
-    return 0;
+    if (!vm || id != RETRO_MEMORY_SAVE_RAM)
+        return 0;
+    return std::get<1>(vm->save_ram());
 }
 
@@ -1,7 +1,7 @@
 //
 //  ZEPTO-8 — Fantasy console emulator
 //
-//  Copyright © 2016—2018 Sam Hocevar <sam@hocevar.net>
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
 //
 //  This program is free software. It comes without any warranty, to
 //  the extent permitted by applicable law. You can redistribute it
@@ -14,83 +14,233 @@
 #   include "config.h"
 #endif
 
-#include <vector>
-#include <iostream>
-#include <streambuf>
-#include <cstdint>
-#include <cstdlib>
-#include <regex>
+#include <lol/msg>       // lol::msg
+#include <algorithm>     // std::sort
+#include <string>        // std::string
+#include <string_view>   // std::string_view
+#include <unordered_map> // std::unordered_map
+#include <unordered_set> // std::unordered_set
+#include <vector>        // std::vector
 
 #include "minify.h"
+#include "pico8/pico8.h"
+#include "pico8/tokens.h"
 
 namespace z8
 {
 
-std::string minify(std::string const &input)
+using pico8::token;
+
+static bool is_word(char ch)
 {
-    std::regex re_spaces(" +");
+    return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9')
+            || ch == '_' || (uint8_t)ch >= 0x7f || ((uint8_t)ch >= 0x10 && (uint8_t)ch <= 0x1f);
+}
 
-    // Split input into lines
-    std::vector<std::string> lines;
-    std::regex re_crlf("\r*\n");
-    std::copy(std::sregex_token_iterator(input.begin(), input.end(), re_crlf, -1),
-              std::sregex_token_iterator(),
-              std::back_inserter(lines));
+static bool is(token const &t, char const *text)
+{
+    return t.kind != token::type::string && t.text == text;
+}
 
-    // Skip first three lines (they’re the PICO-8 cart header)
-    lines.erase(lines.begin(), lines.begin() + 3);
+// Whether tokens a and b need a space between them to be lexed again as
+// the same two tokens
+static bool need_space(token const &a, token const &b)
+{
+    // Lua reads numbers greedily, so “1and” or “1..x” are malformed
+    if (is_word(a.text.back()) && is_word(b.text.front()))
+        return true;
+    if (a.kind == token::type::number && b.text.front() == '.')
+        return true;
+    if (a.kind != token::type::op)
+        return false;
+
+    std::string const s = std::string(a.text) + std::string(b.text);
+    auto const tokens = pico8::lex(s);
+    return tokens.size() != 2 || tokens[0].text != a.text;
+}
 
-    std::vector<std::tuple<std::string, std::string>> replaces;
-    std::string result;
+// Generate the n-th short name: a, b, …, z, aa, ab, …
+static std::string short_name(size_t n)
+{
+    static char const first[] = "abcdefghijklmnopqrstuvwxyz";
+    static char const other[] = "abcdefghijklmnopqrstuvwxyz0123456789_";
+
+    std::string ret(1, first[n % 26]);
+    for (n /= 26; n > 0; n = (n - 1) / 37)
+        ret += other[(n - 1) % 37];
+    return ret;
+}
+
+std::string minify(std::string const &input)
+{
+    if (pico8::code::parse_tokens(input) < 0)
+        return input;
 
-    // Process each line
-    for (auto & line : lines)
+    auto const tokens = pico8::lex(input);
+
+    // Find names declared as locals, and names that must be kept as they
+    // are: fields and table keys, API functions, metamethods and globals
+    // such as _init, and anything that also appears in a string, because
+    // it could be used to index a table.
+    std::unordered_map<std::string_view, int> uses;
+    std::unordered_set<std::string_view> locals, pinned;
+    std::vector<char> brackets;
+
+    for (size_t i = 0; i < tokens.size(); ++i)
     {
-        // Parse special comments indicating possible replacements
-        static std::regex re_replaces("^(.*--.*replaces: |.*)");
-        static std::regex re_replace_pair(" *([^ ]+) *([^ ]+) *");
-        std::vector<std::string> replaces_list;
-        auto tmp = std::regex_replace(line, re_replaces, "");
-        std::copy(std::sregex_token_iterator(tmp.begin(), tmp.end(), re_spaces, -1),
-                  std::sregex_token_iterator(),
-                  std::back_inserter(replaces_list));
-        for (size_t i = 0; i + 1 < replaces_list.size(); i += 2)
-            replaces.push_back(std::make_tuple(replaces_list[i], replaces_list[i + 1]));
-
-        // Strip comments; if comment starts with "debug" then whole line is stripped
-        static std::regex re_comment("(^.*-- *debug| *--).*");
-        line = std::regex_replace(line, re_comment, "");
-
-        // Ignore empty lines
-        static std::regex re_empty("^ *$");
-        if (std::regex_match(line, re_empty))
-            continue;
-
-        // Protect lines that contain +=, -= etc.
-        static std::regex re_compound(".*[-+*/%]=.*");
-        line = std::regex_replace(line, re_compound, "X $0 X");
-
-        result += result.empty() ? line : " " + line;
+        auto const &t = tokens[i];
+        token const *prev = i > 0 ? &tokens[i - 1] : nullptr;
+        token const *next = i + 1 < tokens.size() ? &tokens[i + 1] : nullptr;
+
+        if (t.kind == token::type::string)
+        {
+            for (size_t j = 0; j < t.text.length(); )
+            {
+                size_t k = j;
+                while (k < t.text.length() && is_word(t.text[k]))
+                    ++k;
+                if (k > j)
+                    pinned.insert(t.text.substr(j, k - j));
+                j = k + 1;
+            }
+        }
+        else if (t.kind == token::type::op)
+        {
+            if (is(t, "(") || is(t, "[") || is(t, "{"))
+                brackets.push_back(t.text[0]);
+            else if ((is(t, ")") || is(t, "]") || is(t, "}")) && brackets.size())
+                brackets.pop_back();
+        }
+        else if (t.kind == token::type::name)
+        {
+            ++uses[t.text];
+            bool const field = prev && (is(*prev, ".") || is(*prev, ":"));
+            bool const key = brackets.size() && brackets.back() == '{' && next && is(*next, "=")
+                              && prev && (is(*prev, "{") || is(*prev, ",") || is(*prev, ";"));
+            if (field || key || t.text[0] == '_' || t.text == "self"
+                 || pico8::api::functions.count(std::string(t.text)))
+                pinned.insert(t.text);
+        }
+        else if (is(t, "local") || is(t, "for"))
+        {
+            // “local a, b”, “local function f” and “for a, b in”
+            size_t j = i + 1;
+            if (j < tokens.size() && is(tokens[j], "function"))
+                ++j;
+            for (; j < tokens.size() && tokens[j].kind == token::type::name; j += 2)
+            {
+                locals.insert(tokens[j].text);
+                if (j + 1 >= tokens.size() || !is(tokens[j + 1], ","))
+                    break;
+            }
+        }
+        else if (is(t, "function"))
+        {
+            // Skip the function name, then declare the parameters
+            size_t j = i + 1;
+            while (j < tokens.size() && !is(tokens[j], "("))
+                ++j;
+            for (++j; j < tokens.size() && tokens[j].kind == token::type::name; j += 2)
+            {
+                locals.insert(tokens[j].text);
+                if (j + 1 >= tokens.size() || !is(tokens[j + 1], ","))
+                    break;
+            }
+        }
     }
 
-    // Rename all variables according to our rules
-    for (auto & rep : replaces)
-        result = std::regex_replace(result, std::regex("([^a-z_])(" + std::get<0>(rep) + ")([^a-z0-9_])"), "$1" + std::get<1>(rep) + "$3");
+    // Give the shortest names to the most used locals. A name is renamed
+    // everywhere it appears, and candidates are never a name that already
+    // appears in the code, so that renaming cannot capture a variable.
+    std::vector<std::string_view> renamed;
+    for (auto const &name : locals)
+        if (!pinned.count(name))
+            renamed.push_back(name);
+    std::sort(renamed.begin(), renamed.end(), [&](std::string_view a, std::string_view b)
+    {
+        return uses[a] != uses[b] ? uses[a] > uses[b] : a < b;
+    });
+
+    std::unordered_map<std::string_view, std::string> names;
+    size_t candidate = 0;
+    for (auto const &name : renamed)
+    {
+        std::string s;
+        for (;;)
+        {
+            s = short_name(candidate);
+            if (!uses.count(s) && !pinned.count(s) && !pico8::api::keywords.count(s) && !pico8::api::functions.count(s))
+                break;
+            ++candidate;
+        }
+
+        if (s.length() < name.length())
+            names[name] = s, ++candidate;
+    }
 
-    // Strip multiple spaces
-    result = std::regex_replace(result, re_spaces, " ");
+    // PICO-8 extensions such as short if, short print and compound
+    // assignments end at the end of the line, so keep line breaks around
+    // lines that may contain them
+    std::vector<bool> sensitive(1, false);
+    for (auto const &t : tokens)
+    {
+        if (t.newline)
+            sensitive.push_back(false);
+        if (is(t, "if") || is(t, "while") || is(t, "?")
+             || (t.kind == token::type::op && t.text.length() > 1 && t.text.back() == '='
+                  && t.text != "==" && t.text != "~=" && t.text != "!="
+                  && t.text != "<=" && t.text != ">="))
+            sensitive.back() = true;
+    }
 
-    // Exploit Lua parsing rules
-    result = std::regex_replace(result, std::regex("0 ([g-wyz])"), "0$1");
-    result = std::regex_replace(result, std::regex("([1-9]) ([g-z])"), "$1$2");
+    std::string ret;
+    token last {};
+    size_t line = 0;
 
-    // Unprotect lines protected with X
-    result = std::regex_replace(result, std::regex(" *X[ X]*"), " ");
+    // Token texts point either to the input or to the new names, so they
+    // remain valid until the end
+    for (size_t i = 0; i < tokens.size(); ++i)
+    {
+        auto const &t = tokens[i];
+        bool const newline = t.newline && (sensitive[line] || sensitive[line + 1]);
+        line += t.newline;
+
+        // Parentheses around a single name or number are redundant, unless
+        // they are a call, a function or a short if or while condition
+        bool const strip = is(t, "(") && i + 2 < tokens.size() && is(tokens[i + 2], ")")
+             && !tokens[i + 1].newline && !tokens[i + 2].newline && !newline
+             && (tokens[i + 1].kind == token::type::name || tokens[i + 1].kind == token::type::number)
+             && ((last.kind == token::type::op && last.text.size()
+                   && !is(last, ")") && !is(last, "]") && !is(last, "}"))
+                  || is(last, "return") || is(last, "and") || is(last, "or") || is(last, "not")
+                  || is(last, "then") || is(last, "do") || is(last, "else") || is(last, "in")
+                  || is(last, "until") || is(last, "repeat") || is(last, "elseif"));
+
+        token out = tokens[i + strip];
+        auto it = out.kind == token::type::name ? names.find(out.text) : names.end();
+        if (it != names.end())
+            out.text = it->second;
+
+        if (ret.size())
+        {
+            if (newline || is(out, "?"))
+                ret += '\n';
+            else if (need_space(last, out))
+                ret += ' ';
+        }
+        ret += out.text;
+        last = out;
+
+        i += 2 * strip;
+    }
 
-    // Remove spaces before and after symbols
-    result = std::regex_replace(result, std::regex(" *([[\\]<>(){}#+*%^/=:!~,-]) *"), "$1");
+    if (pico8::code::parse_tokens(ret) < 0)
+    {
+        lol::msg::error("minified code does not parse, keeping the original\n");
+        return input;
+    }
 
-    return result;
+    return ret;
 }
 
 } // namespace z8
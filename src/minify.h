@@ -12,9 +12,14 @@
 
 #pragma once
 
+#include <string> // std::string
+
 namespace z8
 {
 
+// Minify PICO-8 code: strip comments and spaces, drop redundant parentheses
+// and give the shortest names to the most used locals. The code is returned
+// unchanged if it does not parse.
 std::string minify(std::string const &input);
 
 } // namespace z8
@@ -56,6 +56,10 @@ std::unordered_set<std::string> api::functions =
     "count", "add", "sub", "foreach", "all", "del", "deli", "t", "dget",
     "dset", "cartdata", "load", "save", "info", "abort", "folder",
     "resume", "reboot", "dir", "ls", "flip", "mapdraw",
+    // ZEPTO-8 extensions
+    "__draw",
+    // Needed by the main loop, which runs in the sandbox
+    "__draw_frame",
 };
 
 } // namespace z8::pico8
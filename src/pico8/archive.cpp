@@ -0,0 +1,353 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <lol/msg>    // lol::msg
+#include <lol/utils>  // lol::ends_with
+#include <algorithm>  // std::sort, std::lower_bound
+#include <filesystem> // std::filesystem
+#include <fstream>    // std::ofstream
+#include <cstring>    // memcmp(), strlen()
+
+#if _WIN32
+#   define WIN32_LEAN_AND_MEAN
+#   include <windows.h>
+#else
+#   include <fcntl.h>
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <unistd.h>
+#endif
+
+#include "zepto8.h"
+#include "pico8/archive.h"
+#include "pico8/cart.h"
+#include "pico8/pico8.h"
+
+namespace z8::pico8
+{
+
+static char const magic[4] = { 'z', '8', 'a', 'r' };
+static uint32_t const version = 1;
+static size_t const header_size = 32;
+static size_t const entry_size = 40;
+static size_t const label_size = LABEL_WIDTH * LABEL_HEIGHT;
+
+// Fields are little-endian whatever the host
+static uint32_t read32(uint8_t const *p)
+{
+    return uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24;
+}
+
+static uint64_t read64(uint8_t const *p)
+{
+    return read32(p) | uint64_t(read32(p + 4)) << 32;
+}
+
+static void write32(std::string &out, uint32_t x)
+{
+    for (int i = 0; i < 4; ++i)
+        out += char(x >> (8 * i));
+}
+
+static void write64(std::string &out, uint64_t x)
+{
+    write32(out, uint32_t(x));
+    write32(out, uint32_t(x >> 32));
+}
+
+archive::~archive()
+{
+    close();
+}
+
+bool archive::open(std::string const &filename)
+{
+    close();
+
+#if _WIN32
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER size;
+    HANDLE mapping = GetFileSizeEx(file, &size) && size.QuadPart
+                   ? CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+    CloseHandle(file);
+    if (!mapping)
+        return false;
+    m_data = (uint8_t const *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!m_data)
+    {
+        CloseHandle(mapping);
+        return false;
+    }
+    m_mapping = mapping;
+    m_size = size_t(size.QuadPart);
+#else
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    void *data = fstat(fd, &st) == 0 && st.st_size > 0
+               ? mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if (data == MAP_FAILED)
+        return false;
+    m_data = (uint8_t const *)data;
+    m_size = size_t(st.st_size);
+#endif
+
+    // Check the header, then decode and check every entry, so that the
+    // accessors do not need to
+    uint32_t file_version = 0, count = 0;
+    if (m_size >= header_size)
+    {
+        file_version = read32(m_data + 4);
+        count = read32(m_data + 8);
+        m_strings = read64(m_data + 16);
+        m_strings_size = read64(m_data + 24);
+    }
+
+    bool ok = m_size >= header_size && !memcmp(m_data, magic, sizeof(magic))
+           && file_version == version
+           && count <= (m_size - header_size) / entry_size
+           && m_strings <= m_size && m_strings_size <= m_size - m_strings
+           && m_strings_size && m_data[m_strings + m_strings_size - 1] == '\0';
+
+    m_count = ok ? count : 0;
+    m_entries.resize(m_count);
+    for (size_t n = 0; ok && n < m_count; ++n)
+    {
+        uint8_t const *p = m_data + header_size + n * entry_size;
+        entry &e = m_entries[n];
+        e.hash = read64(p);
+        e.offset = read64(p + 8);
+        e.code_size = read32(p + 16);
+        e.tokens = read32(p + 20);
+        e.name = read32(p + 24);
+        e.title = read32(p + 28);
+        e.author = read32(p + 32);
+        e.flags = read32(p + 36);
+
+        uint64_t const len = sizeof(memory) + (e.flags & 1 ? label_size : 0) + e.code_size + 1;
+        ok = e.offset <= m_size && len <= m_size - e.offset
+          && m_data[e.offset + len - 1] == '\0'
+          && e.name < m_strings_size && e.title < m_strings_size && e.author < m_strings_size
+          && (n == 0 || get_entry(n - 1).hash <= e.hash);
+    }
+
+    if (!ok)
+    {
+        lol::msg::error("%s: not a valid cart archive\n", filename.c_str());
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+void archive::close()
+{
+    if (m_data)
+    {
+#if _WIN32
+        UnmapViewOfFile(m_data);
+        CloseHandle((HANDLE)m_mapping);
+#else
+        munmap((void *)m_data, m_size);
+#endif
+    }
+
+    m_data = nullptr;
+    m_mapping = nullptr;
+    m_entries.clear();
+    m_size = m_count = 0;
+}
+
+int archive::find(std::string const &name) const
+{
+    if (!m_count)
+        return -1;
+
+    uint64_t const hash = hash64(name.data(), name.length());
+    auto const *first = &get_entry(0), *last = first + m_count;
+    auto it = std::lower_bound(first, last, hash,
+                  [](entry const &e, uint64_t h) { return e.hash < h; });
+
+    for (; it != last && it->hash == hash; ++it)
+        if (name == get_string(it->name))
+            return int(it - first);
+
+    return -1;
+}
+
+archive::info archive::get_info(size_t index) const
+{
+    entry const &e = get_entry(index);
+    return info { get_string(e.name), get_string(e.title), get_string(e.author), int(e.tokens) };
+}
+
+memory const &archive::get_rom(size_t index) const
+{
+    return *(memory const *)(m_data + get_entry(index).offset);
+}
+
+std::string_view archive::get_code(size_t index) const
+{
+    entry const &e = get_entry(index);
+    size_t const start = e.offset + sizeof(memory) + (e.flags & 1 ? label_size : 0);
+    return std::string_view((char const *)m_data + start, e.code_size);
+}
+
+uint8_t const *archive::get_label(size_t index) const
+{
+    entry const &e = get_entry(index);
+    return e.flags & 1 ? m_data + e.offset + sizeof(memory) : nullptr;
+}
+
+archive::entry const &archive::get_entry(size_t index) const
+{
+    return m_entries[index];
+}
+
+char const *archive::get_string(uint32_t offset) const
+{
+    return (char const *)m_data + m_strings + offset;
+}
+
+std::string archive::cart_name(std::string const &filename)
+{
+    std::string name = std::filesystem::path(filename).filename().string();
+    for (auto suffix : { ".png", ".p8", ".bin", ".lua", ".js" })
+        if (lol::ends_with(name, suffix))
+            name.resize(name.length() - strlen(suffix));
+    return name;
+}
+
+// By convention, the first two lines of a cart are comments with its
+// title and its author
+void archive::title_author(std::string const &code, std::string &title, std::string &author)
+{
+    size_t pos = 0;
+    for (std::string *s : { &title, &author })
+    {
+        if (pos >= code.length() || code.compare(pos, 2, "--") != 0)
+            break;
+        size_t const eol = std::min(code.find('\n', pos), code.length());
+        *s = code.substr(pos + 2, eol - pos - 2);
+        s->erase(0, s->find_first_not_of(" \t"));
+        s->erase(s->find_last_not_of(" \t\r") + 1);
+        pos = eol + 1;
+    }
+
+    if (author.compare(0, 3, "by ") == 0)
+        author.erase(0, 3);
+}
+
+bool archive::build(std::string const &filename, std::vector<std::string> const &carts)
+{
+    std::vector<entry> entries;
+    std::string data, strings;
+
+    auto add_string = [&](std::string const &s)
+    {
+        uint32_t const ret = uint32_t(strings.length());
+        strings += s;
+        strings += '\0';
+        return ret;
+    };
+
+    for (auto const &file : carts)
+    {
+        cart c;
+        if (!c.load(file))
+        {
+            lol::msg::error("%s: cannot load cart\n", file.c_str());
+            continue;
+        }
+
+        std::string const &code = c.get_code();
+        auto const &label = c.get_label();
+        std::string title, author;
+        title_author(code, title, author);
+
+        // Keep cart data aligned, since the ROM is accessed in place
+        data.resize((data.length() + 15) & ~size_t(15));
+
+        std::string const name = cart_name(file);
+        entry e;
+        e.hash = hash64(name.data(), name.length());
+        e.offset = data.length();
+        e.code_size = uint32_t(code.length());
+        e.tokens = uint32_t(code::count_tokens(code));
+        e.name = add_string(name);
+        e.title = add_string(title);
+        e.author = add_string(author);
+        e.flags = label.size() >= label_size ? 1 : 0;
+        entries.push_back(e);
+
+        data.append((char const *)&c.get_rom(), sizeof(memory));
+        if (e.flags & 1)
+            data.append((char const *)label.data(), label_size);
+        data.append(code.c_str(), code.length() + 1);
+    }
+
+    // Sort the index so that find() can use a binary search, then make
+    // data offsets absolute
+    std::stable_sort(entries.begin(), entries.end(),
+                     [](entry const &a, entry const &b) { return a.hash < b.hash; });
+    uint64_t const data_start = (header_size + entries.size() * entry_size + 15) & ~uint64_t(15);
+    for (auto &e : entries)
+        e.offset += data_start;
+
+    if (strings.empty())
+        strings += '\0';
+
+    std::string header(magic, sizeof(magic));
+    write32(header, version);
+    write32(header, uint32_t(entries.size()));
+    write32(header, 0);
+    write64(header, data_start + data.length());
+    write64(header, strings.length());
+    for (auto const &e : entries)
+    {
+        write64(header, e.hash);
+        write64(header, e.offset);
+        write32(header, e.code_size);
+        write32(header, e.tokens);
+        write32(header, e.name);
+        write32(header, e.title);
+        write32(header, e.author);
+        write32(header, e.flags);
+    }
+    header.resize(data_start, '\0');
+
+    std::ofstream f(filename, std::ios::binary);
+    f.write(header.data(), header.length());
+    f.write(data.data(), data.length());
+    f.write(strings.data(), strings.length());
+
+    if (!f)
+    {
+        lol::msg::error("cannot write archive %s\n", filename.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+} // namespace z8::pico8
+
@@ -0,0 +1,101 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <string>      // std::string
+#include <string_view> // std::string_view
+#include <vector>      // std::vector
+#include <cstdint>     // uint8_t, uint64_t
+
+#include "pico8/memory.h"
+
+// The archive class
+// —————————————————
+// A single file holding many carts, already unpacked: for each of them the
+// ROM, the label, the decompressed code and some metadata, plus an index
+// sorted by a hash of the cart names. The file is memory-mapped, so that
+// opening an archive only decodes the index, and loading a cart from it is
+// a few copies.
+//
+// All values are little-endian. The layout is:
+//   header: "z8ar", version, cart count, 0, string table offset and size
+//   index:  one entry per cart, see archive::entry
+//   data:   per cart, the ROM, the label if any, and the code
+//   string table: NUL-terminated names, titles and authors
+
+namespace z8::pico8
+{
+
+class archive
+{
+public:
+    struct info
+    {
+        char const *name, *title, *author;
+        int tokens;
+    };
+
+    archive() = default;
+    ~archive();
+
+    archive(archive const &) = delete;
+    archive &operator =(archive const &) = delete;
+
+    bool open(std::string const &filename);
+    void close();
+
+    size_t size() const { return m_count; }
+
+    // Index of the cart with this name, or -1 if it is not in the archive
+    int find(std::string const &name) const;
+
+    info get_info(size_t index) const;
+    memory const &get_rom(size_t index) const;
+    std::string_view get_code(size_t index) const;
+    // Null if the cart has no label
+    uint8_t const *get_label(size_t index) const;
+
+    // Write an archive containing these carts, named after their file name
+    // without its extensions; carts that fail to load are skipped
+    static bool build(std::string const &filename, std::vector<std::string> const &carts);
+
+    // The name a cart file is given in an archive
+    static std::string cart_name(std::string const &filename);
+
+    // The title and author of a cart, from the comments on the first two
+    // lines of its code
+    static void title_author(std::string const &code, std::string &title, std::string &author);
+
+private:
+    struct entry
+    {
+        uint64_t hash;      // hash64() of the name
+        uint64_t offset;    // start of the cart data
+        uint32_t code_size; // code length, not including the final NUL
+        uint32_t tokens;
+        uint32_t name, title, author; // offsets in the string table
+        uint32_t flags;     // bit 0: the cart has a label
+    };
+
+    entry const &get_entry(size_t index) const;
+    char const *get_string(uint32_t offset) const;
+
+    uint8_t const *m_data = nullptr;
+    std::vector<entry> m_entries;
+    size_t m_size = 0, m_count = 0;
+    uint64_t m_strings = 0, m_strings_size = 0;
+    void *m_mapping = nullptr; // for Windows
+};
+
+} // namespace z8::pico8
+
@@ -0,0 +1,383 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <lol/engine.h> // lol::net
+#include <lol/utils>    // lol::format, lol::split
+#include <algorithm>    // std::find, std::sort
+#include <chrono>       // std::chrono
+#include <cctype>       // isalnum()
+#include <cstdlib>      // std::strtoull
+#include <filesystem>   // std::filesystem
+#include <fstream>      // std::ifstream, std::ofstream
+#include <iterator>     // std::istreambuf_iterator
+
+#include "zepto8.h"
+#include "pico8/bbs.h"
+
+namespace fs = std::filesystem;
+
+namespace z8::pico8
+{
+
+// Concurrent fetches
+static int const workers = 4;
+
+// Prefetched carts that were never requested are dropped after this many
+static size_t const max_prefetched = 32;
+
+static std::string read_file(fs::path const &path)
+{
+    std::ifstream f(path, std::ios::binary);
+    return std::string((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+}
+
+// Write to a temporary file first, so that readers never see a partial file
+static bool write_file(fs::path const &path, std::string const &data, int index)
+{
+    fs::path tmp = path;
+    tmp += lol::format(".%d.tmp", index);
+    {
+        std::ofstream f(tmp, std::ios::binary);
+        f.write(data.data(), data.length());
+        if (!f)
+            return false;
+    }
+
+    std::error_code ec;
+    fs::rename(tmp, path, ec);
+    if (ec)
+        fs::remove(tmp, ec);
+    return !ec;
+}
+
+// Cart ids end up in file names, so only keep the safe characters
+static std::string ref_name(std::string const &id)
+{
+    std::string ret;
+    for (char ch : id)
+        ret += isalnum((uint8_t)ch) || ch == '-' || ch == '_' ? ch : '_';
+    return ret + ".ref";
+}
+
+static std::string blob_name(uint64_t hash)
+{
+    return lol::format("%016llx.p8.png", (unsigned long long)hash);
+}
+
+bbs &bbs::get()
+{
+    static bbs instance;
+    return instance;
+}
+
+bbs::bbs()
+  : m_host("http://sam.hocevar.net/zepto8")
+{
+    //m_host = "https://www.lexaloffle.com";
+#if _WIN32
+    m_directory = lol::sys::getenv("APPDATA");
+#else
+    m_directory = lol::sys::getenv("HOME") + "/.lexaloffle";
+#endif
+    m_directory += "/pico-8/bbs/zepto8";
+}
+
+bbs::~bbs()
+{
+    m_stop = true;
+    m_cv.notify_all();
+    for (auto &t : m_threads)
+        t.join();
+}
+
+void bbs::set_directory(std::string const &dir)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_directory = dir;
+}
+
+void bbs::set_capacity(size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_capacity = bytes;
+}
+
+void bbs::request(std::string const &id)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    start();
+
+    // A prefetched cart now belongs to the caller
+    auto it = std::find(m_prefetched.begin(), m_prefetched.end(), id);
+    if (it != m_prefetched.end())
+        m_prefetched.erase(it);
+
+    // Wait for the download in progress, if any
+    auto &e = m_downloads[id];
+    ++e.waiters;
+    if (e.d.state != status::pending || e.active)
+        return;
+
+    auto queued = std::find(m_queue.begin(), m_queue.end(), id);
+    if (queued != m_queue.end())
+        m_queue.erase(queued);
+    m_queue.push_front(id);
+    m_cv.notify_one();
+}
+
+void bbs::prefetch(std::vector<std::string> const &ids)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    start();
+
+    for (auto const &id : ids)
+    {
+        if (m_downloads.count(id))
+            continue;
+
+        m_downloads[id] = entry();
+        m_queue.push_back(id);
+        m_prefetched.push_back(id);
+
+        if (m_prefetched.size() > max_prefetched)
+        {
+            // A prefetch being fetched is kept, so that requesting it
+            // later still finds the download in progress
+            auto const &old = m_prefetched.front();
+            auto queued = std::find(m_queue.begin(), m_queue.end(), old);
+            if (queued != m_queue.end())
+                m_queue.erase(queued);
+            if (!m_downloads[old].active)
+                m_downloads.erase(old);
+            m_prefetched.pop_front();
+        }
+    }
+    m_cv.notify_all();
+}
+
+bbs::download bbs::poll(std::string const &id)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto it = m_downloads.find(id);
+    if (it == m_downloads.end())
+        return download { status::failed, nullptr, "no such download" };
+
+    download ret = it->second.d;
+    if (ret.state != status::pending && --it->second.waiters <= 0)
+    {
+        m_downloads.erase(it);
+        auto prefetched = std::find(m_prefetched.begin(), m_prefetched.end(), id);
+        if (prefetched != m_prefetched.end())
+            m_prefetched.erase(prefetched);
+    }
+    return ret;
+}
+
+// Called with the mutex held
+void bbs::start()
+{
+    if (m_threads.size())
+        return;
+
+    for (int i = 0; i < workers; ++i)
+        m_threads.emplace_back(&bbs::worker, this, i);
+}
+
+void bbs::worker(int index)
+{
+    for (;;)
+    {
+        std::string id;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [&]() { return m_stop || m_queue.size(); });
+            if (m_stop)
+                return;
+            id = m_queue.front();
+            m_queue.pop_front();
+            m_downloads[id].active = true;
+        }
+
+        download d = fetch(id, index);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto &e = m_downloads[id];
+        e.d = d;
+        e.active = false;
+
+        // Nobody will ask for a prefetch that was dropped meanwhile
+        if (!e.waiters && std::find(m_prefetched.begin(), m_prefetched.end(), id) == m_prefetched.end())
+            m_downloads.erase(id);
+    }
+}
+
+bbs::download bbs::fetch(std::string const &id, int index)
+{
+    auto failed = [](char const *error)
+    {
+        return download { status::failed, nullptr, error };
+    };
+
+    std::string data;
+    if (!read_cache(id, data))
+    {
+        std::string nfo;
+        if (!fetch_url(m_host + "/bbs/cpost_lister3.php?nfo=1&version=000112bw&lid=" + id, nfo))
+            return failed("error downloading info");
+
+        std::map<std::string, std::string> info;
+        for (auto const &line : lol::split(nfo, '\n'))
+        {
+            size_t delim = line.find(':');
+            if (delim != std::string::npos)
+                info[line.substr(0, delim)] = line.substr(delim + 1);
+        }
+
+        auto const &lid = info["lid"];
+        if (lid.empty() || info["mid"].empty())
+            return failed("no cart info found");
+
+        if (!fetch_url(m_host + "/bbs/get_cart.php?cat=7&lid=" + lid, data))
+            return failed("error downloading cart");
+
+        write_cache(id, nfo, data, index);
+        if (lid != id)
+            write_cache(lid, nfo, data, index);
+    }
+
+    auto c = std::make_shared<cart>();
+    if (!c->load(data.data(), data.length()))
+        return failed("can't decode cart");
+
+    return download { status::ready, c, "" };
+}
+
+bool bbs::fetch_url(std::string const &url, std::string &data) const
+{
+    lol::net::http::client client;
+    client.get(url);
+
+    while (client.get_status() == lol::net::http::status::pending)
+    {
+        if (m_stop)
+            return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    if (client.get_status() != lol::net::http::status::success)
+        return false;
+
+    data = client.get_result();
+    return true;
+}
+
+// Reference files hold the hash of the cart file, then the cart info
+bool bbs::read_cache(std::string const &id, std::string &data)
+{
+    std::string dir;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        dir = m_directory;
+    }
+
+    fs::path const ref = fs::path(dir) / ref_name(id);
+    std::string const text = read_file(ref);
+    size_t const eol = text.find('\n');
+    if (eol == std::string::npos)
+        return false;
+
+    uint64_t const hash = std::strtoull(text.substr(0, eol).c_str(), nullptr, 16);
+    fs::path const blob = fs::path(dir) / blob_name(hash);
+    data = read_file(blob);
+
+    // Drop references to cart files that were trimmed or damaged
+    std::error_code ec;
+    if (data.empty() || hash64(data.data(), data.length()) != hash)
+    {
+        fs::remove(ref, ec);
+        return false;
+    }
+
+    // Touch the cart so that trimming removes it last
+    fs::last_write_time(blob, fs::file_time_type::clock::now(), ec);
+    return true;
+}
+
+void bbs::write_cache(std::string const &id, std::string const &nfo,
+                      std::string const &data, int index)
+{
+    std::string dir;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        dir = m_directory;
+    }
+
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+
+    uint64_t const hash = hash64(data.data(), data.length());
+    fs::path const blob = fs::path(dir) / blob_name(hash);
+    if (!fs::exists(blob, ec) && !write_file(blob, data, index))
+        return;
+    write_file(fs::path(dir) / ref_name(id), lol::format("%016llx\n", (unsigned long long)hash) + nfo, index);
+
+    trim_directory();
+}
+
+// Remove the least recently used carts until under capacity; their
+// reference files are removed when next read
+void bbs::trim_directory()
+{
+    std::string dir;
+    size_t capacity;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        dir = m_directory;
+        capacity = m_capacity;
+    }
+
+    std::vector<std::pair<fs::file_time_type, fs::path>> files;
+    uintmax_t total = 0;
+    std::error_code ec;
+    for (auto const &e : fs::directory_iterator(dir, ec))
+    {
+        if (e.path().extension() != ".png")
+            continue;
+        uintmax_t const size = e.file_size(ec);
+        if (ec)
+            continue;
+        total += size;
+        files.emplace_back(e.last_write_time(ec), e.path());
+    }
+
+    if (total <= capacity)
+        return;
+
+    std::sort(files.begin(), files.end());
+    for (auto const &f : files)
+    {
+        if (total <= capacity)
+            break;
+        uintmax_t const size = fs::file_size(f.second, ec);
+        if (!fs::remove(f.second, ec))
+            continue;
+        total -= size;
+    }
+}
+
+} // namespace z8::pico8
+
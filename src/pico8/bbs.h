@@ -0,0 +1,114 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <atomic>             // std::atomic
+#include <condition_variable> // std::condition_variable
+#include <deque>              // std::deque
+#include <map>                // std::map
+#include <memory>             // std::shared_ptr
+#include <mutex>              // std::mutex
+#include <string>             // std::string
+#include <thread>             // std::thread
+#include <vector>             // std::vector
+
+#include "pico8/cart.h"
+
+// The bbs class
+// —————————————
+// A process-wide download manager for BBS carts. Requests are served by a
+// pool of worker threads that fetch the cart info and the cart, store them
+// in the cache directory, and decode the cart, so that the VM only ever
+// polls for a ready cart object.
+//
+// Cart files are stored under a hash of their content, next to small
+// reference files that map cart ids to them, and the least recently used
+// carts are removed when the directory exceeds its capacity. Carts found
+// in the cache are not downloaded again, and requesting a cart that is
+// already being downloaded waits for that download instead of starting
+// another one.
+
+namespace z8::pico8
+{
+
+class bbs
+{
+public:
+    enum class status
+    {
+        pending,
+        ready,
+        failed,
+    };
+
+    struct download
+    {
+        status state = status::pending;
+        std::shared_ptr<pico8::cart> cart;
+        std::string error;
+    };
+
+    static bbs &get();
+    ~bbs();
+
+    // Cache directory and its maximum size
+    void set_directory(std::string const &dir);
+    void set_capacity(size_t bytes);
+
+    // Start downloading a cart, given its id without the leading '#',
+    // before any prefetched cart
+    void request(std::string const &id);
+
+    // Download carts that are likely to be requested soon, such as the
+    // neighbours of the current one in a listing
+    void prefetch(std::vector<std::string> const &ids);
+
+    // The state of a requested or prefetched cart; a finished download is
+    // forgotten once it has been returned to each of its requesters
+    download poll(std::string const &id);
+
+private:
+    bbs();
+
+    void start();
+    void worker(int index);
+    download fetch(std::string const &id, int index);
+
+    bool fetch_url(std::string const &url, std::string &data) const;
+    bool read_cache(std::string const &id, std::string &data);
+    void write_cache(std::string const &id, std::string const &nfo,
+                     std::string const &data, int index);
+    void trim_directory();
+
+    std::string m_host, m_directory;
+    size_t m_capacity = 256 << 20;
+
+    std::vector<std::thread> m_threads;
+    std::atomic<bool> m_stop { false };
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+
+    struct entry
+    {
+        download d;
+        int waiters = 0;      // requests not yet given the result
+        bool active = false;  // a worker is fetching it
+    };
+
+    std::deque<std::string> m_queue;          // requests first, then prefetches
+    std::map<std::string, entry> m_downloads;
+    std::deque<std::string> m_prefetched;     // unclaimed prefetches, oldest first
+};
+
+} // namespace z8::pico8
+
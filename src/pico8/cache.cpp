@@ -0,0 +1,214 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <lol/utils>  // lol::format
+#include <algorithm>  // std::sort
+#include <filesystem> // std::filesystem
+#include <fstream>    // std::ifstream, std::ofstream
+#include <iterator>   // std::istreambuf_iterator
+#include <vector>     // std::vector
+#include <cstring>    // memcmp()
+
+#include "zepto8.h"
+#include "pico8/cache.h"
+
+namespace fs = std::filesystem;
+
+namespace z8::pico8
+{
+
+// Files start with this magic, then the key and a hash of the bytecode
+static char const magic[4] = { 'z', '8', 'b', 'c' };
+static size_t const header_size = sizeof(magic) + 2 * sizeof(uint64_t);
+
+code_cache &code_cache::get()
+{
+    static code_cache instance;
+    return instance;
+}
+
+void code_cache::set_capacity(size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_capacity = bytes;
+    trim();
+    trim_directory();
+}
+
+void code_cache::set_directory(std::string const &dir)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_directory = dir;
+    if (dir.length())
+    {
+        std::error_code ec;
+        fs::create_directories(dir, ec);
+    }
+}
+
+bool code_cache::find(uint64_t key, std::string &bytecode)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto it = m_index.find(key);
+    if (it != m_index.end())
+    {
+        m_entries.splice(m_entries.begin(), m_entries, it->second);
+        bytecode = it->second->second;
+        return true;
+    }
+
+    if (m_directory.empty())
+        return false;
+
+    std::ifstream f(path(key), std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+    f.close();
+
+    // Drop files that are truncated or were written for another key
+    uint64_t file_key, hash;
+    if (data.length() >= header_size)
+    {
+        ::memcpy(&file_key, data.data() + sizeof(magic), sizeof(file_key));
+        ::memcpy(&hash, data.data() + sizeof(magic) + sizeof(file_key), sizeof(hash));
+    }
+    if (data.length() < header_size || ::memcmp(data.data(), magic, sizeof(magic))
+         || file_key != key || hash != hash64(data.data() + header_size, data.length() - header_size))
+    {
+        std::error_code ec;
+        if (data.length())
+            fs::remove(path(key), ec);
+        return false;
+    }
+
+    // Touch the file so that trimming the directory removes it last
+    std::error_code ec;
+    fs::last_write_time(path(key), fs::file_time_type::clock::now(), ec);
+
+    bytecode = data.substr(header_size);
+    insert(key, bytecode);
+    return true;
+}
+
+void code_cache::store(uint64_t key, std::string const &bytecode)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (!m_index.count(key))
+        insert(key, bytecode);
+
+    if (m_directory.empty() || header_size + bytecode.length() > m_capacity)
+        return;
+
+    // Write to a temporary file first, so that other processes never see
+    // a partial file
+    uint64_t const hash = hash64(bytecode.data(), bytecode.length());
+    std::string const tmp = path(key) + ".tmp";
+    {
+        std::ofstream f(tmp, std::ios::binary);
+        f.write(magic, sizeof(magic));
+        f.write((char const *)&key, sizeof(key));
+        f.write((char const *)&hash, sizeof(hash));
+        f.write(bytecode.data(), bytecode.length());
+        if (!f)
+            return;
+    }
+
+    std::error_code ec;
+    fs::rename(tmp, path(key), ec);
+    if (ec)
+        fs::remove(tmp, ec);
+    trim_directory();
+}
+
+void code_cache::clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_entries.clear();
+    m_index.clear();
+    m_size = 0;
+
+    if (m_directory.length())
+    {
+        std::error_code ec;
+        for (auto const &e : fs::directory_iterator(m_directory, ec))
+            if (e.path().extension() == ".z8bc")
+                fs::remove(e.path(), ec);
+    }
+}
+
+std::string code_cache::path(uint64_t key) const
+{
+    return m_directory + lol::format("/%016llx.z8bc", (unsigned long long)key);
+}
+
+void code_cache::insert(uint64_t key, std::string const &bytecode)
+{
+    if (bytecode.length() > m_capacity)
+        return;
+
+    m_entries.emplace_front(key, bytecode);
+    m_index[key] = m_entries.begin();
+    m_size += bytecode.length();
+    trim();
+}
+
+// Remove the least recently used entries until under capacity
+void code_cache::trim()
+{
+    while (m_size > m_capacity && m_entries.size())
+    {
+        m_size -= m_entries.back().second.length();
+        m_index.erase(m_entries.back().first);
+        m_entries.pop_back();
+    }
+}
+
+// Same for files, using their modification time
+void code_cache::trim_directory()
+{
+    if (m_directory.empty())
+        return;
+
+    std::vector<std::pair<fs::file_time_type, fs::path>> files;
+    uintmax_t total = 0;
+    std::error_code ec;
+    for (auto const &e : fs::directory_iterator(m_directory, ec))
+    {
+        if (e.path().extension() != ".z8bc")
+            continue;
+        uintmax_t const size = e.file_size(ec);
+        if (ec)
+            continue;
+        total += size;
+        files.emplace_back(e.last_write_time(ec), e.path());
+    }
+
+    if (total <= m_capacity)
+        return;
+
+    std::sort(files.begin(), files.end());
+    for (auto const &f : files)
+    {
+        if (total <= m_capacity)
+            break;
+        total -= std::min(total, fs::file_size(f.second, ec));
+        fs::remove(f.second, ec);
+    }
+}
+
+} // namespace z8::pico8
+
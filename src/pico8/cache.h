@@ -0,0 +1,69 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <string>        // std::string
+#include <list>          // std::list
+#include <unordered_map> // std::unordered_map
+#include <mutex>         // std::mutex
+#include <cstdint>       // uint64_t
+
+// The code_cache class
+// ————————————————————
+// A process-wide cache of compiled cart code, keyed by a hash of the
+// source. Entries are kept in memory in least recently used order, and
+// optionally in a directory so that they survive the process. Since
+// keys depend on the content, a changed cart or BIOS simply misses.
+//
+// Bytecode is not verified by Lua, so the directory must not be writable
+// by untrusted users.
+
+namespace z8::pico8
+{
+
+class code_cache
+{
+public:
+    static code_cache &get();
+
+    // Maximum memory used by entries, and by files in the directory
+    void set_capacity(size_t bytes);
+
+    // Also store entries in this directory, or nowhere if empty
+    void set_directory(std::string const &dir);
+
+    bool find(uint64_t key, std::string &bytecode);
+    void store(uint64_t key, std::string const &bytecode);
+
+    // Forget all entries, including the ones on disk
+    void clear();
+
+private:
+    code_cache() = default;
+
+    std::string path(uint64_t key) const;
+    void trim();
+    void trim_directory();
+    void insert(uint64_t key, std::string const &bytecode);
+
+    using entry = std::pair<uint64_t, std::string>;
+
+    std::mutex m_mutex;
+    std::list<entry> m_entries; // most recently used first
+    std::unordered_map<uint64_t, std::list<entry>::iterator> m_index;
+    size_t m_size = 0, m_capacity = 32 << 20;
+    std::string m_directory;
+};
+
+} // namespace z8::pico8
+
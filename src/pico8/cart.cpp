@@ -18,8 +18,10 @@
 #include <lol/file>  // lol::file
 #include <lol/msg>   // lol::msg
 #include <lol/utils> // lol::ends_with
-#include <lol/pegtl> // pegtl::*
-#include <regex>     // std::regex_replace
+#include <string_view> // std::string_view
+#include <cctype>    // isalnum
+#include <cstdlib>   // std::abs, std::atoi
+#include <cstring>   // memcmp(), memcpy()
 
 #include <lol/sys/init.h> // lol::sys::get_data_path
 
@@ -29,6 +31,7 @@ extern "C" {
 }
 
 #include "zepto8.h"
+#include "pico8/archive.h"
 #include "pico8/cart.h"
 #include "pico8/pico8.h"
 
@@ -40,10 +43,10 @@ using lol::msg;
 using lol::u8vec4;
 using lol::PixelFormat;
 
-using namespace tao;
-
 bool cart::load(std::string const &filename)
 {
+    m_label_pixels.clear();
+
     if (lol::ends_with(lol::tolower(filename), ".p8") && load_p8(filename))
         return true;
 
@@ -59,45 +62,250 @@ bool cart::load(std::string const &filename)
     return false;
 }
 
-bool cart::load_png(std::string const &filename)
+bool cart::load(void const *data, size_t size)
 {
-    // Open cartridge as PNG image
-    std::vector<uint8_t> image;
-    unsigned int width, height;
-    unsigned int error = lodepng::decode(image, width, height, filename);
+    static uint8_t const png_magic[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    static char const p8_magic[] = "pico-8 cartridge";
+
+    m_label_pixels.clear();
+
+    if (size >= sizeof(png_magic) && !memcmp(data, png_magic, sizeof(png_magic)))
+        return parse_png((uint8_t const *)data, size);
+
+    if (size >= sizeof(p8_magic) - 1 && !memcmp(data, p8_magic, sizeof(p8_magic) - 1))
+        return parse_p8(std::string((char const *)data, size));
+
+    return false;
+}
 
-    if (error)
+bool cart::load(archive const &a, size_t index)
+{
+    if (index >= a.size())
         return false;
 
-    if (width * height != 160 * 205)
+    memcpy(&m_rom, &a.get_rom(index), sizeof(m_rom));
+    m_code = std::string(a.get_code(index));
+
+    uint8_t const *label = a.get_label(index);
+    m_label_pixels.clear();
+    if (label)
+        m_label.assign(label, label + LABEL_WIDTH * LABEL_HEIGHT);
+    else
+        m_label.clear();
+
+    // Invalidate code cache
+    m_lua.resize(0);
+
+    return true;
+}
+
+bool cart::load_png(std::string const &filename)
+{
+    std::string s;
+    if (!lol::file::read(lol::sys::get_data_path(filename), s))
         return false;
 
-    u8vec4 const *pixels = (u8vec4 const *)image.data();
+    return parse_png((uint8_t const *)s.data(), s.size());
+}
 
-    // Retrieve cartridge data from lower image bits
-    std::vector<uint8_t> bytes(sizeof(m_rom) + 5);
-    for (int n = 0; n < (int)bytes.size(); ++n)
+static inline uint32_t read_be32(uint8_t const *p)
+{
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+}
+
+// Undo the PNG filter of one row of RGBA pixels, in place; prev is the
+// previous unfiltered row, or null for the first row
+static bool unfilter_row(uint8_t *row, uint8_t const *prev, int filter, size_t len)
+{
+    int const bpp = 4;
+
+    switch (filter)
     {
-        u8vec4 p = pixels[n] * 64;
-        bytes[n] = p.a + p.r / 4 + p.g / 16 + p.b / 64;
+    case 0:
+        break;
+    case 1:
+        for (size_t i = bpp; i < len; ++i)
+            row[i] += row[i - bpp];
+        break;
+    case 2:
+        if (prev)
+            for (size_t i = 0; i < len; ++i)
+                row[i] += prev[i];
+        break;
+    case 3:
+        for (size_t i = 0; i < len; ++i)
+        {
+            int const left = i >= bpp ? row[i - bpp] : 0;
+            int const up = prev ? prev[i] : 0;
+            row[i] += (left + up) / 2;
+        }
+        break;
+    case 4:
+        for (size_t i = 0; i < len; ++i)
+        {
+            int const a = i >= bpp ? row[i - bpp] : 0;
+            int const b = prev ? prev[i] : 0;
+            int const c = prev && i >= bpp ? prev[i - bpp] : 0;
+            int const pa = std::abs(b - c), pb = std::abs(a - c), pc = std::abs(a + b - 2 * c);
+            row[i] += pa <= pb && pa <= pc ? a : pb <= pc ? b : c;
+        }
+        break;
+    default:
+        return false;
     }
 
-    // Retrieve label from image pixels
-    if (width >= LABEL_WIDTH + LABEL_X && height >= LABEL_HEIGHT + LABEL_Y)
+    return true;
+}
+
+bool cart::parse_png(uint8_t const *data, size_t size)
+{
+    int const width = 160, height = 205;
+    size_t const stride = width * 4;
+
+    // The cart data, followed by the version bytes, is stored in the two
+    // lower bits of each pixel component
+    size_t const rom_size = sizeof(m_rom) + 5;
+    uint8_t version[5] = {};
+    auto store_pixel = [&](size_t n, uint8_t const *p)
     {
-        m_label.resize(LABEL_WIDTH * LABEL_HEIGHT);
-        for (int y = 0; y < LABEL_HEIGHT; ++y)
-        for (int x = 0; x < LABEL_WIDTH; ++x)
+        uint8_t const b = ((p[3] & 3) << 6) | ((p[0] & 3) << 4) | ((p[1] & 3) << 2) | (p[2] & 3);
+        if (n < sizeof(m_rom))
+            ((uint8_t *)&m_rom)[n] = b;
+        else if (n < rom_size)
+            version[n - sizeof(m_rom)] = b;
+    };
+
+    // Walk the chunks; carts saved by PICO-8 are always 8-bit RGBA and not
+    // interlaced, which is the only case decoded here, straight from the
+    // buffer. Anything else goes through lodepng.
+    bool simple = size >= 33 && read_be32(data + 8) == 13 && !memcmp(data + 12, "IHDR", 4)
+               && read_be32(data + 16) == uint32_t(width) && read_be32(data + 20) == uint32_t(height)
+               && data[24] == 8 && data[25] == 6 && data[28] == 0;
+
+    uint8_t const *idat = nullptr;
+    size_t idat_size = 0;
+    std::vector<uint8_t> idat_copy;
+
+    for (size_t pos = 8; simple && pos + 12 <= size; )
+    {
+        size_t const len = read_be32(data + pos);
+        uint8_t const *type = data + pos + 4;
+        if (len > size - pos - 12)
         {
-            lol::u8vec4 p = pixels[(y + LABEL_Y) * width + (x + LABEL_X)];
-            m_label[y * LABEL_WIDTH + x] = palette::best(p, 32);
+            simple = false;
+            break;
         }
+
+        if (!memcmp(type, "IDAT", 4))
+        {
+            // Only concatenate if the stream is split across chunks
+            if (!idat)
+            {
+                idat = data + pos + 8;
+                idat_size = len;
+            }
+            else
+            {
+                if (idat_copy.empty())
+                    idat_copy.assign(idat, idat + idat_size);
+                idat_copy.insert(idat_copy.end(), data + pos + 8, data + pos + 8 + len);
+            }
+        }
+        else if (!memcmp(type, "IEND", 4))
+            break;
+
+        pos += len + 12;
     }
 
-    set_bin(bytes);
+    if (idat_copy.size())
+    {
+        idat = idat_copy.data();
+        idat_size = idat_copy.size();
+    }
+
+    std::vector<uint8_t> rows;
+    simple = simple && idat && !lodepng::decompress(rows, idat, idat_size)
+              && rows.size() >= (stride + 1) * height;
+
+    if (simple)
+    {
+        // Unfilter one scanline at a time and extract its bytes directly
+        for (int y = 0; y < height; ++y)
+        {
+            uint8_t *row = rows.data() + y * (stride + 1);
+            uint8_t const *prev = y ? row - stride : nullptr;
+            if (!unfilter_row(row + 1, prev, row[0], stride))
+                return false;
+
+            for (int x = 0; x < width; ++x)
+                store_pixel(y * width + x, row + 1 + 4 * x);
+
+            if (y >= LABEL_Y && y < LABEL_Y + LABEL_HEIGHT)
+            {
+                if (y == LABEL_Y)
+                    m_label_pixels.resize(LABEL_WIDTH * LABEL_HEIGHT);
+                memcpy(&m_label_pixels[(y - LABEL_Y) * LABEL_WIDTH],
+                       row + 1 + 4 * LABEL_X, LABEL_WIDTH * 4);
+            }
+        }
+    }
+    else
+    {
+        std::vector<uint8_t> image;
+        unsigned int w, h;
+        if (lodepng::decode(image, w, h, data, size) || w * h != width * height)
+            return false;
+
+        for (size_t n = 0; n < rom_size; ++n)
+            store_pixel(n, image.data() + 4 * n);
+
+        if (w >= LABEL_WIDTH + LABEL_X && h >= LABEL_HEIGHT + LABEL_Y)
+        {
+            m_label_pixels.resize(LABEL_WIDTH * LABEL_HEIGHT);
+            for (int y = 0; y < LABEL_HEIGHT; ++y)
+                memcpy(&m_label_pixels[y * LABEL_WIDTH],
+                       image.data() + 4 * ((y + LABEL_Y) * w + LABEL_X), LABEL_WIDTH * 4);
+        }
+    }
+
+    m_label.clear();
+    unpack_code(version);
     return true;
 }
 
+// Match the label pixels of a PNG cart against the palette, if not done yet
+void cart::unpack_label() const
+{
+    if (m_label_pixels.empty())
+        return;
+
+    // Matching is a single lookup in the palette cube
+    m_label.resize(m_label_pixels.size());
+    for (size_t n = 0; n < m_label_pixels.size(); ++n)
+        m_label[n] = palette::best(m_label_pixels[n], 32);
+
+    m_label_pixels.clear();
+}
+
+// Append text from a file to cart code, removing CRLF for internal
+// consistency. PICO-8 saves some symbols in the .p8 file as Emoji/Unicode
+// characters but the runtime expects 8-bit characters instead.
+static void append_code(std::string &code, std::string_view text)
+{
+    for (char const *p = text.data(), *end = p + text.length(); p < end; )
+    {
+        if (p[0] == '\r' && p + 1 < end && p[1] == '\n')
+        {
+            ++p;
+            continue;
+        }
+
+        uint8_t ch;
+        p += charset::decode_utf8(p, end, ch);
+        code += char(ch);
+    }
+}
+
 bool cart::load_lua(std::string const &filename)
 {
     // Read file
@@ -105,12 +313,8 @@ bool cart::load_lua(std::string const &filename)
     if (!lol::file::read(lol::sys::get_data_path(filename), code))
         return false;
 
-    // Remove CRLF for internal consistency
-    code = std::regex_replace(code, std::regex("\r\n"), "\n");
-
-    // PICO-8 saves some symbols in the .p8 file as Emoji/Unicode characters
-    // but the runtime expects 8-bit characters instead.
-    m_code = charset::utf8_to_pico8(code);
+    m_code.clear();
+    append_code(m_code, code);
     memset(&m_rom, 0, sizeof(m_rom));
     return true;
 }
@@ -166,7 +370,13 @@ bool cart::load_js(std::string const &filename)
 void cart::set_bin(std::vector<uint8_t> const &bytes)
 {
     memcpy(&m_rom, bytes.data(), sizeof(m_rom));
-    uint8_t const *vbytes = bytes.data() + sizeof(m_rom);
+    unpack_code(bytes.data() + sizeof(m_rom));
+}
+
+// Decode the code section of m_rom; vbytes are the version bytes that
+// follow the ROM data in binary carts
+void cart::unpack_code(uint8_t const *vbytes)
+{
     int version = vbytes[0];
     int minor = (vbytes[1] << 24) | (vbytes[2] << 16) | (vbytes[3] << 8) | vbytes[4];
 
@@ -180,62 +390,12 @@ void cart::set_bin(std::vector<uint8_t> const &bytes)
 }
 
 //
-// A special parser object for the .p8 format
+// A special parser object for the .p8 format; the text is read in a single
+// pass, and data sections are decoded straight into the ROM
 //
 
 struct p8_reader
 {
-    //
-    // Grammar rules
-    //
-
-    struct r_lua : TAO_PEGTL_STRING("__lua__") {};
-    struct r_gfx : TAO_PEGTL_STRING("__gfx__") {};
-    struct r_gff : TAO_PEGTL_STRING("__gff__") {};
-    struct r_map : TAO_PEGTL_STRING("__map__") {};
-    struct r_sfx : TAO_PEGTL_STRING("__sfx__") {};
-    struct r_mus : TAO_PEGTL_STRING("__music__") {};
-    struct r_lab : TAO_PEGTL_STRING("__label__") {};
-    struct r_any : pegtl::seq<pegtl::two<'_'>, pegtl::plus<pegtl::alnum>, pegtl::two<'_'>> {};
-
-    struct r_section_name : pegtl::sor<r_lua,
-                                       r_gfx,
-                                       r_gff,
-                                       r_map,
-                                       r_sfx,
-                                       r_mus,
-                                       r_lab,
-                                       r_any> {};
-    struct r_section_line : pegtl::seq<r_section_name, pegtl::eolf> {};
-
-    struct r_data_line : pegtl::until<pegtl::eolf> {};
-    struct r_data : pegtl::star<pegtl::not_at<r_section_line>,
-                                pegtl::not_at<pegtl::eof>,
-                                r_data_line> {};
-
-    struct r_section : pegtl::seq<r_section_line, r_data> {};
-    struct r_version : pegtl::star<pegtl::digit> {};
-
-    struct r_header: pegtl::seq<TAO_PEGTL_STRING("pico-8 cartridge"), pegtl::until<pegtl::eol>,
-                                TAO_PEGTL_STRING("version "), r_version, pegtl::until<pegtl::eol>> {};
-    struct r_file : pegtl::seq<pegtl::opt<pegtl::utf8::bom>,
-                               r_header,
-                               r_data, /* data before the first section is ignored */
-                               pegtl::star<r_section>,
-                               pegtl::eof> {};
-
-    //
-    // Grammar actions
-    //
-
-    template<typename R> struct action {};
-
-    //
-    // Parser state
-    //
-
-    int m_version = -1;
-
     enum class section : int8_t
     {
         error = -1,
@@ -249,121 +409,233 @@ struct p8_reader
         lab,
     };
 
-    section m_current_section;
-    std::map<int8_t, std::vector<uint8_t>> m_sections;
-    std::string m_code;
+    p8_reader(memory &rom, std::string &code, std::vector<uint8_t> &label)
+      : m_rom(rom),
+        m_code(code),
+        m_label(label)
+    {}
+
+    int m_version = -1;
+
+    // Number of bytes decoded in each section
+    size_t m_sizes[8] = {};
 
     //
-    // Actual reader
+    // Actual reader; the ROM, code and label are only reset if the text
+    // starts with a valid header
     //
 
-    void parse(std::string const &str)
+    bool parse(std::string_view s)
     {
-        pegtl::string_input<> in(str, "p8");
-        pegtl::parse<r_file, action>(in, *this);
+        if (s.substr(0, 3) == "\xef\xbb\xbf")
+            s.remove_prefix(3);
+
+        if (next_line(s).substr(0, 16) != "pico-8 cartridge")
+            return false;
+        auto version = next_line(s);
+        if (version.substr(0, 8) != "version ")
+            return false;
+        m_version = std::atoi(std::string(version.substr(8)).c_str());
+
+        memset(&m_rom, 0, sizeof(m_rom));
+        m_code.clear();
+        m_label.clear();
+
+        // Data before the first section is ignored
+        m_section = section::header;
+        while (!s.empty())
+        {
+            auto line = next_line(s);
+            if (!set_section(line))
+                data_line(line);
+        }
+
+        return true;
     }
 
-};
+private:
+    // Return the first line of s, including its end of line, and remove it
+    static std::string_view next_line(std::string_view &s)
+    {
+        size_t eol = s.find('\n');
+        size_t len = eol == std::string_view::npos ? s.length() : eol + 1;
+        auto line = s.substr(0, len);
+        s.remove_prefix(len);
+        return line;
+    }
 
-template<>
-struct p8_reader::action<p8_reader::r_version>
-{
-    template<typename Input>
-    static void apply(Input const &in, p8_reader &r)
+    static int hex(uint8_t ch)
     {
-        r.m_version = std::atoi(in.string().c_str());
+        return ch >= '0' && ch <= '9' ? ch - '0' :
+               ch >= 'a' && ch <= 'f' ? ch - 'a' + 10 :
+               ch >= 'A' && ch <= 'F' ? ch - 'A' + 10 : -1;
     }
-};
 
-template<>
-struct p8_reader::action<p8_reader::r_section_name>
-{
-    template<typename Input>
-    static void apply(Input const &in, p8_reader &r)
+    // Section lines are __name__ where name is alphanumeric
+    bool set_section(std::string_view line)
     {
-        if (in.string().find("lua") != std::string::npos)
-            r.m_current_section = section::lua;
-        else if (in.string().find("gfx") != std::string::npos)
-            r.m_current_section = section::gfx;
-        else if (in.string().find("gff") != std::string::npos)
-            r.m_current_section = section::gff;
-        else if (in.string().find("map") != std::string::npos)
-            r.m_current_section = section::map;
-        else if (in.string().find("sfx") != std::string::npos)
-            r.m_current_section = section::sfx;
-        else if (in.string().find("music") != std::string::npos)
-            r.m_current_section = section::mus;
-        else if (in.string().find("label") != std::string::npos)
-            r.m_current_section = section::lab;
+        if (!line.empty() && line.back() == '\n')
+        {
+            line.remove_suffix(1);
+            if (!line.empty() && line.back() == '\r')
+                line.remove_suffix(1);
+        }
+
+        if (line.length() < 5 || line.substr(0, 2) != "__"
+             || line.substr(line.length() - 2) != "__")
+            return false;
+
+        auto name = line.substr(2, line.length() - 4);
+        for (uint8_t ch : name)
+            if (!isalnum(ch))
+                return false;
+
+        if (name.find("lua") != std::string_view::npos)
+            m_section = section::lua;
+        else if (name.find("gfx") != std::string_view::npos)
+            m_section = section::gfx;
+        else if (name.find("gff") != std::string_view::npos)
+            m_section = section::gff;
+        else if (name.find("map") != std::string_view::npos)
+            m_section = section::map;
+        else if (name.find("sfx") != std::string_view::npos)
+            m_section = section::sfx;
+        else if (name.find("music") != std::string_view::npos)
+            m_section = section::mus;
+        else if (name.find("label") != std::string_view::npos)
+            m_section = section::lab;
         else
         {
-            msg::info("unknown section name %s\n", in.string().c_str());
-            r.m_current_section = section::error;
+            msg::info("unknown section name %s\n", std::string(line).c_str());
+            m_section = section::error;
         }
+
+        return true;
     }
-};
 
-template<>
-struct p8_reader::action<p8_reader::r_data>
-{
-    template<typename Input>
-    static void apply(Input const &in, p8_reader &r)
+    void data_line(std::string_view line)
     {
-        if (r.m_current_section == section::lua)
+        switch (m_section)
         {
-            // Copy the code but remove CRLF for internal consistency
-            r.m_code += std::regex_replace(in.string(), std::regex("\r\n"), "\n");
+        case section::error:
+        case section::header:
+            break;
+        case section::lua:
+            append_code(m_code, line);
+            break;
+        case section::lab:
+            // Label is base32 (0-9 a-v)
+            for (uint8_t ch : line)
+            {
+                int b = ch >= '0' && ch <= '9' ? ch - '0' :
+                        ch >= 'a' && ch <= 'v' ? ch - 'a' + 10 :
+                        ch >= 'A' && ch <= 'V' ? ch - 'A' + 10 :
+                        -1;
+                if (b >= 0)
+                    put(uint8_t(b));
+            }
+            break;
+        default:
+            // Other sections are hexadecimal; gfx has nybbles swapped
+            for (size_t i = 0; i < line.length(); ++i)
+            {
+                int hi = hex(line[i]);
+                if (hi < 0)
+                    continue;
+                int lo = ++i < line.length() ? hex(line[i]) : -1;
+                if (lo < 0)
+                    put(uint8_t(hi));
+                else if (m_section == section::gfx)
+                    put(uint8_t(hi | lo << 4));
+                else
+                    put(uint8_t(hi << 4 | lo));
+            }
+            break;
         }
-        else
+    }
+
+    void put(uint8_t b)
+    {
+        size_t const n = m_sizes[int8_t(m_section)]++;
+
+        switch (m_section)
         {
-            // Gfx section has nybbles swapped
-            bool const is_swapped = r.m_current_section == section::gfx;
-            // Label is base32 (0-9 a-v), others are hexadecimal
-            bool const is_base32 = r.m_current_section == section::lab;
-
-            // Decode data from this section
-            auto &section = r.m_sections[int8_t(r.m_current_section)];
-            for (auto *parser = (uint8_t const *)in.begin(); parser < (uint8_t const *)in.end(); ++parser)
+        case section::gfx:
+            // Use binary OR here and for the second map chunk, because some
+            // old versions of PICO-8 would store a full gfx+gfx2 section AND
+            // a full map+map2 section, so we cannot really decide which one
+            // is relevant.
+            if (n < sizeof(m_rom.gfx))
+                m_rom.gfx.data[n / 64][n % 64] |= b;
+            break;
+        case section::gff:
+            if (n < sizeof(m_rom.gfx_props))
+                m_rom.gfx_props[n] = b;
+            break;
+        case section::map:
+            if (n < sizeof(m_rom.map))
+                m_rom.map[int(n)] = b;
+            else if (n < sizeof(m_rom.map) + sizeof(m_rom.map2))
+                m_rom.map[int(n)] |= b;
+            break;
+        case section::sfx:
+            // SFX data is packed; decode it once a whole SFX is known
+            m_record[n % (4 + 32 * 5 / 2)] = b;
+            if (n % (4 + 32 * 5 / 2) == 4 + 32 * 5 / 2 - 1)
+                put_sfx(n / (4 + 32 * 5 / 2));
+            break;
+        case section::mus:
+            // Song data is encoded slightly differently
+            m_record[n % 5] = b;
+            if (n % 5 == 4 && n / 5 < sizeof(m_rom.song) / 4)
             {
-                if (is_base32)
-                {
-                    uint8_t ch = parser[0];
-                    int8_t b = ch >= '0' && ch <= '9' ? ch - '0' :
-                               ch >= 'a' && ch <= 'v' ? ch - 'a' + 10 :
-                               ch >= 'A' && ch <= 'V' ? ch - 'A' + 10 :
-                               -1;
-                    if (b >= 0)
-                        section.push_back(uint8_t(b));
-                }
-                else if ((parser[0] >= 'a' && parser[0] <= 'f')
-                      || (parser[0] >= 'A' && parser[0] <= 'F')
-                      || (parser[0] >= '0' && parser[0] <= '9'))
-                {
-                    char str[3] = { (char)parser[is_swapped ? 1 : 0],
-                                    (char)parser[is_swapped ? 0 : 1], '\0' };
-                    section.push_back((uint8_t)strtoul(str, nullptr, 16));
-                    ++parser;
-                }
+                auto &song = m_rom.song[n / 5];
+                for (int j = 0; j < 4; ++j)
+                    song.data[j] = m_record[j + 1] | ((m_record[0] << (7 - j)) & 0x80);
             }
+            break;
+        case section::lab:
+            if (m_label.size() < LABEL_WIDTH * LABEL_HEIGHT)
+                m_label.push_back(b);
+            break;
+        default:
+            break;
         }
     }
-};
 
-struct replacement
-{
-    replacement(char const *re, char const *str)
-      : m_re(re),
-        m_str(str)
-    {}
-
-    std::string replace(std::string const &str) const
+    void put_sfx(size_t i)
     {
-        return std::regex_replace(str, m_re, m_str);
+        if (i >= sizeof(m_rom.sfx) / sizeof(m_rom.sfx[0]))
+            return;
+
+        auto &sfx = m_rom.sfx[i];
+        for (int j = 0; j < 32; ++j)
+        {
+            uint32_t ins = (m_record[4 + j * 5 / 2 + 0] << 16)
+                         | (m_record[4 + j * 5 / 2 + 1] << 8)
+                         | (m_record[4 + j * 5 / 2 + 2]);
+            // We read unaligned data; must realign it if j is odd
+            ins = (j & 1) ? ins & 0xfffff : ins >> 4;
+
+            sfx.notes[j].key = (ins & 0x3f000) >> 12;
+            sfx.notes[j].instrument = (ins & 0x700) >> 8;
+            sfx.notes[j].volume = (ins & 0x70) >> 4;
+            sfx.notes[j].effect = ins & 0xf;
+        }
+
+        sfx.editor_mode = m_record[0];
+        sfx.speed       = m_record[1];
+        sfx.loop_start  = m_record[2];
+        sfx.loop_end    = m_record[3];
     }
 
-private:
-    std::regex m_re;
-    char const *m_str;
+    memory &m_rom;
+    std::string &m_code;
+    std::vector<uint8_t> &m_label;
+
+    section m_section = section::header;
+    // The SFX or song being decoded
+    uint8_t m_record[4 + 32 * 5 / 2];
 };
 
 bool cart::load_p8(std::string const &filename)
@@ -374,93 +646,25 @@ bool cart::load_p8(std::string const &filename)
 
     msg::debug("loaded file %s\n", filename.c_str());
 
-    p8_reader reader;
-    reader.parse(s.c_str());
+    return parse_p8(s);
+}
 
-    if (reader.m_version < 0)
+bool cart::parse_p8(std::string const &s)
+{
+    p8_reader reader(m_rom, m_code, m_label);
+    if (!reader.parse(s))
         return false;
 
-    // PICO-8 saves some symbols in the .p8 file as Emoji/Unicode characters
-    // but the runtime expects 8-bit characters instead.
-    m_code = charset::utf8_to_pico8(reader.m_code);
-
-    memset(&m_rom, 0, sizeof(m_rom));
-
-    auto const &gfx = reader.m_sections[(int8_t)p8_reader::section::gfx];
-    auto const &gff = reader.m_sections[(int8_t)p8_reader::section::gff];
-    auto const &map = reader.m_sections[(int8_t)p8_reader::section::map];
-    auto const &sfx = reader.m_sections[(int8_t)p8_reader::section::sfx];
-    auto const &mus = reader.m_sections[(int8_t)p8_reader::section::mus];
-    auto const &lab = reader.m_sections[(int8_t)p8_reader::section::lab];
-
+    auto const &size = reader.m_sizes;
     msg::debug("version: %d code: %d gfx: %d/%d gff: %d/%d map: %d/%d "
                "sfx: %d/%d mus: %d/%d lab: %d/%d\n",
                reader.m_version, (int)m_code.length(),
-               (int)gfx.size(), (int)sizeof(m_rom.gfx),
-               (int)gff.size(), (int)sizeof(m_rom.gfx_props),
-               (int)map.size(), (int)(sizeof(m_rom.map) + sizeof(m_rom.map2)),
-               (int)sfx.size() / (4 + 80) * (4 + 64), (int)sizeof(m_rom.sfx),
-               (int)mus.size() / 5 * 4, (int)sizeof(m_rom.song),
-               (int)lab.size(), LABEL_WIDTH * LABEL_HEIGHT);
-
-    // The optional second chunk of gfx is contiguous, we can copy it directly
-    memcpy(&m_rom.gfx, gfx.data(), std::min(sizeof(m_rom.gfx), gfx.size()));
-
-    memcpy(&m_rom.gfx_props, gff.data(), std::min(sizeof(m_rom.gfx_props), gff.size()));
-
-    // Map data + optional second chunk
-    memcpy(&m_rom.map, map.data(), std::min(sizeof(m_rom.map), map.size()));
-    if (map.size() > sizeof(m_rom.map))
-    {
-        size_t map2_count = std::min(sizeof(m_rom.map2),
-                                     map.size() - sizeof(m_rom.map));
-        // Use binary OR because some old versions of PICO-8 would store
-        // a full gfx+gfx2 section AND a full map+map2 section, so we cannot
-        // really decide which one is relevant.
-        for (size_t i = 0; i < map2_count; ++i)
-            m_rom.map2[i] |= map[sizeof(m_rom.map) + i];
-    }
-
-    // Song data is encoded slightly differently
-    size_t song_count = std::min(sizeof(m_rom.song) / 4,
-                                 mus.size() / 5);
-    for (size_t i = 0; i < song_count; ++i)
-    {
-        m_rom.song[i].data[0] = mus[i * 5 + 1] | ((mus[i * 5] << 7) & 0x80);
-        m_rom.song[i].data[1] = mus[i * 5 + 2] | ((mus[i * 5] << 6) & 0x80);
-        m_rom.song[i].data[2] = mus[i * 5 + 3] | ((mus[i * 5] << 5) & 0x80);
-        m_rom.song[i].data[3] = mus[i * 5 + 4] | ((mus[i * 5] << 4) & 0x80);
-    }
-
-    // SFX data is packed
-    size_t sfx_count = std::min(sizeof(m_rom.sfx) / (4 + 32 * 2),
-                                sfx.size() / (4 + 32 * 5 / 2));
-    for (size_t i = 0; i < sfx_count; ++i)
-    {
-        // FIXME move this to the parser maybe?
-        for (int j = 0; j < 32; ++j)
-        {
-            uint32_t ins = (sfx[4 + i * (4 + 80) + j * 5 / 2 + 0] << 16)
-                         | (sfx[4 + i * (4 + 80) + j * 5 / 2 + 1] << 8)
-                         | (sfx[4 + i * (4 + 80) + j * 5 / 2 + 2]);
-            // We read unaligned data; must realign it if j is odd
-            ins = (j & 1) ? ins & 0xfffff : ins >> 4;
-
-            m_rom.sfx[i].notes[j].key = (ins & 0x3f000) >> 12;
-            m_rom.sfx[i].notes[j].instrument = (ins & 0x700) >> 8;
-            m_rom.sfx[i].notes[j].volume = (ins & 0x70) >> 4;
-            m_rom.sfx[i].notes[j].effect = ins & 0xf;
-        }
-
-        m_rom.sfx[i].editor_mode = sfx[i * (4 + 32 * 5 / 2) + 0];
-        m_rom.sfx[i].speed       = sfx[i * (4 + 32 * 5 / 2) + 1];
-        m_rom.sfx[i].loop_start  = sfx[i * (4 + 32 * 5 / 2) + 2];
-        m_rom.sfx[i].loop_end    = sfx[i * (4 + 32 * 5 / 2) + 3];
-    }
-
-    // Optional cartridge label
-    m_label.resize(std::min(lab.size(), size_t(LABEL_WIDTH * LABEL_HEIGHT)));
-    memcpy(m_label.data(), lab.data(), m_label.size());
+               (int)size[(int8_t)p8_reader::section::gfx], (int)sizeof(m_rom.gfx),
+               (int)size[(int8_t)p8_reader::section::gff], (int)sizeof(m_rom.gfx_props),
+               (int)size[(int8_t)p8_reader::section::map], (int)(sizeof(m_rom.map) + sizeof(m_rom.map2)),
+               (int)size[(int8_t)p8_reader::section::sfx] / (4 + 80) * (4 + 64), (int)sizeof(m_rom.sfx),
+               (int)size[(int8_t)p8_reader::section::mus] / 5 * 4, (int)sizeof(m_rom.song),
+               (int)size[(int8_t)p8_reader::section::lab], LABEL_WIDTH * LABEL_HEIGHT);
 
     // Invalidate code cache
     m_lua.resize(0);
@@ -484,6 +688,7 @@ bool cart::save_png(std::string const &filename) const
     u8vec4 *pixels = (u8vec4 *)image.data();
 
     // Apply label
+    unpack_label();
     if (m_label.size() >= LABEL_WIDTH * LABEL_HEIGHT)
     {
         for (int y = 0; y < LABEL_HEIGHT; ++y)
@@ -516,7 +721,7 @@ bool cart::save_png(std::string const &filename) const
 
 std::vector<uint8_t> cart::get_compressed_code() const
 {
-    return code::compress(m_code);
+    return code::compress(m_code, m_compression);
 }
 
 std::vector<uint8_t> cart::get_bin() const
@@ -531,7 +736,7 @@ std::vector<uint8_t> cart::get_bin() const
     memcpy(ret.data(), &m_rom, data_size);
 
     // Copy code to ROM
-    auto compressed = code::compress(m_code);
+    auto compressed = code::compress(m_code, m_compression);
     ret.insert(ret.end(), compressed.begin(), compressed.end());
 
     msg::debug("compressed code length: %d/%d\n",
@@ -571,6 +776,7 @@ bool cart::save_p8(std::string const &filename) const
     }
 
     // Export label
+    unpack_label();
     if (m_label.size() >= LABEL_WIDTH * LABEL_HEIGHT)
     {
         ret += "__label__\n";
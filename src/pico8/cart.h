@@ -28,6 +28,8 @@
 namespace z8::pico8
 {
 
+class archive;
+
 class cart
 {
 public:
@@ -36,6 +38,14 @@ public:
 
     bool load(std::string const &filename);
 
+    // Load a cart that is already in memory, e.g. from an archive or a
+    // mapped file; only PNG and P8 data are recognised. The buffer is not
+    // referenced after the call.
+    bool load(void const *data, size_t size);
+
+    // Load a cart from an archive; nothing needs to be decoded
+    bool load(archive const &a, size_t index);
+
     memory const &get_rom() const
     {
         return m_rom;
@@ -46,8 +56,11 @@ public:
         return m_rom;
     }
 
+    // The label of PNG carts is only matched against the palette when
+    // first requested
     std::vector<uint8_t> &get_label()
     {
+        unpack_label();
         return m_label;
     }
 
@@ -56,6 +69,19 @@ public:
         return m_code;
     }
 
+    void set_code(std::string const &code)
+    {
+        m_code = code;
+        m_lua.resize(0);
+    }
+
+    // Code compression used when saving; format::pxa_fast trades a few
+    // percent of size for speed
+    void set_compression(code::format fmt)
+    {
+        m_compression = fmt;
+    }
+
     std::vector<uint8_t> get_compressed_code() const;
     std::vector<uint8_t> get_bin() const;
     bool save_p8(std::string const &filename) const;
@@ -64,15 +90,21 @@ public:
 private:
     bool load_png(std::string const &filename);
     bool load_p8(std::string const &filename);
+    bool parse_png(uint8_t const *data, size_t size);
+    bool parse_p8(std::string const &text);
     bool load_lua(std::string const &filename);
     bool load_js(std::string const &filename);
 
     void set_bin(std::vector<uint8_t> const &data);
+    void unpack_code(uint8_t const *version);
+    void unpack_label() const;
 
     memory m_rom;
-    std::vector<uint8_t> m_label;
+    mutable std::vector<uint8_t> m_label;
+    mutable std::vector<lol::u8vec4> m_label_pixels;
     std::string m_code, m_lua;
     int m_version;
+    code::format m_compression = code::format::pxa;
 };
 
 } // namespace z8::pico8
@@ -0,0 +1,215 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <lol/engine.h> // lol::sys::getenv
+#include <lol/msg>      // lol::msg
+#include <lol/utils>    // lol::format
+#include <algorithm>    // std::max
+#include <cctype>       // isalnum(), isxdigit()
+#include <cstdlib>      // std::strtoul
+#include <filesystem>   // std::filesystem
+#include <fstream>      // std::ifstream, std::ofstream
+#include <iterator>     // std::istreambuf_iterator
+
+#include "pico8/cartdata.h"
+
+namespace fs = std::filesystem;
+
+namespace z8::pico8
+{
+
+// Files hold 64 little-endian 32-bit words in hexadecimal, 8 per line
+static std::string encode(cartdata_store::data const &d)
+{
+    std::string ret;
+    for (size_t n = 0; n < d.size(); n += 4)
+    {
+        uint32_t word = d[n] | d[n + 1] << 8 | d[n + 2] << 16 | uint32_t(d[n + 3]) << 24;
+        ret += lol::format("%08x", word);
+        if (n % 32 == 28)
+            ret += '\n';
+    }
+    return ret;
+}
+
+static bool decode(std::string const &s, cartdata_store::data &d)
+{
+    d.fill(0);
+
+    size_t n = 0;
+    for (size_t i = 0; i + 8 <= s.length() && n < d.size(); )
+    {
+        if (!isxdigit((uint8_t)s[i]))
+        {
+            ++i;
+            continue;
+        }
+
+        uint32_t word = (uint32_t)std::strtoul(s.substr(i, 8).c_str(), nullptr, 16);
+        for (int k = 0; k < 4; ++k)
+            d[n++] = uint8_t(word >> (8 * k));
+        i += 8;
+    }
+
+    return n > 0;
+}
+
+cartdata_store &cartdata_store::get()
+{
+    static cartdata_store instance;
+    return instance;
+}
+
+cartdata_store::cartdata_store()
+{
+#if _WIN32
+    m_directory = lol::sys::getenv("APPDATA");
+#else
+    m_directory = lol::sys::getenv("HOME") + "/.lexaloffle";
+#endif
+    m_directory += "/pico-8/cdata/zepto8";
+}
+
+cartdata_store::~cartdata_store()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cv.notify_all();
+    if (m_thread.joinable())
+        m_thread.join();
+
+    // The writer saves everything before it stops, but it may never have
+    // been started
+    flush();
+}
+
+void cartdata_store::set_directory(std::string const &dir)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_directory = dir;
+}
+
+void cartdata_store::set_delay(int milliseconds)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_delay = std::chrono::milliseconds(std::max(milliseconds, 0));
+}
+
+bool cartdata_store::load(std::string const &id, data &d)
+{
+    // Wait for a write in progress, whose data is no longer pending but
+    // may not be in the file yet
+    std::lock_guard<std::mutex> write_lock(m_write_mutex);
+    std::string path;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_pending.find(id);
+        if (it != m_pending.end())
+        {
+            d = it->second;
+            return true;
+        }
+        path = filename(m_directory, id);
+    }
+
+    std::ifstream f(path, std::ios::binary);
+    std::string s((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+    return decode(s, d);
+}
+
+void cartdata_store::store(std::string const &id, data const &d)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_pending[id] = d;
+
+    if (!m_thread.joinable() && !m_stop)
+        m_thread = std::thread(&cartdata_store::writer, this);
+    m_cv.notify_one();
+}
+
+void cartdata_store::flush()
+{
+    std::lock_guard<std::mutex> write_lock(m_write_mutex);
+    std::map<std::string, data> pending;
+    std::string dir;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        pending.swap(m_pending);
+        dir = m_directory;
+    }
+
+    if (pending.empty())
+        return;
+
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+
+    for (auto const &[id, d] : pending)
+    {
+        // Write to a temporary file first, so that the data is replaced
+        // in a single step
+        fs::path path = filename(dir, id), tmp = path;
+        tmp += ".tmp";
+        {
+            std::ofstream f(tmp, std::ios::binary);
+            std::string s = encode(d);
+            f.write(s.data(), s.length());
+            if (!f)
+                ec = std::make_error_code(std::errc::io_error);
+        }
+
+        if (!ec)
+            fs::rename(tmp, path, ec);
+        if (ec)
+        {
+            lol::msg::error("cannot save cart data %s: %s\n", id.c_str(), ec.message().c_str());
+            fs::remove(tmp, ec);
+            ec.clear();
+        }
+    }
+}
+
+void cartdata_store::writer()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_stop)
+    {
+        m_cv.wait(lock, [this]() { return m_stop || !m_pending.empty(); });
+
+        // Give the cart some time to change more data before writing it,
+        // unless the process is exiting
+        m_cv.wait_for(lock, m_delay, [this]() { return m_stop; });
+
+        lock.unlock();
+        flush();
+        lock.lock();
+    }
+}
+
+// Cart ids end up in file names, so only keep the safe characters, even
+// though cartdata() already checks them
+std::string cartdata_store::filename(std::string const &dir, std::string const &id)
+{
+    std::string ret;
+    for (char ch : id)
+        ret += isalnum((uint8_t)ch) || ch == '-' || ch == '_' ? ch : '_';
+    return dir + "/" + ret + ".p8d.txt";
+}
+
+} // namespace z8::pico8
+
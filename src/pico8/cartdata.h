@@ -0,0 +1,76 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <array>              // std::array
+#include <chrono>             // std::chrono
+#include <condition_variable> // std::condition_variable
+#include <map>                // std::map
+#include <mutex>              // std::mutex
+#include <string>             // std::string
+#include <thread>             // std::thread
+#include <cstdint>            // uint8_t
+
+// The cartdata_store class
+// ————————————————————————
+// A process-wide store for the 256 bytes of persistent data that carts
+// open with cartdata(). Storing data only copies it to memory; a writer
+// thread saves the carts that changed at most once per delay, and all of
+// them when the process exits. Files are replaced atomically, so a crash
+// leaves either the old data or the new one.
+
+namespace z8::pico8
+{
+
+class cartdata_store
+{
+public:
+    using data = std::array<uint8_t, 0x100>;
+
+    static cartdata_store &get();
+    ~cartdata_store();
+
+    // Directory of the cartdata files, and the shortest time between two
+    // writes of the pending data
+    void set_directory(std::string const &dir);
+    void set_delay(int milliseconds);
+
+    // Read the data of a cart id, including changes not saved yet; returns
+    // false and zeroes d if there is none
+    bool load(std::string const &id, data &d);
+
+    // Queue the data of a cart id for the next write
+    void store(std::string const &id, data const &d);
+
+    // Write all pending data now
+    void flush();
+
+private:
+    cartdata_store();
+
+    void writer();
+    static std::string filename(std::string const &dir, std::string const &id);
+
+    std::string m_directory;
+    std::chrono::milliseconds m_delay { 1000 };
+
+    std::thread m_thread;
+    bool m_stop = false;
+    std::mutex m_mutex, m_write_mutex;
+    std::condition_variable m_cv;
+
+    std::map<std::string, data> m_pending;
+};
+
+} // namespace z8::pico8
+
@@ -21,6 +21,7 @@
 #include <lol/algo/suffix_array> // lol::suffix_array
 #include <unordered_map> // std::unordered_map
 #include <lol/msg> // lol::msg
+#include <lol/utils> // lol::ends_with
 #include <cstring> // std::memchr
 #include <regex>   // std::regex
 #include <stack>   // std::stack
@@ -40,7 +41,8 @@ using lol::msg;
 
 static std::string pxa_decompress(uint8_t const *input);
 static std::string legacy_decompress(uint8_t const *input);
-static std::vector<uint8_t> pxa_compress(std::string const &input, bool fast = false);
+static std::vector<uint8_t> pxa_compress(std::string const &input);
+static std::vector<uint8_t> pxa_compress_fast(std::string const &input);
 static std::vector<uint8_t> legacy_compress(std::string const &input);
 
 // Move to front structure
@@ -150,6 +152,80 @@ struct compression_graph
     std::vector<node> nodes;
 };
 
+// this[n/16] is the number of bits required to encode n
+static int const compress_bits[16] =
+{
+    4, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7, 7, 7, 7, 7, 8
+};
+
+// Bit stream writer for the PXA format, shared by both compressors
+struct pxa_writer
+{
+    pxa_writer(size_t length)
+      : ret { '\0', 'p', 'x', 'a', uint8_t(length >> 8), uint8_t(length), 0, 0 }
+    {}
+
+    void put_bits(size_t count, uint32_t n)
+    {
+        for (size_t i = 0; i < count; ++i, ++pos)
+        {
+            if (ret.size() * 8 <= pos)
+                ret.push_back(0);
+            ret.back() |= ((n >> i) & 1) << (pos & 0x7);
+        }
+    }
+
+    // Single character, given its move-to-front index
+    void put_char(int n)
+    {
+        int bits = compress_bits[n >> 4];
+        put_bits(bits - 2, ((1 << (bits - 3)) - 1));
+        put_bits(bits, n - (1 << bits) + 16);
+    }
+
+    void put_block(char const *data, int length)
+    {
+        put_bits(13, 0x2);
+        for (int j = 0; j < length; ++j)
+            put_bits(8, uint8_t(data[j]));
+        put_bits(8, 0x0);
+    }
+
+    void put_ref(int offset, int length)
+    {
+        int len = length - 3;
+        int off = offset - 1;
+
+        if (off < 32)
+            put_bits(8, 0x6 | (off << 3));
+        else if (off < 1024)
+            put_bits(13, 0x2 | (off << 3));
+        else
+            put_bits(17, 0x0 | (off << 2));
+
+        while (len >= 0)
+        {
+            put_bits(3, std::min(len, 7));
+            len -= 7;
+        }
+    }
+
+    // Store the compressed size in the header
+    std::vector<uint8_t> finish()
+    {
+        size_t compressed = (pos + 7) / 8;
+        ret[6] = uint8_t(compressed >> 8);
+        ret[7] = uint8_t(compressed);
+
+        TRACE("# Size: %d (%04x)\n", int(compressed), int(compressed));
+
+        return std::move(ret);
+    }
+
+    std::vector<uint8_t> ret;
+    size_t pos = 8 * 8; // stream position in bits
+};
+
 std::string code::decompress(uint8_t const *input)
 {
     if (input[0] == '\0' && input[1] == 'p' && input[2] == 'x' && input[3] == 'a')
@@ -170,7 +246,7 @@ std::vector<uint8_t> code::compress(std::string const &input,
     {
         case format::old: return legacy_compress(input);
         case format::pxa: return pxa_compress(input);
-        case format::pxa_fast: return pxa_compress(input, true);
+        case format::pxa_fast: return pxa_compress_fast(input);
         case format::best:
         default:
         {
@@ -197,70 +273,137 @@ static std::string printable(char ch)
                                      : lol::format("$%d", uint8_t(ch));
 }
 
-static uint8_t const *compress_lut = nullptr;
 static char const *decompress_lut = "\n 0123456789abcdefghijklmnopqrstuvwxyz!#%(){}[]<>+=/*:;.,~_";
 
+// Bits are read LSB first through a 64-bit buffer that is refilled a byte
+// at a time; reading past the end of the stream returns zeroes, as it is
+// padded in memory.
+struct pxa_reader
+{
+    pxa_reader(uint8_t const *input, size_t size)
+      : data(input), end(size * 8)
+    {}
+
+    uint32_t peek(int count)
+    {
+        while (avail < count)
+        {
+            uint64_t byte = next < end / 8 ? data[next] : 0;
+            buffer |= byte << avail;
+            avail += 8;
+            ++next;
+        }
+        return uint32_t(buffer & ((uint64_t(1) << count) - 1));
+    }
+
+    void skip(int count)
+    {
+        buffer >>= count;
+        avail -= count;
+        pos += count;
+    }
+
+    uint32_t get(int count)
+    {
+        uint32_t n = peek(count);
+        skip(count);
+        return n;
+    }
+
+    bool done() const { return pos >= end; }
+
+    uint8_t const *data;
+    size_t end, pos = 0, next = 0;
+    uint64_t buffer = 0;
+    int avail = 0;
+};
+
 static std::string pxa_decompress(uint8_t const *input)
 {
     size_t length = input[4] * 256 + input[5];
     size_t compressed = input[6] * 256 + input[7];
 
-    size_t pos = size_t(8) * 8; // stream position in bits
-    auto get_bits = [&](size_t count) -> uint32_t
+    // For each value of the next two bits: the number of bits of a back
+    // reference offset, and how many of the two bits were used
+    static uint8_t const offset_bits[4][2] = { { 15, 1 }, { 10, 2 }, { 15, 1 }, { 5, 2 } };
+
+    // Number of trailing ones in a byte
+    static auto const ones_lut = []()
     {
-        uint32_t n = 0;
-        for (size_t i = 0; i < count && pos < compressed * 8; ++i, ++pos)
-            n |= ((input[pos >> 3] >> (pos & 0x7)) & 0x1) << i;
-        return n;
-    };
+        std::array<uint8_t, 256> ret {};
+        for (int i = 0; i < 256; ++i)
+            while (ret[i] < 8 && (i >> ret[i]) & 1)
+                ++ret[i];
+        return ret;
+    }();
+
+    size_t const size = std::min(std::max(compressed, size_t(8)), sizeof(pico8::memory::code));
+    pxa_reader bits(input + 8, size - 8);
+
+    // Move-to-front state of literals
+    uint8_t mtf[256];
+    for (int n = 0; n < 256; ++n)
+        mtf[n] = uint8_t(n);
 
-    move_to_front mtf;
     std::string ret;
+    ret.reserve(length);
 
     TRACE("# Size: %d (%04x)\n", int(compressed), int(compressed));
 
-    while (ret.size() < length && pos < compressed * 8)
+    while (ret.size() < length && !bits.done())
     {
-        auto oldpos = pos; (void)oldpos;
-
-        if (get_bits(1))
+        if (bits.get(1))
         {
-            int nbits = 4;
-            while (get_bits(1))
-                ++nbits;
-            int n = get_bits(nbits) + (1 << nbits) - 16;
-            uint8_t ch = mtf.get(n);
+            // The number of ones before the next zero gives the width of the
+            // literal index, from 4 to 8 bits
+            int ones = ones_lut[bits.peek(8)];
+            if (ones > 4)
+                break;
+            bits.skip(ones + 1);
+            int nbits = 4 + ones;
+            int n = bits.get(nbits) + (1 << nbits) - 16;
+            uint8_t ch = n < 256 ? mtf[n] : 0;
             if (!ch)
                 break;
-            TRACE("%04x [%d] %s\n", int(ret.size()), int(pos-oldpos), printable(ch).c_str());
+            ::memmove(mtf + 1, mtf, n);
+            mtf[0] = ch;
+            TRACE("%04x %s\n", int(ret.size()), printable(ch).c_str());
             ret.push_back(char(ch));
         }
         else
         {
-            int nbits = get_bits(1) ? get_bits(1) ? 5 : 10 : 15;
-            int offset = get_bits(nbits) + 1;
+            auto const &code = offset_bits[bits.peek(2)];
+            bits.skip(code[1]);
+            int nbits = code[0];
+            size_t offset = bits.get(nbits) + 1;
 
             if (nbits == 10 && offset == 1)
             {
-                uint8_t ch = get_bits(8);
-                while (ch)
-                {
+                for (uint8_t ch = bits.get(8); ch; ch = bits.get(8))
                     ret.push_back(char(ch));
-                    ch = get_bits(8);
-                }
-                TRACE("%04x [%d] #%d\n", int(ret.size()), int(pos-oldpos), int(pos-oldpos-21) / 8);
+                TRACE("%04x raw block\n", int(ret.size()));
             }
             else
             {
-                int n, len = 3;
+                size_t n, len = 3;
                 do
-                    len += (n = get_bits(3));
+                    len += (n = bits.get(3));
                 while (n == 7);
 
-                TRACE("%04x [%d] %d@-%d\n", int(ret.size()), int(pos-oldpos), len, offset);
-                for (int i = 0; i < len; ++i)
-                    ret.push_back(ret[ret.size() - offset]);
+                TRACE("%04x %d@-%d\n", int(ret.size()), int(len), int(offset));
+                if (offset > ret.size())
+                    break;
+
+                // Overlapping references repeat a pattern; every copy doubles
+                // the data available after the start of the reference
+                size_t const start = ret.size() - offset;
+                while (len)
+                {
+                    size_t count = std::min(len, ret.size() - start);
+                    ret.append(ret, start, count);
+                    len -= count;
                 }
+            }
         }
     }
 
@@ -302,37 +445,17 @@ static std::string legacy_decompress(uint8_t const *input)
     // Some old PNG carts have a “if(_update60)_update…” code snippet added by PICO-8 for backwards
     // compatibility. But some buggy versions apparently miss a carriage return or space, leading
     // to syntax errors. Remove it.
+    // The regex is slow, so only use it when the code could match.
     static std::regex junk("if(_update60)_update=function()_update60([)_update_buttons(]*)_update60()end$");
+    if (!lol::ends_with(ret, "end") || ret.find("_update60") == std::string::npos)
+        return ret;
     return std::regex_replace(ret, junk, "");
 }
 
-static std::vector<uint8_t> pxa_compress(std::string const& input, bool fast)
+static std::vector<uint8_t> pxa_compress(std::string const& input)
 {
-    static int compress_bits[16] =
-    {
-        // this[n/16] is the number of bits required to encode n
-        4, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7, 7, 7, 7, 7, 8
-    };
-
-    std::vector<uint8_t> ret;
-
-    ret.insert(ret.end(),
-    {
-        '\0', 'p', 'x', 'a',
-        uint8_t(input.length() >> 8), uint8_t(input.length()),
-        0, 0,
-    });
-
-    size_t pos = ret.size() * 8; // stream position in bits
-    auto put_bits = [&pos, &ret](size_t count, uint32_t n) -> void
-    {
-        for (size_t i = 0; i < count; ++i, ++pos)
-        {
-            if (ret.size() * 8 <= pos)
-                ret.push_back(0);
-            ret.back() |= ((n >> i) & 1) << (pos & 0x7);
-        }
-    };
+    pxa_writer w(input.length());
+    size_t const &pos = w.pos;
 
     compression_graph graph(input.length());
 
@@ -468,11 +591,6 @@ static std::vector<uint8_t> pxa_compress(std::string const& input, bool fast)
                 next_right_len = std::min(next_right_len, lcp[right + 1]);
             }
 
-            // If we already tested 100 back references for this suffix, stop there so as not to
-            // use too much CPU.
-            if (fast && right - left > 100)
-                break;
-
             size_t j = sar.nth_element(suffix);
 
             // Only look at valid back references
@@ -528,10 +646,7 @@ static std::vector<uint8_t> pxa_compress(std::string const& input, bool fast)
         {
             // Single character
             int n = mtf.find(input[i]);
-            int bits = compress_bits[n >> 4];
-
-            put_bits(bits - 2, ((1 << (bits - 3)) - 1));
-            put_bits(bits, n - (1 << bits) + 16);
+            w.put_char(n);
             mtf.get(n);
             TRACE("%04x Δ%+d [%d] %s\n", int(i), int(pos - oldpos - 8), int(pos - oldpos),
                                          printable(input[i]).c_str());
@@ -539,42 +654,123 @@ static std::vector<uint8_t> pxa_compress(std::string const& input, bool fast)
         else if (t.offset == -1)
         {
             // Raw block
-            put_bits(13, 0x2);
-            for (int j = 0; j < t.length; ++j)
-                put_bits(8, input[i + j]);
-            put_bits(8, 0x0);
+            w.put_block(input.data() + i, t.length);
             TRACE("%04x Δ%+d [%d] #%d\n", int(i), 21, int(pos - oldpos), t.length);
         }
         else
         {
             // Back reference
-            int len = t.length - 3;
-            int off = t.offset - 1;
-
-            if (off < 32)
-                put_bits(8, 0x6 | (off << 3));
-            else if (off < 1024)
-                put_bits(13, 0x2 | (off << 3));
-            else
-                put_bits(17, 0x0 | (off << 2));
-
-            while (len >= 0)
-            {
-                put_bits(3, std::min(len, 7));
-                len -= 7;
-            }
+            w.put_ref(t.offset, t.length);
             TRACE("%04x Δ%+d [%d] %d@-%d\n", int(i), int(pos - oldpos - 8 * t.length), int(pos - oldpos), t.length, t.offset);
         }
     }
 
-    // Adjust compressed size
-    size_t compressed = (pos + 7) / 8;
-    ret[6] = uint8_t(compressed >> 8);
-    ret[7] = uint8_t(compressed);
+    return w.finish();
+}
 
-    TRACE("# Size: %d (%04x)\n", int(compressed), int(compressed));
+// Greedy compressor with lazy matching: back references are found through
+// hash chains instead of a suffix array, and the move-to-front state is
+// always exact since characters are emitted in order. Raw blocks are never
+// used; they seldom help.
+static std::vector<uint8_t> pxa_compress_fast(std::string const &input)
+{
+    int const size = int(input.length());
+    int const window = 32768, max_chain = 64, hash_bits = 15;
 
-    return ret;
+    pxa_writer w(input.length());
+    move_to_front mtf;
+
+    auto hash = [&](int i)
+    {
+        uint32_t n = uint8_t(input[i]) | uint8_t(input[i + 1]) << 8 | uint8_t(input[i + 2]) << 16;
+        return (n * 2654435761u) >> (32 - hash_bits);
+    };
+
+    std::vector<int> head(1 << hash_bits, -1), chain(size, -1);
+    auto insert = [&](int i)
+    {
+        if (i + 3 > size)
+            return;
+        uint32_t h = hash(i);
+        chain[i] = head[h];
+        head[h] = i;
+    };
+
+    // Cost in bits of a back reference
+    auto ref_bits = [](int offset, int length)
+    {
+        return (offset <= 32 ? 8 : offset <= 1024 ? 13 : 17) + 3 * ((length - 3) / 7 + 1);
+    };
+
+    // Find the back reference saving the most bits, assuming characters
+    // cost about 7 bits each; return the number of bits saved
+    struct match { int length = 0, offset = 0, gain = 0; };
+    auto find = [&](int i)
+    {
+        match best;
+        if (i + 3 > size)
+            return best;
+
+        int count = 0;
+        for (int j = head[hash(i)]; j >= 0 && i - j <= window && count < max_chain; j = chain[j], ++count)
+        {
+            int length = 0;
+            while (i + length < size && input[j + length] == input[i + length])
+                ++length;
+            if (length < 3)
+                continue;
+
+            int gain = 7 * length - ref_bits(i - j, length);
+            if (gain > best.gain)
+                best = match { length, i - j, gain };
+        }
+        return best;
+    };
+
+    // Exact cost of emitting characters one by one from the current state
+    auto chars_bits = [&](int i, int length)
+    {
+        move_to_front tmp = mtf;
+        int bits = 0;
+        for (int k = 0; k < length; ++k)
+        {
+            int n = tmp.find(input[i + k]);
+            tmp.get(n);
+            bits += 2 * compress_bits[n >> 4] - 2;
+        }
+        return bits;
+    };
+
+    match next = find(0);
+    for (int i = 0; i < size; )
+    {
+        match m = next;
+        insert(i);
+        next = find(i + 1);
+
+        // Prefer a character if the next position has a clearly better
+        // reference, or if a short reference is not worth it
+        bool use = m.length >= 3 && next.gain <= m.gain + 7;
+        if (use && m.length < 8)
+            use = ref_bits(m.offset, m.length) < chars_bits(i, m.length);
+
+        if (!use)
+        {
+            int n = mtf.find(input[i]);
+            w.put_char(n);
+            mtf.get(n);
+            ++i;
+            continue;
+        }
+
+        w.put_ref(m.offset, m.length);
+        for (int k = 1; k < m.length; ++k)
+            insert(i + k);
+        i += m.length;
+        next = find(i);
+    }
+
+    return w.finish();
 }
 
 static std::vector<uint8_t> legacy_compress(std::string const &input)
@@ -588,15 +784,14 @@ static std::vector<uint8_t> legacy_compress(std::string const &input)
         0, 0 // FIXME: what is this?
     });
 
-    // Ensure the compression LUT is initialised
-    if (!compress_lut)
+    // The compression LUT is initialised once, even with several threads
+    static auto const compress_lut = []()
     {
-        uint8_t *tmp = new uint8_t[256];
-        memset(tmp, 0, 256);
+        std::array<uint8_t, 256> ret {};
         for (int i = 0; i < 0x3b; ++i)
-            tmp[(uint8_t)decompress_lut[i]] = i + 1;
-        compress_lut = tmp;
-    }
+            ret[(uint8_t)decompress_lut[i]] = i + 1;
+        return ret;
+    }();
 
     // FIXME: PICO-8 appears to be adding an implicit \n at the end of the code, and ignoring it
     // when compressing code. So for the moment we write one char too many.
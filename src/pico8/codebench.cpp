@@ -0,0 +1,393 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <lol/msg>    // lol::msg
+#include <lol/utils>  // lol::format
+#include <lol/thread> // lol::timer
+#include <algorithm>  // std::min, std::max, std::shuffle
+#include <cmath>      // std::log
+#include <filesystem> // std::filesystem
+#include <fstream>    // std::ofstream
+#include <numeric>    // std::iota
+#include <random>     // std::mt19937
+#include <cstdio>     // printf
+
+#include "pico8/codebench.h"
+#include "pico8/cart.h"
+#include "pico8/memory.h"
+#include "pico8/pico8.h"
+
+namespace z8::pico8
+{
+
+static struct { char const *name; code::format fmt; } const codecs[] =
+{
+    { "pxa",      code::format::pxa },
+    { "pxa_fast", code::format::pxa_fast },
+    { "old",      code::format::old },
+};
+
+// PICO-8 code is at most this long, and cannot contain zeroes
+static size_t const max_code_size = 65535;
+
+// Decompressors may read up to the end of the code section, and a little
+// past it for the old format, so the data needs to be padded
+static void pad(std::vector<uint8_t> &data)
+{
+    data.resize(std::max(data.size(), sizeof(memory::code)) + 1);
+}
+
+// Compress input with every format, and return the name of the first one
+// that does not decompress to the same input, or nullptr. Data that does
+// not fit in a cart cannot be decompressed, and is not checked.
+static char const *round_trip(std::string const &input)
+{
+    for (auto const &c : codecs)
+    {
+        auto data = code::compress(input, c.fmt);
+        if (data.size() > sizeof(memory::code))
+            continue;
+        pad(data);
+        if (code::decompress(data.data()) != input)
+            return c.name;
+    }
+    return nullptr;
+}
+
+//
+// Input generators for the fuzzer
+//
+
+using rng_t = std::mt19937;
+
+static char nonzero(rng_t &rng)
+{
+    return char(1 + rng() % 255);
+}
+
+// Random characters from a small range
+static std::string gen_alphabet(rng_t &rng, size_t size, std::vector<std::string> const &)
+{
+    int const count = 2 + rng() % 94;
+    int const first = 1 + rng() % (256 - count);
+    std::string ret;
+    while (ret.size() < size)
+        ret += char(first + rng() % count);
+    return ret;
+}
+
+// Sequences of Lua tokens, which compress the way real code does
+static std::string gen_tokens(rng_t &rng, size_t size, std::vector<std::string> const &)
+{
+    static char const *tokens[] =
+    {
+        "local ", "function ", "end\n", "if ", " then\n", "else\n", "for ", " do\n",
+        "return ", "and ", "or ", "not ", "nil", "true", "false", "=", "==", "~=",
+        "+", "-", "*", "/", "%", "..", "(", ")", "[", "]", "{", "}", ",", ".",
+        "\n", " ", "  ", "x", "y", "dx", "dy", "t", "i", "p", "player", "_update",
+        "_draw", "spr(", "cls()", "btn(", "rnd(", "flr(", "0", "1", "8", "128",
+        "0x5f00", "\"str\"", "-- comment\n", "\x80", "\x8b", "\x91", "\x94",
+    };
+
+    std::string ret;
+    while (ret.size() < size)
+        ret += tokens[rng() % (sizeof(tokens) / sizeof(*tokens))];
+    ret.resize(size);
+    return ret;
+}
+
+// A short pattern repeated with a few mutations, for long back references
+// at every possible offset
+static std::string gen_repeat(rng_t &rng, size_t size, std::vector<std::string> const &)
+{
+    std::string pattern;
+    for (size_t len = 1 + rng() % 64; pattern.size() < len; )
+        pattern += nonzero(rng);
+
+    uint32_t const rate = 1 + rng() % 1000;
+    std::string ret;
+    while (ret.size() < size)
+    {
+        ret += pattern[ret.size() % pattern.size()];
+        if (rng() % rate == 0)
+            ret.back() = nonzero(rng);
+    }
+    return ret;
+}
+
+// Fibonacci words have a huge number of overlapping repetitions, which is
+// the hardest case for the suffix array and for choosing between matches
+static std::string gen_fibonacci(rng_t &rng, size_t size, std::vector<std::string> const &)
+{
+    std::string a(1, nonzero(rng)), b = a + nonzero(rng);
+    while (b.size() < size)
+    {
+        a = b + a;
+        std::swap(a, b);
+    }
+    b.resize(size);
+    return b;
+}
+
+// All characters in a scrambled order with short backtracks, so that most
+// literals are far down the move-to-front list and matches are short
+static std::string gen_mtf(rng_t &rng, size_t size, std::vector<std::string> const &)
+{
+    uint8_t perm[255];
+    std::iota(perm, perm + 255, uint8_t(1));
+    std::shuffle(perm, perm + 255, rng);
+
+    int const step = 1 + rng() % 254;
+    std::string ret;
+    for (size_t i = 0; ret.size() < size; ++i)
+        ret += char(perm[(i * step + rng() % 4) % 255]);
+    return ret;
+}
+
+// Carts of the corpus, concatenated and then mutated
+static std::string gen_corpus(rng_t &rng, size_t size, std::vector<std::string> const &corpus)
+{
+    std::string ret;
+    while (ret.size() < size)
+        ret += corpus[rng() % corpus.size()];
+    ret.resize(size);
+
+    for (int count = rng() % 9; count--; )
+    {
+        size_t const pos = rng() % ret.size();
+        size_t const len = std::min(size_t(1 + rng() % 64), ret.size() - pos);
+        switch (rng() % 4)
+        {
+            case 0: ret[pos] = nonzero(rng); break;
+            case 1: ret.erase(pos, len); break;
+            case 2: ret.insert(rng() % ret.size(), ret.substr(pos, len)); break;
+            case 3: ret.insert(pos, 1, nonzero(rng)); break;
+        }
+        if (ret.empty())
+            ret += nonzero(rng);
+    }
+
+    ret.resize(std::min(ret.size(), max_code_size));
+    return ret;
+}
+
+static struct
+{
+    char const *name;
+    std::string (*fn)(rng_t &, size_t, std::vector<std::string> const &);
+}
+const generators[] =
+{
+    { "alphabet",  gen_alphabet },
+    { "tokens",    gen_tokens },
+    { "repeat",    gen_repeat },
+    { "fibonacci", gen_fibonacci },
+    { "mtf",       gen_mtf },
+    { "corpus",    gen_corpus }, // must be last, it needs a corpus
+};
+
+//
+// The harness
+//
+
+bool code_bench::load(std::vector<std::string> const &carts)
+{
+    bool ok = true;
+    for (auto const &name : carts)
+    {
+        cart c;
+        if (!c.load(name))
+        {
+            lol::msg::error("%s: cannot load cart\n", name.c_str());
+            ok = false;
+        }
+        else if (c.get_code().length())
+        {
+            m_names.push_back(name);
+            m_corpus.push_back(c.get_code());
+        }
+    }
+    return ok;
+}
+
+bool code_bench::bench(int passes) const
+{
+    passes = std::max(passes, 1);
+
+    size_t input_size = 0;
+    for (auto const &input : m_corpus)
+        input_size += input.size();
+    if (!input_size)
+    {
+        lol::msg::error("no code to compress\n");
+        return false;
+    }
+
+    printf("%d carts, %d bytes of code, %d passes\n",
+           int(m_corpus.size()), int(input_size), passes);
+    printf("format       ratio   vs pxa   compress      decompress    slowest cart\n");
+
+    bool ok = true;
+    size_t pxa_size = 0;
+    for (auto const &c : codecs)
+    {
+        size_t output_size = 0, slowest = 0;
+        float compress_time = 0.f, decompress_time = 0.f, worst = 0.f;
+
+        for (size_t n = 0; n < m_corpus.size(); ++n)
+        {
+            auto const &input = m_corpus[n];
+            std::vector<uint8_t> data;
+            std::string output;
+
+            lol::timer t;
+            for (int i = 0; i < passes; ++i)
+                data = code::compress(input, c.fmt);
+            float const time = t.get();
+
+            size_t const size = data.size();
+            pad(data);
+            t.get();
+            for (int i = 0; i < passes; ++i)
+                output = code::decompress(data.data());
+            decompress_time += t.get();
+            compress_time += time;
+            output_size += size;
+
+            // Compare time per byte, so that big carts are not always the
+            // slowest ones
+            if (time / input.size() > worst)
+            {
+                worst = time / input.size();
+                slowest = n;
+            }
+
+            if (size <= sizeof(memory::code) && output != input)
+            {
+                lol::msg::error("%s: %s round trip failed\n", m_names[n].c_str(), c.name);
+                ok = false;
+            }
+        }
+
+        if (c.fmt == code::format::pxa)
+            pxa_size = output_size;
+
+        double const mb = 1e-6 * double(input_size) * passes;
+        printf("%-10s %6.2f%%  %6.2f%%  %7.2f MB/s  %7.2f MB/s  %s (%.2f ms/KiB)\n",
+               c.name, 100.0 * output_size / input_size, 100.0 * output_size / pxa_size,
+               mb / std::max(compress_time, 1e-6f), mb / std::max(decompress_time, 1e-6f),
+               m_names[slowest].c_str(), worst * 1024.f * 1000.f / passes);
+    }
+
+    return ok;
+}
+
+bool code_bench::fuzz(int iterations, uint32_t seed, std::string const &dir) const
+{
+    size_t const count = sizeof(generators) / sizeof(*generators) - (m_corpus.empty() ? 1 : 0);
+    int failures = 0;
+
+    std::error_code ec;
+    if (dir.length())
+        std::filesystem::create_directories(dir, ec);
+
+    auto fail = [&](std::string const &input, std::string const &what)
+    {
+        lol::msg::error("%s\n", what.c_str());
+        ++failures;
+        if (dir.empty())
+            return;
+        std::string const name = dir + "/" + lol::format("fail-%u-%d.txt", seed, failures);
+        if (!(std::ofstream(name, std::ios::binary) << input))
+            lol::msg::error("cannot write %s\n", name.c_str());
+    };
+
+    // Round trips: each iteration gets its own generator, so that it can
+    // be reproduced without running the previous ones
+    float worst = 0.f;
+    std::string worst_input;
+    for (int i = 0; i < iterations; ++i)
+    {
+        rng_t rng(seed + uint32_t(i));
+        auto const &g = generators[rng() % count];
+
+        // Mostly small inputs, but up to the maximum code size
+        size_t const range = size_t(2) << rng() % 16;
+        size_t const size = std::min(1 + rng() % range, max_code_size);
+        std::string const input = g.fn(rng, size, m_corpus);
+
+        lol::timer t;
+        char const *error = round_trip(input);
+        float const time = t.get() / input.size();
+
+        if (error)
+            fail(input, lol::format("iteration %d (%s, %d bytes): %s round trip failed",
+                                    i, g.name, int(input.size()), error));
+        // Per-byte times of small inputs are mostly overhead
+        if (input.size() >= 1024 && time > worst)
+        {
+            worst = time;
+            worst_input = lol::format("iteration %d (%s, %d bytes)", i, g.name, int(input.size()));
+        }
+    }
+
+    if (iterations > 0)
+        printf("%d round trips, %d failed\n", iterations, failures);
+    if (worst_input.length())
+        printf("slowest: %s at %.2f ms/KiB\n", worst_input.c_str(), worst * 1024.f * 1000.f);
+
+    // Scaling: time the PXA compressors on two prefixes of the same input;
+    // the exponent is about 1 for linear or n log n growth, and 2 when the
+    // encoder turns quadratic. Wall-clock times depend on the load of the
+    // machine, so a high exponent is only a warning.
+    size_t const small = 16384, large = max_code_size;
+    printf("generator  format    exponent\n");
+    for (size_t n = 0; n < count; ++n)
+    {
+        rng_t rng(seed);
+        std::string const input = generators[n].fn(rng, large, m_corpus);
+
+        for (auto const &c : codecs)
+        {
+            if (c.fmt == code::format::old)
+                continue;
+
+            float time[2];
+            for (int k = 0; k < 2; ++k)
+            {
+                std::string const s = input.substr(0, k ? large : small);
+                time[k] = 1e9f;
+                for (int pass = 0; pass < 3; ++pass)
+                {
+                    lol::timer t;
+                    code::compress(s, c.fmt);
+                    time[k] = std::min(time[k], t.get());
+                }
+            }
+
+            double const exponent = std::log(std::max(time[1], 1e-6f) / std::max(time[0], 1e-6f))
+                                  / std::log(double(large) / small);
+            printf("%-10s %-9s %5.2f  (%.1f ms)%s\n", generators[n].name, c.name,
+                   exponent, time[1] * 1000.f,
+                   exponent > 1.5 ? "  warning: time grows too fast" : "");
+        }
+    }
+
+    return failures == 0;
+}
+
+} // namespace z8::pico8
+
@@ -0,0 +1,57 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <string>  // std::string
+#include <vector>  // std::vector
+#include <cstdint> // uint32_t
+
+// The code_bench class
+// ————————————————————
+// A harness for the code compressors. The benchmark measures compression
+// and decompression throughput and compression ratios on the code of a
+// corpus of carts, for each format, and names the carts that take the
+// longest to compress.
+//
+// The fuzzer checks round trips through every format, on generated code
+// and on mutations of the corpus. Since input is a function of the seed,
+// a failure can be reproduced from the seed and the iteration number. It
+// also times the compressors on growing inputs from each generator, and
+// warns about inputs that seem to send the PXA encoder into quadratic
+// time, e.g. through long move-to-front rollbacks, even when they round
+// trip; timings are too noisy for this to be a failure.
+
+namespace z8::pico8
+{
+
+class code_bench
+{
+public:
+    // Load the code of carts; returns false if one of them failed
+    bool load(std::vector<std::string> const &carts);
+
+    // Compress and decompress each cart passes times, and print the
+    // results; returns false if a round trip failed
+    bool bench(int passes) const;
+
+    // Run iterations round trips, then the scaling checks, and return
+    // false if a round trip failed. Failing inputs are printed, and saved
+    // to dir if it is not empty.
+    bool fuzz(int iterations, uint32_t seed, std::string const &dir) const;
+
+private:
+    std::vector<std::string> m_names, m_corpus;
+};
+
+} // namespace z8::pico8
+
@@ -14,12 +14,17 @@
 #   include "config.h"
 #endif
 
-#include <lol/math>  // lol::round, lol::mix
-#include <lol/utils> // lol::format
-#include <algorithm> // std::swap
-#include <cmath>     // std::min, std::max
+#include <lol/math>   // lol::round, lol::mix, lol::rand
+#include <lol/utils>  // lol::format
+#include <lol/thread> // lol::timer
+#include <algorithm>  // std::swap
+#include <cmath>      // std::min, std::max, std::floor
+#include <cstring>    // ::memcpy
+#include <cstdio>     // printf
+#include <vector>     // std::vector
 
 #include "pico8/vm.h"
+#include "raster.h"
 #include "bios.h"
 
 namespace z8::pico8
@@ -71,7 +76,9 @@ uint8_t vm::get_pixel(int16_t x, int16_t y) const
 {
     auto &ds = m_ram.draw_state;
 
-    if (x < ds.clip.x1 || x >= ds.clip.x2 || y < ds.clip.y1 || y >= ds.clip.y2)
+    // Carts may poke clipping bounds beyond the screen
+    if (x < ds.clip.x1 || x >= std::min<int>(ds.clip.x2, 128)
+         || y < ds.clip.y1 || y >= std::min<int>(ds.clip.y2, 128))
         return 0;
 
     return m_ram.screen.get(x, y);
@@ -82,9 +89,13 @@ void vm::set_pixel(int16_t x, int16_t y, uint32_t color_bits)
     auto &ds = m_ram.draw_state;
     auto &hw = m_ram.hw_state;
 
-    if (x < ds.clip.x1 || x >= ds.clip.x2 || y < ds.clip.y1 || y >= ds.clip.y2)
+    if (x < ds.clip.x1 || x >= std::min<int>(ds.clip.x2, 128)
+         || y < ds.clip.y1 || y >= std::min<int>(ds.clip.y2, 128))
         return;
 
+    m_dirty.rows.set(y);
+    charge_pixels(1, cpu_pixel);
+
     uint8_t color = (color_bits >> 16) & 0xf;
     if ((color_bits >> ((x & 3) + 4 * (y & 3))) & 0x1)
     {
@@ -103,91 +114,301 @@ void vm::set_pixel(int16_t x, int16_t y, uint32_t color_bits)
     m_ram.screen.set(x, y, color);
 }
 
-void vm::hline(int16_t x1, int16_t x2, int16_t y, uint32_t color_bits)
+// Precomputed state for drawing one screen row with a fill pattern and
+// bitplane masks. The 4-pixel pattern period spans exactly two bytes, so
+// everything set_pixel() would compute per pixel is stored per byte.
+//
+// For a given byte, the new value is computed as:
+//     (old & ~write) | (((old & keep) | color) & write)
+// where “write” is the mask of non-transparent nibbles, and “keep” and
+// “color” come from the bitplane selector (0x00 and the pen colours when
+// bitplanes are disabled).
+struct vm::span_state
+{
+    span_state(uint32_t color_bits, uint8_t bit_mask, int16_t y)
+    {
+        uint8_t c1 = (color_bits >> 16) & 0xf;
+        uint8_t c2 = (color_bits >> 20) & 0xf;
+        bool trans = color_bits & 0x1000000;
+        int bits = (color_bits >> (4 * (y & 3))) & 0xf;
+
+        uint8_t set = 0xff;
+        keep = 0x00;
+        if (bit_mask)
+        {
+            keep = (0xf ^ (bit_mask & 7)) * 0x11;
+            set = ((bit_mask & 7) & (bit_mask >> 4)) * 0x11;
+        }
+
+        color[0] = color[1] = write[0] = write[1] = 0;
+        for (int i = 0; i < 4; ++i)
+        {
+            bool alt = (bits >> i) & 0x1;
+            if (alt && trans) // Special transparency bit
+                continue;
+            color[i / 2] |= (alt ? c2 : c1) << (4 * (i & 1));
+            write[i / 2] |= 0xf << (4 * (i & 1));
+        }
+
+        color[0] &= set;
+        color[1] &= set;
+
+        // Same data, replicated over 64-bit words starting with either
+        // an even or an odd byte.
+        uint8_t tmp[3][2][8];
+        for (int i = 0; i < 8; ++i)
+            for (int n = 0; n < 2; ++n)
+            {
+                tmp[0][n][i] = color[(i + n) & 1];
+                tmp[1][n][i] = write[(i + n) & 1];
+                tmp[2][n][i] = keep;
+            }
+        ::memcpy(color64, tmp[0], sizeof(color64));
+        ::memcpy(write64, tmp[1], sizeof(write64));
+        ::memcpy(&keep64, tmp[2][0], sizeof(keep64));
+    }
+
+    // Blend pattern into byte at index b of a screen row, only touching
+    // the nibbles selected by mask.
+    inline void blend(uint8_t &data, int b, uint8_t mask) const
+    {
+        uint8_t w = write[b & 1] & mask;
+        data = (data & ~w) | (((data & keep) | color[b & 1]) & w);
+    }
+
+    // Blend pattern into 8 bytes starting at index b of a screen row
+    inline void blend64(uint8_t *p, int b) const
+    {
+        uint64_t data, w = write64[b & 1];
+        ::memcpy(&data, p, sizeof(data));
+        data = (data & ~w) | (((data & keep64) | color64[b & 1]) & w);
+        ::memcpy(p, &data, sizeof(data));
+    }
+
+    uint8_t color[2], write[2], keep;
+    uint64_t color64[2], write64[2], keep64;
+};
+
+void vm::hline(int16_t x1, int16_t x2, int16_t y, uint32_t color_bits, int64_t cost)
 {
     using std::min, std::max;
 
     auto &ds = m_ram.draw_state;
     auto &hw = m_ram.hw_state;
 
-    if (y < ds.clip.y1 || y >= ds.clip.y2)
+    if (y < ds.clip.y1 || y >= min<int>(ds.clip.y2, 128))
         return;
 
     if (x1 > x2)
         std::swap(x1, x2);
 
     x1 = max(x1, (int16_t)ds.clip.x1);
-    x2 = min(x2, (int16_t)(ds.clip.x2 - 1));
+    x2 = min(x2, (int16_t)(min<int>(ds.clip.x2, 128) - 1));
 
     if (x1 > x2)
         return;
 
-    // Cannot use shortcut code when fillp or bitplanes are active
+    m_dirty.rows.set(y);
+    charge_pixels(x2 - x1 + 1, cost);
+
+    uint8_t *p = m_ram.screen.data[y];
+
+    // Use span code when fillp or bitplanes are active
     if ((color_bits & 0xffff) || hw.bit_mask)
     {
-        for (int16_t x = x1; x <= x2; ++x)
-            set_pixel(x, y, color_bits);
-    }
-    else
-    {
-        uint8_t *p = m_ram.screen.data[y];
-        uint8_t color = (color_bits >> 16) & 0xf;
+        span_state const span(color_bits, hw.bit_mask, y);
 
+        int b = x1 / 2, b2 = x2 / 2;
+
+        // Partial bytes at both ends of the span
         if (x1 & 1)
         {
-            p[x1 / 2] = (p[x1 / 2] & 0x0f) | (color << 4);
-            ++x1;
+            span.blend(p[b], b, 0xf0);
+            ++b;
         }
 
-        if ((x2 & 1) == 0)
+        if ((x2 & 1) == 0 && b <= b2)
         {
-            p[x2 / 2] = (p[x2 / 2] & 0xf0) | color;
-            --x2;
+            span.blend(p[b2], b2, 0x0f);
+            --b2;
         }
 
-        ::memset(p + x1 / 2, color * 0x11, (x2 - x1 + 1) / 2);
+        // The pattern period is two bytes, so 8-byte words always start
+        // with the same pattern parity as their first byte.
+        for ( ; b + 8 <= b2 + 1; b += 8)
+            span.blend64(p + b, b);
+
+        for ( ; b <= b2; ++b)
+            span.blend(p[b], b, 0xff);
     }
+    else
+        raster::fill(p, x1, x2, (color_bits >> 16) & 0xf);
 }
 
-void vm::vline(int16_t x, int16_t y1, int16_t y2, uint32_t color_bits)
+void vm::vline(int16_t x, int16_t y1, int16_t y2, uint32_t color_bits, int64_t cost)
 {
     using std::min, std::max;
 
     auto &ds = m_ram.draw_state;
     auto &hw = m_ram.hw_state;
 
-    if (x < ds.clip.x1 || x >= ds.clip.x2)
+    if (x < ds.clip.x1 || x >= min<int>(ds.clip.x2, 128))
         return;
 
     if (y1 > y2)
         std::swap(y1, y2);
 
     y1 = max(y1, (int16_t)ds.clip.y1);
-    y2 = min(y2, (int16_t)(ds.clip.y2 - 1));
+    y2 = min(y2, (int16_t)(min<int>(ds.clip.y2, 128) - 1));
 
     if (y1 > y2)
         return;
 
-    // Cannot use shortcut code when fillp or bitplanes are active
+    for (int16_t y = y1; y <= y2; ++y)
+        m_dirty.rows.set(y);
+    charge_pixels(y2 - y1 + 1, cost);
+
+    uint8_t const nibble = (x & 1) ? 0xf0 : 0x0f;
+
+    // Use span code when fillp or bitplanes are active
     if ((color_bits & 0xffff) || hw.bit_mask)
     {
+        // The pattern repeats every 4 lines, so compute the state once
+        // for each of them.
+        span_state const span[4] =
+        {
+            span_state(color_bits, hw.bit_mask, 0),
+            span_state(color_bits, hw.bit_mask, 1),
+            span_state(color_bits, hw.bit_mask, 2),
+            span_state(color_bits, hw.bit_mask, 3),
+        };
+
         for (int16_t y = y1; y <= y2; ++y)
-            set_pixel(x, y, color_bits);
+            span[y & 3].blend(m_ram.screen.data[y][x / 2], x / 2, nibble);
     }
     else
     {
-        uint8_t mask = (x & 1) ? 0x0f : 0xf0;
         uint8_t color = (color_bits >> 16) & 0xf;
         uint8_t p = (x & 1) ? color << 4 : color;
 
         for (int16_t y = y1; y <= y2; ++y)
         {
             auto &data = m_ram.screen.data[y][x / 2];
-            data = (data & mask) | p;
+            data = (data & ~nibble) | p;
         }
     }
 }
 
+// Precomputed draw palette for blitting from the sprite sheet, with
+// bitplane masks handled the same way as in span_state.
+struct vm::blit_state : raster::blit_palette
+{
+    blit_state(uint8_t const *draw_palette, uint8_t bit_mask)
+    {
+        uint8_t set = 0xf;
+        if (bit_mask)
+        {
+            keep = (0xf ^ (bit_mask & 7)) * 0x11;
+            set = (bit_mask & 7) & (bit_mask >> 4);
+        }
+
+        for (int c = 0; c < 16; ++c)
+        {
+            color[c] = draw_palette[c] & 0xf & set;
+            write[c] = (draw_palette[c] & 0x10) ? 0x0 : 0xf;
+        }
+    }
+};
+
+// Copy the sw×sh rectangle at sx,sy of the sprite sheet to the dw×dh
+// destination rectangle at dx,dy (which are screen coordinates). Pixels
+// outside the sprite sheet have colour 0.
+void vm::blit(int16_t sx, int16_t sy, int16_t sw, int16_t sh,
+              int16_t dx, int16_t dy, int16_t dw, int16_t dh,
+              bool flip_x, bool flip_y)
+{
+    if (dw <= 0 || dh <= 0)
+        return;
+
+    bool const scaled = sw != dw || sh != dh;
+
+#define BLIT(A, B, C) \
+    blit_kernel<A, B, C>(sx, sy, sw, sh, dx, dy, dw, dh)
+
+    if (scaled)
+    {
+        if (flip_x)
+            flip_y ? BLIT(true, true, true) : BLIT(true, true, false);
+        else
+            flip_y ? BLIT(true, false, true) : BLIT(true, false, false);
+    }
+    else
+    {
+        if (flip_x)
+            flip_y ? BLIT(false, true, true) : BLIT(false, true, false);
+        else
+            flip_y ? BLIT(false, false, true) : BLIT(false, false, false);
+    }
+
+#undef BLIT
+}
+
+template<bool SCALED, bool FLIP_X, bool FLIP_Y>
+void vm::blit_kernel(int16_t sx, int16_t sy, int16_t sw, int16_t sh,
+                     int16_t dx, int16_t dy, int16_t dw, int16_t dh)
+{
+    using std::min, std::max;
+
+    auto &ds = m_ram.draw_state;
+
+    // Clip the destination rectangle once
+    int const i0 = max(0, ds.clip.x1 - dx);
+    int const i1 = min(int(dw), min<int>(ds.clip.x2, 128) - dx);
+    int const j0 = max(0, ds.clip.y1 - dy);
+    int const j1 = min(int(dh), min<int>(ds.clip.y2, 128) - dy);
+
+    if (i0 >= i1 || j0 >= j1)
+        return;
+
+    charge_pixels((i1 - i0) * (j1 - j0), cpu_blit_pixel);
+
+    blit_state const bs(ds.draw_palette, m_ram.hw_state.bit_mask);
+
+    for (int j = j0; j < j1; ++j)
+    {
+        int const v = FLIP_Y ? dh - 1 - j : j;
+        int16_t const src_y = SCALED ? int16_t(sy + sh * v / dh) : int16_t(sy + v);
+        uint8_t *dst = m_ram.screen.data[dy + j];
+        m_dirty.rows.set(dy + j);
+
+        // Rows outside the sprite sheet are uniformly colour 0
+        if (src_y < 0 || src_y >= 128)
+        {
+            if (bs.write[0])
+                for (int i = i0; i < i1; ++i)
+                    bs.blend(dst[(dx + i) / 2], dx + i, 0);
+            continue;
+        }
+
+        uint8_t const *src = m_ram.gfx.data[src_y];
+
+        if (!SCALED)
+        {
+            raster::blit_row<FLIP_X>(dst, dx, src, 128, sx, dw, i0, i1, bs);
+            continue;
+        }
+
+        for (int i = i0; i < i1; ++i)
+        {
+            int const u = FLIP_X ? dw - 1 - i : i;
+            int16_t const src_x = int16_t(sx + sw * u / dw);
+            uint8_t c = 0;
+            if (src_x >= 0 && src_x < 128)
+                c = (src[src_x / 2] >> (4 * (src_x & 1))) & 0xf;
+            bs.blend(dst[(dx + i) / 2], dx + i, c);
+        }
+    }
+}
 
 //
 // Text
@@ -205,6 +426,57 @@ tup<uint8_t, uint8_t, uint8_t> vm::api_cursor(uint8_t x, uint8_t y, opt<uint8_t>
     return std::make_tuple(x, y, c);
 }
 
+// Draw one glyph of the BIOS font with its top left corner at (x, y), in
+// screen coordinates; equivalent to set_pixel() for each of its pixels
+void vm::print_glyph(uint8_t ch, int16_t w, int16_t x, int16_t y, uint32_t color_bits)
+{
+    using std::min, std::max;
+
+    auto &ds = m_ram.draw_state;
+    auto &hw = m_ram.hw_state;
+
+    // Clip the glyph rectangle once
+    int16_t const dx1 = max(0, ds.clip.x1 - x), dx2 = min<int>(w, min<int>(ds.clip.x2, 128) - x);
+    int16_t const dy1 = max(0, ds.clip.y1 - y), dy2 = min<int>(5, min<int>(ds.clip.y2, 128) - y);
+    if (dx1 >= dx2 || dy1 >= dy2)
+        return;
+
+    uint8_t const clip_mask = ((1 << dx2) - 1) & ~((1 << dx1) - 1);
+
+    uint8_t color = (color_bits >> 16) & 0xf;
+    uint8_t keep = 0x0;
+    if (hw.bit_mask)
+    {
+        keep = ~(hw.bit_mask & 7) & 0xf;
+        color &= hw.bit_mask & 7 & (hw.bit_mask >> 4);
+    }
+
+    int count = 0;
+    for (int16_t dy = dy1; dy < dy2; ++dy)
+    {
+        uint8_t const bits = m_bios->get_glyph_row(ch, dy) & clip_mask;
+        if (!bits)
+            continue;
+
+        m_dirty.rows.set(y + dy);
+        uint8_t *line = m_ram.screen.data[y + dy];
+        for (int16_t dx = dx1; dx < dx2; ++dx)
+        {
+            if (!((bits >> dx) & 1))
+                continue;
+
+            int16_t const sx = x + dx;
+            uint8_t &p = line[sx / 2];
+            uint8_t const shift = 4 * (sx & 1);
+            uint8_t const old = (p >> shift) & 0xf;
+            p = (p & (0xf0 >> shift)) | (((old & keep) | color) << shift);
+            ++count;
+        }
+    }
+
+    charge_pixels(count, cpu_pixel);
+}
+
 void vm::api_print(opt<rich_string> str, opt<fix32> opt_x, opt<fix32> opt_y,
                    opt<fix32> c)
 {
@@ -232,19 +504,8 @@ void vm::api_print(opt<rich_string> str, opt<fix32> opt_x, opt<fix32> opt_y,
         else
         {
             int16_t w = ch < 0x80 ? 4 : 8;
-            int offset = ch < 0x80 ? ch : 2 * ch - 0x80;
-            int font_x = offset % 32 * 4;
-            int font_y = offset / 32 * 6;
-
-            for (int16_t dy = 0; dy < 5; ++dy)
-                for (int16_t dx = 0; dx < w; ++dx)
-                {
-                    int16_t screen_x = (int16_t)x - ds.camera.x + dx;
-                    int16_t screen_y = (int16_t)y - ds.camera.y + dy;
-
-                    if (m_bios->get_spixel(font_x + dx, font_y + dy))
-                        set_pixel(screen_x, screen_y, color_bits);
-                }
+            print_glyph(ch, w, (int16_t)((int16_t)x - ds.camera.x),
+                        (int16_t)((int16_t)y - ds.camera.y), color_bits);
 
             x += fix32(w);
         }
@@ -269,6 +530,7 @@ void vm::api_print(opt<rich_string> str, opt<fix32> opt_x, opt<fix32> opt_y,
             uint8_t *s = m_ram.screen.data[0];
             memmove(s, s + lines * 64, sizeof(m_ram.screen) - lines * 64);
             ::memset(s + sizeof(m_ram.screen) - lines * 64, 0, lines * 64);
+            m_dirty.rows.set();
             y -= fix32(lines);
         }
 
@@ -291,38 +553,67 @@ tup<int16_t, int16_t> vm::api_camera(int16_t x, int16_t y)
     return std::make_tuple(prev.x, prev.y);
 }
 
-void vm::api_circ(int16_t x, int16_t y, int16_t r, opt<fix32> c)
+// Walk the rows of a circle of radius r, with the same midpoint algorithm
+// as PICO-8, and call emit(dy, in, out) once for each row offset dy >= 0.
+// The row covers the pixels whose horizontal offset from the centre is
+// between in and out, on both sides; for filled circles in is always 0.
+template<typename T>
+static void circle_spans(int16_t r, bool fill, T emit)
 {
-    auto &ds = m_ram.draw_state;
-
-    x -= ds.camera.x;
-    y -= ds.camera.y;
-    uint32_t color_bits = to_color_bits(c);
-
-    for (int16_t dx = r, dy = 0, err = 0; dx >= dy; )
+    // Each iteration yields the point (dx, dy) of the first octant. Row dy
+    // gets that point, and row dx the run of points that share its dx, on
+    // the iteration where dx changes or the loop ends.
+    for (int16_t dx = r, dy = 0, err = 0, start = 0; dx >= dy; )
     {
-        set_pixel(x + dx, y + dy, color_bits);
-        set_pixel(x + dy, y + dx, color_bits);
-        set_pixel(x - dy, y + dx, color_bits);
-        set_pixel(x - dx, y + dy, color_bits);
-        set_pixel(x - dx, y - dy, color_bits);
-        set_pixel(x - dy, y - dx, color_bits);
-        set_pixel(x + dy, y - dx, color_bits);
-        set_pixel(x + dx, y - dy, color_bits);
+        if (fill)
+            emit(dy, 0, dx);
+        else if (dy < dx)
+            emit(dy, dx, dx);
+
+        int16_t const prev_dx = dx, prev_dy = dy;
 
         dy += 1;
         err += 1 + 2 * dy;
         // XXX: original Bresenham has a different test, but
         // this one seems to match PICO-8 better.
-        if (2 * (err - dx) > r + 1)
+        bool const step = 2 * (err - dx) > r + 1;
+        if (step)
         {
             dx -= 1;
             err += 1 - 2 * dx;
         }
+
+        if (step || dx < dy)
+        {
+            // Inner filled rows were already covered by the first emit()
+            if (!fill || prev_dx > prev_dy)
+                emit(prev_dx, fill ? 0 : start, prev_dy);
+            start = dy;
+        }
     }
 }
 
-void vm::api_circfill(int16_t x, int16_t y, int16_t r, opt<fix32> c)
+// Draw the pixels of rows y - dy and y + dy whose distance to x is between
+// in and out, as one span per row if in is 0 and two otherwise
+void vm::sym_hline(int16_t x, int16_t y, int16_t dy, int16_t in, int16_t out,
+                   uint32_t color_bits, int64_t cost)
+{
+    for (int16_t row : { int16_t(y - dy), int16_t(y + dy) })
+    {
+        if (in == 0)
+            hline(x - out, x + out, row, color_bits, cost);
+        else
+        {
+            hline(x - out, x - in, row, color_bits, cost);
+            hline(x + in, x + out, row, color_bits, cost);
+        }
+
+        if (dy == 0)
+            break;
+    }
+}
+
+void vm::api_circ(int16_t x, int16_t y, int16_t r, opt<fix32> c)
 {
     auto &ds = m_ram.draw_state;
 
@@ -330,24 +621,24 @@ void vm::api_circfill(int16_t x, int16_t y, int16_t r, opt<fix32> c)
     y -= ds.camera.y;
     uint32_t color_bits = to_color_bits(c);
 
-    for (int16_t dx = r, dy = 0, err = 0; dx >= dy; )
+    circle_spans(r, false, [&](int16_t dy, int16_t in, int16_t out)
     {
-        /* Some minor overdraw here, but nothing serious */
-        hline(x - dx, x + dx, y - dy, color_bits);
-        hline(x - dx, x + dx, y + dy, color_bits);
-        vline(x - dy, y - dx, y + dx, color_bits);
-        vline(x + dy, y - dx, y + dx, color_bits);
+        sym_hline(x, y, dy, in, out, color_bits, cpu_pixel);
+    });
+}
 
-        dy += 1;
-        err += 1 + 2 * dy;
-        // XXX: original Bresenham has a different test, but
-        // this one seems to match PICO-8 better.
-        if (2 * (err - dx) > r + 1)
-        {
-            dx -= 1;
-            err += 1 - 2 * dx;
-        }
-    }
+void vm::api_circfill(int16_t x, int16_t y, int16_t r, opt<fix32> c)
+{
+    auto &ds = m_ram.draw_state;
+
+    x -= ds.camera.x;
+    y -= ds.camera.y;
+    uint32_t color_bits = to_color_bits(c);
+
+    circle_spans(r, true, [&](int16_t dy, int16_t in, int16_t out)
+    {
+        sym_hline(x, y, dy, in, out, color_bits, cpu_fill_pixel);
+    });
 }
 
 tup<uint8_t, uint8_t, uint8_t, uint8_t> vm::api_clip(int16_t x, int16_t y,
@@ -379,6 +670,8 @@ tup<uint8_t, uint8_t, uint8_t, uint8_t> vm::api_clip(int16_t x, int16_t y,
 void vm::api_cls(uint8_t c)
 {
     ::memset(&m_ram.screen, c % 0x10 * 0x11, sizeof(m_ram.screen));
+    m_dirty.rows.set();
+    charge_pixels(128 * 128, cpu_fill_pixel);
 
     // Documentation: “Clear the screen and reset the clipping rectangle”.
     auto &ds = m_ram.draw_state;
@@ -491,48 +784,112 @@ void vm::api_line(opt<fix32> arg0, opt<fix32> arg1, opt<fix32> arg2,
     x0 -= ds.camera.x; y0 -= ds.camera.y;
     x1 -= ds.camera.x; y1 -= ds.camera.y;
 
-    bool horiz = abs(x1 - x0) >= abs(y1 - y0);
-    int16_t dx = x0 <= x1 ? 1 : -1;
-    int16_t dy = y0 <= y1 ? 1 : -1;
+    // Axis-aligned lines are plain spans
+    if (y0 == y1)
+    {
+        hline(x0, x1, y0, color_bits, cpu_pixel);
+        return;
+    }
 
-    // Clamping helps with performance even if pixels are clipped later
-    int16_t x = lol::clamp(int(x0), -1, 128);
-    int16_t y = lol::clamp(int(y0), -1, 128);
-    int16_t xend = lol::clamp(int(x1), -1, 128);
-    int16_t yend = lol::clamp(int(y1), -1, 128);
+    if (x0 == x1)
+    {
+        vline(x0, y0, y1, color_bits, cpu_pixel);
+        return;
+    }
 
-    for (;;)
+    // Walk along the major axis u; the minor coordinate v is computed for
+    // each step from the original endpoints, so that clipping the segment
+    // does not change which pixels are drawn.
+    bool const horiz = abs(x1 - x0) >= abs(y1 - y0);
+    int const u0 = horiz ? x0 : y0, u1 = horiz ? x1 : y1;
+    int const v0 = horiz ? y0 : x0, v1 = horiz ? y1 : x1;
+
+    auto v_at = [&](int u) -> int
     {
-        set_pixel(x, y, color_bits);
+        return (int)lol::round(lol::mix((double)v0, (double)v1, (double)(u - u0) / (u1 - u0)));
+    };
 
-        if (horiz)
-        {
-            if (x == xend)
-                break;
-            x += dx;
-            y = (int16_t)lol::round(lol::mix((double)y0, (double)y1, (double)(x - x0) / (x1 - x0)));
-        }
+    int const umin = horiz ? ds.clip.x1 : ds.clip.y1;
+    int const umax = min(int(horiz ? ds.clip.x2 : ds.clip.y2), 128) - 1;
+    int const vmin = horiz ? ds.clip.y1 : ds.clip.x1;
+    int const vmax = min(int(horiz ? ds.clip.y2 : ds.clip.x2), 128) - 1;
+
+    // Liang–Barsky: intersect the range of u covered by the segment with
+    // the clipping rectangle on both axes. The bounds for the minor axis
+    // come from the unrounded line equation, so they are only estimates;
+    // since v is monotonic in u, a couple of exact checks fix them.
+    double const k = double(u1 - u0) / (v1 - v0);
+    double ua = u0 + (vmin - 0.5 - v0) * k;
+    double ub = u0 + (vmax + 0.5 - v0) * k;
+    if (ua > ub)
+        std::swap(ua, ub);
+
+    int const ulo = max(min(u0, u1), umin);
+    int const uhi = min(max(u0, u1), umax);
+    if (ulo > uhi || vmin > vmax)
+        return;
+
+    auto inside = [&](int u) { int v = v_at(u); return v >= vmin && v <= vmax; };
+
+    int a = (int)lol::clamp(std::floor(ua), double(ulo), double(uhi));
+    int b = (int)lol::clamp(std::ceil(ub), double(ulo), double(uhi));
+    while (a <= b && !inside(a))
+        ++a;
+    while (a > ulo && inside(a - 1))
+        --a;
+    while (b >= a && !inside(b))
+        --b;
+    while (b < uhi && inside(b + 1))
+        ++b;
+
+    if (!horiz)
+    {
+        // Steep lines have at most one pixel per row
+        for (int u = a; u <= b; ++u)
+            set_pixel(v_at(u), u, color_bits);
+        return;
+    }
+
+    // Shallow lines: merge runs of pixels on the same row into spans
+    for (int u = a, v = v_at(a); u <= b; )
+    {
+        int end = u, next = v;
+        while (end < b && (next = v_at(end + 1)) == v)
+            ++end;
+
+        if (end == u)
+            set_pixel(u, v, color_bits);
         else
-        {
-            if (y == yend)
-                break;
-            y += dy;
-            x = (int16_t)lol::round(lol::mix((double)x0, (double)x1, (double)(y - y0) / (y1 - y0)));
-        }
+            hline(u, end, v, color_bits, cpu_pixel);
+
+        u = end + 1;
+        v = next;
     }
 }
 
 void vm::api_tline(int16_t x0, int16_t y0, int16_t x1, int16_t y1,
                    fix32 mx, fix32 my, opt<fix32> in_mdx, opt<fix32> in_mdy, int16_t layer)
 {
-    using std::abs, std::min;
-
-    auto &ds = m_ram.draw_state;
-
     // mdx, mdy default to 1/8, 0
     fix32 mdx = in_mdx ? *in_mdx : fix32::frombits(0x2000);
     fix32 mdy = in_mdy ? *in_mdy : fix32(0);
 
+    // Without a layer mask, sprite flags never need to be looked up and
+    // the inner loop can be a lot simpler.
+    if (layer)
+        tline_kernel<false>(x0, y0, x1, y1, mx, my, mdx, mdy, layer);
+    else
+        tline_kernel<true>(x0, y0, x1, y1, mx, my, mdx, mdy, layer);
+}
+
+template<bool FAST>
+void vm::tline_kernel(int16_t x0, int16_t y0, int16_t x1, int16_t y1,
+                      fix32 mx, fix32 my, fix32 mdx, fix32 mdy, int16_t layer)
+{
+    using std::abs, std::min;
+
+    auto &ds = m_ram.draw_state;
+
     // Retrieve masks for wrap-around and subtract 0x0.0001
     fix32 xmask = fix32(ds.tline.mask.x) - fix32::frombits(1);
     fix32 ymask = fix32(ds.tline.mask.y) - fix32::frombits(1);
@@ -550,6 +907,8 @@ void vm::api_tline(int16_t x0, int16_t y0, int16_t x1, int16_t y1,
     int16_t xend = lol::clamp(int(x1), -1, 128);
     int16_t yend = lol::clamp(int(y1), -1, 128);
 
+    charge_pixels(abs(horiz ? xend - x : yend - y) + 1, cpu_tline_pixel);
+
     // Advance texture coordinates; do it in steps to avoid overflows
     int16_t delta = abs(horiz ? x - x0 : y - y0);
     while (delta)
@@ -560,6 +919,61 @@ void vm::api_tline(int16_t x0, int16_t y0, int16_t x1, int16_t y1,
         delta -= step;
     }
 
+    if constexpr (FAST)
+    {
+        // Work directly on the 16:16 bit patterns; unsigned arithmetic
+        // gives the same wrap-around as fix32 without undefined behaviour.
+        uint32_t ux = mx.bits(), uy = my.bits();
+        uint32_t const udx = mdx.bits(), udy = mdy.bits();
+        uint32_t const kx = xmask.bits(), ky = ymask.bits();
+        int const ox = ds.tline.offset.x, oy = ds.tline.offset.y;
+
+        // Axis-aligned lines never need their minor coordinate recomputed
+        bool const straight = horiz ? y0 == y1 : x0 == x1;
+
+        blit_state const bs(ds.draw_palette, m_ram.hw_state.bit_mask);
+        int const clip_x2 = min<int>(ds.clip.x2, 128), clip_y2 = min<int>(ds.clip.y2, 128);
+
+        for (;;)
+        {
+            if (x >= ds.clip.x1 && x < clip_x2 && y >= ds.clip.y1 && y < clip_y2)
+            {
+                int sx = (ox + (int32_t(ux) >> 16)) & 0x7f;
+                int sy = (oy + (int32_t(uy) >> 16)) & 0x3f;
+                uint8_t sprite = m_ram.map[128 * sy + sx];
+                if (sprite)
+                {
+                    int tx = sprite % 16 * 8 + ((ux >> 13) & 0x7);
+                    int ty = sprite / 16 * 8 + ((uy >> 13) & 0x7);
+                    uint8_t col = (m_ram.gfx.data[ty][tx / 2] >> (4 * (tx & 1))) & 0xf;
+                    bs.blend(m_ram.screen.data[y][x / 2], x, col);
+                    m_dirty.rows.set(y);
+                }
+            }
+
+            ux = (ux & ~kx) | ((ux + udx) & kx);
+            uy = (uy & ~ky) | ((uy + udy) & ky);
+
+            if (horiz)
+            {
+                if (x == xend)
+                    break;
+                x += dx;
+                if (!straight)
+                    y = (int16_t)lol::round(lol::mix((double)y0, (double)y1, (double)(x - x0) / (x1 - x0)));
+            }
+            else
+            {
+                if (y == yend)
+                    break;
+                y += dy;
+                if (!straight)
+                    x = (int16_t)lol::round(lol::mix((double)x0, (double)x1, (double)(y - y0) / (y1 - y0)));
+            }
+        }
+        return;
+    }
+
     for (;;)
     {
         // Find sprite in map memory
@@ -606,6 +1020,8 @@ void vm::api_tline(int16_t x0, int16_t y0, int16_t x1, int16_t y1,
 void vm::api_map(int16_t cel_x, int16_t cel_y, int16_t sx, int16_t sy,
                  opt<int16_t> in_cel_w, opt<int16_t> in_cel_h, int16_t layer)
 {
+    using std::max, std::min;
+
     auto &ds = m_ram.draw_state;
 
     sx -= ds.camera.x;
@@ -613,27 +1029,20 @@ void vm::api_map(int16_t cel_x, int16_t cel_y, int16_t sx, int16_t sy,
 
     // PICO-8 documentation: “If cel_w and cel_h are not specified,
     // defaults to 128,32”.
-    bool no_size = !in_cel_w && !in_cel_h;
-    int16_t src_w = (no_size ? 128 : *in_cel_w) * 8;
-    int16_t src_h = (no_size ? 32 : *in_cel_h) * 8;
-    int16_t src_x = cel_x * 8;
-    int16_t src_y = cel_y * 8;
-
-    // Clamp to screen
-    int16_t mx = std::max(-sx, 0);
-    int16_t my = std::max(-sy, 0);
-    src_x += mx;
-    src_y += my;
-    src_w -= mx + std::max(src_w + sx - 128, 0);
-    src_h -= my + std::max(src_h + sy - 128, 0);
-    sx += mx;
-    sy += my;
-
-    for (int16_t dy = 0; dy < src_h; ++dy)
-    for (int16_t dx = 0; dx < src_w; ++dx)
-    {
-        int16_t cx = (src_x + dx) / 8;
-        int16_t cy = (src_y + dy) / 8;
+    int cel_w = in_cel_w ? *in_cel_w : 128;
+    int cel_h = in_cel_h ? *in_cel_h : 32;
+
+    // Only visit the cells that intersect the clipping rectangle
+    auto floor8 = [](int n) { return (n - (n < 0 ? 7 : 0)) / 8; };
+    int i0 = max(0, floor8(ds.clip.x1 - sx));
+    int j0 = max(0, floor8(ds.clip.y1 - sy));
+    int i1 = min(cel_w, floor8(ds.clip.x2 - 1 - sx) + 1);
+    int j1 = min(cel_h, floor8(ds.clip.y2 - 1 - sy) + 1);
+
+    for (int j = j0; j < j1; ++j)
+    for (int i = i0; i < i1; ++i)
+    {
+        int cx = cel_x + i, cy = cel_y + j;
         if (cx < 0 || cx >= 128 || cy < 0 || cy >= 64)
             continue;
 
@@ -643,15 +1052,8 @@ void vm::api_map(int16_t cel_x, int16_t cel_y, int16_t sx, int16_t sy,
             continue;
 
         if (sprite)
-        {
-            int col = m_ram.gfx.get(sprite % 16 * 8 + (src_x + dx) % 8,
-                                    sprite / 16 * 8 + (src_y + dy) % 8);
-            if ((ds.draw_palette[col] & 0x10) == 0)
-            {
-                uint32_t color_bits = (ds.draw_palette[col] & 0xf) << 16;
-                set_pixel(sx + dx, sy + dy, color_bits);
-            }
-        }
+            blit(sprite % 16 * 8, sprite / 16 * 8, 8, 8,
+                 sx + i * 8, sy + j * 8, 8, 8, false, false);
     }
 }
 
@@ -691,12 +1093,33 @@ void vm::api_oval(int16_t x0, int16_t y0, int16_t x1, int16_t y1, opt<fix32> c)
     float xc = float(x0 + x1) / 2;
     float yc = float(y0 + y1) / 2;
 
+    int16_t const mx = x0 + x1, my = y0 + y1; // mirror axes, 2 * xc and 2 * yc
+
     auto plot = [&](int16_t x, int16_t y)
     {
         set_pixel(x, y, color_bits);
-        set_pixel(int16_t(2 * xc) - x, y, color_bits);
-        set_pixel(x, int16_t(2 * yc) - y, color_bits);
-        set_pixel(int16_t(2 * xc) - x, int16_t(2 * yc) - y, color_bits);
+        set_pixel(mx - x, y, color_bits);
+        set_pixel(x, my - y, color_bits);
+        set_pixel(mx - x, my - y, color_bits);
+    };
+
+    // Same for a run of pixels on one row, merged with its mirror image
+    // when they touch
+    auto plot_run = [&](int16_t xa, int16_t xb, int16_t y)
+    {
+        for (int16_t row : { y, int16_t(my - y) })
+        {
+            if (mx - xa >= xa - 1)
+                hline(mx - xb, xb, row, color_bits, cpu_pixel);
+            else
+            {
+                hline(mx - xb, mx - xa, row, color_bits, cpu_pixel);
+                hline(xa, xb, row, color_bits, cpu_pixel);
+            }
+
+            if (my - y == y)
+                break;
+        }
     };
 
     // Cutoff for slope = 0.5 happens at x = a²/sqrt(a²+b²)
@@ -704,12 +1127,24 @@ void vm::api_oval(int16_t x0, int16_t y0, int16_t x1, int16_t y1, opt<fix32> c)
     float b = float(y1 - y0) / 2;
     float cutoff = a / sqrt(1 + b * b / (a * a));
 
+    // Near the top and bottom, consecutive points share a row
+    int16_t run_start = 0, run_end = 0, run_y = 0;
     for (float dx = 0; dx <= cutoff; ++dx)
     {
         int16_t x = int16_t(ceil(xc + dx));
         int16_t y = int16_t(round(yc - b / a * sqrt(a * a - dx * dx)));
-        plot(x, y);
+        if (dx > 0 && y == run_y)
+        {
+            run_end = x;
+            continue;
+        }
+        if (dx > 0)
+            plot_run(run_start, run_end, run_y);
+        run_start = run_end = x;
+        run_y = y;
     }
+    if (cutoff >= 0)
+        plot_run(run_start, run_end, run_y);
 
     cutoff = b / sqrt(1 + a * a / (b * b));
     for (float dy = 0; dy < cutoff; ++dy)
@@ -748,7 +1183,9 @@ void vm::api_ovalfill(int16_t x0, int16_t y0, int16_t x1, int16_t y1,
         float dy = y - yc;
         int16_t x = int16_t(round(xc - a / b * sqrt(b * b - dy * dy)));
         hline(int16_t(2 * xc) - x, x, y, color_bits);
-        hline(int16_t(2 * xc) - x, x, int16_t(2 * yc) - y, color_bits);
+        // The middle row is its own mirror image
+        if (int16_t(2 * yc) - y != y)
+            hline(int16_t(2 * xc) - x, x, int16_t(2 * yc) - y, color_bits);
     }
 }
 
@@ -903,18 +1340,7 @@ void vm::api_spr(int16_t n, int16_t x, int16_t y, opt<fix32> w,
     int16_t w8 = w ? (int16_t)(*w * fix32(8.0)) : 8;
     int16_t h8 = h ? (int16_t)(*h * fix32(8.0)) : 8;
 
-    for (int16_t j = 0; j < h8; ++j)
-        for (int16_t i = 0; i < w8; ++i)
-        {
-            int16_t di = flip_x ? w8 - 1 - i : i;
-            int16_t dj = flip_y ? h8 - 1 - j : j;
-            uint8_t col = m_ram.gfx.safe_get(n % 16 * 8 + di, n / 16 * 8 + dj);
-            if ((ds.draw_palette[col] & 0x10) == 0)
-            {
-                uint32_t color_bits = (ds.draw_palette[col] & 0xf) << 16;
-                set_pixel(x + i, y + j, color_bits);
-            }
-        }
+    blit(n % 16 * 8, n / 16 * 8, w8, h8, x, y, w8, h8, flip_x, flip_y);
 }
 
 void vm::api_sspr(int16_t sx, int16_t sy, int16_t sw, int16_t sh,
@@ -932,25 +1358,74 @@ void vm::api_sspr(int16_t sx, int16_t sy, int16_t sw, int16_t sh,
     if (dw < 0) { dw = -dw; dx -= dw - 1; flip_x = !flip_x; }
     if (dh < 0) { dh = -dh; dy -= dh - 1; flip_y = !flip_y; }
 
-    // Iterate over destination pixels
-    // FIXME: maybe clamp if target area is too big?
-    for (int16_t j = 0; j < dh; ++j)
-    for (int16_t i = 0; i < dw; ++i)
+    blit(sx, sy, sw, sh, dx, dy, dw, dh, flip_x, flip_y);
+}
+
+//
+// Micro-benchmarks
+//
+
+// Compare the generic and fast tline() paths on random lines and check
+// that they produce the same output.
+void vm::bench_tline()
+{
+    auto &ds = m_ram.draw_state;
+
+    // Random sprite sheet and map, default draw state
+    auto ram = (uint8_t *)&m_ram;
+    for (int i = 0; i < 0x3000; ++i)
+        ram[i] = lol::rand(256);
+    api_pal(std::nullopt, std::nullopt, 0);
+    ds.clip.x1 = ds.clip.y1 = 0;
+    ds.clip.x2 = ds.clip.y2 = 128;
+    ds.camera = lol::i16vec2(0);
+    m_ram.hw_state.bit_mask = 0;
+
+    struct line { int16_t x0, y0, x1, y1; fix32 mx, my, mdx, mdy; uint8_t mask; };
+
+    std::vector<line> lines;
+    for (int i = 0; i < 4096; ++i)
     {
-        int16_t di = flip_x ? dw - 1 - i : i;
-        int16_t dj = flip_y ? dh - 1 - j : j;
+        line l;
+        l.x0 = lol::rand(-32, 160); l.y0 = lol::rand(-32, 160);
+        l.x1 = lol::rand(-32, 160); l.y1 = lol::rand(-32, 160);
+        // Half of the lines are horizontal, as in mode 7 renderers
+        if (i & 1)
+            l.y1 = l.y0;
+        l.mx = fix32::frombits(lol::rand(0x800000));
+        l.my = fix32::frombits(lol::rand(0x400000));
+        l.mdx = fix32::frombits(lol::rand(-0x8000, 0x8000));
+        l.mdy = fix32::frombits(lol::rand(-0x8000, 0x8000));
+        l.mask = i & 2 ? 1 << lol::rand(8) : 0;
+        lines.push_back(l);
+    }
 
-        // Find source
-        int16_t x = sx + sw * di / dw;
-        int16_t y = sy + sh * dj / dh;
+    float time[2] = { 0.f, 0.f };
+    uint8_t result[2][sizeof(m_ram.screen)];
 
-        uint8_t col = m_ram.gfx.safe_get(x, y);
-        if ((ds.draw_palette[col] & 0x10) == 0)
-        {
-            uint32_t color_bits = (ds.draw_palette[col] & 0xf) << 16;
-            set_pixel(dx + i, dy + j, color_bits);
-        }
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        ::memset(&m_ram.screen, 0, sizeof(m_ram.screen));
+
+        lol::timer t;
+        for (int k = 0; k < 16; ++k)
+            for (auto const &l : lines)
+            {
+                ds.tline.mask = lol::u8vec2(l.mask);
+                if (pass)
+                    tline_kernel<true>(l.x0, l.y0, l.x1, l.y1, l.mx, l.my, l.mdx, l.mdy, 0);
+                else
+                    tline_kernel<false>(l.x0, l.y0, l.x1, l.y1, l.mx, l.my, l.mdx, l.mdy, 0);
+            }
+        time[pass] = t.get();
+
+        ::memcpy(result[pass], &m_ram.screen, sizeof(m_ram.screen));
     }
+
+    int const calls = 16 * int(lines.size());
+    printf("tline: generic %.3fµs fast %.3fµs per call (%s)\n",
+           time[0] * 1e6f / calls, time[1] * 1e6f / calls,
+           ::memcmp(result[0], result[1], sizeof(result[0])) ? "MISMATCH" : "ok");
 }
 
 } // namespace z8::pico8
@@ -0,0 +1,423 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <algorithm> // std::min, std::sort
+#include <vector>    // std::vector
+#include <new>       // std::bad_alloc
+#include <cstring>   // memcpy(), memset(), memcmp()
+
+#if _WIN32
+#   define WIN32_LEAN_AND_MEAN
+#   include <windows.h>
+#else
+#   include <sys/mman.h>
+#endif
+
+#include "pico8/heap.h"
+
+namespace z8::pico8
+{
+
+static inline size_t round_up(size_t size, size_t align)
+{
+    return (size + align - 1) & ~(align - 1);
+}
+
+// Map zero-filled memory; pages are committed when first touched
+static uint8_t *map_arena(size_t size)
+{
+#if _WIN32
+    void *p = VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        p = nullptr;
+#endif
+    return (uint8_t *)p;
+}
+
+static void unmap_arena(uint8_t *p, size_t size)
+{
+#if _WIN32
+    VirtualFree(p, 0, MEM_RELEASE);
+#else
+    munmap(p, size);
+#endif
+}
+
+heap::heap(size_t capacity)
+  : m_arena(nullptr),
+    m_capacity(round_up(capacity, page_size)),
+    m_limit(capacity)
+{
+    m_arena = map_arena(m_capacity);
+    if (!m_arena)
+        throw std::bad_alloc();
+
+    ::memset(&header(), 0, sizeof(arena_header));
+    header().top = (uint32_t)round_up(sizeof(arena_header), align);
+}
+
+heap::~heap()
+{
+    unmap_arena(m_arena, m_capacity);
+}
+
+void *heap::realloc(void *ptr, size_t osize, size_t nsize)
+{
+    auto &h = header();
+
+    if (nsize == 0)
+    {
+        if (ptr)
+        {
+            free(uint32_t((uint8_t *)ptr - m_arena), round_up(osize, align));
+            h.used -= uint32_t(round_up(osize, align));
+        }
+        return nullptr;
+    }
+
+    size_t const nn = round_up(nsize, align);
+
+    // When ptr is null, osize is a Lua type tag and not a size
+    if (!ptr)
+    {
+        uint32_t offset = h.used + nn <= m_limit ? alloc(nn) : 0;
+        if (!offset)
+            return nullptr;
+        h.used += uint32_t(nn);
+        return m_arena + offset;
+    }
+
+    size_t const on = round_up(osize, align);
+    uint32_t const offset = uint32_t((uint8_t *)ptr - m_arena);
+
+    // Shrinking always happens in place, as Lua expects it to succeed
+    if (nn <= on)
+    {
+        if (nn < on)
+            free(uint32_t(offset + nn), on - nn);
+        h.used -= uint32_t(on - nn);
+        return ptr;
+    }
+
+    if (h.used + nn - on > m_limit)
+        return nullptr;
+
+    // Grow the last block in place
+    if (offset + on == h.top && offset + nn <= m_capacity)
+    {
+        h.top = uint32_t(offset + nn);
+        h.used += uint32_t(nn - on);
+        return ptr;
+    }
+
+    uint32_t const noffset = alloc(nn);
+    if (!noffset)
+        return nullptr;
+    ::memcpy(m_arena + noffset, ptr, on);
+    free(offset, on);
+    h.used += uint32_t(nn - on);
+    return m_arena + noffset;
+}
+
+// The image is the number of free blocks, their sorted offsets, then the
+// arena up to the top, where each free block only keeps its header
+size_t heap::image_bound() const
+{
+    return sizeof(uint32_t) + round_up(sizeof(arena_header), align) + m_limit + m_limit / 2;
+}
+
+size_t heap::save_image(void *data, size_t size, uint8_t const *copy) const
+{
+    // A copy has the same allocator metadata as the arena
+    auto const *arena = copy ? copy : m_arena;
+    auto const &h = header();
+
+    std::vector<uint32_t> blocks;
+    for (auto const &e : reserved(arena))
+        if (e.first)
+            blocks.push_back(uint32_t(e.first));
+    std::sort(blocks.begin(), blocks.end());
+
+    size_t total = sizeof(uint32_t) + blocks.size() * sizeof(uint32_t) + h.top;
+    for (uint32_t offset : blocks)
+        total -= block(offset).size - sizeof(free_block);
+    if (total > size)
+        return 0;
+
+    auto *p = (uint8_t *)data;
+    auto put = [&p](void const *src, size_t len) { ::memcpy(p, src, len); p += len; };
+
+    uint32_t const count = uint32_t(blocks.size());
+    put(&count, sizeof(count));
+    put(blocks.data(), blocks.size() * sizeof(uint32_t));
+
+    size_t start = 0;
+    for (uint32_t offset : blocks)
+    {
+        put(arena + start, offset + sizeof(free_block) - start);
+        start = offset + block(offset).size;
+    }
+    put(arena + start, h.top - start);
+
+    return size_t(p - (uint8_t *)data);
+}
+
+bool heap::read_image(void const *data, size_t size, std::vector<uint8_t> &out) const
+{
+    auto const *p = (uint8_t const *)data, *end = p + size;
+
+    uint32_t count;
+    if (size < sizeof(count))
+        return false;
+    ::memcpy(&count, p, sizeof(count));
+    p += sizeof(count);
+    if (count > size_t(end - p) / sizeof(uint32_t))
+        return false;
+    std::vector<uint32_t> blocks(count);
+    ::memcpy(blocks.data(), p, count * sizeof(uint32_t));
+    p += count * sizeof(uint32_t);
+
+    arena_header h;
+    if (size_t(end - p) < sizeof(h))
+        return false;
+    ::memcpy(&h, p, sizeof(h));
+    if (h.top > m_capacity || h.top < round_up(sizeof(h), align))
+        return false;
+
+    // Free block bodies are zero; each block keeps its header, which gives
+    // the size of the part that was skipped
+    out.assign(h.top, 0);
+    size_t start = 0;
+    for (uint32_t n = 0; n < count; ++n)
+    {
+        size_t const offset = blocks[n];
+        if (offset % align || offset < start || offset + sizeof(free_block) > h.top
+             || offset + sizeof(free_block) - start > size_t(end - p))
+            return false;
+        ::memcpy(out.data() + start, p, offset + sizeof(free_block) - start);
+        p += offset + sizeof(free_block) - start;
+
+        free_block b;
+        ::memcpy(&b, out.data() + offset, sizeof(b));
+        if (b.size < sizeof(free_block) || b.size % align || b.size > h.top - offset)
+            return false;
+        start = offset + b.size;
+    }
+    if (size_t(end - p) != h.top - start)
+        return false;
+    ::memcpy(out.data() + start, p, h.top - start);
+
+    return check(out.data(), out.size());
+}
+
+bool heap::check(uint8_t const *data, size_t size) const
+{
+    arena_header h;
+    ::memcpy(&h, data, sizeof(h));
+    size_t const first = round_up(sizeof(h), align);
+    if (h.top != size || size > m_capacity || size < first)
+        return false;
+
+    // Every free block must lie in the arena, the large ones in address
+    // order, and all of them apart; there are at most size / align blocks,
+    // which also stops cycles
+    std::vector<extent> blocks;
+    auto add = [&](uint32_t offset, size_t expected) -> bool
+    {
+        free_block b;
+        if (offset % align || offset < first || offset > size - sizeof(b)
+             || blocks.size() >= size / align)
+            return false;
+        ::memcpy(&b, data + offset, sizeof(b));
+        if (b.size < sizeof(b) || b.size % align || b.size > size - offset
+             || (expected && b.size != expected))
+            return false;
+        blocks.push_back(extent(offset, b.size));
+        return true;
+    };
+
+    for (size_t i = 0; i < small_max / align; ++i)
+        for (uint32_t offset = h.small[i]; offset; )
+        {
+            if (!add(offset, (i + 1) * align))
+                return false;
+            offset = ((free_block const *)(data + offset))->next;
+        }
+
+    for (uint32_t offset = h.large, prev = 0; offset; )
+    {
+        if (offset <= prev || !add(offset, 0))
+            return false;
+        prev = offset;
+        offset = ((free_block const *)(data + offset))->next;
+    }
+
+    std::sort(blocks.begin(), blocks.end());
+    size_t free = 0;
+    for (size_t n = 0; n < blocks.size(); ++n)
+    {
+        if (n && blocks[n - 1].first + blocks[n - 1].second > blocks[n].first)
+            return false;
+        free += blocks[n].second;
+    }
+
+    return h.used == size - first - free;
+}
+
+void heap::assign(uint8_t const *data, size_t size)
+{
+    ::memcpy(m_arena, data, size);
+}
+
+std::vector<heap::extent> heap::reserved(uint8_t const *data)
+{
+    arena_header const &h = *(arena_header const *)data;
+
+    std::vector<extent> ret { extent(0, round_up(sizeof(h), align)) };
+    auto next = [data](uint32_t offset) { return ((free_block const *)(data + offset))->next; };
+    auto size = [data](uint32_t offset) { return ((free_block const *)(data + offset))->size; };
+    for (uint32_t head : h.small)
+        for (uint32_t offset = head; offset; offset = next(offset))
+            ret.push_back(extent(offset, size(offset)));
+    for (uint32_t offset = h.large; offset; offset = next(offset))
+        ret.push_back(extent(offset, size(offset)));
+    return ret;
+}
+
+void heap::save(pages &out, pages const &prev) const
+{
+    size_t const size = this->size();
+    out.resize((size + page_size - 1) / page_size);
+
+    for (size_t i = 0; i < out.size(); ++i)
+    {
+        uint8_t const *src = m_arena + i * page_size;
+        size_t const len = std::min(page_size, size - i * page_size);
+        if (i < prev.size() && !::memcmp(prev[i].get(), src, len))
+        {
+            out[i] = prev[i];
+            continue;
+        }
+
+        std::shared_ptr<uint8_t[]> page(new uint8_t[page_size]());
+        ::memcpy(page.get(), src, len);
+        out[i] = page;
+    }
+}
+
+bool heap::read_pages(pages const &in, size_t size, std::vector<uint8_t> &out) const
+{
+    if (size > m_capacity || in.size() != (size + page_size - 1) / page_size)
+        return false;
+
+    out.resize(size);
+    for (size_t i = 0; i < in.size(); ++i)
+        ::memcpy(out.data() + i * page_size, in[i].get(),
+                 std::min(page_size, size - i * page_size));
+    return true;
+}
+
+uint32_t heap::alloc(size_t size)
+{
+    auto &h = header();
+
+    if (size <= small_max)
+    {
+        uint32_t &head = h.small[size / align - 1];
+        if (uint32_t offset = head)
+        {
+            head = block(offset).next;
+            return offset;
+        }
+    }
+
+    // First fit in the address-ordered list; the remainder of the chosen
+    // block stays in the list
+    for (uint32_t *link = &h.large; *link; link = &block(*link).next)
+    {
+        uint32_t const offset = *link;
+        free_block const b = block(offset);
+        if (b.size < size)
+            continue;
+
+        if (b.size == size)
+            *link = b.next;
+        else
+        {
+            *link = uint32_t(offset + size);
+            block(*link) = free_block { b.next, uint32_t(b.size - size) };
+        }
+        return offset;
+    }
+
+    if (h.top + size > m_capacity)
+        return 0;
+
+    uint32_t const offset = h.top;
+    h.top = uint32_t(h.top + size);
+    return offset;
+}
+
+void heap::free(uint32_t offset, size_t size)
+{
+    auto &h = header();
+
+    if (size <= small_max && offset + size != h.top)
+    {
+        uint32_t &head = h.small[size / align - 1];
+        block(offset) = free_block { head, uint32_t(size) };
+        head = offset;
+        return;
+    }
+
+    // Insert larger blocks in address order, merging them with their
+    // neighbours, and give the last block back to the top of the arena
+    uint32_t *link = &h.large, *prev_link = nullptr;
+    while (*link && *link < offset)
+    {
+        prev_link = link;
+        link = &block(*link).next;
+    }
+
+    uint32_t next = *link;
+    if (next && offset + size == next)
+    {
+        size += block(next).size;
+        next = block(next).next;
+    }
+
+    if (prev_link && *prev_link + block(*prev_link).size == offset)
+    {
+        offset = *prev_link;
+        size += block(offset).size;
+        link = prev_link;
+    }
+
+    if (offset + size == h.top)
+    {
+        h.top = offset;
+        *link = next;
+        return;
+    }
+
+    block(offset) = free_block { next, uint32_t(size) };
+    *link = offset;
+}
+
+} // namespace z8::pico8
+
@@ -0,0 +1,120 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <memory>  // std::shared_ptr
+#include <utility> // std::pair
+#include <vector>  // std::vector
+#include <cstddef> // size_t
+#include <cstdint> // uint8_t, uint32_t
+
+// The heap class
+// ——————————————
+// A Lua allocator working inside a single fixed-size arena. All allocator
+// metadata lives in the arena too, as offsets, so that the arena prefix in
+// use is a complete image of the Lua heap: copying it back restores every
+// object, the Lua state itself included. The pointers between objects
+// still refer to the arena that saved the image; moving them is up to the
+// caller, see vm::relocate().
+
+namespace z8::pico8
+{
+
+class heap
+{
+public:
+    heap(size_t capacity);
+    ~heap();
+
+    heap(heap const &) = delete;
+    heap &operator =(heap const &) = delete;
+
+    // Same semantics as lua_Alloc
+    void *realloc(void *ptr, size_t osize, size_t nsize);
+
+    // The image of the heap: size() bytes at data()
+    uint8_t const *data() const { return m_arena; }
+    size_t size() const { return header().top; }
+    size_t capacity() const { return m_capacity; }
+    bool contains(void const *p) const { return p >= m_arena && p < m_arena + m_capacity; }
+
+    // Bytes in live blocks; allocations fail rather than exceed the limit,
+    // which Lua reports as an out of memory error after a full GC
+    size_t used() const { return header().used; }
+    void set_limit(size_t limit) { m_limit = limit; }
+
+    // The image without the contents of free blocks, which takes about
+    // used() bytes; image_bound() is enough unless the heap is badly
+    // fragmented, in which case save_image() fails and returns 0. The
+    // image is made from copy, a copy of the size() bytes at data(), if
+    // it is not null.
+    size_t image_bound() const;
+    size_t save_image(void *data, size_t size, uint8_t const *copy = nullptr) const;
+
+    // Expand an image into a copy of the arena prefix, checking it and its
+    // allocator metadata; the heap itself is left intact. A checked copy
+    // then replaces the heap contents with assign().
+    bool read_image(void const *data, size_t size, std::vector<uint8_t> &out) const;
+    void assign(uint8_t const *data, size_t size);
+
+    // The byte ranges of a checked copy that Lua objects must not overlap:
+    // the allocator metadata and the free blocks, as (offset, size) pairs
+    using extent = std::pair<size_t, size_t>;
+    static std::vector<extent> reserved(uint8_t const *data);
+
+    // The image split into pages, which cost nothing to copy; save() shares
+    // the pages that are identical in prev, usually the previous image, and
+    // read_pages() expands them into a copy for assign(). Pages are not
+    // checked, since they never leave the process.
+    static constexpr size_t page_size = 4096;
+    using pages = std::vector<std::shared_ptr<uint8_t const[]>>;
+
+    void save(pages &out, pages const &prev) const;
+    bool read_pages(pages const &in, size_t size, std::vector<uint8_t> &out) const;
+
+private:
+    // Block sizes are multiples of 8; blocks up to small_max bytes are
+    // recycled through one free list per size, larger blocks through a
+    // single first-fit list. Links are arena offsets, 0 meaning none.
+    static size_t const align = 8;
+    static size_t const small_max = 512;
+
+    struct free_block
+    {
+        uint32_t next, size;
+    };
+
+    struct arena_header
+    {
+        uint32_t top, used;
+        uint32_t small[small_max / align];
+        uint32_t large;
+    };
+
+    arena_header &header() { return *(arena_header *)m_arena; }
+    arena_header const &header() const { return *(arena_header const *)m_arena; }
+    free_block &block(uint32_t offset) { return *(free_block *)(m_arena + offset); }
+    free_block const &block(uint32_t offset) const { return *(free_block const *)(m_arena + offset); }
+
+    uint32_t alloc(size_t size);
+    void free(uint32_t offset, size_t size);
+
+    // Check the allocator metadata of a copy of size bytes
+    bool check(uint8_t const *data, size_t size) const;
+
+    uint8_t *m_arena;
+    size_t m_capacity, m_limit;
+};
+
+} // namespace z8::pico8
+
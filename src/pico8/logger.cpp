@@ -0,0 +1,278 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <lol/msg>    // lol::msg
+#include <lol/utils>  // lol::format
+#include <algorithm>  // std::min, std::max, std::find, std::remove_if
+#include <chrono>     // std::chrono
+#include <cstdio>     // fwrite(), fflush()
+#include <filesystem> // std::filesystem
+#include <fstream>    // std::ofstream
+#include <map>        // std::map
+
+#include "pico8/logger.h"
+
+namespace fs = std::filesystem;
+
+namespace z8::pico8
+{
+
+// Lines each channel can hold until the writer collects them
+static size_t const ring_size = 4096;
+
+// Time between two batches
+static auto const write_period = std::chrono::milliseconds(50);
+
+//
+// Channels
+//
+
+logger::channel::channel(int id, size_t capacity)
+  : m_id(id),
+    m_ring(capacity)
+{
+}
+
+void logger::channel::print(std::string_view text, std::string const &filename, bool overwrite)
+{
+    auto &log = logger::get();
+    int const rate = log.m_rate;
+    size_t const max_size = log.m_max_size;
+
+    if (rate > 0)
+    {
+        if (m_budget < 1.0)
+        {
+            ++m_dropped;
+            return;
+        }
+        m_budget -= 1.0;
+    }
+
+    if (m_capped)
+        return;
+
+    std::string str;
+    if (log.m_tags)
+        str = lol::format("[%d:%lld] ", m_id, (long long)m_frame);
+    str += text;
+    str += '\n';
+
+    if (max_size && m_bytes + str.length() > max_size)
+    {
+        push("", false, lol::format("printh: output limit of %zu bytes reached\n", max_size));
+        m_capped = true;
+        return;
+    }
+
+    m_bytes += str.length();
+    push(filename, overwrite, std::move(str));
+}
+
+void logger::channel::tick()
+{
+    ++m_frame;
+
+    // A full second of lines can be printed at once
+    int const rate = logger::get().m_rate;
+    if (rate > 0)
+        m_budget = std::min(m_budget + rate / 60.0, double(rate));
+
+    // Say how many lines were lost, but only once per second
+    if (m_dropped && m_frame % 60 == 0)
+    {
+        push("", false, lol::format("printh: %lld lines dropped\n", (long long)m_dropped));
+        m_dropped = 0;
+    }
+}
+
+void logger::channel::push(std::string const &filename, bool overwrite, std::string text)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    // The writer is late: drop the line rather than wait for it
+    if (m_count == m_ring.size())
+    {
+        ++m_dropped;
+        return;
+    }
+
+    m_ring[(m_head + m_count) % m_ring.size()] = line { filename, std::move(text), overwrite };
+    ++m_count;
+}
+
+std::vector<logger::channel::line> logger::channel::drain()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    std::vector<line> ret;
+    ret.reserve(m_count);
+    for (size_t n = 0; n < m_count; ++n)
+        ret.push_back(std::move(m_ring[(m_head + n) % m_ring.size()]));
+    m_head = (m_head + m_count) % m_ring.size();
+    m_count = 0;
+    return ret;
+}
+
+//
+// The writer
+//
+
+logger &logger::get()
+{
+    static logger instance;
+    return instance;
+}
+
+logger::~logger()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cv.notify_all();
+    if (m_thread.joinable())
+        m_thread.join();
+
+    flush();
+}
+
+void logger::set_directory(std::string const &dir)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_directory = dir;
+}
+
+void logger::set_rate(int lines_per_second)
+{
+    m_rate = std::max(lines_per_second, 0);
+}
+
+void logger::set_max_size(size_t bytes)
+{
+    m_max_size = bytes;
+}
+
+void logger::set_tags(bool enable)
+{
+    m_tags = enable;
+}
+
+std::shared_ptr<logger::channel> logger::open()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto c = std::make_shared<channel>(m_next_id++, ring_size);
+    c->m_budget = m_rate;
+    m_channels.push_back(c);
+
+    if (!m_thread.joinable() && !m_stop)
+        m_thread = std::thread(&logger::writer, this);
+    return c;
+}
+
+void logger::flush()
+{
+    std::lock_guard<std::mutex> write_lock(m_write_mutex);
+
+    // Channels that nobody else holds can be forgotten once drained, since
+    // no more lines can be queued
+    std::vector<std::shared_ptr<channel>> channels, released;
+    std::string dir;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        channels = m_channels;
+        dir = m_directory;
+        for (auto const &c : m_channels)
+            if (c.use_count() == 2)
+                released.push_back(c);
+    }
+
+    // Gather each destination’s data; lines that overwrite a file discard
+    // what was gathered for it before
+    struct file
+    {
+        bool truncate = false;
+        std::string data;
+    };
+
+    std::string out;
+    std::map<std::string, file> files;
+    for (auto const &c : channels)
+    {
+        for (auto &l : c->drain())
+        {
+            if (l.filename.empty())
+            {
+                out += l.text;
+                continue;
+            }
+
+            auto &f = files[l.filename];
+            if (l.overwrite)
+            {
+                f.truncate = true;
+                f.data.clear();
+            }
+            f.data += l.text;
+        }
+    }
+
+    if (out.length())
+    {
+        fwrite(out.data(), 1, out.length(), stdout);
+        fflush(stdout);
+    }
+
+    for (auto const &[name, f] : files)
+    {
+        auto const base = fs::path(name).filename();
+        if (base.empty())
+            continue;
+
+        auto mode = std::ios::binary | (f.truncate ? std::ios::trunc : std::ios::app);
+        std::ofstream s(fs::path(dir) / base, mode);
+        s.write(f.data.data(), f.data.length());
+        if (!s)
+            lol::msg::error("cannot write printh() output to %s\n", name.c_str());
+    }
+
+    if (released.size())
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_channels.erase(std::remove_if(m_channels.begin(), m_channels.end(),
+            [&](auto const &c)
+            {
+                return std::find(released.begin(), released.end(), c) != released.end();
+            }), m_channels.end());
+    }
+}
+
+void logger::writer()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_stop)
+    {
+        m_cv.wait_for(lock, write_period, [this]() { return m_stop; });
+
+        lock.unlock();
+        flush();
+        lock.lock();
+    }
+}
+
+} // namespace z8::pico8
+
@@ -0,0 +1,124 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <atomic>             // std::atomic
+#include <condition_variable> // std::condition_variable
+#include <memory>             // std::shared_ptr
+#include <mutex>              // std::mutex
+#include <string>             // std::string
+#include <string_view>        // std::string_view
+#include <thread>             // std::thread
+#include <vector>             // std::vector
+#include <cstdint>            // int64_t
+
+// The logger class
+// ————————————————
+// A process-wide sink for printh() output. Each VM queues its lines in the
+// ring buffer of its own channel, without any I/O, and a writer thread
+// regularly collects the lines of all channels and writes them to stdout
+// or to files, one batch at a time.
+//
+// Channels can limit how many lines per second and how many bytes in total
+// a cart prints; lines over the limits are dropped, and a note says how
+// many. Time is counted in VM steps, so that limits do not depend on how
+// fast the host runs. Lines can also be tagged with the channel id and the
+// frame number, to tell apart the output of many VMs in the same process.
+
+namespace z8::pico8
+{
+
+class logger
+{
+public:
+    class channel
+    {
+    public:
+        channel(int id, size_t capacity);
+
+        // Queue a line for stdout, or for a file in the log directory if
+        // filename is not empty; called on the VM thread
+        void print(std::string_view text, std::string const &filename, bool overwrite);
+
+        // Called after each VM step, to advance the frame counter and the
+        // rate limit
+        void tick();
+
+    private:
+        friend class logger;
+
+        struct line
+        {
+            std::string filename, text;
+            bool overwrite;
+        };
+
+        void push(std::string const &filename, bool overwrite, std::string text);
+        std::vector<line> drain();
+
+        int const m_id;
+        int64_t m_frame = 0;
+
+        // Lines that may still be printed this second, bytes printed so
+        // far, and lines that were dropped since the last note about them
+        double m_budget = 0.0;
+        size_t m_bytes = 0;
+        int64_t m_dropped = 0;
+        bool m_capped = false;
+
+        std::mutex m_mutex;
+        std::vector<line> m_ring;
+        size_t m_head = 0, m_count = 0;
+    };
+
+    static logger &get();
+    ~logger();
+
+    // Directory of the files written by printh(); only their base names
+    // are used, so that carts cannot write anywhere else
+    void set_directory(std::string const &dir);
+
+    // Lines per second and total bytes each channel may print, 0 meaning
+    // no limit, and whether lines are tagged with the channel id and frame
+    void set_rate(int lines_per_second);
+    void set_max_size(size_t bytes);
+    void set_tags(bool enable);
+
+    // A new channel for a VM; its lines are still written after the VM
+    // releases it
+    std::shared_ptr<channel> open();
+
+    // Write all queued lines now
+    void flush();
+
+private:
+    logger() = default;
+
+    void writer();
+
+    std::string m_directory = ".";
+    std::atomic<int> m_rate { 0 };
+    std::atomic<size_t> m_max_size { 0 };
+    std::atomic<bool> m_tags { false };
+
+    std::thread m_thread;
+    bool m_stop = false;
+    int m_next_id = 0;
+    std::mutex m_mutex, m_write_mutex;
+    std::condition_variable m_cv;
+
+    std::vector<std::shared_ptr<channel>> m_channels;
+};
+
+} // namespace z8::pico8
+
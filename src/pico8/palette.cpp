@@ -0,0 +1,118 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <lol/vector> // lol::vec3
+#include <cfloat>     // FLT_MAX
+#include <cmath>      // std::pow, std::cbrt
+#include <vector>     // std::vector
+
+#include "pico8/pico8.h"
+
+namespace z8::pico8
+{
+
+// Convert sRGB in 0…1 to OKLab, see https://bottosson.github.io/posts/oklab/
+static lol::vec3 srgb_to_oklab(lol::vec3 c)
+{
+    auto linear = [](float x)
+    {
+        return x <= 0.04045f ? x / 12.92f : std::pow((x + 0.055f) / 1.055f, 2.4f);
+    };
+
+    float const r = linear(c.r), g = linear(c.g), b = linear(c.b);
+    float const l = std::cbrt(0.4122214708f * r + 0.5363325363f * g + 0.0514459929f * b);
+    float const m = std::cbrt(0.2119034982f * r + 0.6806995451f * g + 0.1073969566f * b);
+    float const s = std::cbrt(0.0883024619f * r + 0.2817188376f * g + 0.6299787005f * b);
+
+    return lol::vec3(0.2104542553f * l + 0.7936177850f * m - 0.0040720468f * s,
+                     1.9779984951f * l - 2.4285922050f * m + 0.4505937099f * s,
+                     0.0259040371f * l + 0.7827717662f * m - 0.8086757660f * s);
+}
+
+// Index in the list of the closest colour to c, an OKLab colour
+static int closest(lol::vec3 c, std::vector<lol::vec3> const &colors)
+{
+    int ret = 0;
+    float dist = FLT_MAX;
+    for (size_t n = 0; n < colors.size(); ++n)
+    {
+        float newdist = lol::sqlength(c - colors[n]);
+        if (newdist < dist)
+        {
+            dist = newdist;
+            ret = int(n);
+        }
+    }
+    return ret;
+}
+
+static std::vector<lol::vec3> to_oklab(std::vector<uint8_t> const &colors)
+{
+    std::vector<lol::vec3> ret;
+    for (uint8_t n : colors)
+        ret.push_back(srgb_to_oklab(palette::get(n).rgb));
+    return ret;
+}
+
+palette::lut::lut(std::vector<uint8_t> const &colors)
+{
+    // The OKLab value of the centre of each cell is the same for all cubes
+    static std::vector<lol::vec3> const centres = []()
+    {
+        std::vector<lol::vec3> ret(32 * 32 * 32);
+        for (int i = 0; i < 32 * 32 * 32; ++i)
+            ret[i] = srgb_to_oklab((lol::vec3(i >> 10, i >> 5 & 31, i & 31) * 8.f + 3.5f) / 255.f);
+        return ret;
+    }();
+
+    auto const oklab = to_oklab(colors);
+    m_cube.resize(centres.size());
+    for (size_t i = 0; i < centres.size(); ++i)
+        m_cube[i] = uint8_t(closest(centres[i], oklab));
+
+    // No two palette colours share a cell, so exact matches are kept
+    for (size_t n = colors.size(); n-- > 0; )
+        m_cube[find(get8(colors[n]))] = uint8_t(n);
+}
+
+// The cubes for the standard palette and the extended one
+static palette::lut const *get_lut(int count)
+{
+    static palette::lut const lut16({ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 });
+    static palette::lut const lut32({ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+                                      16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31 });
+    return count == 16 ? &lut16 : count == 32 ? &lut32 : nullptr;
+}
+
+int palette::best(lol::vec4 c, int count)
+{
+    if (auto cube = get_lut(count))
+        return cube->find(c.rgb);
+
+    std::vector<uint8_t> colors;
+    for (int n = 0; n < count; ++n)
+        colors.push_back(uint8_t(n));
+    return closest(srgb_to_oklab(lol::clamp(c.rgb, 0.f, 1.f)), to_oklab(colors));
+}
+
+int palette::best(lol::u8vec4 c, int count)
+{
+    if (auto cube = get_lut(count))
+        return cube->find(c);
+    return best(lol::vec4(c) / 255.f, count);
+}
+
+} // namespace z8::pico8
@@ -101,7 +101,7 @@ template<typename R> struct tokenise_action
     }
 };
 
-int code::count_tokens(std::string const &s)
+int code::parse_tokens(std::string const &s)
 {
     pegtl::string_input<> in(s, "p8");
     try
@@ -12,11 +12,12 @@
 
 #pragma once
 
+#include <array>         // std::array
 #include <map>           // std::map
 #include <unordered_set> // std::unordered_set
 #include <string_view>   // std::string_view
-#include <regex>         // std::regex
-#include <cfloat>        // FLT_MAX
+#include <vector>        // std::vector
+#include <algorithm>     // std::min, std::max
 #include <lol/vector>    // lol::vec4
 
 // The PICO-8 definitions
@@ -50,15 +51,17 @@ struct charset
     static std::string utf8_to_pico8(std::string const &str);
     static std::string pico8_to_utf8(std::string const &str);
 
-    // Map 8-bit PICO-8 characters to UTF-32 codepoints
-    static std::u32string_view to_utf32[256];
+    // Decode the character at the start of UTF-8 text, which must not be
+    // empty, and return the number of bytes it used; bytes that do not
+    // start a PICO-8 glyph are passed through as is
+    static size_t decode_utf8(char const *str, char const *end, uint8_t &ch);
 
-    // Map 8-bit PICO-8 characters to UTF-8 string views
-    static std::string_view to_utf8[256];
+    // Map 8-bit PICO-8 characters to UTF-32 codepoints; the tables are
+    // built at compile time
+    static std::array<std::u32string_view, 256> const to_utf32;
 
-private:
-    static std::regex static_init();
-    static std::regex utf8_regex;
+    // Map 8-bit PICO-8 characters to UTF-8 string views
+    static std::array<std::string_view, 256> const to_utf8;
 };
 
 struct code
@@ -72,7 +75,11 @@ struct code
     static std::vector<uint8_t> compress(std::string const &input,
                                          format fmt = format::pxa);
 
-    static int count_tokens(std::string const &s);
+    // Count tokens with a hand-written lexer; this is fast but does not
+    // check the syntax, see also token_cache for code that is being edited
+    static int count_tokens(std::string_view s);
+    // Count tokens by parsing the code; returns -1 on syntax errors
+    static int parse_tokens(std::string const &s);
     static std::string ast(std::string const &s);
 };
 
@@ -147,29 +154,39 @@ struct palette
         return pal[n & 0x1f];
     }
 
-    /* Find the closest palette element to c (a vector of floats in 0…1) */
-    static int best(lol::vec4 c, int count = 16)
+    /* Find the closest palette element to c (a vector of floats in 0…1);
+     * colours are compared in OKLab space, using a lookup cube when count
+     * is 16 or 32 */
+    static int best(lol::vec4 c, int count = 16);
+
+    /* Find the closest palette element to c (a vector of uint8_ts in 0…255) */
+    static int best(lol::u8vec4 c, int count = 16);
+
+    /* A lookup cube from RGB to the perceptually closest colour of a list
+     * of palette elements, with 5 bits per component. Colours are compared
+     * in OKLab space, and colours of the list always map to themselves. */
+    class lut
     {
-        int ret = 0;
-        float dist = FLT_MAX;
-        for (int n = 0; n < count; ++n)
+    public:
+        lut() = default;
+        lut(std::vector<uint8_t> const &colors);
+
+        /* Index in the list of the closest colour to c */
+        uint8_t find(lol::u8vec4 c) const
         {
-            lol::vec3 delta = c.rgb - get(n).rgb;
-            float newdist = lol::sqlength(delta);
-            if (newdist < dist)
-            {
-                dist = newdist;
-                ret = n;
-            }
+            return m_cube[(c.r >> 3) << 10 | (c.g >> 3) << 5 | c.b >> 3];
         }
-        return ret;
-    }
 
-    /* Find the closest palette element to c (a vector of uint8_ts in 0…255) */
-    static int best(lol::u8vec4 c, int count = 16)
-    {
-        return best(lol::vec4(c) / 255.f, count);
-    }
+        /* Same, for a vector of floats, clamped to 0…1 */
+        uint8_t find(lol::vec3 c) const
+        {
+            auto q = [](float x) { return int(std::min(std::max(x, 0.f), 1.f) * 255.f + 0.5f) >> 3; };
+            return m_cube[q(c.r) << 10 | q(c.g) << 5 | q(c.b)];
+        }
+
+    private:
+        std::vector<uint8_t> m_cube;
+    };
 };
 
 } // namespace z8::pico8
@@ -14,101 +14,207 @@
 #   include "config.h"
 #endif
 
-// I know codecvt_utf8 is deprecated, but let’s hope C++ comes with a
-// replacement before they actually remove the feature.
-#define _SILENCE_CXX17_CODECVT_HEADER_DEPRECATION_WARNING 1
-
 #include <lol/msg>   // lol::msg
-#include <lol/utils> // lol::format
 
-#include <locale>
+#include <algorithm> // std::upper_bound, std::any_of
+#include <array>     // std::array
 #include <string>
-#include <codecvt>
 #include <cstring>
 
 #include "pico8/pico8.h"
+#include "pico8/cartdata.h"
 #include "pico8/vm.h"
 
 namespace z8::pico8
 {
 
-std::string_view charset::to_utf8[256];
-std::u32string_view charset::to_utf32[256];
+// All the glyph tables are computed at compile time, so that programs
+// that never convert text do not pay for them at startup
+namespace
+{
 
-static uint8_t multibyte_start[256];
-static std::map<std::string, uint8_t> to_pico8;
-std::regex charset::utf8_regex = charset::static_init();
+// The complete PICO-8 charmap, from 0 to 255. We cannot just store
+// codepoints because some emoji glyphs are combinations of several
+// codepoints, e.g. ⬇️ is U+2B07 (down arrow) + U+FE0F (variation
+// selector-16).
+constexpr char utf8_chars[] =
+    "\0¹²³⁴⁵⁶⁷⁸\t\nᵇᶜ\rᵉᶠ▮■□⁙⁘‖◀▶「」¥•、。゛゜"
+    " !\"#$%&'()*+,-./0123456789:;<=>?@ABCDEFGHIJKLMNO"
+    "PQRSTUVWXYZ[\\]^_`abcdefghijklmnopqrstuvwxyz{|}~○"
+    "█▒🐱⬇️░✽●♥☉웃⌂⬅️😐♪🅾️◆…➡️★⧗⬆️ˇ∧❎▤▥あいうえおか"
+    "きくけこさしすせそたちつてとなにぬねのはひふへほまみむめもやゆよ"
+    "らりるれろわをんっゃゅょアイウエオカキクケコサシスセソタチツテト"
+    "ナニヌネノハヒフヘホマミムメモヤユヨラリルレロワヲンッャュョ◜◝";
 
-std::regex charset::static_init()
+constexpr size_t sequence_length(uint8_t b)
 {
-#if _WIN32 // Work around a Visual Studio CRT bug
-    std::wstring_convert<std::codecvt_utf8<int32_t>, int32_t> cvt;
-#else
-    std::wstring_convert<std::codecvt_utf8<char32_t>, char32_t> cvt;
-#endif
+    return b < 0x80 ? 1 : b < 0xe0 ? 2 : b < 0xf0 ? 3 : 4;
+}
+
+constexpr char32_t decode(char const *p)
+{
+    size_t const len = sequence_length(uint8_t(p[0]));
+    char32_t ret = uint8_t(p[0]) & (len == 1 ? 0x7f : 0x7f >> len);
+    for (size_t i = 1; i < len; ++i)
+        ret = ret << 6 | (uint8_t(p[i]) & 0x3f);
+    return ret;
+}
+
+// Where each glyph starts in the UTF-8 and UTF-32 strings, and how long
+// it is; a glyph is one codepoint, possibly followed by U+FE0F
+struct span { size_t start, length; };
+
+struct layout
+{
+    span utf8[256], utf32[256];
+    size_t codepoints;
+};
 
-    // The complete PICO-8 charmap, from 0 to 255. We cannot just store
-    // codepoints because some emoji glyphs are combinations of several
-    // codepoints, e.g. ⬇️ is U+2B07 (down arrow) + U+FE0F (variation
-    // selector-16).
-    static char const utf8_chars[] =
-        "\0¹²³⁴⁵⁶⁷⁸\t\nᵇᶜ\rᵉᶠ▮■□⁙⁘‖◀▶「」¥•、。゛゜"
-        " !\"#$%&'()*+,-./0123456789:;<=>?@ABCDEFGHIJKLMNO"
-        "PQRSTUVWXYZ[\\]^_`abcdefghijklmnopqrstuvwxyz{|}~○"
-        "█▒🐱⬇️░✽●♥☉웃⌂⬅️😐♪🅾️◆…➡️★⧗⬆️ˇ∧❎▤▥あいうえおか"
-        "きくけこさしすせそたちつてとなにぬねのはひふへほまみむめもやゆよ"
-        "らりるれろわをんっゃゅょアイウエオカキクケコサシスセソタチツテト"
-        "ナニヌネノハヒフヘホマミムメモヤユヨラリルレロワヲンッャュョ◜◝";
-    static auto utf32_chars = cvt.from_bytes(utf8_chars, &utf8_chars[sizeof(utf8_chars)]);
-
-    // Create all sorts of lookup tables for PICO-8 character conversions
-    char const *p8 = utf8_chars;
-    auto const *p32 = (char32_t const *)utf32_chars.data();
-    std::string regex("(");
-    for (int i = 0; i < 256; ++i)
+constexpr layout make_layout()
+{
+    layout ret {};
+    for (size_t i = 0, p8 = 0, p32 = 0; i < 256; ++i)
     {
-        size_t len32 = p32[1] == 0xfe0f ? 2 : 1;
-        size_t len8 = ((0xe5000000 >> ((*p8 >> 3) & 0x1e)) & 3) + len32 * len32;
-        to_utf8[i] = std::string_view(p8, len8);
-        to_utf32[i] = std::u32string_view(p32, len32);
-        to_pico8[std::string(p8, len8)] = i;
-
-        // Build a regex that lets us do faster (maybe?) UTF-8 conversions
-        if (len8 > 1)
-        {
-            multibyte_start[(uint8_t)*p8] = 1;
-            regex += std::string(p8, len8) + '|';
-        }
+        size_t len8 = sequence_length(uint8_t(utf8_chars[p8]));
+        size_t len32 = decode(utf8_chars + p8 + len8) == 0xfe0f ? 2 : 1;
+        len8 += len32 == 2 ? 3 : 0;
 
+        ret.utf8[i] = span { p8, len8 };
+        ret.utf32[i] = span { p32, len32 };
         p8 += len8;
         p32 += len32;
+        ret.codepoints = p32;
     }
-    regex += ')'; // Fall back to an empty match on purpose
+    return ret;
+}
+
+constexpr layout glyphs = make_layout();
 
-    return std::regex(regex);
+constexpr std::array<char32_t, glyphs.codepoints> make_utf32_chars()
+{
+    std::array<char32_t, glyphs.codepoints> ret {};
+    for (size_t i = 0; i < 256; ++i)
+        for (size_t n = 0, p8 = glyphs.utf8[i].start; n < glyphs.utf32[i].length; ++n)
+        {
+            ret[glyphs.utf32[i].start + n] = decode(utf8_chars + p8);
+            p8 += sequence_length(uint8_t(utf8_chars[p8]));
+        }
+    return ret;
 }
 
-std::string charset::utf8_to_pico8(std::string const &str)
+constexpr auto utf32_chars = make_utf32_chars();
+
+constexpr std::array<std::string_view, 256> make_to_utf8()
 {
-    std::string ret;
-    std::smatch sm;
+    std::array<std::string_view, 256> ret {};
+    for (size_t i = 0; i < 256; ++i)
+        ret[i] = std::string_view(utf8_chars + glyphs.utf8[i].start, glyphs.utf8[i].length);
+    return ret;
+}
+
+constexpr std::array<std::u32string_view, 256> make_to_utf32()
+{
+    std::array<std::u32string_view, 256> ret {};
+    for (size_t i = 0; i < 256; ++i)
+        ret[i] = std::u32string_view(utf32_chars.data() + glyphs.utf32[i].start, glyphs.utf32[i].length);
+    return ret;
+}
+
+// Multibyte glyphs sorted by their UTF-8 sequence; all glyphs starting
+// with byte b are in the range [glyph_start[b], glyph_start[b + 1])
+struct multibyte
+{
+    std::string_view utf8;
+    uint8_t ch;
+};
+
+constexpr size_t count_multibyte()
+{
+    size_t ret = 0;
+    for (size_t i = 0; i < 256; ++i)
+        ret += glyphs.utf8[i].length > 1 ? 1 : 0;
+    return ret;
+}
+
+constexpr std::array<multibyte, count_multibyte()> make_to_pico8()
+{
+    std::array<multibyte, count_multibyte()> ret {};
+    for (size_t i = 0, n = 0; i < 256; ++i)
+    {
+        if (glyphs.utf8[i].length == 1)
+            continue;
 
-    for (auto p = str.begin(); p != str.end(); )
+        // Insertion sort, since std::sort is not constexpr yet
+        multibyte const g { std::string_view(utf8_chars + glyphs.utf8[i].start,
+                                             glyphs.utf8[i].length), uint8_t(i) };
+        size_t k = n++;
+        for (; k > 0 && g.utf8 < ret[k - 1].utf8; --k)
+            ret[k] = ret[k - 1];
+        ret[k] = g;
+    }
+    return ret;
+}
+
+constexpr auto to_pico8 = make_to_pico8();
+
+constexpr std::array<uint16_t, 257> make_glyph_start()
+{
+    std::array<uint16_t, 257> ret {};
+    for (size_t b = 0, n = 0; b < 257; ++b)
+    {
+        while (n < to_pico8.size() && uint8_t(to_pico8[n].utf8[0]) < b)
+            ++n;
+        ret[b] = uint16_t(n);
+    }
+    return ret;
+}
+
+constexpr auto glyph_start = make_glyph_start();
+
+} // anonymous namespace
+
+constexpr std::array<std::string_view, 256> charset::to_utf8 = make_to_utf8();
+constexpr std::array<std::u32string_view, 256> charset::to_utf32 = make_to_utf32();
+
+size_t charset::decode_utf8(char const *str, char const *end, uint8_t &ch)
+{
+    auto const begin = to_pico8.begin() + glyph_start[(uint8_t)*str];
+    auto const last = to_pico8.begin() + glyph_start[(uint8_t)*str + 1];
+
+    if (begin != last)
     {
-        // Only pass known start characters through the expensive regex
-        if (multibyte_start[(uint8_t)*p]
-             && std::regex_search(p, str.end(), sm, utf8_regex)
-             && sm.length() > 1)
+        std::string_view text(str, std::min(size_t(end - str), size_t(8)));
+        auto it = std::upper_bound(begin, last, text, [](std::string_view a, auto const &b)
         {
-            ret += to_pico8[sm.str()];
-            p += sm.length();
-        }
-        else
+            return a < b.utf8;
+        });
+        if (it != begin)
         {
-            ret += *p++;
+            auto const &glyph = *--it;
+            if (text.compare(0, glyph.utf8.length(), glyph.utf8) == 0)
+            {
+                ch = glyph.ch;
+                return glyph.utf8.length();
+            }
         }
     }
 
+    ch = (uint8_t)*str;
+    return 1;
+}
+
+std::string charset::utf8_to_pico8(std::string const &str)
+{
+    std::string ret;
+    ret.reserve(str.length());
+
+    for (char const *p = str.data(), *end = p + str.length(); p < end; )
+    {
+        uint8_t ch;
+        p += decode_utf8(p, end, ch);
+        ret += char(ch);
+    }
+
     return ret;
 }
 
@@ -125,6 +231,15 @@ void vm::private_stub(std::string str)
     lol::msg::info("z8:stub:%s\n", str.c_str());
 }
 
+bool vm::private_draw_frame(int16_t fps)
+{
+    m_frame_rate = fps;
+    if (m_skip_frames <= 0)
+        return true;
+    --m_skip_frames;
+    return false;
+}
+
 bool vm::private_is_api(std::string str)
 {
     // Find str in function list
@@ -147,13 +262,42 @@ opt<bool> vm::private_cartdata(opt<std::string> str)
     if (!str->size())
     {
         // Empty argument given: get rid of cart data
+        save_cartdata();
         m_cartdata = "";
         return std::nullopt;
     }
 
+    // Deterministic runs must not depend on what previous runs saved, so
+    // they keep the persistent memory, which is empty unless a frontend
+    // restored it, see save_ram()
+    cartdata_store::data d {};
+    bool found = false;
+    if (m_deterministic)
+    {
+        memcpy(d.data(), m_ram.persistent, d.size());
+        found = std::any_of(d.begin(), d.end(), [](uint8_t x) { return x != 0; });
+    }
+    else
+        found = cartdata_store::get().load(*str, d);
+    memcpy(m_ram.persistent, d.data(), sizeof(m_ram.persistent));
+    memcpy(m_cartdata_saved, d.data(), sizeof(m_cartdata_saved));
+
     m_cartdata = *str;
-    private_stub(lol::format("cartdata(\"%s\")", m_cartdata.c_str()));
-    return false;
+    return found;
+}
+
+void vm::save_cartdata()
+{
+    // Carts may also write the data with poke(), memcpy() or memset();
+    // in deterministic mode, the frontend saves the memory itself
+    if (m_cartdata.empty() || m_deterministic
+         || !memcmp(m_cartdata_saved, m_ram.persistent, sizeof(m_cartdata_saved)))
+        return;
+
+    cartdata_store::data d;
+    memcpy(d.data(), m_ram.persistent, d.size());
+    cartdata_store::get().store(m_cartdata, d);
+    memcpy(m_cartdata_saved, m_ram.persistent, sizeof(m_cartdata_saved));
 }
 
 } // namespace z8::pico8
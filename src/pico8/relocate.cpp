@@ -0,0 +1,847 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <algorithm> // std::sort, std::lower_bound, std::unique
+#include <cstddef>   // offsetof
+#include <cstring>   // memset
+
+#include "pico8/vm.h"
+#include "3rdparty/z8lua/lauxlib.h"
+
+// Lua internals come last, since they define many macros
+#include "3rdparty/z8lua/lstate.h"
+#include "3rdparty/z8lua/lgc.h"
+
+namespace z8::pico8
+{
+
+// Objects in a heap image point to each other, to addresses in the arena
+// that saved it, and to C functions in this program. Images come from
+// files, so none of these are trusted: the walker first finds every object
+// through the lists the collector keeps, then checks that every pointer
+// refers to an object of the expected type, or to an array that lies in
+// the image and overlaps nothing else, and only then moves the pointers
+// to the new arena. In files, C functions are stored as indices into the
+// list of those this build can reach, see collect_natives().
+class vm::walker
+{
+public:
+    walker(vm const &owner, uint8_t const *data, size_t size,
+           uintptr_t from, uintptr_t to, natives mode)
+      : m_owner(owner), m_data(const_cast<uint8_t *>(data)), m_size(size),
+        m_capacity(owner.m_heap.capacity()), m_from(from), m_to(to), m_mode(mode)
+    {}
+
+    // The first thread is the main thread; all of them move along with
+    // the heap. Nothing is written unless every check passed.
+    bool run(uintptr_t *threads, size_t count)
+    {
+        if (!find_objects(threads[0]))
+            return false;
+
+        for (size_t i = 0; i < count; ++i)
+            if (type(threads[i]) != LUA_TTHREAD)
+                return false;
+
+        walk();
+        if (!m_ok || !check_extents() || m_mode == natives::collect)
+            return m_ok;
+
+        m_write = true;
+        walk();
+        for (size_t i = 0; i < count; ++i)
+            threads[i] = threads[i] - m_from + m_to;
+        return true;
+    }
+
+    std::vector<uintptr_t> const &found() const { return m_found; }
+
+private:
+    struct object
+    {
+        uintptr_t addr;
+        int tt;
+        bool gray; // in one of the collector's gray lists
+        bool open; // an open upvalue, in the list of a thread
+    };
+
+    //
+    // Checks, only made on the first walk
+    //
+
+    void fail() { m_ok = false; }
+
+    // The copy of count objects at address p of the arena that saved the
+    // image, or null if they do not lie within the image
+    template<typename T> T *at(T const *p, size_t count = 1)
+    {
+        uintptr_t const offset = uintptr_t(p) - m_from;
+        if (uintptr_t(p) < m_from || offset > m_size
+             || count > (m_size - offset) / sizeof(T))
+        {
+            fail();
+            return nullptr;
+        }
+        return (T *)(m_data + offset);
+    }
+
+    // Arrays may be null when empty
+    template<typename T> bool array(T const *p, size_t count)
+    {
+        return !count || at(p, count);
+    }
+
+    // Where the copy of the object at address p is, once checked
+    template<typename T> T *local(T const *p)
+    {
+        return (T *)(m_data + (uintptr_t(p) - m_from));
+    }
+
+    // Record an allocation, which may not overlap any other
+    void own(void const *p, size_t bytes)
+    {
+        if (!m_write && bytes)
+            m_extents.push_back(heap::extent(uintptr_t(p) - m_from, bytes));
+    }
+
+    object *find(void const *p)
+    {
+        auto it = std::lower_bound(m_objects.begin(), m_objects.end(), uintptr_t(p),
+                                   [](object const &o, uintptr_t a) { return o.addr < a; });
+        return it != m_objects.end() && it->addr == uintptr_t(p) ? &*it : nullptr;
+    }
+
+    int type(uintptr_t p)
+    {
+        object const *o = find((void const *)p);
+        return o ? o->tt : -1;
+    }
+
+    // Whether p is one of the count elements at base, or just past them
+    template<typename T> static bool within(T const *p, T const *base, size_t count, bool end)
+    {
+        uintptr_t const offset = uintptr_t(p) - uintptr_t(base);
+        return offset % sizeof(T) == 0 && offset / sizeof(T) < count + end;
+    }
+
+    //
+    // Moving pointers, only done on the second walk
+    //
+
+    template<typename T> void move(T *&p)
+    {
+        if (m_write && p)
+            p = (T *)(uintptr_t(p) - m_from + m_to);
+    }
+
+    template<typename T> void clear(T &field)
+    {
+        if (m_write)
+            field = T();
+    }
+
+    // A pointer to an object of type tt
+    template<typename T> void ref(T *&p, int tt, bool nullable = true)
+    {
+        if (!m_write && (p ? type(uintptr_t(p)) != tt : !nullable))
+            fail();
+        move(p);
+    }
+
+    template<typename T> void string(T *&p, bool nullable = true)
+    {
+        if (!m_write && (p || !nullable))
+        {
+            int const tt = type(uintptr_t(p));
+            if (tt != LUA_TSHRSTR && tt != LUA_TLNGSTR)
+                fail();
+        }
+        move(p);
+    }
+
+    // A pointer to any object
+    void any(GCObject *&p)
+    {
+        if (!m_write && p && !find(p))
+            fail();
+        move(p);
+    }
+
+    // A pointer that is never followed without being set first, but that
+    // still has to stay within the arena
+    template<typename T> void loose(T *&p)
+    {
+        if (!m_write && p && (uintptr_t(p) < m_from || uintptr_t(p) - m_from >= m_capacity))
+            fail();
+        move(p);
+    }
+
+    // The collector follows gclist only for objects in its gray lists,
+    // which were checked when the objects were found
+    void gclist(GCObject *&p, object const &o)
+    {
+        if (o.gray)
+            move(p);
+        else
+            clear(p);
+    }
+
+    // A stack offset, as used by error handlers and yields
+    void offset(ptrdiff_t p, int stacksize)
+    {
+        if (!m_write && (p < 0 || p % sizeof(TValue) || p / sizeof(TValue) >= size_t(stacksize)))
+            fail();
+    }
+
+    void native(lua_CFunction &f)
+    {
+        auto const &registry = m_owner.m_natives;
+        uintptr_t const p = reinterpret_cast<uintptr_t>(f);
+
+        switch (m_mode)
+        {
+        case natives::keep:
+            break;
+        case natives::collect:
+            if (!m_write && p)
+                m_found.push_back(p);
+            break;
+        case natives::encode:
+        {
+            auto it = std::lower_bound(registry.begin(), registry.end(), p);
+            if (!m_write && p && (it == registry.end() || *it != p))
+                fail();
+            if (m_write && p)
+                f = reinterpret_cast<lua_CFunction>(uintptr_t(it - registry.begin() + 1));
+            break;
+        }
+        case natives::decode:
+            if (!m_write && p > registry.size())
+                fail();
+            if (m_write && p)
+                f = reinterpret_cast<lua_CFunction>(registry[p - 1]);
+            break;
+        }
+    }
+
+    //
+    // Values and objects
+    //
+
+    void value(TValue *o, bool key = false)
+    {
+        switch (rttype(o))
+        {
+        case LUA_TNIL:
+        case LUA_TBOOLEAN:
+        case LUA_TLIGHTUSERDATA:
+        case LUA_TNUMBER:
+            return;
+        case LUA_TLCF:
+            return native(o->value_.f);
+        case ctb(LUA_TSHRSTR):
+        case ctb(LUA_TLNGSTR):
+        case ctb(LUA_TTABLE):
+        case ctb(LUA_TLCL):
+        case ctb(LUA_TCCL):
+        case ctb(LUA_TUSERDATA):
+        case ctb(LUA_TTHREAD):
+            return ref(o->value_.gc, ttype(o), false);
+        case LUA_TDEADKEY:
+            // Dead keys are only compared with live ones
+            if (key)
+                return loose(o->value_.gc);
+        }
+        fail();
+    }
+
+    // Size of the part of each object type that does not vary
+    static size_t fixed_size(int tt)
+    {
+        switch (tt)
+        {
+        case LUA_TSHRSTR:
+        case LUA_TLNGSTR: return sizeof(TString);
+        case LUA_TTABLE: return sizeof(Table);
+        case LUA_TLCL: return offsetof(LClosure, upvals);
+        case LUA_TCCL: return offsetof(CClosure, upvalue);
+        case LUA_TUSERDATA: return sizeof(Udata);
+        case LUA_TTHREAD: return sizeof(lua_State);
+        case LUA_TPROTO: return sizeof(Proto);
+        case LUA_TUPVAL: return sizeof(UpVal);
+        default: return 0;
+        }
+    }
+
+    static GCObject **gclist_of(GCObject *o)
+    {
+        switch (gch(o)->tt)
+        {
+        case LUA_TTABLE: return &gco2t(o)->gclist;
+        case LUA_TLCL: return &gco2lcl(o)->gclist;
+        case LUA_TCCL: return &gco2ccl(o)->gclist;
+        case LUA_TTHREAD: return &gco2th(o)->gclist;
+        case LUA_TPROTO: return &gco2p(o)->gclist;
+        default: return nullptr;
+        }
+    }
+
+    // Add the objects of a list linked through their headers
+    bool add_list(GCObject *p)
+    {
+        for (; p; p = gch(p)->next)
+        {
+            auto *o = at((GCheader *)p);
+            size_t const fixed = o ? fixed_size(o->tt) : 0;
+            if (!fixed || !at((uint8_t const *)p, fixed) || m_objects.size() > m_size / 16)
+                return false;
+            m_objects.push_back(object { uintptr_t(p), o->tt, false, false });
+        }
+        return true;
+    }
+
+    bool find_objects(uintptr_t main)
+    {
+        auto *l = at((lua_State const *)main);
+        auto *g = l ? at(l->l_G) : nullptr;
+        if (!g || l->tt != LUA_TTHREAD || uintptr_t(g->mainthread) != main)
+            return false;
+        m_main = main;
+        m_g = uintptr_t(l->l_G);
+
+        // The main thread is not in the lists, and short strings are in
+        // the string table only
+        m_objects.push_back(object { main, LUA_TTHREAD, false, false });
+        if (!add_list(g->allgc) || !add_list(g->finobj) || !add_list(g->tobefnz))
+            return false;
+
+        auto *hash = at(g->strt.hash, size_t(g->strt.size));
+        if (!hash || g->strt.size <= 0 || (g->strt.size & (g->strt.size - 1)))
+            return false;
+        for (int i = 0; i < g->strt.size; ++i)
+            if (!add_list(hash[i]))
+                return false;
+
+        // Open upvalues are in the list of their thread only
+        size_t const closed = m_objects.size();
+        for (size_t i = 0; i < closed; ++i)
+        {
+            if (m_objects[i].tt != LUA_TTHREAD)
+                continue;
+            auto *th = local((lua_State const *)m_objects[i].addr);
+            size_t const first = m_objects.size();
+            if (!add_list(th->openupval))
+                return false;
+            for (size_t j = first; j < m_objects.size(); ++j)
+                m_objects[j].open = true;
+        }
+
+        std::sort(m_objects.begin(), m_objects.end(),
+                  [](object const &a, object const &b) { return a.addr < b.addr; });
+        for (size_t i = 1; i < m_objects.size(); ++i)
+            if (m_objects[i].addr == m_objects[i - 1].addr)
+                return false;
+
+        for (auto &o : m_objects)
+            if (o.open != (o.tt == LUA_TUPVAL && !closed_upvalue(o.addr)))
+                return false;
+
+        // Objects in the gray lists are in one list at most, once
+        for (GCObject *list : { g->gray, g->grayagain, g->weak, g->ephemeron, g->allweak })
+            for (GCObject *p = list; p; )
+            {
+                object *o = find(p);
+                GCObject **next = o ? gclist_of(local(p)) : nullptr;
+                if (!next || o->gray)
+                    return false;
+                o->gray = true;
+                p = *next;
+            }
+
+        return m_ok;
+    }
+
+    bool closed_upvalue(uintptr_t addr)
+    {
+        auto *uv = local((UpVal const *)addr);
+        return uintptr_t(uv->v) == addr + offsetof(UpVal, u.value);
+    }
+
+    void walk()
+    {
+        for (auto const &o : m_objects)
+            visit(o);
+        global();
+    }
+
+    void visit(object const &o)
+    {
+        auto *p = local((GCObject const *)o.addr);
+
+        if (o.addr != m_main)
+            any(gch(p)->next);
+        else if (!m_write && gch(p)->next)
+            fail();
+
+        switch (o.tt)
+        {
+        case LUA_TSHRSTR:
+        case LUA_TLNGSTR:
+        {
+            TString *ts = rawgco2ts(p);
+            auto const *chars = (char const *)((TString const *)o.addr + 1);
+            if (!m_write && !at(chars, ts->tsv.len + 1))
+                return;
+            own((void *)o.addr, sizeof(TString) + ts->tsv.len + 1);
+            break;
+        }
+        case LUA_TTABLE:
+            table(gco2t(p), o);
+            break;
+        case LUA_TLCL:
+        {
+            LClosure *cl = gco2lcl(p);
+            auto *old = (LClosure *)o.addr;
+            if (!m_write && !at(old->upvals, cl->nupvalues))
+                return;
+            own(old, offsetof(LClosure, upvals) + cl->nupvalues * sizeof(UpVal *));
+            gclist(cl->gclist, o);
+            ref(cl->p, LUA_TPROTO, false);
+            for (int i = 0; i < cl->nupvalues; ++i)
+                ref(cl->upvals[i], LUA_TUPVAL);
+            break;
+        }
+        case LUA_TCCL:
+        {
+            CClosure *cl = gco2ccl(p);
+            auto *old = (CClosure *)o.addr;
+            if (!m_write && !at(old->upvalue, cl->nupvalues))
+                return;
+            own(old, offsetof(CClosure, upvalue) + cl->nupvalues * sizeof(TValue));
+            gclist(cl->gclist, o);
+            if (!m_write && !cl->f)
+                fail();
+            native(cl->f);
+            for (int i = 0; i < cl->nupvalues; ++i)
+                value(&cl->upvalue[i]);
+            break;
+        }
+        case LUA_TUSERDATA:
+        {
+            Udata *u = rawgco2u(p);
+            auto const *bytes = (uint8_t const *)((Udata const *)o.addr + 1);
+            if (!m_write && !at(bytes, u->uv.len))
+                return;
+            own((void *)o.addr, sizeof(Udata) + u->uv.len);
+            ref(u->uv.metatable, LUA_TTABLE);
+            ref(u->uv.env, LUA_TTABLE);
+            break;
+        }
+        case LUA_TTHREAD:
+            thread(gco2th(p), o);
+            break;
+        case LUA_TPROTO:
+            proto(gco2p(p), o);
+            break;
+        case LUA_TUPVAL:
+        {
+            // Open upvalues point into the stack of their thread, which is
+            // where they are checked, and are linked through uvhead
+            UpVal *uv = gco2uv(p);
+            own((void *)o.addr, sizeof(UpVal));
+            if (!o.open)
+                value(&uv->u.value);
+            else
+            {
+                upvalue_link(uv->u.l.prev);
+                upvalue_link(uv->u.l.next);
+            }
+            move(uv->v);
+            break;
+        }
+        }
+    }
+
+    void upvalue_link(UpVal *&p)
+    {
+        if (!m_write && uintptr_t(p) != m_g + offsetof(global_State, uvhead))
+        {
+            object const *o = find(p);
+            if (!o || !o->open)
+                fail();
+        }
+        move(p);
+    }
+
+    void table(Table *t, object const &o)
+    {
+        auto *old = (Table *)o.addr;
+        own(old, sizeof(Table));
+        gclist(t->gclist, o);
+        ref(t->metatable, LUA_TTABLE);
+
+        if (!m_write && (t->sizearray < 0 || !array(t->array, size_t(t->sizearray))))
+            return fail();
+        own(t->array, t->sizearray * sizeof(TValue));
+        for (int i = 0; i < t->sizearray; ++i)
+            value(local(&t->array[i]));
+        move(t->array);
+
+        // Empty tables share a static node, stored as null in files
+        bool const dummy = m_mode == natives::decode ? !t->node
+                         : uintptr_t(t->node) == m_owner.m_dummy_node;
+        if (dummy)
+        {
+            if (!m_write && (t->lsizenode || t->lastfree))
+                fail();
+            if (m_write)
+                t->node = m_mode == natives::encode ? nullptr : (Node *)m_owner.m_dummy_node;
+            return;
+        }
+
+        if (!m_write && t->lsizenode >= 8 * sizeof(int) - 2)
+            return fail();
+        size_t const count = size_t(1) << t->lsizenode;
+        if (!m_write && !at(t->node, count))
+            return;
+        own(t->node, count * sizeof(Node));
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            Node *n = local(&t->node[i]);
+            if (!m_write && n->i_key.nk.next && !within(n->i_key.nk.next, t->node, count, false))
+                fail();
+            move(n->i_key.nk.next);
+            value(gkey(n), true);
+            value(gval(n));
+        }
+
+        if (!m_write && t->lastfree && !within(t->lastfree, t->node, count, true))
+            fail();
+        move(t->lastfree);
+        move(t->node);
+    }
+
+    void proto(Proto *f, object const &o)
+    {
+        own((void *)o.addr, sizeof(Proto));
+        gclist(f->gclist, o);
+
+        if (!m_write && (f->sizek < 0 || f->sizecode < 0 || f->sizep < 0
+                          || f->sizelineinfo < 0 || f->sizelocvars < 0 || f->sizeupvalues < 0
+                          || !array(f->k, f->sizek) || !array(f->code, f->sizecode)
+                          || !array(f->p, f->sizep) || !array(f->lineinfo, f->sizelineinfo)
+                          || !array(f->locvars, f->sizelocvars)
+                          || !array(f->upvalues, f->sizeupvalues)))
+            return fail();
+
+        own(f->k, f->sizek * sizeof(TValue));
+        own(f->code, f->sizecode * sizeof(Instruction));
+        own(f->p, f->sizep * sizeof(Proto *));
+        own(f->lineinfo, f->sizelineinfo * sizeof(int));
+        own(f->locvars, f->sizelocvars * sizeof(LocVar));
+        own(f->upvalues, f->sizeupvalues * sizeof(Upvaldesc));
+
+        for (int i = 0; i < f->sizek; ++i)
+            value(local(&f->k[i]));
+        for (int i = 0; i < f->sizep; ++i)
+            ref(*local(&f->p[i]), LUA_TPROTO, false);
+        for (int i = 0; i < f->sizelocvars; ++i)
+            string(local(&f->locvars[i])->varname);
+        for (int i = 0; i < f->sizeupvalues; ++i)
+            string(local(&f->upvalues[i])->name);
+
+        move(f->k);
+        move(f->code);
+        move(f->p);
+        move(f->lineinfo);
+        move(f->locvars);
+        move(f->upvalues);
+        ref(f->cache, LUA_TLCL);
+        string(f->source);
+    }
+
+    void thread(lua_State *l, object const &o)
+    {
+        auto *old = (lua_State *)o.addr;
+        own(old, sizeof(lua_State));
+        gclist(l->gclist, o);
+
+        // Threads only ever get the count hook, see vm::vm()
+        StkId const stack = l->stack;
+        int const size = l->stacksize;
+        if (!m_write && (uintptr_t(l->l_G) != m_g || l->status > LUA_ERRERR
+                          || (l->hookmask & ~LUA_MASKCOUNT) || l->errorJmp
+                          || size <= EXTRA_STACK || !at(stack, size)
+                          || l->stack_last != stack + size - EXTRA_STACK
+                          || !within(l->top, stack, size, true)))
+            return fail();
+        own(stack, size * sizeof(TValue));
+        offset(l->errfunc, size);
+
+        // Slots above the top may hold collected objects
+        TValue *slots = local(stack);
+        int const top = int(l->top - stack);
+        for (int i = 0; i < size; ++i)
+        {
+            if (i < top)
+                value(&slots[i]);
+            else if (m_write)
+                setnilvalue(&slots[i]);
+        }
+
+        // Open upvalues point to live slots of this thread
+        if (!m_write)
+            for (GCObject *p = l->openupval; p; p = gch(p)->next)
+            {
+                auto *uv = local((UpVal const *)p);
+                if (!within(uv->v, stack, size, false))
+                    fail();
+            }
+
+        // Walk the call chain, then the unused entries cached after it
+        CallInfo *ci = &l->base_ci, *addr = &old->base_ci, *previous = nullptr;
+        bool active = true;
+        for (size_t count = 0; ; ++count)
+        {
+            if (!m_write && ci->previous != previous)
+                return fail();
+            move(ci->previous);
+
+            if (active)
+                frame(ci, l, slots, stack, size, top, addr == l->ci);
+            else if (m_write)
+            {
+                ci->func = ci->top = nullptr;
+                ci->callstatus = 0;
+                memset(&ci->u, 0, sizeof(ci->u));
+            }
+
+            if (addr == l->ci)
+                active = false;
+
+            CallInfo *next = ci->next;
+            if (!next)
+                break;
+            if (!m_write && (count > m_size / sizeof(CallInfo) || !at(next)))
+                return fail();
+            own(next, sizeof(CallInfo));
+            move(ci->next);
+
+            previous = addr;
+            addr = next;
+            ci = local(next);
+        }
+        if (!m_write && active)
+            return fail();
+
+        move(l->ci);
+        move(l->stack);
+        move(l->stack_last);
+        move(l->top);
+        move(l->l_G);
+        ref(l->openupval, LUA_TUPVAL);
+        clear(l->oldpc);
+        if (m_write)
+            l->hook = l->hookmask ? &vm::instruction_hook : nullptr;
+    }
+
+    void frame(CallInfo *ci, lua_State const *l, TValue const *slots,
+               StkId stack, int size, int top, bool current)
+    {
+        if (!m_write && (!within(ci->func, stack, top, false)
+                          || !within(ci->top, stack, size, true)))
+            return fail();
+
+        // A suspended coroutine saved its function for resuming
+        if (current && l->status == LUA_YIELD)
+            offset(ci->extra, size);
+
+        if (isLua(ci))
+        {
+            if (!m_write)
+            {
+                // The saved instruction belongs to the running function
+                TValue const *func = &slots[ci->func - stack];
+                auto *cl = rttype(func) == ctb(LUA_TLCL) ? at((LClosure const *)func->value_.gc) : nullptr;
+                auto *p = cl ? at(cl->p) : nullptr;
+                if (!p || ci->u.l.base <= ci->func || !within(ci->u.l.base, stack, size, true)
+                       || !within(ci->u.l.savedpc, p->code, size_t(std::max(p->sizecode, 0)), true))
+                    return fail();
+            }
+            move(ci->u.l.base);
+            move(ci->u.l.savedpc);
+        }
+        else
+        {
+            if (ci->callstatus & CIST_YPCALL)
+            {
+                offset(ci->extra, size);
+                offset(ci->u.c.old_errfunc, size);
+            }
+            native(ci->u.c.k);
+        }
+
+        move(ci->func);
+        move(ci->top);
+    }
+
+    void global()
+    {
+        auto *old = (global_State *)m_g;
+        auto *g = local(old);
+        own(old, sizeof(global_State));
+
+        if (!m_write && (g->gcstate > GCSpause || g->gckind > KGC_GEN
+                          || g->sweepstrgc < 0 || g->sweepstrgc > g->strt.size
+                          || uintptr_t(g->mainthread) != m_main))
+            fail();
+
+        // The string table and the buffer
+        own(g->strt.hash, g->strt.size * sizeof(GCObject *));
+        for (int i = 0; i < g->strt.size; ++i)
+            any(*local(&g->strt.hash[i]));
+        move(g->strt.hash);
+
+        if (!m_write && !array(g->buff.buffer, g->buff.buffsize))
+            return fail();
+        own(g->buff.buffer, g->buff.buffsize);
+        move(g->buff.buffer);
+
+        // Lists, which the sweep phase walks through pointers to their links
+        for (GCObject **list : { &g->allgc, &g->finobj, &g->tobefnz, &g->gray,
+                                 &g->grayagain, &g->weak, &g->ephemeron, &g->allweak })
+            any(*list);
+        sweep_link(g->sweepgc);
+        sweep_link(g->sweepfin);
+
+        if (!m_write && rttype(&g->l_registry) != ctb(LUA_TTABLE))
+            fail();
+        value(&g->l_registry);
+        ref(g->mainthread, LUA_TTHREAD, false);
+        upvalue_link(g->uvhead.u.l.prev);
+        upvalue_link(g->uvhead.u.l.next);
+        string(g->memerrmsg, false);
+        for (auto &name : g->tmname)
+            string(name, false);
+        for (auto &mt : g->mt)
+            ref(mt, LUA_TTABLE);
+
+        // Native pointers that the VM sets again, see attach_lua()
+        if (m_write)
+        {
+            g->frealloc = nullptr;
+            g->ud = nullptr;
+            g->panic = nullptr;
+            g->version = lua_version(nullptr);
+        }
+    }
+
+    void sweep_link(GCObject **&p)
+    {
+        if (!m_write && p && uintptr_t(p) != m_g + offsetof(global_State, allgc)
+                          && uintptr_t(p) != m_g + offsetof(global_State, finobj)
+                          && !find(p))
+            fail();
+        move(p);
+    }
+
+    bool check_extents()
+    {
+        auto extents = heap::reserved(m_data);
+        extents.insert(extents.end(), m_extents.begin(), m_extents.end());
+        std::sort(extents.begin(), extents.end());
+
+        size_t end = 0;
+        for (auto const &e : extents)
+        {
+            if (e.first < end || e.first > m_size || e.second > m_size - e.first)
+                return m_ok = false;
+            end = e.first + e.second;
+        }
+        return true;
+    }
+
+    vm const &m_owner;
+    uint8_t *m_data;
+    size_t m_size, m_capacity;
+    uintptr_t m_from, m_to, m_main = 0, m_g = 0;
+    natives m_mode;
+    bool m_ok = true, m_write = false;
+
+    std::vector<object> m_objects;
+    std::vector<heap::extent> m_extents;
+    std::vector<uintptr_t> m_found;
+};
+
+bool vm::relocate(uint8_t *data, size_t size, uintptr_t from, uintptr_t to,
+                  natives mode, uintptr_t threads[2]) const
+{
+    walker w(*this, data, size, from, to, mode);
+    return w.run(threads, 2);
+}
+
+// C functions that a heap can point to are those reachable from the BIOS
+// state, plus the closures and continuations that library functions only
+// create when called, which a probe calls once.
+static char const *native_probe = R"(
+    local co = coroutine.create(function() pcall(coroutine.yield) end)
+    coroutine.resume(co)
+    return co, coroutine.wrap(print), string.gmatch('', ''), ipairs({})
+)";
+
+void vm::collect_natives()
+{
+    int const top = lua_gettop(m_lua);
+    lua_newtable(m_lua);
+    m_dummy_node = uintptr_t(hvalue(m_lua->top - 1)->node);
+    if (luaL_loadstring(m_lua, native_probe) == LUA_OK)
+        lua_pcall(m_lua, 0, LUA_MULTRET, 0);
+
+    uintptr_t threads[] = { uintptr_t(m_lua) };
+    walker w(*this, m_heap.data(), m_heap.size(), uintptr_t(m_heap.data()),
+             uintptr_t(m_heap.data()), natives::collect);
+    if (!w.run(threads, 1))
+        lol::msg::error("cannot walk the Lua heap, snapshots will fail\n");
+    lua_settop(m_lua, top);
+
+    m_natives = w.found();
+    std::sort(m_natives.begin(), m_natives.end());
+    m_natives.erase(std::unique(m_natives.begin(), m_natives.end()), m_natives.end());
+
+    // The build is identified by the layout of the Lua structures and of
+    // the native code, which does not depend on where it was loaded
+    uintptr_t const base = m_natives.empty() ? 0 : m_natives[0];
+    std::vector<uint64_t> layout
+    {
+        sizeof(lua_State), sizeof(global_State), sizeof(CallInfo), sizeof(TValue),
+        sizeof(Table), sizeof(Node), sizeof(TString), sizeof(Udata), sizeof(Proto),
+        sizeof(UpVal), m_dummy_node - base, reinterpret_cast<uintptr_t>(&vm::instruction_hook) - base,
+    };
+    for (uintptr_t p : m_natives)
+        layout.push_back(p - base);
+    m_build = hash64(layout.data(), layout.size() * sizeof(layout[0]));
+}
+
+void vm::attach_lua()
+{
+    // The state also points to this VM, which may be another one
+    lua_setallocf(m_lua, &vm::alloc, this);
+    lua_atpanic(m_lua, &vm::panic_hook);
+    lua_setpico8memory(m_lua, (uint8_t *)&m_ram);
+}
+
+} // namespace z8::pico8
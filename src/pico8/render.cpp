@@ -16,26 +16,166 @@
 
 #include "pico8/vm.h"
 #include "pico8/pico8.h"
+#include "raster.h"
 
-#include <lol/vector> // lol::u8vec4
+#include <lol/vector>  // lol::u8vec4
+#include <algorithm>   // std::min
+#include <type_traits> // std::is_same_v
 
 namespace z8::pico8
 {
 
-void vm::render(lol::u8vec4 *screen) const
+// Convert the screen to pixels of type T. The hardware colour index, in
+// 0…31, of each screen palette entry is converted to T with the FMT
+// function, so that the inner loops never need to do any format conversion.
+template<typename T, typename FMT>
+static void render_screen(memory const &ram, T *screen, FMT fmt)
 {
-    // Cannot use a 256-value LUT because data access will be
-    // very random due to rotation, flip, stretch etc.
-    lol::u8vec4 lut[128 + 16];
+    auto const &ds = ram.draw_state;
+    auto const &raster = ram.hw_state.raster;
+    uint8_t const mode = ds.screen_mode;
+
+    // Hardware colour for a screen palette entry; bit 0x80 selects the
+    // extended palette.
+    auto rgb = [fmt](uint8_t n) { return fmt((n & 0xf) | ((n & 0x80) >> 3)); };
+
+    // Raster modes may change the palette of every source row, so compute
+    // the final colours of each row once instead of once per pixel.
+    bool const alt = raster.mode == 0x10;
+    bool const gradient = !alt && (raster.mode & 0x30) == 0x30;
+    bool const has_raster = alt || gradient;
+
+    T pal[128][16];
+    for (int y = 0; y < (has_raster ? 128 : 1); ++y)
     for (int c = 0; c < 16; ++c)
     {
-        lut[c] = palette::get8(c);
-        lut[128 + c] = palette::get8(16 + c);
+        uint8_t n = ds.screen_palette[c];
+        if (alt && raster.bits[y])
+            n = raster.palette[c];
+        else if (gradient && (raster.mode & 0x0f) == c)
+            n = raster.palette[(y / 8 + (raster.bits[y] ? 1 : 0)) % 16];
+        pal[y][c] = rgb(n);
+    }
+
+    // Resolve the screen mode into source coordinate tables; rotations
+    // with odd mode numbers also swap the two axes.
+    bool const rotated = (mode & 0xbc) == 0x84;
+    bool const transposed = rotated && (mode & 1);
+    int xmap[128], ymap[128];
+    for (int i = 0; i < 128; ++i)
+    {
+        if (rotated)
+        {
+            xmap[i] = mode & 2 ? 127 - i : i;
+            ymap[i] = ((mode + 1) & 2) ? 127 - i : i;
+        }
+        else
+        {
+            xmap[i] = (mode & 0xbd) == 0x05 ? std::min(i, 127 - i) // mirror
+                    : (mode & 0xbd) == 0x01 ? i / 2                // stretch
+                    : (mode & 0xbd) == 0x81 ? 127 - i : i;         // flip
+            ymap[i] = (mode & 0xbe) == 0x06 ? std::min(i, 127 - i) // mirror
+                    : (mode & 0xbe) == 0x02 ? i / 2                // stretch
+                    : (mode & 0xbe) == 0x82 ? 127 - i : i;         // flip
+        }
+    }
+
+    bool const identity = !rotated && xmap[127] == 127 && xmap[0] == 0
+                       && ymap[127] == 127 && ymap[0] == 0;
+
+    if constexpr (std::is_same_v<T, uint8_t>)
+    {
+        // Indexed output is the palette lookup of unpacked rows, which the
+        // raster kernel can do 16 bytes at a time
+        if (identity)
+        {
+            for (int y = 0; y < 128; ++y, screen += 128)
+                raster::unpack(screen, ram.screen.data[y], 64, pal[has_raster ? y : 0]);
+            return;
+        }
     }
 
-    for (int y = 0; y < 128; ++y)
-    for (int x = 0; x < 128; ++x)
-        *screen++ = lut[m_ram.pixel(x, y)];
+    if (identity && !has_raster)
+    {
+        // Common case: convert two pixels at a time using a byte LUT
+        T lut[256][2];
+        for (int n = 0; n < 256; ++n)
+        {
+            lut[n][0] = pal[0][n & 0xf];
+            lut[n][1] = pal[0][n >> 4];
+        }
+
+        for (auto const &row : ram.screen.data)
+            for (uint8_t p : row)
+            {
+                *screen++ = lut[p][0];
+                *screen++ = lut[p][1];
+            }
+    }
+    else if (!transposed)
+    {
+        // Each destination row maps to a single source row
+        for (int y = 0; y < 128; ++y)
+        {
+            int const sy = ymap[y];
+            uint8_t const *src = ram.screen.data[sy];
+            T const *p = pal[has_raster ? sy : 0];
+            for (int x = 0; x < 128; ++x)
+            {
+                int const sx = xmap[x];
+                *screen++ = p[(src[sx / 2] >> (4 * (sx & 1))) & 0xf];
+            }
+        }
+    }
+    else
+    {
+        // Each destination row maps to a single source column
+        for (int y = 0; y < 128; ++y)
+        {
+            int const sx = xmap[y];
+            for (int x = 0; x < 128; ++x)
+            {
+                int const sy = ymap[x];
+                uint8_t const p = ram.screen.data[sy][sx / 2];
+                *screen++ = pal[has_raster ? sy : 0][(p >> (4 * (sx & 1))) & 0xf];
+            }
+        }
+    }
+}
+
+void vm::render(lol::u8vec4 *screen) const
+{
+    render_screen(m_ram, screen, [](uint8_t n) { return palette::get8(n); });
+}
+
+void vm::render_xrgb8888(uint32_t *screen) const
+{
+    render_screen(m_ram, screen, [](uint8_t n)
+    {
+        lol::u8vec4 c = palette::get8(n);
+        return uint32_t(c.r) << 16 | uint32_t(c.g) << 8 | uint32_t(c.b);
+    });
+}
+
+void vm::render_rgb565(uint16_t *screen) const
+{
+    render_screen(m_ram, screen, [](uint8_t n)
+    {
+        lol::u8vec4 c = palette::get8(n);
+        return uint16_t((c.r >> 3) << 11 | (c.g >> 2) << 5 | (c.b >> 3));
+    });
+}
+
+// Indices are hardware colours, so the palette is the same for every frame
+int vm::render_indexed(uint8_t *screen, uint32_t *rgb) const
+{
+    render_screen(m_ram, screen, [](uint8_t n) { return n; });
+    for (int n = 0; n < 32; ++n)
+    {
+        lol::u8vec4 c = palette::get8(n);
+        rgb[n] = uint32_t(c.r) << 16 | uint32_t(c.g) << 8 | uint32_t(c.b);
+    }
+    return 32;
 }
 
 int vm::get_ansi_color(uint8_t c) const
@@ -16,9 +16,11 @@
 
 #include <lol/math>  // lol::clamp, lol::mix
 #include <lol/utils> // lol::format
-#include <algorithm> // std::max
+#include <algorithm> // std::max, std::fill
 #include <cmath>     // std::fabs, std::fmod, std::floor
 #include <cassert>   // assert
+#include <cfloat>    // FLT_MAX
+#include <numeric>   // std::gcd
 
 #include "pico8/vm.h"
 #include "synth.h"
@@ -67,6 +69,12 @@ uint8_t song_t::sfx(int n) const
 std::map<int, FILE *> exports;
 #endif
 
+// Maximum number of samples rendered at once
+static int const max_run = 256;
+
+// All synthesis happens at this rate
+static int const native_rate = 22050;
+
 std::function<void(void *, int)> vm::get_streamer(int ch)
 {
     using namespace std::placeholders;
@@ -74,136 +82,204 @@ std::function<void(void *, int)> vm::get_streamer(int ch)
     return std::bind(&vm::getaudio, this, ch, _1, _2);
 }
 
-// FIXME: there is a problem with the per-channel approach; if a channel
-// advances the music, then all the other channels will reference the
-// new music chunk. Be careful when implementing music.
-void vm::getaudio(int chan, void *in_buffer, int in_bytes)
+// Advance music by one sample, and handle fade out and pattern changes
+void vm::update_music()
 {
-    using std::fabs, std::fmod, std::floor, std::max;
-
     int const samples_per_second = 22050;
-    int const bytes_per_sample = 2; // mono S16 for now
 
-    int16_t *buffer = (int16_t *)in_buffer;
-    int const samples = in_bytes / bytes_per_sample;
+    float const offset_per_second = 22050.f / (183.f * m_state.music.speed);
+    float const offset_per_sample = offset_per_second / samples_per_second;
+    m_state.music.offset += offset_per_sample;
+    m_state.music.volume += m_state.music.volume_step / samples_per_second;
+    m_state.music.volume = lol::clamp(m_state.music.volume, 0.f, 1.f);
 
-    for (int i = 0; i < samples; ++i)
+    if (m_state.music.volume_step < 0 && m_state.music.volume <= 0)
     {
-        // Advance music using the master channel
-        if (chan == m_state.music.master && m_state.music.pattern != -1)
+        // Fade out is finished, stop playing the current song
+        for (int n = 0; n < 4; ++n)
+            if (m_state.channels[n].is_music)
+                m_state.channels[n].sfx = -1;
+        m_state.music.pattern = -1;
+    }
+    else if (m_state.music.offset >= 32.f)
+    {
+        int16_t next_pattern = m_state.music.pattern + 1;
+        int16_t next_count = m_state.music.count + 1;
+        if (m_ram.song[m_state.music.pattern].stop)
         {
-            float const offset_per_second = 22050.f / (183.f * m_state.music.speed);
-            float const offset_per_sample = offset_per_second / samples_per_second;
-            m_state.music.offset += offset_per_sample;
-            m_state.music.volume += m_state.music.volume_step / samples_per_second;
-            m_state.music.volume = lol::clamp(m_state.music.volume, 0.f, 1.f);
+            next_pattern = -1;
+            next_count = m_state.music.count;
+        }
+        else if (m_ram.song[m_state.music.pattern].loop)
+            while (--next_pattern > 0 && !m_ram.song[next_pattern].start)
+                ;
 
-            if (m_state.music.volume_step < 0 && m_state.music.volume <= 0)
-            {
-                // Fade out is finished, stop playing the current song
-                for (int n = 0; n < 4; ++n)
-                    if (m_state.channels[n].is_music)
-                        m_state.channels[n].sfx = -1;
-                m_state.music.pattern = -1;
-            }
-            else if (m_state.music.offset >= 32.f)
-            {
-                int16_t next_pattern = m_state.music.pattern + 1;
-                int16_t next_count = m_state.music.count + 1;
-                if (m_ram.song[m_state.music.pattern].stop)
-                {
-                    next_pattern = -1;
-                    next_count = m_state.music.count;
-                }
-                else if (m_ram.song[m_state.music.pattern].loop)
-                    while (--next_pattern > 0 && !m_ram.song[next_pattern].start)
-                        ;
+        m_state.music.count = next_count;
+        set_music_pattern(next_pattern);
+    }
+}
 
-                m_state.music.count = next_count;
-                set_music_pattern(next_pattern);
-            }
-        }
+// Compute the music offset and volume for at most count samples, starting
+// with the current sample, for which update_music() was already called.
+// Stops before any sample that would cause a music event, and returns the
+// number of samples computed. The music state itself is not modified.
+int vm::music_run(int count, float *offset, float *volume) const
+{
+    int const samples_per_second = 22050;
 
-        if (m_state.channels[chan].sfx == -1)
+    auto const &music = m_state.music;
+
+    offset[0] = music.offset;
+    volume[0] = music.volume;
+
+    if (music.master == -1 || music.pattern == -1)
+    {
+        for (int i = 1; i < count; ++i)
         {
-            buffer[i] = 0;
-            continue;
+            offset[i] = music.offset;
+            volume[i] = music.volume;
         }
+        return count;
+    }
 
-        int const index = m_state.channels[chan].sfx;
+    float const offset_per_second = 22050.f / (183.f * music.speed);
+    float const offset_per_sample = offset_per_second / samples_per_second;
+    float const volume_per_sample = music.volume_step / samples_per_second;
+    for (int i = 1; i < count; ++i)
+    {
+        offset[i] = offset[i - 1] + offset_per_sample;
+        volume[i] = lol::clamp(volume[i - 1] + volume_per_sample, 0.f, 1.f);
+        if ((music.volume_step < 0 && volume[i] <= 0) || offset[i] >= 32.f)
+            return i;
+    }
+
+    return count;
+}
+
+// Render at most count samples of a channel, stopping after the last
+// sample of the current note. The music volume for each sample is given
+// in music_volume. Returns the number of samples rendered. If buffer is
+// null, the channel state advances but no waveform is synthesised.
+int vm::getaudio_run(int chan, int16_t *buffer, int count, float const *music_volume)
+{
+    using std::fabs, std::fmod, std::floor, std::max, std::min;
+
+    int const samples_per_second = 22050;
+
+    auto &ch = m_state.channels[chan];
+
+    count = min(count, max_run);
+
+    int n = count;
+
+    if (ch.sfx == -1)
+    {
+        if (buffer)
+            std::fill(buffer, buffer + n, 0);
+    }
+    else
+    {
+        int const index = ch.sfx;
         assert(index >= 0 && index < 64);
         sfx_t const &sfx = m_ram.sfx[index];
 
         // Speed must be 1—255 otherwise the SFX is invalid
         int const speed = max(1, (int)sfx.speed);
 
-        float const offset = m_state.channels[chan].offset;
-        float const phi = m_state.channels[chan].phi;
-
         // PICO-8 exports instruments as 22050 Hz WAV files with 183 samples
         // per speed unit per note, so this is how much we should advance
         float const offset_per_second = 22050.f / (183.f * speed);
         float const offset_per_sample = offset_per_second / samples_per_second;
-        float next_offset = offset + offset_per_sample;
 
         // Handle SFX loops. From the documentation: “Looping is turned
         // off when the start index >= end index”.
         float const loop_range = float(sfx.loop_end - sfx.loop_start);
-        if (loop_range > 0.f && next_offset >= sfx.loop_end
-             && m_state.channels[chan].can_loop)
+        bool const can_loop = loop_range > 0.f && ch.can_loop;
+
+        // Compute sample offsets until the note changes, the SFX loops,
+        // or the SFX ends.
+        float offset[max_run];
+        float next_offset = ch.offset;
+        int const note_id = (int)floor(ch.offset);
+        for (n = 0; n < count; )
         {
-            next_offset = fmod(next_offset - sfx.loop_start, loop_range)
-                        + sfx.loop_start;
-        }
+            offset[n++] = next_offset;
+            next_offset += offset_per_sample;
+
+            bool const wrap = can_loop && next_offset >= sfx.loop_end;
+            if (wrap)
+                next_offset = fmod(next_offset - sfx.loop_start, loop_range)
+                            + sfx.loop_start;
 
-        int const note_id = (int)floor(offset);
-        int const next_note_id = (int)floor(next_offset);
+            if (wrap || next_offset >= 32.f || (int)floor(next_offset) != note_id)
+                break;
+        }
 
-        uint8_t key = sfx.notes[note_id].key;
-        float volume = sfx.notes[note_id].volume / 7.f;
-        float freq = key_to_freq(key);
+        auto const &note = sfx.notes[note_id];
+        float const base_volume = note.volume / 7.f;
 
-        if (volume == 0.f)
+        if (base_volume == 0.f)
         {
             // Play silence
-            buffer[i] = 0;
+            if (buffer)
+                std::fill(buffer, buffer + n, 0);
         }
         else
         {
-            int const fx = sfx.notes[note_id].effect;
+            float const base_freq = key_to_freq(note.key);
+            float freq[max_run], volume[max_run];
 
-            // Apply effect, if any
+            // Apply effect, if any. Offsets are all within the current
+            // note, so fmod(offset, 1.f) is the same as offset - note_id.
+            int const fx = note.effect;
             switch (fx)
             {
-                case FX_NO_EFFECT:
-                    break;
                 case FX_SLIDE:
                 {
-                    float t = fmod(offset, 1.f);
                     // From the documentation: “Slide to the next note and volume”,
                     // but it’s actually _from_ the _prev_ note and volume.
-                    freq = lol::mix(key_to_freq(m_state.channels[chan].prev_key), freq, t);
-                    if (m_state.channels[chan].prev_vol > 0.f)
-                        volume = lol::mix(m_state.channels[chan].prev_vol, volume, t);
+                    float const prev_freq = key_to_freq(ch.prev_key);
+                    float const prev_vol = ch.prev_vol;
+                    for (int i = 0; i < n; ++i)
+                    {
+                        float t = offset[i] - note_id;
+                        freq[i] = lol::mix(prev_freq, base_freq, t);
+                        volume[i] = prev_vol > 0.f ? lol::mix(prev_vol, base_volume, t)
+                                                   : base_volume;
+                    }
                     break;
                 }
                 case FX_VIBRATO:
-                {
-                    // 7.5f and 0.25f were found empirically by matching
-                    // frequency graphs of PICO-8 instruments.
-                    float t = fabs(fmod(7.5f * offset / offset_per_second, 1.0f) - 0.5f) - 0.25f;
-                    // Vibrato half a semi-tone, so multiply by pow(2,1/12)
-                    freq = lol::mix(freq, freq * 1.059463094359f, t);
+                    for (int i = 0; i < n; ++i)
+                    {
+                        // 7.5f and 0.25f were found empirically by matching
+                        // frequency graphs of PICO-8 instruments.
+                        float t = fabs(fmod(7.5f * offset[i] / offset_per_second, 1.0f) - 0.5f) - 0.25f;
+                        // Vibrato half a semi-tone, so multiply by pow(2,1/12)
+                        freq[i] = lol::mix(base_freq, base_freq * 1.059463094359f, t);
+                        volume[i] = base_volume;
+                    }
                     break;
-                }
                 case FX_DROP:
-                    freq *= 1.f - fmod(offset, 1.f);
+                    for (int i = 0; i < n; ++i)
+                    {
+                        freq[i] = base_freq * (1.f - (offset[i] - note_id));
+                        volume[i] = base_volume;
+                    }
                     break;
                 case FX_FADE_IN:
-                    volume *= fmod(offset, 1.f);
+                    for (int i = 0; i < n; ++i)
+                    {
+                        freq[i] = base_freq;
+                        volume[i] = base_volume * (offset[i] - note_id);
+                    }
                     break;
                 case FX_FADE_OUT:
-                    volume *= 1.f - fmod(offset, 1.f);
+                    for (int i = 0; i < n; ++i)
+                    {
+                        freq[i] = base_freq;
+                        volume[i] = base_volume * (1.f - (offset[i] - note_id));
+                    }
                     break;
                 case FX_ARP_FAST:
                 case FX_ARP_SLOW:
@@ -213,45 +289,110 @@ void vm::getaudio(int chan, void *in_buffer, int in_bytes)
                     //  7 arpeggio slow  //  Iterate over groups of 4 notes at speed of 8”
                     // “If the SFX speed is <= 8, arpeggio speeds are halved to 2, 4”
                     int const m = (speed <= 8 ? 32 : 16) / (fx == FX_ARP_FAST ? 4 : 8);
-                    int const n = (int)(m * 7.5f * offset / offset_per_second);
-                    int const arp_note = (note_id & ~3) | (n & 3);
-                    freq = key_to_freq(sfx.notes[arp_note].key);
+                    float arp_freq[4];
+                    for (int k = 0; k < 4; ++k)
+                        arp_freq[k] = key_to_freq(sfx.notes[(note_id & ~3) | k].key);
+                    for (int i = 0; i < n; ++i)
+                    {
+                        int const k = (int)(m * 7.5f * offset[i] / offset_per_second);
+                        freq[i] = arp_freq[k & 3];
+                        volume[i] = base_volume;
+                    }
                     break;
                 }
+                default:
+                    for (int i = 0; i < n; ++i)
+                    {
+                        freq[i] = base_freq;
+                        volume[i] = base_volume;
+                    }
+                    break;
             }
 
-            // Play note
-            float waveform = synth::waveform(sfx.notes[note_id].instrument, phi);
-
             // Apply master music volume from fade in/out
             // FIXME: check whether this should be done after distortion
-            if (m_state.channels[chan].is_music)
-                volume *= m_state.music.volume;
+            if (ch.is_music)
+                for (int i = 0; i < n; ++i)
+                    volume[i] *= music_volume[i];
 
-            int16_t sample = (int16_t)(32767.99f * volume * waveform);
+            // Play note
+            float phi[max_run + 1], waveform[max_run];
+            phi[0] = ch.phi;
+            for (int i = 0; i < n; ++i)
+                phi[i + 1] = phi[i] + freq[i] / samples_per_second;
+            ch.phi = phi[n];
 
-            // Apply hardware effects
-            if (m_ram.hw_state.distort & (1 << chan))
+            if (buffer)
             {
-                sample = sample / 0x1000 * 0x1249;
-            }
+                synth::waveform(note.instrument, phi, waveform, n);
 
-            buffer[i] = sample;
+                for (int i = 0; i < n; ++i)
+                    buffer[i] = (int16_t)(32767.99f * volume[i] * waveform[i]);
 
-            m_state.channels[chan].phi = phi + freq / samples_per_second;
+                // Apply hardware effects
+                if (m_ram.hw_state.distort & (1 << chan))
+                    for (int i = 0; i < n; ++i)
+                        buffer[i] = buffer[i] / 0x1000 * 0x1249;
+            }
         }
 
-        m_state.channels[chan].offset = next_offset;
+        ch.offset = next_offset;
 
         if (next_offset >= 32.f)
         {
-            m_state.channels[chan].sfx = -1;
+            ch.sfx = -1;
+        }
+        else if ((int)floor(next_offset) != note_id)
+        {
+            ch.prev_key = note.key;
+            ch.prev_vol = base_volume;
         }
-        else if (next_note_id != note_id)
+
+        if (m_profiler.enabled)
+            m_profiler.samples += n;
+    }
+
+    return n;
+}
+
+// FIXME: there is a problem with the per-channel approach; if a channel
+// advances the music, then all the other channels will reference the
+// new music chunk. Be careful when implementing music. The get_audio()
+// mixer does not have this problem.
+void vm::getaudio(int chan, void *in_buffer, int in_bytes)
+{
+    int const bytes_per_sample = 2; // mono S16 for now
+
+    int16_t *buffer = (int16_t *)in_buffer;
+    int const samples = in_bytes / bytes_per_sample;
+
+    // Render runs of samples that share the same note and music state
+    for (int i = 0; i < samples; )
+    {
+        auto &music = m_state.music;
+
+        // Advance music using the master channel
+        if (chan == music.master && music.pattern != -1)
+            update_music();
+
+        // Only the master channel sees the music state change during a run
+        int n = std::min(samples - i, max_run);
+        float offset[max_run], volume[max_run];
+        bool const master = chan == music.master && music.pattern != -1;
+        if (master)
+            n = music_run(n, offset, volume);
+        else
+            std::fill(volume, volume + n, music.volume);
+
+        n = getaudio_run(chan, buffer + i, n, volume);
+
+        if (master)
         {
-            m_state.channels[chan].prev_key = sfx.notes[note_id].key;
-            m_state.channels[chan].prev_vol = sfx.notes[note_id].volume / 7.f;
+            music.offset = offset[n - 1];
+            music.volume = volume[n - 1];
         }
+
+        i += n;
     }
 
 #if DEBUG_EXPORT_WAV
@@ -271,6 +412,119 @@ void vm::getaudio(int chan, void *in_buffer, int in_bytes)
 #endif
 }
 
+void vm::mix_audio(int16_t *buffer, int frames, bool stereo)
+{
+    using std::min;
+
+    auto &music = m_state.music;
+
+    // All channels are rendered in lockstep, so that music events happen
+    // at the same time for each of them.
+    for (int i = 0; i < frames; )
+    {
+        if (music.master != -1 && music.pattern != -1)
+            update_music();
+
+        bool const playing = music.master != -1 && music.pattern != -1;
+        int n = min(frames - i, max_run);
+        float offset[max_run], volume[max_run];
+        n = music_run(n, offset, volume);
+
+        int32_t mix[max_run] = { 0 };
+        for (int chan = 0; chan < 4; ++chan)
+        {
+            int16_t tmp[max_run];
+            for (int j = 0; j < n; )
+                j += getaudio_run(chan, buffer ? tmp + j : nullptr, n - j, volume + j);
+            if (buffer)
+                for (int j = 0; j < n; ++j)
+                    mix[j] += tmp[j];
+        }
+
+        if (playing)
+        {
+            music.offset = offset[n - 1];
+            music.volume = volume[n - 1];
+        }
+
+        for (int j = 0; buffer && j < n; ++j)
+        {
+            int16_t sample = (int16_t)lol::clamp(mix[j], -32768, 32767);
+            *buffer++ = sample;
+            if (stereo)
+                *buffer++ = sample;
+        }
+
+        i += n;
+    }
+}
+
+void vm::set_audio_rate(int rate)
+{
+    auto &rs = m_resampler;
+    rs.rate = lol::clamp(rate, 8000, 192000);
+    int const g = std::gcd(rs.rate, native_rate);
+    rs.step = native_rate / g;
+    rs.den = rs.rate / g;
+    rs.phase = 0;
+}
+
+void vm::get_audio(int16_t *buffer, int frames, bool stereo)
+{
+    auto &rs = m_resampler;
+
+    // Synthesis always happens at the native rate
+    if (rs.rate == native_rate)
+        return mix_audio(buffer, frames, stereo);
+
+    if (frames <= 0)
+        return;
+
+    // Render exactly the number of native samples that the output frames
+    // span, so that nothing is buffered ahead of the VM state, then
+    // interpolate linearly between consecutive native samples.
+    int const count = int((rs.phase + int64_t(frames - 1) * rs.step) / rs.den);
+
+    if (!buffer)
+    {
+        // Advance as the loop below would, but only synthesise the last
+        // two native samples, which the next frames interpolate from
+        int16_t last[2];
+        int const tail = std::min(count, 2);
+        mix_audio(nullptr, count - tail, false);
+        mix_audio(last, tail, false);
+
+        if (tail == 2)
+            rs.prev = last[0];
+        else if (tail == 1)
+            rs.prev = rs.next;
+        if (tail >= 1)
+            rs.next = last[tail - 1];
+        rs.phase = int(rs.phase + int64_t(frames) * rs.step - int64_t(count) * rs.den);
+        return;
+    }
+
+    rs.buffer.resize(std::max(count, 1));
+    mix_audio(rs.buffer.data(), count, false);
+
+    int16_t const *src = rs.buffer.data();
+    for (int i = 0; i < frames; ++i)
+    {
+        for ( ; rs.phase >= rs.den; rs.phase -= rs.den)
+        {
+            rs.prev = rs.next;
+            rs.next = *src++;
+        }
+
+        int16_t sample = int16_t(rs.prev + int64_t(rs.next - rs.prev) * rs.phase / rs.den);
+        *buffer++ = sample;
+        if (stereo)
+            *buffer++ = sample;
+
+        rs.phase += rs.step;
+    }
+}
+
 //
 // Sound
 //
@@ -0,0 +1,332 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <string>      // std::string
+#include <string_view> // std::string_view
+#include <vector>      // std::vector
+#include <cstring>     // memcmp()
+
+#include "zepto8.h"
+#include "pico8/pico8.h"
+#include "pico8/tokens.h"
+
+namespace z8::pico8
+{
+
+// The rules are the same as in parser.cpp: every token costs 1, except
+// “,” “;” “.” “:” “::” “end” “local” and closing brackets, which are free,
+// and “-” or “~” in front of a number, which count as part of the number.
+
+static inline bool is_space(uint8_t c)
+{
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static inline bool is_digit(uint8_t c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static inline bool is_xdigit(uint8_t c)
+{
+    return is_digit(c) || ((c | 0x20) >= 'a' && (c | 0x20) <= 'f');
+}
+
+// PICO-8 also allows characters 0x10–0x1f and 0x7f–0xff in names
+static inline bool is_name_first(uint8_t c)
+{
+    return ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') || c == '_'
+            || (c >= 0x10 && c <= 0x1f) || c >= 0x7f;
+}
+
+static inline bool is_name(uint8_t c)
+{
+    return is_name_first(c) || is_digit(c);
+}
+
+// Multi-character operators, longest first so that “<<>=” is not split
+static std::string_view const operators[] =
+{
+    ">>>=", ">><=", "<<>=",
+    "...", "..=", "^^=", ">>>", ">><", "<<>", "<<=", ">>=",
+    "..", "==", "~=", "!=", "<=", ">=", "<<", ">>", "^^", "::",
+    "+=", "-=", "*=", "/=", "\\=", "%=", "^=", "&=", "|=",
+};
+
+// Call emit() for every token. In a long comment or a long string that ends
+// after the code, st is left in that state and lexing resumes from there.
+template<typename F>
+static void lex(std::string_view code, lex_state &st, F emit)
+{
+    auto p = (uint8_t const *)code.data(), end = p + code.length();
+    bool newline = false;
+
+    auto push = [&](token::type kind, bool cost, uint8_t const *start)
+    {
+        emit(token { kind, cost, newline, std::string_view((char const *)start, size_t(p - start)) });
+        newline = false;
+    };
+
+    while (p < end)
+    {
+        // Inside a long comment, which may be nested
+        if (st.mode == 1)
+        {
+            for (; p < end && st.mode == 1; ++p)
+            {
+                newline |= *p == '\n';
+                if (p + 1 < end && p[0] == '[' && p[1] == '[')
+                    ++st.depth, ++p;
+                else if (p + 1 < end && p[0] == ']' && p[1] == ']')
+                    st.mode = --st.depth ? 1 : 0, ++p;
+            }
+            continue;
+        }
+
+        // Inside a long string, which ends with the first matching bracket
+        if (st.mode == 2)
+        {
+            for (; p < end && st.mode == 2; ++p)
+            {
+                if (*p != ']')
+                    continue;
+                auto q = p + 1;
+                while (q < end && *q == '=')
+                    ++q;
+                if (q < end && *q == ']' && q - p - 1 == st.depth)
+                    st.mode = 0, p = q;
+            }
+            continue;
+        }
+
+        uint8_t const c = *p;
+        size_t const left = size_t(end - p);
+        auto const start = p;
+
+        if (is_space(c))
+        {
+            newline |= c == '\n';
+            ++p;
+            continue;
+        }
+
+        // Comments: “--”, “--[[ ]]” and “//”
+        if (left >= 2 && ((c == '-' && p[1] == '-') || (c == '/' && p[1] == '/')))
+        {
+            if (c == '-' && left >= 4 && p[2] == '[' && p[3] == '[')
+            {
+                st.mode = 1;
+                st.depth = 1;
+                p += 4;
+                continue;
+            }
+            while (p < end && *p != '\n')
+                ++p;
+            continue;
+        }
+
+        // Names and keywords
+        if (is_name_first(c))
+        {
+            while (p < end && is_name(*p))
+                ++p;
+            std::string_view word((char const *)start, size_t(p - start));
+
+            bool const keyword = word.length() <= 8 && api::keywords.count(std::string(word));
+            st.value = !keyword || word == "true" || word == "false" || word == "nil";
+            push(keyword ? token::type::keyword : token::type::name,
+                 word != "end" && word != "local", start);
+            continue;
+        }
+
+        // A “-” or “~” directly in front of a number is free, unless it is
+        // a binary operator
+        bool const at_number = is_digit(c) || (c == '.' && left >= 2 && is_digit(p[1]));
+        if ((c == '-' || c == '~') && !st.value && left >= 2
+             && (is_digit(p[1]) || (p[1] == '.' && left >= 3 && is_digit(p[2]))))
+        {
+            ++p;
+            push(token::type::op, false, start);
+            continue;
+        }
+
+        // Numbers, following the grammar: hexadecimal and binary numbers
+        // have no exponent, and there is at most one decimal point
+        if (at_number)
+        {
+            bool (*digit)(uint8_t) = is_digit;
+            if (c == '0' && left >= 2 && (p[1] | 0x20) == 'x')
+                digit = is_xdigit, p += 2;
+            else if (c == '0' && left >= 2 && (p[1] | 0x20) == 'b')
+                digit = [](uint8_t ch) { return ch == '0' || ch == '1'; }, p += 2;
+
+            while (p < end && digit(*p))
+                ++p;
+            if (p < end && *p == '.' && !(p + 1 < end && p[1] == '.'))
+                for (++p; p < end && digit(*p); )
+                    ++p;
+
+            if (digit == is_digit && p < end && (*p | 0x20) == 'e')
+            {
+                auto q = p + 1;
+                if (q < end && (*q == '+' || *q == '-'))
+                    ++q;
+                if (q < end && is_digit(*q))
+                    for (p = q; p < end && is_digit(*p); )
+                        ++p;
+            }
+
+            st.value = true;
+            push(token::type::number, true, start);
+            continue;
+        }
+
+        // Short strings, where escape sequences may hide quotes and line breaks
+        if (c == '"' || c == '\'')
+        {
+            for (++p; p < end && *p != c && *p != '\n'; ++p)
+            {
+                if (*p != '\\' || ++p == end)
+                    continue;
+                if (*p == 'z')
+                    while (p + 1 < end && is_space(p[1]))
+                        ++p;
+            }
+            p += p < end && *p == c;
+            st.value = true;
+            push(token::type::string, true, start);
+            continue;
+        }
+
+        // Long strings: “[[”, “[=[” etc.
+        if (c == '[')
+        {
+            auto q = p + 1;
+            while (q < end && *q == '=')
+                ++q;
+            if (q < end && *q == '[')
+            {
+                st.mode = 2;
+                st.depth = uint8_t(q - p - 1);
+                st.value = true;
+                for (p = q + 1; p < end && st.mode == 2; ++p)
+                {
+                    if (*p != ']')
+                        continue;
+                    q = p + 1;
+                    while (q < end && *q == '=')
+                        ++q;
+                    if (q < end && *q == ']' && q - p - 1 == st.depth)
+                        st.mode = 0, p = q;
+                }
+                push(token::type::string, true, start);
+                continue;
+            }
+        }
+
+        // Punctuation and operators
+        std::string_view op((char const *)p, 1);
+        for (auto const &s : operators)
+            if (s.length() <= left && !memcmp(p, s.data(), s.length()))
+            {
+                op = s;
+                break;
+            }
+        p += op.length();
+
+        if (c < 0x10)
+            continue; // not part of the language, ignore it
+
+        bool const is_free = op == ")" || op == "]" || op == "}" || op == ","
+                           || op == ";" || op == "." || op == ":" || op == "::";
+        st.value = op == ")" || op == "]" || op == "}" || op == "...";
+        push(token::type::op, !is_free, start);
+    }
+}
+
+int lex_tokens(std::string_view code, lex_state &st)
+{
+    int tokens = 0;
+    lex(code, st, [&](token const &t) { tokens += t.cost; });
+    return tokens;
+}
+
+std::vector<token> lex(std::string_view code)
+{
+    std::vector<token> ret;
+    lex_state st;
+    lex(code, st, [&](token const &t) { ret.push_back(t); });
+    return ret;
+}
+
+int code::count_tokens(std::string_view s)
+{
+    lex_state st;
+    return lex_tokens(s, st);
+}
+
+int token_cache::count(std::string_view code)
+{
+    m_next.clear();
+
+    lex_state st;
+    int tokens = 0;
+
+    for (size_t start = 0; start < code.length(); )
+    {
+        // Cut just before the next line that does not start with a space
+        size_t stop = start;
+        for (;;)
+        {
+            stop = code.find('\n', stop);
+            if (stop == std::string_view::npos)
+            {
+                stop = code.length();
+                break;
+            }
+            if (++stop == code.length() || !is_space(code[stop]))
+                break;
+        }
+
+        auto const text = code.substr(start, stop - start);
+        uint64_t const key = hash64(text.data(), text.length(), st.pack());
+
+        auto it = m_next.find(key);
+        if (it == m_next.end())
+        {
+            auto old = m_chunks.find(key);
+            if (old != m_chunks.end())
+                it = m_next.insert(*old).first;
+            else
+            {
+                chunk c;
+                c.exit = st;
+                c.tokens = lex_tokens(text, c.exit);
+                it = m_next.emplace(key, c).first;
+            }
+        }
+
+        tokens += it->second.tokens;
+        st = it->second.exit;
+        start = stop;
+    }
+
+    std::swap(m_chunks, m_next);
+    return tokens;
+}
+
+} // namespace z8::pico8
+
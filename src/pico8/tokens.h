@@ -0,0 +1,86 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <string_view>   // std::string_view
+#include <unordered_map> // std::unordered_map
+#include <vector>        // std::vector
+#include <cstdint>       // uint8_t, uint64_t
+
+// The token_cache class
+// —————————————————————
+// Counts the tokens of code that changes a little between calls, such as
+// the contents of an editor. The code is split into chunks at every line
+// that starts in the first column, which is usually a top-level statement,
+// and the token count of each chunk is remembered by a hash of its text.
+// After an edit only the modified chunks are lexed again.
+//
+// Counting uses the same lexer as code::count_tokens(), so that the syntax
+// is not checked.
+
+namespace z8::pico8
+{
+
+// Where the lexer stands at the end of a chunk, since a chunk may end
+// inside a long comment or a long string
+struct lex_state
+{
+    uint8_t mode = 0;   // 0: code, 1: long comment, 2: long string
+    uint8_t depth = 0;  // nesting of long comments, level of long strings
+    bool value = false; // the last token ends a value, so “-” is binary
+
+    uint64_t pack() const { return mode | depth << 8 | (value ? 0x10000 : 0); }
+};
+
+struct token
+{
+    enum class type : uint8_t { name, keyword, number, string, op };
+
+    type kind;
+    bool cost;    // counts towards the token limit
+    bool newline; // there is a line break between this token and the previous one
+    std::string_view text;
+};
+
+// Lex code, starting in state st and leaving st in the final state;
+// return the number of tokens
+int lex_tokens(std::string_view code, lex_state &st);
+
+// Split code into tokens, leaving out spaces and comments; the tokens
+// point into the code
+std::vector<token> lex(std::string_view code);
+
+class token_cache
+{
+public:
+    int count(std::string_view code);
+
+    void clear()
+    {
+        m_chunks.clear();
+    }
+
+private:
+    struct chunk
+    {
+        int tokens;
+        lex_state exit;
+    };
+
+    // Chunks seen during the last call, keyed by a hash of their text and
+    // lexer state; older ones are dropped so that memory use stays bounded
+    std::unordered_map<uint64_t, chunk> m_chunks, m_next;
+};
+
+} // namespace z8::pico8
+
@@ -14,11 +14,11 @@
 #   include "config.h"
 #endif
 
-#include <lol/engine.h> // lol::net
+#include <lol/engine.h> // lol::timer, lol::format
 #include <lol/msg>      // lol::msg
-#include <lol/file>     // lol::file
 
 #include <algorithm>  // std::min
+#include <unordered_map>
 #include <filesystem>
 #include <chrono>
 #include <ctime>
@@ -26,11 +26,14 @@
 
 #include "pico8/pico8.h"
 #include "pico8/vm.h"
+#include "pico8/cache.h"
+#include "pico8/bbs.h"
+#include "pico8/cartdata.h"
+#include "gif.h"
+#include "tracker.h"
 #include "bindings/lua.h"
 #include "bios.h"
-
-// FIXME: activate this one day, when we use Lua 5.3 maybe?
-#define HAVE_LUA_GETEXTRASPACE 0
+#include "startup.h"
 
 // Binding specialisations specific to PICO-8
 template<> void z8::bindings::lua_get(lua_State *l, int n,
@@ -67,29 +70,54 @@ template<> void z8::bindings::lua_get(lua_State *l, int n,
 namespace z8::pico8
 {
 
+// Collector pause in percent of the live heap, growth in percent that
+// starts a cycle between frames, and work in KiB per increment and at
+// most per frame
+static int const gc_pause = 400;
+static int const gc_idle_pause = 150;
+static int const gc_step_kb = 16;
+static int const gc_frame_kb = 128;
+
 vm::vm()
 {
-    m_bios = std::make_unique<bios>();
+    m_bios = bios::get();
+    startup::mark("bios");
+    m_log = logger::get().open();
 
-    m_lua = luaL_newstate();
+    // Allocate everything in the heap arena, so that snapshots can save it
+    m_lua = lua_newstate(&vm::alloc, this);
     lua_atpanic(m_lua, &vm::panic_hook);
     lua_setpico8memory(m_lua, (uint8_t *)&m_ram);
     luaL_openlibs(m_lua);
 
     bindings::lua::init(m_lua, this);
+    startup::mark("lua state");
 
     // Automatically yield every 1000 instructions
-    lua_sethook(m_lua, &vm::instruction_hook, LUA_MASKCOUNT, 1000);
+    lua_sethook(m_lua, &vm::instruction_hook, LUA_MASKCOUNT, hook_period);
+
+    // Garbage is mostly collected between frames, see collect_garbage()
+    lua_gc(m_lua, LUA_GCSETPAUSE, gc_pause);
 
     // Clear memory
     ::memset(&m_ram, 0, sizeof(m_ram));
 
+    // The whole screen needs to be presented at least once
+    clear_dirty();
+    m_dirty.rows.set();
+
     // Initialise the PRNG with the current time
     auto now = std::chrono::high_resolution_clock::now();
     api_srand(fix32::frombits((int32_t)now.time_since_epoch().count()));
 
-    // Initialize Zepto8 runtime
-    int status = luaL_dostring(m_lua, m_bios->get_code().c_str());
+    // Initialize Zepto8 runtime from the shared bytecode, falling back to
+    // the source so that compilation errors get reported
+    auto const &bytecode = m_bios->get_bytecode();
+    int status = bytecode.length()
+               ? luaL_loadbuffer(m_lua, bytecode.data(), bytecode.length(), "=bios.p8")
+               : luaL_loadstring(m_lua, m_bios->get_code().c_str());
+    if (status == LUA_OK)
+        status = lua_pcall(m_lua, 0, LUA_MULTRET, 0);
     if (status != LUA_OK)
     {
         char const *message = lua_tostring(m_lua, -1);
@@ -97,13 +125,27 @@ vm::vm()
         lua_pop(m_lua, 1);
         assert(false);
     }
+
+    // Snapshots need to know every C function the heap may point to
+    collect_natives();
+
+    // Carts get the PICO-8 amount of Lua memory on top of what the BIOS uses
+    m_heap_base = m_gc_mark = m_heap.used();
+    m_heap.set_limit(m_heap_base + lua_memory);
+    startup::mark("bios run");
 }
 
 vm::~vm()
 {
+    save_cartdata();
     lua_close(m_lua);
 }
 
+void *vm::alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+    return ((vm *)ud)->m_heap.realloc(ptr, osize, nsize);
+}
+
 std::string const &vm::get_code() const
 {
     return m_cart.get_code();
@@ -114,6 +156,62 @@ u4mat2<128, 128> const &vm::get_screen() const
     return m_ram.screen;
 }
 
+uint64_t vm::hash_screen() const
+{
+    auto const &ds = m_ram.draw_state;
+    auto const &raster = m_ram.hw_state.raster;
+
+    // The presentation registers seed the hash of the screen data
+    uint64_t h = hash64(ds.screen_palette, sizeof(ds.screen_palette), ds.screen_mode);
+    h = hash64(&raster, sizeof(raster), h);
+    return hash64(&m_ram.screen, sizeof(m_ram.screen), h);
+}
+
+std::bitset<128> vm::get_dirty() const
+{
+    auto const &ds = m_ram.draw_state;
+    auto const &raster = m_ram.hw_state.raster;
+
+    // A change in any of the presentation registers affects all rows
+    if (::memcmp(m_dirty.palette, ds.screen_palette, sizeof(m_dirty.palette))
+         || m_dirty.mode != ds.screen_mode
+         || ::memcmp(m_dirty.raster, &raster, sizeof(m_dirty.raster)))
+        return std::bitset<128>().set();
+
+    // With a screen mode, rows do not map directly to the output
+    if (ds.screen_mode && m_dirty.rows.any())
+        return std::bitset<128>().set();
+
+    return m_dirty.rows;
+}
+
+void vm::clear_dirty()
+{
+    auto const &ds = m_ram.draw_state;
+
+    m_dirty.rows.reset();
+    ::memcpy(m_dirty.palette, ds.screen_palette, sizeof(m_dirty.palette));
+    m_dirty.mode = ds.screen_mode;
+    ::memcpy(m_dirty.raster, &m_ram.hw_state.raster, sizeof(m_dirty.raster));
+}
+
+void vm::dirty_memory(int addr, int size)
+{
+    using std::min, std::max;
+
+    if (m_tracker)
+        m_tracker->record(addr, size);
+
+    // Mark all screen rows touched by the [addr, addr + size) range
+    int const start = offsetof(memory, screen);
+    if (addr + size <= start)
+        return;
+    int y1 = (max(addr, start) - start) / 64;
+    int y2 = (min(addr + size, start + (int)sizeof(m_ram.screen)) - start + 63) / 64;
+    for (int y = y1; y < y2; ++y)
+        m_dirty.rows.set(y);
+}
+
 std::tuple<uint8_t *, size_t> vm::ram()
 {
     return std::make_tuple(&m_ram[0], sizeof(m_ram));
@@ -121,10 +219,15 @@ std::tuple<uint8_t *, size_t> vm::ram()
 
 std::tuple<uint8_t *, size_t> vm::rom()
 {
-    auto rom = m_cart.get_rom();
+    auto &rom = m_cart.get_rom();
     return std::make_tuple(&rom[0], sizeof(rom));
 }
 
+std::tuple<uint8_t *, size_t> vm::save_ram()
+{
+    return std::make_tuple(m_ram.persistent, sizeof(m_ram.persistent));
+}
+
 void vm::runtime_error(std::string str)
 {
     // This function never returns
@@ -141,107 +244,57 @@ int vm::panic_hook(lua_State* l)
 
 void vm::instruction_hook(lua_State *l, lua_Debug *)
 {
-#if HAVE_LUA_GETEXTRASPACE
-    vm *that = *static_cast<vm**>(lua_getextraspace(l));
-#else
-    lua_getglobal(l, "\x01");
-    vm *that = (vm *)lua_touserdata(l, -1);
-    lua_remove(l, -1);
-#endif
+    vm *that = bindings::lua::get_this<vm>(l);
+    auto &cpu = that->m_cpu;
+
+    auto &sampler = that->m_sampler;
+    if (sampler.period && --sampler.countdown <= 0)
+    {
+        sampler.countdown = sampler.period;
+        that->sample_stack(l);
+    }
 
-    // The value 135000 was found using trial and error, but it causes
-    // side effects in lots of cases. Use 300000 instead.
-    // FIXME: this is because we do not consider system costs, see
-    // https://pico-8.fandom.com/wiki/CPU for more information
-    that->m_instructions += 1000;
-    if (that->m_instructions >= 300000)
+    // FIXME: the count hook cannot tell opcodes apart, so they all have
+    // the same weight.
+    cpu.lua += hook_period * cpu_instruction;
+    if (cpu.lua + cpu.system - cpu.tick < cpu_per_tick)
+        return;
+
+    // Out of cycles for this tick: preempt the cart, but only when running
+    // its main coroutine, so that coroutines created by the cart itself
+    // never see a spurious yield().
+    if (l == that->m_main_thread)
+    {
+        cpu.preempted = true;
         lua_yield(l, 0);
+    }
 }
 
 tup<bool, bool, std::string> vm::private_download(opt<std::string> str)
 {
-    // Load cart info from a URL
-    //std::string host = "https://www.lexaloffle.com";
-    std::string host = "http://sam.hocevar.net/zepto8";
+    // Downloads, file writes and cart decoding all happen on the download
+    // manager threads; the cart is only copied here.
+    auto &manager = bbs::get();
 
     if (str)
-        download_state.step = 0;
-
-    switch (download_state.step)
-    {
-    case 0:
-        // Step 0: start downloading cart info
-        download_state.client.get(host + "/bbs/cpost_lister3.php?nfo=1&version=000112bw&lid=" + str->substr(1));
-        download_state.step = 1;
-        break;
-    case 1:
-        // Step 1: wait while downloading
-        if (download_state.client.get_status() != lol::net::http::status::pending)
-            download_state.step = 2;
-        break;
-    case 2: {
-        // Step 2: bail out if errors, save cart info, start downloading cart
-        if (download_state.client.get_status() != lol::net::http::status::success)
-            return std::make_tuple(true, false, std::string("error downloading info"));
-
-        std::map<std::string, std::string> data;
-        for (auto& line : lol::split(download_state.client.get_result(), '\n'))
-        {
-            size_t delim = line.find(':');
-            if (delim != std::string::npos)
-                data[line.substr(0, delim)] = line.substr(delim + 1);
-        }
+    {
+        m_download = str->substr(1);
+        manager.request(m_download);
+    }
 
-        auto const& lid = data["lid"];
-        auto const& mid = data["mid"];
-        if (lid.size() == 0 || lid.size() == 0)
-            return std::make_tuple(true, false, std::string("no cart info found"));
+    if (m_download.empty())
+        return std::make_tuple(true, false, std::string("no download in progress"));
 
-        // Write cart info
-#if _WIN32
-        std::string cache_dir = lol::sys::getenv("APPDATA");
-#else
-        std::string cache_dir = lol::sys::getenv("HOME") + "/.lexaloffle";
-#endif
-        cache_dir += "/pico-8/bbs/";
-        cache_dir += (mid[0] >= '1' && mid[0] <= '9') ? mid.substr(0, 1) : "carts";
-        std::error_code code;
-        if (!std::filesystem::create_directories(cache_dir, code))
-            if (code.value() != 0) // XXX: workaround for Windows weird behaviour
-                return std::make_tuple(true, false, "can't create cache dir");
-        std::string nfo_path = cache_dir + "/" + mid + ".nfo";
-        download_state.cart_path = cache_dir + "/" + lid + ".p8.png";
-
-        if (!lol::file::write(nfo_path, download_state.client.get_result()))
-            return std::make_tuple(true, false, "can't save nfo file");
-
-        // Download cart
-        download_state.client.get(host + "/bbs/get_cart.php?cat=7&lid=" + lid);
-        download_state.step = 3;
-        break;
-    }
-    case 3:
-        // Step 3: wait while downloading
-        if (download_state.client.get_status() != lol::net::http::status::pending)
-            download_state.step = 4;
-        break;
-    case 4:
-        // Step 4: bail out if errors, load cart otherwise
-        if (download_state.client.get_status() != lol::net::http::status::success)
-            return std::make_tuple(true, false, std::string("error downloading cart"));
-
-        // Save cart
-        if (!lol::file::write(download_state.cart_path, download_state.client.get_result()))
-            return std::make_tuple(true, false, "can't save cart file");
-
-        // Load cart
-        m_cart.load(download_state.cart_path);
-        return std::make_tuple(true, true, std::string());
-    default:
-        break;
-    }
-
-    return std::make_tuple(false, false, std::string());
+    auto d = manager.poll(m_download);
+    if (d.state == bbs::status::pending)
+        return std::make_tuple(false, false, std::string());
+
+    m_download.clear();
+    if (d.state == bbs::status::failed)
+        return std::make_tuple(true, false, d.error);
+
+    m_cart = std::move(*d.cart);
+    return std::make_tuple(true, true, std::string());
 }
 
 bool vm::private_load(std::string name)
@@ -254,10 +307,71 @@ bool vm::private_load(std::string name)
 void vm::load(std::string const &name)
 {
     m_cart.load(name);
+    m_name = std::filesystem::path(name).filename().string();
+    m_name = m_name.substr(0, m_name.find('.'));
+    startup::mark("cart loaded");
+}
+
+bool vm::hot_reload(std::string const &name)
+{
+    cart c;
+    if (!c.load(name))
+    {
+        lol::msg::error("hot reload: cannot load %s\n", name.c_str());
+        return false;
+    }
+
+    // Swap the code first, so that a syntax or runtime error leaves the
+    // cart exactly as it was
+    if (c.get_code() != m_cart.get_code())
+    {
+        int const top = lua_gettop(m_lua);
+        m_sandbox_lua = m_lua;
+        lua_getglobal(m_lua, "__z8_reload_cart");
+        load_code(c.get_code(), false);
+        bool const ok = lua_pcall(m_lua, 2, 2, 0) == LUA_OK && lua_toboolean(m_lua, -2);
+        if (!ok)
+        {
+            char const *message = lua_tostring(m_lua, -1);
+            lol::msg::error("hot reload: %s\n", message ? message : "error in cart code");
+        }
+        lua_settop(m_lua, top);
+        if (!ok)
+            return false;
+    }
+
+    // Only copy the bytes that changed in each section, so that whatever
+    // the cart wrote elsewhere at runtime is kept
+    static struct { char const *name; int start, end; } const sections[] =
+    {
+        { "gfx",   0x0000, 0x2000 },
+        { "map",   0x2000, 0x3000 },
+        { "flags", offsetof(memory, gfx_props), offsetof(memory, song) },
+        { "music", offsetof(memory, song), offsetof(memory, sfx) },
+        { "sfx",   offsetof(memory, sfx), offsetof(memory, code) },
+    };
+
+    memory const &old_rom = m_cart.get_rom(), &new_rom = c.get_rom();
+    for (auto const &s : sections)
+    {
+        int first = s.start, last = s.end;
+        while (first < last && old_rom[first] == new_rom[first])
+            ++first;
+        while (last > first && old_rom[last - 1] == new_rom[last - 1])
+            --last;
+        if (first < last)
+            ::memcpy(&m_ram[first], &new_rom[first], last - first);
+    }
+
+    m_cart = std::move(c);
+    return true;
 }
 
 void vm::run()
 {
+    // Until the cart reports it, assume the rate of _update60()
+    m_frame_rate = 60.f;
+
     // Start the cartridge!
     int status = luaL_dostring(m_lua, "run()");
     if (status != LUA_OK)
@@ -266,10 +380,26 @@ void vm::run()
         lol::msg::error("error %d running cartridge: %s\n", status, message);
         lua_pop(m_lua, 1);
     }
+    startup::mark("cart started");
 }
 
 bool vm::step(float /* seconds */)
 {
+    lol::timer frame_timer;
+
+    // A cart that was preempted has not reached flip() yet, so it keeps
+    // accumulating costs for the current frame.
+    if (!m_cpu.preempted)
+        m_cpu.lua = m_cpu.system = 0;
+    m_cpu.tick = m_cpu.lua + m_cpu.system;
+    m_cpu.preempted = false;
+
+    // The BIOS may replace the main coroutine between ticks, so look it up
+    // here rather than from the instruction hook.
+    lua_getglobal(m_lua, "__z8_loop");
+    m_main_thread = lua_tothread(m_lua, -1);
+    lua_pop(m_lua, 1);
+
     bool ret = false;
     lua_getglobal(m_lua, "__z8_tick");
     int status = lua_pcall(m_lua, 0, 1, 0);
@@ -284,10 +414,402 @@ bool vm::step(float /* seconds */)
     }
     lua_pop(m_lua, 1);
 
-    m_instructions = 0;
+    collect_garbage();
+    save_cartdata();
+    m_log->tick();
+
+    if (m_gif)
+        m_gif->add_frame(*this, 1.f / 60);
+
+    if (m_profiler.enabled)
+        end_profile_frame(frame_timer.get());
+
+    if (!m_ticks)
+        startup::mark("first frame");
+    ++m_ticks;
     return ret;
 }
 
+// The collector is kept in a long pause, so that it seldom runs in the
+// middle of a frame, and does its work between frames instead: a cycle
+// starts once the heap grew enough since the last one, and each frame
+// gets a fixed amount of work until it completes. In deterministic mode
+// the work is fixed too, because table iteration order depends on where
+// objects live in the heap.
+void vm::collect_garbage()
+{
+    lol::timer t;
+    if (m_deterministic)
+        lua_gc(m_lua, LUA_GCSTEP, gc_step_kb * 8);
+    else
+    {
+        if (!m_gc_running)
+            m_gc_running = m_heap.used() * 100 > m_gc_mark * gc_idle_pause;
+
+        for (int kb = 0; m_gc_running && kb < gc_frame_kb; kb += gc_step_kb)
+        {
+            if (lua_gc(m_lua, LUA_GCSTEP, gc_step_kb))
+            {
+                m_gc_running = false;
+                m_gc_mark = m_heap.used();
+            }
+        }
+    }
+
+    if (m_profiler.enabled)
+    {
+        float const gc = t.get();
+        m_profiler.gc += gc;
+        m_profiler.idle_gc += gc;
+    }
+}
+
+void vm::set_deterministic(uint32_t seed)
+{
+    api_srand(fix32::frombits((int32_t)seed));
+    m_deterministic = true;
+    m_ticks = 0;
+}
+
+//
+// Snapshots
+//
+
+// A snapshot is a header followed by the VM memory, the VM state and the
+// heap image. Lua objects contain pointers into the heap, which are moved
+// to where the heap now is, and to C functions, which are stored as indices
+// into the list of those this build knows about; states from other builds
+// are rejected, and the heap image is checked before anything is loaded.
+struct state_header
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t build;      // identifies the native code, see collect_natives()
+    uint64_t heap;       // address of the heap that saved the state
+    uint64_t threads[2]; // offsets of the Lua threads in the heap
+    uint64_t rom;        // hash of the cart ROM
+    uint32_t cartdata;   // length of the cartdata() identifier
+    uint32_t heap_size;
+};
+
+static size_t const max_cartdata = 256;
+
+// Everything but the cartdata() identifier and the heap image
+size_t vm::state_fixed() const
+{
+    return sizeof(state_header) + sizeof(m_ram) + sizeof(m_state) + sizeof(m_cpu)
+         + sizeof(m_deterministic) + sizeof(m_ticks) + 3 * sizeof(int32_t);
+}
+
+size_t vm::state_size() const
+{
+    return state_fixed() + max_cartdata + m_heap.image_bound();
+}
+
+size_t vm::save_state(void *data, size_t size) const
+{
+    if (size < state_size() || m_cartdata.size() > max_cartdata)
+        return 0;
+
+    auto *p = (uint8_t *)data;
+    auto put = [&p](void const *src, size_t len) { ::memcpy(p, src, len); p += len; };
+
+    // C functions are replaced with their index in a copy of the heap,
+    // which fails if one is unknown
+    uintptr_t const base = uintptr_t(m_heap.data());
+    uintptr_t threads[] = { uintptr_t(m_lua), uintptr_t(m_sandbox_lua) };
+    m_image.assign(m_heap.data(), m_heap.data() + m_heap.size());
+    if (!relocate(m_image.data(), m_image.size(), base, base, natives::encode, threads))
+        return 0;
+
+    // The heap image goes last, and its size is only known once written
+    size_t const fixed = state_fixed() + m_cartdata.size();
+    size_t const heap_size = m_heap.save_image(p + fixed, size - fixed, m_image.data());
+    if (!heap_size)
+        return 0;
+
+    state_header const h
+    {
+        { 'z', '8', 's', 't' }, 4,
+        m_build,
+        (uint64_t)base,
+        { (uint64_t)(threads[0] - base), (uint64_t)(threads[1] - base) },
+        hash64(&m_cart.get_rom(), sizeof(m_cart.get_rom())),
+        (uint32_t)m_cartdata.size(),
+        (uint32_t)heap_size,
+    };
+
+    int32_t const resampler[] = { m_resampler.phase, m_resampler.prev, m_resampler.next };
+
+    put(&h, sizeof(h));
+    put(&m_ram, sizeof(m_ram));
+    put(&m_state, sizeof(m_state));
+    put(&m_cpu, sizeof(m_cpu));
+    put(&m_deterministic, sizeof(m_deterministic));
+    put(&m_ticks, sizeof(m_ticks));
+    put(resampler, sizeof(resampler));
+    put(m_cartdata.data(), m_cartdata.size());
+
+    return fixed + heap_size;
+}
+
+bool vm::load_state(void const *data, size_t size)
+{
+    state_header h;
+    if (size < sizeof(h))
+        return false;
+    ::memcpy(&h, data, sizeof(h));
+
+    size_t const fixed = state_fixed();
+    if (::memcmp(h.magic, "z8st", 4) || h.version != 4 || h.build != m_build
+         || h.rom != hash64(&m_cart.get_rom(), sizeof(m_cart.get_rom()))
+         || h.cartdata > max_cartdata
+         || size < fixed + h.cartdata + h.heap_size)
+        return false;
+
+    // Check and move the heap image in a copy; the current Lua state is
+    // only replaced once that succeeded, so nothing may fail after it
+    uintptr_t const base = uintptr_t(h.heap);
+    uintptr_t threads[] = { base + uintptr_t(h.threads[0]), base + uintptr_t(h.threads[1]) };
+    auto const *image = (uint8_t const *)data + fixed + h.cartdata;
+    if (!m_heap.read_image(image, h.heap_size, m_image)
+         || !relocate(m_image.data(), m_image.size(), base, uintptr_t(m_heap.data()),
+                      natives::decode, threads))
+        return false;
+    m_heap.assign(m_image.data(), m_image.size());
+
+    auto const *p = (uint8_t const *)data + sizeof(h);
+    auto get = [&p](void *dst, size_t len) { ::memcpy(dst, p, len); p += len; };
+    int32_t resampler[3];
+
+    get(&m_ram, sizeof(m_ram));
+    get(&m_state, sizeof(m_state));
+    get(&m_cpu, sizeof(m_cpu));
+    get(&m_deterministic, sizeof(m_deterministic));
+    get(&m_ticks, sizeof(m_ticks));
+    get(resampler, sizeof(resampler));
+    m_cartdata.assign((char const *)p, h.cartdata);
+
+    m_lua = (lua_State *)threads[0];
+    m_sandbox_lua = (lua_State *)threads[1];
+    m_resampler.phase = resampler[0];
+    m_resampler.prev = (int16_t)resampler[1];
+    m_resampler.next = (int16_t)resampler[2];
+    attach_lua();
+
+    // The whole screen needs to be presented again
+    m_dirty.rows.set();
+    return true;
+}
+
+// Checkpoints hold the same state as snapshots, but as plain copies, and
+// the heap as shared pages. They are checked against the same cart, and
+// the heap only moves when restored into another VM, since native code
+// does not move within a process.
+struct vm::checkpoint_data : vm_base::checkpoint
+{
+    uint8_t const *heap;
+    uint64_t rom;
+    lua_State *lua;
+    memory ram;
+    state st;
+    decltype(vm::m_cpu) cpu;
+    bool deterministic;
+    int ticks;
+    lua_State *sandbox_lua;
+    int phase;
+    int16_t prev, next;
+    std::string cartdata;
+    heap::pages pages;
+    size_t heap_size;
+};
+
+std::shared_ptr<vm_base::checkpoint const> vm::save_checkpoint() const
+{
+    auto c = std::make_shared<checkpoint_data>();
+    c->heap = m_heap.data();
+    c->rom = hash64(&m_cart.get_rom(), sizeof(m_cart.get_rom()));
+    c->lua = m_lua;
+    c->ram = m_ram;
+    c->st = m_state;
+    c->cpu = m_cpu;
+    c->deterministic = m_deterministic;
+    c->ticks = m_ticks;
+    c->sandbox_lua = m_sandbox_lua;
+    c->phase = m_resampler.phase;
+    c->prev = m_resampler.prev;
+    c->next = m_resampler.next;
+    c->cartdata = m_cartdata;
+    c->heap_size = m_heap.size();
+    m_heap.save(c->pages, m_heap_pages);
+
+    m_heap_pages = c->pages;
+    return c;
+}
+
+bool vm::restore_checkpoint(checkpoint const &cp)
+{
+    auto c = dynamic_cast<checkpoint_data const *>(&cp);
+    if (!c || c->rom != hash64(&m_cart.get_rom(), sizeof(m_cart.get_rom()))
+         || !m_heap.read_pages(c->pages, c->heap_size, m_image))
+        return false;
+
+    uintptr_t threads[] = { uintptr_t(c->lua), uintptr_t(c->sandbox_lua) };
+    if (c->heap != m_heap.data()
+         && !relocate(m_image.data(), m_image.size(), uintptr_t(c->heap),
+                      uintptr_t(m_heap.data()), natives::keep, threads))
+        return false;
+    m_heap.assign(m_image.data(), m_image.size());
+
+    m_lua = (lua_State *)threads[0];
+    m_ram = c->ram;
+    m_state = c->st;
+    m_cpu = c->cpu;
+    m_deterministic = c->deterministic;
+    m_ticks = c->ticks;
+    m_sandbox_lua = (lua_State *)threads[1];
+    m_resampler.phase = c->phase;
+    m_resampler.prev = c->prev;
+    m_resampler.next = c->next;
+    m_cartdata = c->cartdata;
+    attach_lua();
+
+    m_heap_pages = c->pages;
+    m_dirty.rows.set();
+    return true;
+}
+
+//
+// Profiling
+//
+
+void vm::set_profiling(bool enable)
+{
+    m_profiler.enabled = enable;
+    m_profiler.count.assign(bindings::lua::names.size(), 0);
+    m_profiler.time.assign(bindings::lua::names.size(), 0.f);
+    m_profiler.gc = m_profiler.idle_gc = 0.f;
+    m_profiler.pixels = m_profiler.samples = 0;
+    m_profiler.last = profile();
+}
+
+profile vm::get_profile() const
+{
+    return m_profiler.last;
+}
+
+void vm::profile_call(int id, float seconds)
+{
+    ++m_profiler.count[id];
+    m_profiler.time[id] += seconds;
+}
+
+void vm::set_sampling(int period)
+{
+    m_sampler.period = period > 0 ? std::max(1, (period + hook_period / 2) / hook_period) : 0;
+    m_sampler.countdown = m_sampler.period;
+    if (period > 0)
+        m_sampler.samples = stack_samples();
+}
+
+stack_samples vm::get_samples() const
+{
+    return m_sampler.samples;
+}
+
+// Record the innermost frames of the running stack. The cart code is
+// compiled from a string, so its frames are named after the function and
+// the line where it is defined.
+void vm::sample_stack(lua_State *l)
+{
+    int const max_depth = 48;
+
+    int depth = 0;
+    lua_Debug ar;
+    while (depth < max_depth && lua_getstack(l, depth, &ar))
+        ++depth;
+
+    auto &key = m_sampler.key;
+    key.clear();
+    for (int level = depth - 1; level >= 0; --level)
+    {
+        lua_getstack(l, level, &ar);
+        lua_getinfo(l, "Sn", &ar);
+        if (key.length())
+            key += ';';
+        if (*ar.what == 'm')
+            key += "main";
+        else
+        {
+            key += ar.name ? ar.name : "?";
+            if (*ar.what != 'C')
+                key += ':' + std::to_string(ar.linedefined);
+        }
+    }
+
+    ++m_sampler.samples.stacks[key];
+    ++m_sampler.samples.total;
+}
+
+void vm::end_profile_frame(float seconds)
+{
+    // Sort API functions by family
+    static std::unordered_map<std::string, float profile::*> const families =
+    {
+        { "reload", &profile::mem }, { "memcpy", &profile::mem },
+        { "memset", &profile::mem }, { "peek", &profile::mem },
+        { "peek2", &profile::mem }, { "peek4", &profile::mem },
+        { "poke", &profile::mem }, { "poke2", &profile::mem },
+        { "poke4", &profile::mem }, { "dget", &profile::mem },
+        { "dset", &profile::mem }, { "__cartdata", &profile::mem },
+
+        { "music", &profile::sfx }, { "sfx", &profile::sfx },
+
+        { "cursor", &profile::gfx }, { "print", &profile::gfx },
+        { "__draw", &profile::gfx },
+        { "camera", &profile::gfx }, { "circ", &profile::gfx },
+        { "circfill", &profile::gfx }, { "clip", &profile::gfx },
+        { "cls", &profile::gfx }, { "color", &profile::gfx },
+        { "fillp", &profile::gfx }, { "fget", &profile::gfx },
+        { "fset", &profile::gfx }, { "line", &profile::gfx },
+        { "map", &profile::gfx }, { "mget", &profile::gfx },
+        { "mset", &profile::gfx }, { "oval", &profile::gfx },
+        { "ovalfill", &profile::gfx }, { "pal", &profile::gfx },
+        { "palt", &profile::gfx }, { "pget", &profile::gfx },
+        { "pset", &profile::gfx }, { "rect", &profile::gfx },
+        { "rectfill", &profile::gfx }, { "sget", &profile::gfx },
+        { "sset", &profile::gfx }, { "spr", &profile::gfx },
+        { "sspr", &profile::gfx }, { "tline", &profile::gfx },
+    };
+
+    auto &p = m_profiler;
+    profile ret;
+    ret.frame = seconds;
+    ret.gc = p.gc;
+    ret.pixels = p.pixels;
+    ret.samples = p.samples.exchange(0);
+
+    float api = 0.f;
+    for (size_t id = 0; id < p.count.size(); ++id)
+    {
+        if (!p.count[id])
+            continue;
+
+        std::string name = bindings::lua::names[id];
+        auto family = families.find(name);
+        ret.*(family == families.end() ? &profile::other : family->second) += p.time[id];
+        ret.calls.push_back({ name, p.count[id], p.time[id] });
+        api += p.time[id];
+    }
+    ret.lua = std::max(0.f, seconds - api - p.idle_gc);
+
+    p.last = std::move(ret);
+    std::fill(p.count.begin(), p.count.end(), 0);
+    std::fill(p.time.begin(), p.time.end(), 0.f);
+    p.gc = p.idle_gc = 0.f;
+    p.pixels = 0;
+}
+
 void vm::button(int index, int state)
 {
     m_state.buttons[1][index] += state;
@@ -318,10 +840,58 @@ void vm::api_run()
     // Initialise VM state (TODO: check what else to init)
     ::memset(m_state.buttons, 0, sizeof(m_state.buttons));
 
-    // Load cartridge code and call __z8_run_cart() on it
+    // Compile cartridge code and call __z8_run_cart() on it
     lua_getglobal(m_sandbox_lua, "__z8_run_cart");
-    lua_pushstring(m_sandbox_lua, m_cart.get_code().c_str());
-    lua_pcall(m_sandbox_lua, 1, 0, 0);
+    load_code(m_cart.get_code());
+    lua_pcall(m_sandbox_lua, 2, 0, 0);
+}
+
+// Push the compiled cart code and nil, or nil and the syntax error. The
+// cache key also covers the BIOS, which provides the glue code and whose
+// bytecode changes with the Lua version. Hot reloads leave out the glue
+// code, since the main loop is already running.
+void vm::load_code(std::string const &code, bool glue)
+{
+    lua_State *l = m_sandbox_lua;
+
+    std::string source = code;
+    if (glue)
+    {
+        lua_getglobal(l, "__z8_glue_code");
+        source += lua_tostring(l, -1);
+        lua_pop(l, 1);
+    }
+
+    uint64_t const key = hash64(source.data(), source.length(), m_bios->get_hash());
+    auto &cache = code_cache::get();
+    std::string bytecode;
+
+    if (cache.find(key, bytecode))
+    {
+        if (luaL_loadbuffer(l, bytecode.data(), bytecode.length(), "=cache") == LUA_OK)
+        {
+            lua_pushnil(l);
+            return;
+        }
+        lua_pop(l, 1);
+    }
+
+    // The chunk is named after its source, like load() does
+    if (luaL_loadbuffer(l, source.data(), source.length(), source.c_str()) != LUA_OK)
+    {
+        lua_pushnil(l);
+        lua_insert(l, -2);
+        return;
+    }
+
+    bytecode.clear();
+    lua_dump(l, [](lua_State *, void const *p, size_t size, void *ud)
+    {
+        ((std::string *)ud)->append((char const *)p, size);
+        return 0;
+    }, &bytecode);
+    cache.store(key, bytecode);
+    lua_pushnil(l);
 }
 
 void vm::api_menuitem()
@@ -367,24 +937,25 @@ void vm::api_reload(int16_t in_dst, int16_t in_src, opt<int16_t> in_size)
     // Now copy possibly legal data
     int amount = min(size, (int)offsetof(memory, code) - src);
     ::memcpy(&m_ram[dst], &m_cart.get_rom()[src], amount);
+    m_cpu.system += amount * cpu_byte;
     dst += amount;
     size -= amount;
 
     // If there is anything left to copy, it’s zeroes again
     ::memset(&m_ram[dst], 0, size);
 
+    dirty_memory(in_size ? in_dst & 0xffff : 0, in_size ? *in_size & 0xffff : offsetof(memory, code));
     update_registers();
 }
 
 fix32 vm::api_dget(int16_t n)
 {
-    // FIXME: cannot be used before cartdata()
     return n >= 0 && n < 64 ? api_peek4(0x5e00 + 4 * n) : fix32(0);
 }
 
 void vm::api_dset(int16_t n, fix32 x)
 {
-    // FIXME: cannot be used before cartdata()
+    // The data is saved at the end of the step, if cartdata() was called
     if (n >= 0 && n < 64)
         api_poke4(0x5e00 + 4 * n, x);
 }
@@ -399,6 +970,12 @@ int16_t vm::api_peek(int16_t addr)
 
 int16_t vm::api_peek2(int16_t addr)
 {
+    if (addr >= 0 && addr <= (int)sizeof(m_ram) - 2)
+    {
+        uint8_t const *a = &m_ram[addr];
+        return int16_t(a[0] | a[1] << 8);
+    }
+
     int16_t bits = 0;
     for (int i = 0; i < 2; ++i)
     {
@@ -415,6 +992,13 @@ int16_t vm::api_peek2(int16_t addr)
 fix32 vm::api_peek4(int16_t addr)
 {
     int32_t bits = 0;
+    if (addr >= 0 && addr <= (int)sizeof(m_ram) - 4)
+    {
+        uint8_t const *a = &m_ram[addr];
+        bits = int32_t(uint32_t(a[0]) | uint32_t(a[1]) << 8 | uint32_t(a[2]) << 16 | uint32_t(a[3]) << 24);
+        return fix32::frombits(bits);
+    }
+
     for (int i = 0; i < 4; ++i)
     {
         /* This code handles partial reads by adding zeroes */
@@ -437,6 +1021,7 @@ void vm::api_poke(int16_t addr, int16_t val)
     }
     m_ram[addr] = (uint8_t)val;
 
+    dirty_memory(addr, 1);
     update_registers();
 }
 
@@ -449,9 +1034,12 @@ void vm::api_poke2(int16_t addr, int16_t val)
         return;
     }
 
-    m_ram[addr + 0] = (uint8_t)val;
-    m_ram[addr + 1] = (uint8_t)((uint16_t)val >> 8);
+    uint16_t const bits = (uint16_t)val;
+    uint8_t *a = &m_ram[addr];
+    a[0] = uint8_t(bits);
+    a[1] = uint8_t(bits >> 8);
 
+    dirty_memory(addr, 2);
     update_registers();
 }
 
@@ -464,12 +1052,14 @@ void vm::api_poke4(int16_t addr, fix32 val)
         return;
     }
 
-    uint32_t x = (uint32_t)val.bits();
-    m_ram[addr + 0] = (uint8_t)x;
-    m_ram[addr + 1] = (uint8_t)(x >> 8);
-    m_ram[addr + 2] = (uint8_t)(x >> 16);
-    m_ram[addr + 3] = (uint8_t)(x >> 24);
+    uint32_t const bits = (uint32_t)val.bits();
+    uint8_t *a = &m_ram[addr];
+    a[0] = uint8_t(bits);
+    a[1] = uint8_t(bits >> 8);
+    a[2] = uint8_t(bits >> 16);
+    a[3] = uint8_t(bits >> 24);
 
+    dirty_memory(addr, 4);
     update_registers();
 }
 
@@ -494,6 +1084,16 @@ void vm::api_memcpy(int16_t in_dst, int16_t in_src, int16_t in_size)
         return;
     }
 
+    // Common case: the whole source is in main memory
+    if (src + size <= (int)sizeof(m_ram))
+    {
+        memmove(&m_ram[dst], &m_ram[src], size);
+        m_cpu.system += size * cpu_byte;
+        dirty_memory(dst, size);
+        update_registers();
+        return;
+    }
+
     // If source is outside main memory, part of the operation will be
     // memset(0). But we delay the operation in case the source and the
     // destination overlap.
@@ -519,6 +1119,8 @@ void vm::api_memcpy(int16_t in_dst, int16_t in_src, int16_t in_size)
     if (size)
         ::memset(&m_ram[dst], 0, size);
 
+    m_cpu.system += (in_size & 0xffff) * cpu_byte;
+    dirty_memory(in_dst & 0xffff, in_size & 0xffff);
     update_registers();
 }
 
@@ -535,15 +1137,20 @@ void vm::api_memset(int16_t dst, uint8_t val, int16_t size)
     }
 
     ::memset(&m_ram[dst], val, size);
+    m_cpu.system += size * cpu_byte;
 
+    dirty_memory(dst, size);
     update_registers();
 }
 
 void vm::update_registers()
 {
     // PICO-8 appears to update this after a poke(). No bits are set to 1 though.
-    for (uint8_t &btn : m_ram.hw_state.btn_state)
-        btn &= 0x3f;
+    static_assert(sizeof(m_ram.hw_state.btn_state) == sizeof(uint64_t));
+    uint64_t btn;
+    ::memcpy(&btn, m_ram.hw_state.btn_state, sizeof(btn));
+    btn &= 0x3f3f3f3f3f3f3f3full;
+    ::memcpy(m_ram.hw_state.btn_state, &btn, sizeof(btn));
 }
 
 void vm::update_prng()
@@ -594,16 +1201,26 @@ var<bool, int16_t, fix32, std::string, std::nullptr_t> vm::api_stat(int16_t id)
     {
         // Perform a GC to avoid accounting for short lifespan objects.
         // Not sure about the performance cost of this.
+        lol::timer gc_timer;
         lua_gc(m_sandbox_lua, LUA_GCCOLLECT, 0);
+        if (m_profiler.enabled)
+            m_profiler.gc += gc_timer.get();
 
-        // From the PICO-8 documentation:
-        int32_t bits = ((int)lua_gc(m_sandbox_lua, LUA_GCCOUNT, 0) << 16)
-                     + ((int)lua_gc(m_sandbox_lua, LUA_GCCOUNTB, 0) << 6);
-        return fix32::frombits(bits);
+        // From the PICO-8 documentation: memory in KiB, and the BIOS
+        // does not count
+        size_t const used = m_heap.used() - std::min(m_heap.used(), m_heap_base);
+        return fix32::frombits(int32_t(used << 6));
     }
 
     if (id == 1 || id == 2)
-        return int16_t(0); // TODO (CPU usage)
+    {
+        // 1.0 is a full frame at the cart’s frame rate, i.e. 60 fps when
+        // it defines _update60(); stat(2) only counts system costs
+        int64_t cost = id == 1 ? m_cpu.lua + m_cpu.system : m_cpu.system;
+        int64_t const fps = std::max(int64_t(m_frame_rate), int64_t(1));
+        return fix32::frombits(int32_t(std::min(cost * fps * 0x10000 / cpu_per_second,
+                                                int64_t(0x7fffffff))));
+    }
 
     if (id == 4)
         return std::string(); // TODO (clipboard)
@@ -677,8 +1294,7 @@ var<bool, int16_t, fix32, std::string, std::nullptr_t> vm::api_stat(int16_t id)
 
     if ((id >= 80 && id <= 85) || (id >= 90 && id <= 95))
     {
-        time_t t;
-        time(&t);
+        time_t t = m_deterministic ? time_t(m_ticks / 60) : time(nullptr);
         auto const *tm = (id <= 85 ? std::gmtime : std::localtime)(&t);
         switch (id % 10)
         {
@@ -691,6 +1307,24 @@ var<bool, int16_t, fix32, std::string, std::nullptr_t> vm::api_stat(int16_t id)
         }
     }
 
+    if (id >= 200 && id <= 207)
+    {
+        // ZEPTO-8 extensions: profiler data for the previous frame, times
+        // as a fraction of a 60 fps frame, and counts as 32-bit integers
+        auto const &p = m_profiler.last;
+        switch (id)
+        {
+            case 200: return fix32(p.lua * 60.0);
+            case 201: return fix32(p.gfx * 60.0);
+            case 202: return fix32(p.sfx * 60.0);
+            case 203: return fix32(p.mem * 60.0);
+            case 204: return fix32(p.other * 60.0);
+            case 205: return fix32(p.gc * 60.0);
+            case 206: return fix32::frombits(int32_t(p.pixels));
+            case 207: return fix32::frombits(int32_t(p.samples));
+        }
+    }
+
     // TODO: everything below this is unimplemented
 
     if (id >= 48 && id < 72)
@@ -711,22 +1345,103 @@ var<bool, int16_t, fix32, std::string, std::nullptr_t> vm::api_stat(int16_t id)
 
 void vm::api_printh(rich_string str, opt<std::string> filename, opt<bool> overwrite)
 {
-    (void)filename;
-    (void)overwrite;
+    if (filename && *filename == "@clip")
+    {
+        private_stub("printh(str, \"@clip\")");
+        return;
+    }
 
     std::string decoded;
     for (uint8_t ch : str)
         decoded += charset::to_utf8[ch];
-    fprintf(stdout, "%s\n", decoded.c_str());
-    fflush(stdout);
+    m_log->print(decoded, filename.value_or(""), overwrite.value_or(false));
 }
 
 void vm::api_extcmd(std::string cmd)
 {
-    if (cmd == "label" || cmd == "screen" || cmd == "rec" || cmd == "video")
+    if (cmd == "rec")
+    {
+        // Like PICO-8, record at most 8 seconds at twice the size, to the
+        // first free <cart>_<n>.gif file
+        std::string filename;
+        for (int n = 0; filename.empty() || std::filesystem::exists(filename); ++n)
+            filename = lol::format("%s_%d.gif", m_name.empty() ? "zepto8" : m_name.c_str(), n);
+
+        if (!m_gif)
+            m_gif = std::make_unique<gif_recorder>();
+        if (m_gif->start(filename, 2, 8.f))
+            lol::msg::info("recording video to %s\n", filename.c_str());
+    }
+    else if (cmd == "video")
+    {
+        if (m_gif)
+            m_gif->stop();
+    }
+    else if (cmd == "label" || cmd == "screen")
         private_stub(lol::format("extcmd(%s)\n", cmd.c_str()));
 }
 
+//
+// Extensions
+//
+
+// Draw many primitives in a single call. The argument is a table holding
+// commands one after the other, each made of an opcode and a fixed number
+// of arguments:
+//   1, x, y, c                   pset(x, y, c)
+//   2, x0, y0, x1, y1, c         rectfill(x0, y0, x1, y1, c)
+//   3, x0, y0, x1, y1, c         line(x0, y0, x1, y1, c)
+//   4, n, x, y                   spr(n, x, y)
+//   5, x, y, r, c                circfill(x, y, r, c)
+//   6, x0, y0, x1, y1, c         rect(x0, y0, x1, y1, c)
+//   7, x, y, r, c                circ(x, y, r, c)
+// Drawing stops at the end of the table or at the first unknown or
+// truncated command. Returns the number of commands drawn.
+fix32 vm::api_draw_list()
+{
+    static int const arity[] = { 0, 3, 5, 5, 3, 4, 5, 4 };
+    int const ops = int(sizeof(arity) / sizeof(*arity));
+
+    lua_State *l = m_sandbox_lua;
+    if (!lua_istable(l, 1))
+        return fix32(0);
+
+    auto get = [l](int i)
+    {
+        lua_rawgeti(l, 1, i);
+        fix32 ret = lua_tonumber(l, -1);
+        lua_pop(l, 1);
+        return ret;
+    };
+
+    int const len = int(lua_rawlen(l, 1));
+    int count = 0;
+    fix32 a[5];
+    for (int i = 1; i <= len; ++count)
+    {
+        int const op = int16_t(get(i));
+        if (op <= 0 || op >= ops || i + arity[op] > len)
+            break;
+
+        for (int k = 0; k < arity[op]; ++k)
+            a[k] = get(i + 1 + k);
+        i += 1 + arity[op];
+
+        switch (op)
+        {
+        case 1: api_pset(int16_t(a[0]), int16_t(a[1]), a[2]); break;
+        case 2: api_rectfill(int16_t(a[0]), int16_t(a[1]), int16_t(a[2]), int16_t(a[3]), a[4]); break;
+        case 3: api_line(a[0], a[1], a[2], a[3], a[4]); break;
+        case 4: api_spr(int16_t(a[0]), int16_t(a[1]), int16_t(a[2]), std::nullopt, std::nullopt, false, false); break;
+        case 5: api_circfill(int16_t(a[0]), int16_t(a[1]), int16_t(a[2]), a[3]); break;
+        case 6: api_rect(int16_t(a[0]), int16_t(a[1]), int16_t(a[2]), int16_t(a[3]), a[4]); break;
+        case 7: api_circ(int16_t(a[0]), int16_t(a[1]), int16_t(a[2]), a[3]); break;
+        }
+    }
+
+    return fix32(count);
+}
+
 //
 // I/O
 //
@@ -801,8 +1516,53 @@ void vm::api_serial(int16_t chan, int16_t address, int16_t len)
 
 fix32 vm::api_time()
 {
+    if (m_deterministic)
+        return (fix32)(m_ticks / 60.0);
     return (fix32)(double)m_timer.poll();
 }
 
+//
+// Micro-benchmarks
+//
+
+// Time Lua loops calling a few hot API functions, and subtract the cost
+// of an empty loop to get the per-call overhead of the bindings.
+void vm::bench_bindings()
+{
+    static char const *tests[][2] =
+    {
+        { nullptr, "" },
+        { "pset", "pset(64,64,7)" },
+        { "spr",  "spr(1,60,60)" },
+        { "rnd",  "rnd(10)" },
+        { "btn",  "btn(4,0)" },
+    };
+
+    int const count = 1000000;
+
+    // The instruction hook would try to yield outside of a coroutine
+    lua_sethook(m_lua, nullptr, 0, 0);
+
+    float empty = 0.f;
+    for (auto const &test : tests)
+    {
+        std::string code = lol::format("for i=1,%d do %s end", count, test[1]);
+        lol::timer t;
+        if (luaL_dostring(m_lua, code.c_str()) != LUA_OK)
+        {
+            lol::msg::error("%s\n", lua_tostring(m_lua, -1));
+            lua_pop(m_lua, 1);
+        }
+        float time = t.get();
+
+        if (!test[0])
+            empty = time;
+        else
+            printf("%s: %.3fµs per call\n", test[0], (time - empty) * 1e6f / count);
+    }
+
+    lua_sethook(m_lua, &vm::instruction_hook, LUA_MASKCOUNT, hook_period);
+}
+
 } // namespace z8::pico8
 
@@ -12,18 +12,21 @@
 
 #pragma once
 
-#include <lol/engine.h> // lol::net
+#include <lol/engine.h> // lol::timer
 
 #include <optional>
 #include <variant>
+#include <atomic>
 
 #include "zepto8.h"
 #include "bios.h"
 #include "pico8/cart.h"
 #include "pico8/memory.h"
+#include "pico8/heap.h"
+#include "pico8/logger.h"
 #include "3rdparty/z8lua/lua.h"
 
-namespace z8 { class player; }
+namespace z8 { class player; class gif_recorder; }
 
 namespace z8::pico8
 {
@@ -82,14 +85,39 @@ public:
     virtual void load(std::string const &name);
     virtual void run();
     virtual bool step(float seconds);
+    virtual bool hot_reload(std::string const &name);
+    virtual void set_deterministic(uint32_t seed);
+    virtual void skip_frames(int count) { m_skip_frames = count; }
+    virtual float get_frame_rate() const { return m_frame_rate; }
 
     virtual std::string const &get_code() const;
     virtual u4mat2<128, 128> const &get_screen() const;
     virtual int get_ansi_color(uint8_t c) const;
 
     virtual void render(lol::u8vec4 *screen) const;
+    virtual void render_xrgb8888(uint32_t *screen) const;
+    virtual void render_rgb565(uint16_t *screen) const;
+    virtual int render_indexed(uint8_t *screen, uint32_t *palette) const;
+    virtual std::bitset<128> get_dirty() const;
+    virtual void clear_dirty();
+    virtual void set_write_tracker(write_tracker *tracker) { m_tracker = tracker; }
+    virtual uint64_t hash_screen() const;
 
     virtual std::function<void(void *, int)> get_streamer(int channel);
+    virtual void get_audio(int16_t *buffer, int frames, bool stereo);
+    virtual void set_audio_rate(int rate);
+    virtual int get_audio_rate() const { return m_resampler.rate; }
+
+    virtual void set_profiling(bool enable);
+    virtual profile get_profile() const;
+    virtual void set_sampling(int period);
+    virtual stack_samples get_samples() const;
+
+    virtual size_t state_size() const;
+    virtual size_t save_state(void *data, size_t size) const;
+    virtual bool load_state(void const *data, size_t size);
+    virtual std::shared_ptr<checkpoint const> save_checkpoint() const;
+    virtual bool restore_checkpoint(checkpoint const &c);
 
     virtual void button(int index, int state);
     virtual void mouse(lol::ivec2 coords, int buttons);
@@ -97,9 +125,30 @@ public:
 
     virtual std::tuple<uint8_t *, size_t> ram();
     virtual std::tuple<uint8_t *, size_t> rom();
+    virtual std::tuple<uint8_t *, size_t> save_ram();
+
+    // Micro-benchmarks for internal code paths, see “z8tool test”
+    void bench_tline();
+    void bench_bindings();
 
 private:
     void runtime_error(std::string str);
+    void load_code(std::string const &code, bool glue = true);
+
+    struct checkpoint_data;
+
+    // Moving a heap image from the arena at address from to the one at to,
+    // after checking it; C functions keep their address, are collected,
+    // or are encoded to and decoded from indices into m_natives. The Lua
+    // threads move along. See relocate.cpp.
+    enum class natives : uint8_t { keep, encode, decode, collect };
+    class walker;
+    bool relocate(uint8_t *data, size_t size, uintptr_t from, uintptr_t to,
+                  natives mode, uintptr_t threads[2]) const;
+    void collect_natives();
+    void attach_lua();
+
+    static void *alloc(void *ud, void *ptr, size_t osize, size_t nsize);
     static int panic_hook(struct lua_State *l);
     static void instruction_hook(struct lua_State *l, struct lua_Debug *ar);
 
@@ -109,15 +158,13 @@ private:
     bool private_load(std::string str);
     void private_stub(std::string str);
 
-    // Asynchronous download system (WIP)
+    // Called by the main loop before _draw(), which is skipped when this
+    // returns false; the argument is the rate of the cart’s frames
+    bool private_draw_frame(int16_t fps);
+
+    // Asynchronous download system: polled until the cart is ready
     tup<bool, bool, std::string> private_download(opt<std::string> str);
-    struct
-    {
-        int step;
-        lol::net::http::client client;
-        std::string cart_path;
-    }
-    download_state;
+    std::string m_download;
 
     // System
     void api_run();
@@ -191,6 +238,9 @@ private:
     // Deprecated
     fix32 api_time();
 
+    // ZEPTO-8 extensions
+    fix32 api_draw_list();
+
 public:
     // The API we export to extension languages
     template<typename T> struct exported_api
@@ -257,8 +307,11 @@ public:
 
             { "time", bind<&vm::api_time>() },
 
+            { "__draw", bind<&vm::api_draw_list>() },
+
             { "__cartdata", bind<&vm::private_cartdata>() },
             { "__download", bind<&vm::private_download>() },
+            { "__draw_frame", bind<&vm::private_draw_frame>() },
             { "__is_api",   bind<&vm::private_is_api>() },
             { "__load",     bind<&vm::private_load>() },
             { "__stub",     bind<&vm::private_stub>() },
@@ -272,10 +325,45 @@ private:
 
     void set_pixel(int16_t x, int16_t y, uint32_t color_bits);
 
-    void hline(int16_t x1, int16_t x2, int16_t y, uint32_t color_bits);
-    void vline(int16_t x, int16_t y1, int16_t y2, uint32_t color_bits);
+    struct span_state;
+    void hline(int16_t x1, int16_t x2, int16_t y, uint32_t color_bits,
+               int64_t cost = cpu_fill_pixel);
+    void sym_hline(int16_t x, int16_t y, int16_t dy, int16_t in, int16_t out,
+                   uint32_t color_bits, int64_t cost);
+    void vline(int16_t x, int16_t y1, int16_t y2, uint32_t color_bits,
+               int64_t cost = cpu_fill_pixel);
+
+    struct blit_state;
+    void blit(int16_t sx, int16_t sy, int16_t sw, int16_t sh,
+              int16_t dx, int16_t dy, int16_t dw, int16_t dh,
+              bool flip_x, bool flip_y);
+    template<bool SCALED, bool FLIP_X, bool FLIP_Y>
+    void blit_kernel(int16_t sx, int16_t sy, int16_t sw, int16_t sh,
+                     int16_t dx, int16_t dy, int16_t dw, int16_t dh);
+
+    template<bool FAST>
+    void tline_kernel(int16_t x0, int16_t y0, int16_t x1, int16_t y1,
+                      fix32 mx, fix32 my, fix32 mdx, fix32 mdy, int16_t layer);
+
+    void dirty_memory(int addr, int size);
+    void print_glyph(uint8_t ch, int16_t w, int16_t x, int16_t y, uint32_t color_bits);
+
+    // Account for the CPU cost of drawing count pixels
+    inline void charge_pixels(int64_t count, int64_t cost)
+    {
+        m_cpu.system += count * cost;
+        m_profiler.pixels += count;
+    }
 
     void getaudio(int channel, void *buffer, int bytes);
+    int getaudio_run(int channel, int16_t *buffer, int count, float const *music_volume);
+    int music_run(int count, float *offset, float *volume) const;
+    void mix_audio(int16_t *buffer, int frames, bool stereo);
+    void update_music();
+    void end_profile_frame(float seconds);
+    void collect_garbage();
+    size_t state_fixed() const;
+    void save_cartdata();
     void update_registers();
     void update_prng();
     void set_music_pattern(int pattern);
@@ -284,17 +372,146 @@ public:
     // TODO: try to get rid of this
     struct lua_State *m_sandbox_lua;
 
+    // Used by the bindings to time API calls
+    bool is_profiling() const { return m_profiler.enabled; }
+    void profile_call(int id, float seconds);
+
 private:
+    // The Lua heap, four times as large as the PICO-8 limit of 2 MiB to
+    // allow for fragmentation and for the BIOS
+    heap m_heap { 8 << 20 };
+
+    // Heap usage after loading the BIOS, and the memory available to carts
+    size_t m_heap_base = 0;
+    static size_t const lua_memory = 2 << 20;
+
+    // Heap usage when the last collection cycle between frames completed,
+    // and whether one is in progress
+    size_t m_gc_mark = 0;
+    bool m_gc_running = false;
+
+    // The heap pages of the last checkpoint saved or restored, which new
+    // checkpoints share when nothing changed
+    mutable heap::pages m_heap_pages;
+
+    // The C functions a heap may point to, sorted, the node empty tables
+    // share, and a hash of their layout that identifies this build in
+    // snapshots; plus the heap image being saved or loaded
+    std::vector<uintptr_t> m_natives;
+    uintptr_t m_dummy_node = 0;
+    uint64_t m_build = 0;
+    mutable std::vector<uint8_t> m_image;
+
     struct lua_State *m_lua;
     cart m_cart;
     memory m_ram;
     state m_state;
 
-    // Files
+    // Files; the persistent data is saved after steps that changed it in
+    // any way, by comparing it with the last data saved
     std::string m_cartdata;
+    uint8_t m_cartdata_saved[sizeof(memory::persistent)];
+
+    // Output of printh(), written by another thread
+    std::shared_ptr<logger::channel> m_log;
+
+    // Video started by extcmd("rec"), named after the cart
+    std::string m_name;
+    std::unique_ptr<gif_recorder> m_gif;
 
     lol::timer m_timer;
-    int m_instructions = 0;
+
+    // Steps since the VM was made deterministic, which then act as a clock
+    bool m_deterministic = false;
+    int m_ticks = 0;
+
+    // Frames to skip, and the rate the cart last asked for
+    int m_skip_frames = 0;
+    float m_frame_rate = 60.f;
+
+    // CPU cost model, in 1/16 cycles of the 8 MHz PICO-8 CPU; the weights
+    // are approximations of https://pico-8.fandom.com/wiki/CPU
+    enum : int64_t
+    {
+        cpu_unit = 16,
+        cpu_per_second = 8000000 * cpu_unit,
+        cpu_per_tick = cpu_per_second / 60,
+
+        cpu_instruction = cpu_unit,         // any Lua VM instruction
+        cpu_pixel = cpu_unit,               // pset(), line(), print()…
+        cpu_fill_pixel = cpu_unit / 8,      // cls(), rectfill(), circfill()…
+        cpu_blit_pixel = cpu_unit / 4,      // spr(), sspr(), map()
+        cpu_tline_pixel = cpu_unit / 2,
+        cpu_byte = cpu_unit / 16,           // memcpy(), memset(), reload()
+    };
+
+    struct
+    {
+        // Costs since the last flip, split between Lua and the API
+        int64_t lua = 0, system = 0;
+        // Total cost at the beginning of the current tick
+        int64_t tick = 0;
+        // Whether the cart was preempted instead of reaching flip()
+        bool preempted = false;
+    }
+    m_cpu;
+
+    // The cart's main coroutine, the only one the CPU budget may preempt;
+    // refreshed by each step() and never saved with the CPU state
+    struct lua_State *m_main_thread = nullptr;
+
+    // Profiler counters for the current frame, by binding index for the
+    // API calls, and the data for the last complete frame. Samples come
+    // from the audio thread.
+    struct
+    {
+        bool enabled = false;
+        std::vector<int> count;
+        std::vector<float> time;
+        float gc = 0.f, idle_gc = 0.f;
+        int64_t pixels = 0;
+        std::atomic<int64_t> samples { 0 };
+        profile last;
+    }
+    m_profiler;
+
+    // Sampling profiler, run from the instruction hook, which is called
+    // every hook_period instructions
+    static int const hook_period = 1000;
+    void sample_stack(struct lua_State *l);
+
+    struct
+    {
+        int period = 0, countdown = 0; // in hook calls
+        stack_samples samples;
+        std::string key;
+    }
+    m_sampler;
+
+    // Screen rows modified since the last clear_dirty(), and a copy of
+    // the presentation registers at that time
+    struct
+    {
+        std::bitset<128> rows;
+        uint8_t palette[16], mode;
+        uint8_t raster[sizeof(hw_state_t::raster)];
+    }
+    m_dirty;
+
+    // Where dirty_memory() also reports writes, for memory viewers
+    write_tracker *m_tracker = nullptr;
+
+    // Output rate, and state of the linear resampler that converts the
+    // 22050 Hz mix to it: the output advances by step/den native samples
+    // per frame, and phase/den is the position between prev and next.
+    struct
+    {
+        int rate = 22050;
+        int step = 1, den = 1, phase = 0;
+        int16_t prev = 0, next = 0;
+        std::vector<int16_t> buffer;
+    }
+    m_resampler;
 };
 
 } // namespace z8::pico8
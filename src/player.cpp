@@ -19,8 +19,12 @@
 #include <lol/vector>    // lol::vec2
 #include <lol/transform> // lol::mat4
 #include <lol/color>     // lol::color
+#include <chrono>        // std::chrono
+#include <cstring>       // memcpy()
 
 #include "player.h"
+#include "recording.h"
+#include "rewind.h"
 
 #include "zepto8.h"
 #include "pico8/vm.h"
@@ -30,6 +34,53 @@
 namespace z8
 {
 
+// Screen presentation with the palette lookup done on the GPU. Pixels are
+// blended with their neighbours only across their edges, over about one
+// window pixel (sharp bilinear filtering), so that the screen stays crisp
+// at any scale; with integer scales this is the same as nearest filtering.
+static char const *palette_shader = R"(
+[vert.glsl]
+#version 130
+
+attribute vec2 in_position;
+
+uniform vec4 u_area; // screen corners in clip space
+
+varying vec2 pass_texcoord;
+
+void main()
+{
+    gl_Position = vec4(mix(u_area.xy, u_area.zw, in_position), 0.0, 1.0);
+    pass_texcoord = vec2(in_position.x, 1.0 - in_position.y) * 128.0;
+}
+
+[frag.glsl]
+#version 130
+
+uniform sampler2D u_screen;  // 128×128 palette indices
+uniform sampler2D u_palette; // 256×1 colours
+uniform float u_scale;       // window pixels per screen pixel
+
+varying vec2 pass_texcoord;
+
+vec4 lookup(vec2 p)
+{
+    float index = texture2D(u_screen, (clamp(p, 0.0, 127.0) + 0.5) / 128.0).r;
+    return texture2D(u_palette, vec2((index * 255.0 + 0.5) / 256.0, 0.5));
+}
+
+void main()
+{
+    vec2 p = pass_texcoord - 0.5;
+    vec2 base = floor(p);
+    vec2 t = clamp((p - base - 0.5) * u_scale + 0.5, 0.0, 1.0);
+
+    vec4 top = mix(lookup(base), lookup(base + vec2(1.0, 0.0)), t.x);
+    vec4 bottom = mix(lookup(base + vec2(0.0, 1.0)), lookup(base + vec2(1.0, 1.0)), t.x);
+    gl_FragColor = mix(top, bottom, t.y);
+}
+)";
+
 player::player(bool is_embedded, bool is_raccoon)
   : m_input_map
     {
@@ -90,12 +141,12 @@ player::player(bool is_embedded, bool is_raccoon)
     scene.PushCamera(m_scenecam);
     lol::Ticker::Ref(m_scenecam);
 
-    // Register audio callbacks
-    for (int i = 0; i < 4; ++i)
+    // Register audio callback; the VM mixes all channels itself
+    auto f = [this](void *buffer, int bytes)
     {
-        auto f = m_vm->get_streamer(i);
-        m_streams[i] = lol::audio::start_streaming(f, lol::audio::format::sint16le, 22050, 1);
-    }
+        m_vm->get_audio((int16_t *)buffer, bytes / (int)sizeof(int16_t), false);
+    };
+    m_stream = lol::audio::start_streaming(f, lol::audio::format::sint16le, 22050, 1);
 
     // FIXME: the image gets deleted by TextureImage class, it
     // does not seem right to me.
@@ -111,17 +162,23 @@ player::player(bool is_embedded, bool is_raccoon)
 
     /* Allocate memory */
     m_screen.resize(128 * 128);
+    m_indices.resize(128 * 128);
+    m_palette.resize(256);
 }
 
 player::~player()
 {
+    m_runner.stop();
+
     lol::TileSet::destroy(m_tile);
 #if 0
     lol::TileSet::destroy(m_font_tile);
 #endif
 
-    for (int i = 0; i < 4; ++i)
-        lol::audio::stop_streaming(i);
+    lol::audio::stop_streaming(m_stream);
+
+    if (m_recording && !m_replay)
+        m_recording->save(m_recording_name);
 
     lol::Scene& scene = lol::Scene::GetScene();
     lol::Ticker::Unref(m_scenecam);
@@ -130,12 +187,117 @@ player::~player()
 
 void player::load(std::string const &name)
 {
+    m_runner.stop();
     m_vm->load(name);
+    m_cart_name = name;
+
+    std::error_code ec;
+    m_cart_time = std::filesystem::last_write_time(name, ec);
 }
 
 void player::run()
 {
+    m_runner.stop();
     m_vm->run();
+    if (m_tracking)
+    {
+        auto ram = m_vm->ram(), rom = m_vm->rom();
+        m_tracker.attach(std::get<0>(ram), std::get<1>(ram));
+        m_ram.assign(std::get<0>(ram), std::get<0>(ram) + std::get<1>(ram));
+        m_rom.assign(std::get<0>(rom), std::get<0>(rom) + std::get<1>(rom));
+    }
+    m_vm->set_write_tracker(m_tracking ? &m_tracker : nullptr);
+    m_runner.set_memory_snapshots(m_tracking);
+    m_runner.start([this](int steps) { step_vm(steps); });
+}
+
+void player::record(std::string const &name)
+{
+    auto now = std::chrono::high_resolution_clock::now();
+    m_recording = std::make_unique<recording>();
+    m_recording->start(*m_vm, (uint32_t)now.time_since_epoch().count());
+    m_recording->set_cart(m_cart_name);
+    m_recording_name = name;
+    m_replay = false;
+}
+
+bool player::replay(std::string const &name)
+{
+    m_recording = std::make_unique<recording>();
+    if (!m_recording->load(name))
+    {
+        m_recording.reset();
+        return false;
+    }
+    m_recording->restart(*m_vm);
+    m_replay = true;
+    return true;
+}
+
+// Queue live input for the VM thread, unless a recording is being replayed
+void player::send_buttons(uint32_t mask)
+{
+    if (m_replay || mask == m_sent_buttons)
+        return;
+    m_sent_buttons = mask;
+    m_runner.send({ vm_runner::input::kind::button, int(mask) });
+}
+
+void player::send_mouse(lol::ivec2 coords, int buttons)
+{
+    lol::ivec3 const mouse(coords, buttons);
+    if (m_replay || mouse == m_sent_mouse)
+        return;
+    m_sent_mouse = mouse;
+    m_runner.send({ vm_runner::input::kind::mouse, coords.x, coords.y, buttons });
+}
+
+void player::send_text(char ch)
+{
+    if (m_replay)
+        return;
+    m_runner.send({ vm_runner::input::kind::text, (uint8_t)ch });
+}
+
+void player::show_profile(bool enable)
+{
+    m_show_profile = enable;
+    m_runner.send({ vm_runner::input::kind::profiling, enable ? 1 : 0 });
+}
+
+void player::set_sampling(int period)
+{
+    m_runner.send({ vm_runner::input::kind::sampling, std::max(period, 0) });
+}
+
+void player::poke(size_t addr, uint8_t value)
+{
+    if (addr >= m_ram.size())
+        return;
+
+    // Show the new value until the VM thread sends its next frame
+    m_ram[addr] = value;
+    m_runner.send({ vm_runner::input::kind::poke, int(addr), value });
+}
+
+void player::poke_rom(size_t addr, uint8_t value)
+{
+    if (addr >= m_rom.size())
+        return;
+
+    m_rom[addr] = value;
+    m_runner.send({ vm_runner::input::kind::poke_rom, int(addr), value });
+}
+
+std::shared_ptr<stack_samples const> player::get_samples()
+{
+    std::lock_guard<std::mutex> lock(m_samples_mutex);
+    return m_samples;
+}
+
+void player::set_rewind(size_t budget)
+{
+    m_rewind = budget ? std::make_unique<rewind>(budget) : nullptr;
 }
 
 void player::tick_game(float seconds)
@@ -144,7 +306,9 @@ void player::tick_game(float seconds)
 
     // Aspect ratio
     m_win_size = lol::Video::GetSize();
-    m_scale = (float)std::min(m_win_size.x / SCREEN_WIDTH, m_win_size.y / SCREEN_HEIGHT);
+    m_scale = m_gpu_palette
+            ? std::min((float)m_win_size.x / SCREEN_WIDTH, (float)m_win_size.y / SCREEN_HEIGHT)
+            : (float)std::min(m_win_size.x / SCREEN_WIDTH, m_win_size.y / SCREEN_HEIGHT);
     m_screen_pos = lol::ivec2((lol::vec2(m_win_size) - lol::vec2(SCREEN_WIDTH * m_scale, SCREEN_HEIGHT * m_scale)) / 2.f);
     m_scenecam->SetProjection(lol::mat4::ortho(0.f, (float)m_win_size.x, 0.f, (float)m_win_size.y, -100.f, 100.f));
 
@@ -159,44 +323,216 @@ void player::tick_game(float seconds)
     int buttons = (mouse->button(lol::input::button::BTN_Left) ? 1 : 0)
                 + (mouse->button(lol::input::button::BTN_Right) ? 2 : 0)
                 + (mouse->button(lol::input::button::BTN_Middle) ? 4 : 0);
-    m_vm->mouse(lol::ivec2(mx, my), buttons);
+    send_mouse(lol::ivec2(mx, my), buttons);
 
-    // Joystick events
+    // Joystick and keyboard events as buttons
+    uint32_t held = 0;
     if (auto joy = lol::input::joystick(0))
     {
-        m_vm->button(0, joy->button(lol::input::button::BTN_DpadLeft));
-        m_vm->button(1, joy->button(lol::input::button::BTN_DpadRight));
-        m_vm->button(2, joy->button(lol::input::button::BTN_DpadUp));
-        m_vm->button(3, joy->button(lol::input::button::BTN_DpadDown));
-        m_vm->button(4, joy->button(lol::input::button::BTN_A));
-        m_vm->button(5, joy->button(lol::input::button::BTN_B));
-        m_vm->button(6, joy->button(lol::input::button::BTN_Start));
+        held |= joy->button(lol::input::button::BTN_DpadLeft) ? 1 << 0 : 0;
+        held |= joy->button(lol::input::button::BTN_DpadRight) ? 1 << 1 : 0;
+        held |= joy->button(lol::input::button::BTN_DpadUp) ? 1 << 2 : 0;
+        held |= joy->button(lol::input::button::BTN_DpadDown) ? 1 << 3 : 0;
+        held |= joy->button(lol::input::button::BTN_A) ? 1 << 4 : 0;
+        held |= joy->button(lol::input::button::BTN_B) ? 1 << 5 : 0;
+        held |= joy->button(lol::input::button::BTN_Start) ? 1 << 6 : 0;
     }
 
     if (!m_embedded)
     {
-        // Keyboard events as buttons
         for (auto const &k : m_input_map)
-            m_vm->button(k.second, keyboard->key(k.first));
+            held |= keyboard->key(k.first) ? 1 << k.second : 0;
 
         // Keyboard events as text
         if (keyboard->key_pressed(lol::input::key::SC_Return))
-            m_vm->text('\r');
+            send_text('\r');
         if (keyboard->key_pressed(lol::input::key::SC_Backspace))
-            m_vm->text('\x08');
+            send_text('\x08');
         if (keyboard->key_pressed(lol::input::key::SC_Delete))
-            m_vm->text('\x7f');
+            send_text('\x7f');
+
+        if (keyboard->key_pressed(lol::input::key::SC_F3))
+            show_profile(!m_show_profile);
 
         for (auto ch : keyboard->text())
-            m_vm->text(ch);
+            send_text(ch);
     }
 
+    send_buttons(held);
+
     // Drag-and-drop events
     if (lol::input::has_dnd())
         lol::msg::info("dropped file %s\n", lol::input::get_dnd().c_str());
 
-    // Step the VM
-    m_vm->step(seconds);
+    // Look for changes to the cart file twice per second
+    if (m_watch && !m_recording && (m_watch_delay -= seconds) <= 0.f)
+    {
+        m_watch_delay = 0.5f;
+        std::error_code ec;
+        auto const time = std::filesystem::last_write_time(m_cart_name, ec);
+        if (!ec && time != m_cart_time)
+        {
+            m_cart_time = time;
+            m_reload = true;
+        }
+    }
+
+    // Rewind instead of stepping the VM while F5 is held
+    m_rewinding = m_rewind && !m_recording && !m_embedded && keyboard->key(lol::input::key::SC_F5);
+}
+
+// Apply the queued input, then step the VM, on the VM thread
+void player::step_vm(int steps)
+{
+    vm_runner::input in;
+    while (m_runner.receive(in))
+    {
+        switch (in.type)
+        {
+        case vm_runner::input::kind::button:
+            m_held = uint32_t(in.a);
+            m_pressed |= m_held;
+            break;
+        case vm_runner::input::kind::mouse:
+            m_vm->mouse(lol::ivec2(in.a, in.b), in.c);
+            if (m_recording)
+                m_recording->mouse(lol::ivec2(in.a, in.b), in.c);
+            break;
+        case vm_runner::input::kind::text:
+            m_vm->text(char(in.a));
+            if (m_recording)
+                m_recording->text(char(in.a));
+            break;
+        case vm_runner::input::kind::profiling:
+            m_vm->set_profiling(in.a != 0);
+            break;
+        case vm_runner::input::kind::sampling:
+            m_vm->set_sampling(in.a);
+            m_sampling = in.a > 0;
+            m_samples_age = 30;
+            break;
+        case vm_runner::input::kind::poke:
+        {
+            auto ram = m_vm->ram();
+            if (size_t(in.a) >= std::get<1>(ram))
+                break;
+            std::get<0>(ram)[in.a] = uint8_t(in.b);
+            if (m_tracking)
+                m_tracker.record(size_t(in.a), 1);
+            break;
+        }
+        case vm_runner::input::kind::poke_rom:
+        {
+            // The cart may have been reloaded since the edit was queued
+            auto rom = m_vm->rom();
+            if (size_t(in.a) < std::get<1>(rom))
+                std::get<0>(rom)[in.a] = uint8_t(in.b);
+            break;
+        }
+        }
+    }
+
+    if (m_reload.exchange(false))
+    {
+        lol::timer t;
+        if (m_vm->hot_reload(m_cart_name))
+            lol::msg::info("reloaded %s in %.1f ms\n", m_cart_name.c_str(), t.get() * 1000.f);
+    }
+
+    // When catching up, only the last frame is drawn, except in recordings
+    // which check every frame
+    bool const rewinding = m_rewinding;
+    if (!m_recording && !rewinding)
+        m_vm->skip_frames(m_runner.scheduler().skip_frames(steps, m_vm->get_frame_rate()));
+
+    for (int n = 0; n < steps && !m_tracker.stopped(); ++n)
+    {
+        // Buttons count once per frame while held; presses shorter than a
+        // frame still count for one frame
+        for (int i = 0; i < 32; ++i)
+        {
+            if (!(m_pressed & (1u << i)))
+                continue;
+            m_vm->button(i, 1);
+            if (m_recording)
+                m_recording->button(i, 1);
+        }
+        m_pressed = m_held;
+
+        if (rewinding)
+        {
+            m_rewind->pop(*m_vm);
+            if (m_tracking)
+                m_tracker.update(false);
+            continue;
+        }
+
+        // Step the VM
+        if (m_replay)
+            m_recording->replay(*m_vm, m_frame);
+        m_vm->step(1.f / 60.f);
+
+        if (m_rewind && !m_recording)
+            m_rewind->push(*m_vm);
+
+        if (m_replay)
+        {
+            if (!m_recording->check(*m_vm, m_frame))
+                lol::msg::error("replay: screen differs at frame %d\n", m_frame);
+        }
+        else if (m_recording)
+            m_recording->end_frame(*m_vm, true);
+        ++m_frame;
+
+        write_tracker::hit h;
+        if (m_tracking && m_tracker.update() && m_tracker.get_hit(h))
+            lol::msg::info("watchpoint: 0x%04x changed from 0x%02x to 0x%02x at frame %d\n",
+                           int(h.address), h.old_value, h.new_value, m_frame);
+    }
+
+    if (m_sampling && (m_samples_age += steps) >= 30)
+    {
+        m_samples_age = 0;
+        auto samples = std::make_shared<stack_samples const>(m_vm->get_samples());
+        std::lock_guard<std::mutex> lock(m_samples_mutex);
+        m_samples = std::move(samples);
+    }
+
+    m_runner.publish(*m_vm);
+}
+
+bool player::render(lol::u8vec4 *screen)
+{
+    auto const *f = m_runner.latest();
+    if (!f)
+        return false;
+
+    lol::u8vec4 pal[256];
+    for (int n = 0; n < f->colors; ++n)
+        pal[n] = lol::u8vec4(uint8_t(f->palette[n] >> 16), uint8_t(f->palette[n] >> 8),
+                             uint8_t(f->palette[n]), 0xff);
+    for (int i = 0; i < 128 * 128; ++i)
+        screen[i] = pal[f->pixels[i]];
+
+    update_stats(*f);
+    update_memory(*f);
+    return true;
+}
+
+void player::update_stats(vm_runner::frame const &f)
+{
+    m_profile = f.profile;
+    m_dropped = int(f.stats.dropped - m_stats.dropped);
+    m_stats = f.stats;
+}
+
+void player::update_memory(vm_runner::frame const &f)
+{
+    // Same size, so that views of m_ram and m_rom stay valid
+    if (m_ram.size() && f.ram.size() == m_ram.size())
+        memcpy(m_ram.data(), f.ram.data(), m_ram.size());
+    if (m_rom.size() && f.rom.size() == m_rom.size())
+        memcpy(m_rom.data(), f.rom.data(), m_rom.size());
 }
 
 void player::tick_draw(float seconds, lol::Scene &scene)
@@ -221,19 +557,147 @@ void player::tick_draw(float seconds, lol::Scene &scene)
 
     if (!m_embedded)
     {
-        // Render the VM screen to our buffer
-        m_vm->render(m_screen.data());
-
-        // Blit buffer to the texture
+        // Blit the latest VM frame to the texture, but only if the VM
+        // finished a new one since last time
         // FIXME: move this to some kind of memory viewer class?
-        m_tile->GetTexture()->Bind();
-        m_tile->GetTexture()->SetData(m_screen.data());
-
         scene.get_renderer()->clear_color(lol::color::black);
+        if (m_gpu_palette)
+        {
+            draw_indexed();
+            return;
+        }
+
+        if (render(m_screen.data()))
+        {
+            if (m_show_profile)
+                draw_profile([this](int x, int y, lol::u8vec4 color)
+                {
+                    m_screen[y * SCREEN_WIDTH + x] = color;
+                });
+
+            m_tile->GetTexture()->Bind();
+            m_tile->GetTexture()->SetData(m_screen.data());
+        }
+
         scene.AddTile(m_tile, 0, lol::vec3((float)m_screen_pos.x, (float)m_screen_pos.y, 10.f), lol::vec2(m_scale), 0.f);
     }
 }
 
+void player::draw_indexed()
+{
+    auto &gpu = m_gpu;
+
+    if (!gpu.shader)
+    {
+        gpu.shader = lol::Shader::Create("zepto8-palette", palette_shader);
+        gpu.coord = gpu.shader->GetAttribLocation(lol::VertexUsage::Position, 0);
+        gpu.screen_uni = gpu.shader->GetUniformLocation("u_screen");
+        gpu.palette_uni = gpu.shader->GetUniformLocation("u_palette");
+        gpu.area_uni = gpu.shader->GetUniformLocation("u_area");
+        gpu.scale_uni = gpu.shader->GetUniformLocation("u_scale");
+
+        // Two triangles covering the unit square
+        lol::vec2 const quad[] =
+        {
+            { 0.f, 0.f }, { 1.f, 0.f }, { 1.f, 1.f },
+            { 0.f, 0.f }, { 1.f, 1.f }, { 0.f, 1.f },
+        };
+        gpu.vdecl = std::make_shared<lol::VertexDeclaration>(lol::VertexStream<lol::vec2>(lol::VertexUsage::Position));
+        gpu.vbo = std::make_shared<lol::VertexBuffer>(sizeof(quad));
+        memcpy(gpu.vbo->Lock(0, 0), quad, sizeof(quad));
+        gpu.vbo->Unlock();
+
+        gpu.screen = std::make_shared<lol::Texture>(lol::ivec2(128, 128), lol::PixelFormat::Y_8);
+        gpu.palette = std::make_shared<lol::Texture>(lol::ivec2(256, 1), lol::PixelFormat::RGBA_8);
+    }
+
+    // Upload the latest VM frame, but only if the VM finished a new one
+    // since last time
+    if (auto const *f = m_runner.latest())
+    {
+        memcpy(m_indices.data(), f->pixels, sizeof(f->pixels));
+        m_colors = f->colors;
+        for (int n = 0; n < m_colors; ++n)
+            m_palette[n] = lol::u8vec4(uint8_t(f->palette[n] >> 16), uint8_t(f->palette[n] >> 8),
+                                       uint8_t(f->palette[n]), 0xff);
+        update_stats(*f);
+        update_memory(*f);
+
+        // Profiling bars get palette entries after the frame’s colours
+        if (m_show_profile)
+            draw_profile([this](int x, int y, lol::u8vec4 color)
+            {
+                int n = 0;
+                while (n < m_colors && m_palette[n] != color)
+                    ++n;
+                if (n == m_colors && m_colors < 256)
+                    m_palette[m_colors++] = color;
+                m_indices[y * SCREEN_WIDTH + x] = uint8_t(std::min(n, 255));
+            });
+
+        gpu.screen->Bind();
+        gpu.screen->SetData(m_indices.data());
+        gpu.palette->Bind();
+        gpu.palette->SetData(m_palette.data());
+    }
+
+    lol::vec2 const p0 = lol::vec2(m_screen_pos) / lol::vec2(m_win_size) * 2.f - lol::vec2(1.f);
+    lol::vec2 const p1 = p0 + lol::vec2(SCREEN_WIDTH, SCREEN_HEIGHT) * m_scale / lol::vec2(m_win_size) * 2.f;
+
+    gpu.shader->Bind();
+    gpu.shader->SetUniform(gpu.screen_uni, gpu.screen->GetTextureUniform(), 0);
+    gpu.shader->SetUniform(gpu.palette_uni, gpu.palette->GetTextureUniform(), 1);
+    gpu.shader->SetUniform(gpu.area_uni, lol::vec4(p0, p1));
+    gpu.shader->SetUniform(gpu.scale_uni, m_scale);
+    gpu.vdecl->SetStream(gpu.vbo, gpu.coord);
+    gpu.vdecl->Bind();
+    gpu.vdecl->DrawElements(lol::MeshPrimitive::Triangles, 0, 6);
+    gpu.vdecl->Unbind();
+    gpu.shader->Unbind();
+}
+
+// Draw the last frame’s profile as a stacked bar over the first rows of
+// the screen, where the full width is one 60 fps frame, followed by a
+// second bar for the garbage collector, and a third one with a mark for
+// each frame skipped since the previous one.
+void player::draw_profile(std::function<void(int, int, lol::u8vec4)> const &plot)
+{
+    auto const &p = m_profile;
+
+    struct { float time; lol::u8vec4 color; } const parts[] =
+    {
+        { p.lua,   lol::u8vec4(41, 173, 255, 255) },
+        { p.gfx,   lol::u8vec4(0, 228, 54, 255) },
+        { p.sfx,   lol::u8vec4(255, 236, 39, 255) },
+        { p.mem,   lol::u8vec4(255, 163, 0, 255) },
+        { p.other, lol::u8vec4(194, 195, 199, 255) },
+    };
+
+    auto bar = [&plot](int y, int x0, int x1, lol::u8vec4 color)
+    {
+        for (int j = y; j < y + 2; ++j)
+            for (int i = std::max(x0, 0); i < std::min(x1, SCREEN_WIDTH); ++i)
+                plot(i, j, color);
+    };
+
+    bar(0, 0, SCREEN_WIDTH, lol::u8vec4(0, 0, 0, 255));
+    bar(2, 0, SCREEN_WIDTH, lol::u8vec4(0, 0, 0, 255));
+
+    float x = 0.f;
+    for (auto const &part : parts)
+    {
+        float x1 = x + part.time * 60.f * SCREEN_WIDTH;
+        bar(0, (int)x, (int)x1, part.color);
+        x = x1;
+    }
+
+    bar(2, 0, (int)(p.gc * 60.f * SCREEN_WIDTH), lol::u8vec4(255, 0, 77, 255));
+
+    bar(4, 0, SCREEN_WIDTH, lol::u8vec4(0, 0, 0, 255));
+    for (int n = 0; n < m_dropped; ++n)
+        bar(4, n * 4, n * 4 + 3, lol::u8vec4(255, 119, 168, 255));
+}
+
 lol::Texture *player::get_texture()
 {
     return m_tile ? m_tile->GetTexture() : nullptr;
@@ -13,20 +13,31 @@
 #pragma once
 
 #include <lol/engine.h> // lol::input
-#include <map>    // std::map
-#include <vector> // std::vector
-#include <memory> // std::shared_ptr
+#include <atomic>     // std::atomic
+#include <filesystem> // std::filesystem
+#include <functional> // std::function
+#include <map>        // std::map
+#include <vector>     // std::vector
+#include <memory>     // std::shared_ptr
+#include <mutex>      // std::mutex
 
 #include "zepto8.h"
+#include "runner.h"
+#include "tracker.h"
 #include "pico8/cart.h"
 
 // The player class
 // ————————————————
-// This is a high-level Lol Engine entity that runs the ZEPTO-8 VM.
+// This is a high-level Lol Engine entity that runs the ZEPTO-8 VM. Once
+// run() is called, the VM steps on its own thread at 60 Hz, and the game
+// and draw ticks only send input to it and show the latest frame.
 
 namespace z8
 {
 
+class recording;
+class rewind;
+
 class player : public lol::WorldEntity
 {
 public:
@@ -39,8 +50,53 @@ public:
     void load(std::string const &name);
     void run();
 
+    // Record live input to a file when the player is destroyed, or replay
+    // input from a file instead; both must be called before run()
+    void record(std::string const &name);
+    bool replay(std::string const &name);
+
+    // Show profiling bars on top of the VM screen (toggled with F3)
+    void show_profile(bool enable);
+
+    // Present frames as palette indices, looked up by a shader, instead of
+    // converting them to RGBA; this uploads a quarter of the data and lets
+    // the GPU scale the screen to any size with sharp bilinear filtering
+    void set_gpu_palette(bool enable) { m_gpu_palette = enable; }
+
+    // Sample the cart’s call stacks every period instructions, or stop if
+    // period is 0; the samples are copied from the VM thread twice per
+    // second
+    void set_sampling(int period);
+    std::shared_ptr<stack_samples const> get_samples();
+
+    // Keep a history of VM states within a memory budget, so that the
+    // cart can be rewound by holding F5; disabled while recording
+    void set_rewind(size_t budget);
+
+    // Hot reload the cart when its file changes, if the VM supports it;
+    // disabled while recording or replaying
+    void set_watch(bool enable) { m_watch = enable; }
+
+    // Track writes to the VM’s RAM after each frame, for memory viewers
+    // and watchpoints, which pause the VM when hit; must be called before
+    // run()
+    void set_tracking(bool enable) { m_tracking = enable; }
+    write_tracker &get_tracker() { return m_tracker; }
+
+    // With tracking, copies of the VM’s RAM and ROM as of the latest frame,
+    // for viewers on the UI thread, and writes to the real memory, which
+    // are queued to the VM thread
+    std::tuple<uint8_t *, size_t> get_ram() { return { m_ram.data(), m_ram.size() }; }
+    std::tuple<uint8_t *, size_t> get_rom() { return { m_rom.data(), m_rom.size() }; }
+    void poke(size_t addr, uint8_t value);
+    void poke_rom(size_t addr, uint8_t value);
+
     std::shared_ptr<vm_base> get_vm() { return m_vm; }
 
+    // Convert the latest frame of the VM thread to RGBA; returns false if
+    // there is no new frame since the last call
+    bool render(lol::u8vec4 *screen);
+
     // HACK: if get_texture() is called, rendering is disabled (this
     // is so that we do not overwrite the IDE screen)
     lol::Texture *get_texture();
@@ -48,18 +104,86 @@ public:
 
 private:
     std::shared_ptr<vm_base> m_vm;
+    vm_runner m_runner;
+
+    // Called on the VM thread with the number of frames that are due
+    void step_vm(int steps);
 
     std::map<lol::input::key, int> m_input_map;
+
+    void send_buttons(uint32_t mask);
+    void send_mouse(lol::ivec2 coords, int buttons);
+    void send_text(char ch);
+
+    // Latest input sent by the game tick, so that only changes are queued
+    uint32_t m_sent_buttons = 0;
+    lol::ivec3 m_sent_mouse = lol::ivec3(-1);
+
+    // Buttons held, and pressed since the last frame, on the VM thread
+    uint32_t m_held = 0, m_pressed = 0;
+    std::atomic<bool> m_rewinding { false };
+
+    // Cart file watching, with the last modification time seen
+    bool m_watch = false;
+    float m_watch_delay = 0.f;
+    std::filesystem::file_time_type m_cart_time;
+    std::atomic<bool> m_reload { false };
+
+    bool m_tracking = false;
+    write_tracker m_tracker;
+    std::vector<uint8_t> m_ram, m_rom; // on the UI thread
+
+    // Input recording or replay
+    std::unique_ptr<recording> m_recording;
+    std::string m_recording_name, m_cart_name;
+    bool m_replay = false;
+    int m_frame = 0;
+
+    std::unique_ptr<rewind> m_rewind;
     std::vector<lol::u8vec4> m_screen;
+    profile m_profile; // of the latest frame
+
+    // Stack samples, and frames since they were copied, on the VM thread
+    bool m_sampling = false;
+    int m_samples_age = 0;
+    std::mutex m_samples_mutex;
+    std::shared_ptr<stack_samples const> m_samples;
+    frame_scheduler::stats m_stats;
+    int m_dropped = 0; // frames skipped before the latest one
 
     // Video
     bool m_embedded = false;
     lol::ivec2 m_win_size;
     lol::ivec2 m_screen_pos;
     float m_scale;
+    bool m_show_profile = false;
+
+    void update_stats(vm_runner::frame const &f);
+    void update_memory(vm_runner::frame const &f);
+    void draw_profile(std::function<void(int, int, lol::u8vec4)> const &plot);
+
+    // Palette lookup on the GPU: the latest frame’s indices and palette,
+    // with room for the colours of the profiling bars
+    bool m_gpu_palette = false;
+    std::vector<uint8_t> m_indices;
+    std::vector<lol::u8vec4> m_palette;
+    int m_colors = 0;
+
+    struct
+    {
+        std::shared_ptr<lol::Shader> shader;
+        std::shared_ptr<lol::VertexDeclaration> vdecl;
+        std::shared_ptr<lol::VertexBuffer> vbo;
+        std::shared_ptr<lol::Texture> screen, palette;
+        lol::ShaderAttrib coord;
+        lol::ShaderUniform screen_uni, palette_uni, area_uni, scale_uni;
+    }
+    m_gpu;
+
+    void draw_indexed();
 
     // Audio
-    int m_streams[4];
+    int m_stream;
 
     lol::Camera *m_scenecam;
     lol::TileSet *m_tile;
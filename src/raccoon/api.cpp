@@ -21,10 +21,53 @@
 #include "zepto8.h"
 #include "raccoon/vm.h"
 #include "raccoon/font.h"
+#include "raster.h"
 
 namespace z8::raccoon
 {
 
+// The palette indirection and transparency of the current palette
+static raster::blit_palette draw_palette(memory const &ram)
+{
+    raster::blit_palette bp;
+    for (int c = 0; c < 16; ++c)
+    {
+        bp.color[c] = ram.palette[c].index;
+        bp.write[c] = ram.palette[c].trans ? 0x0 : 0xf;
+    }
+    return bp;
+}
+
+// Copy the w×h rectangle at sx,sy of the sprite sheet to dx,dy on the
+// screen. Pixels outside the screen or the sprite sheet are skipped.
+static void blit(memory &ram, raster::blit_palette const &bp,
+                 int sx, int sy, int w, int h, int dx, int dy,
+                 bool flip_x, bool flip_y)
+{
+    using std::min, std::max;
+
+    // Columns and rows whose source lies within the sheet
+    int const u0 = flip_x ? sx + w - 128 : -sx, u1 = flip_x ? sx + w : 128 - sx;
+    int const v0 = flip_y ? sy + h - 96 : -sy, v1 = flip_y ? sy + h : 96 - sy;
+
+    int const i0 = max(max(0, -dx), u0), i1 = min(min(w, 128 - dx), u1);
+    int const j0 = max(max(0, -dy), v0), j1 = min(min(h, 128 - dy), v1);
+
+    if (i0 >= i1)
+        return;
+
+    for (int j = j0; j < j1; ++j)
+    {
+        int const src_y = sy + (flip_y ? h - 1 - j : j);
+        uint8_t const *src = ram.sprites.data[src_y];
+        uint8_t *dst = ram.screen.data[dy + j];
+        if (flip_x)
+            raster::blit_row<true>(dst, dx, src, 128, sx, w, i0, i1, bp);
+        else
+            raster::blit_row<false>(dst, dx, src, 128, sx, w, i0, i1, bp);
+    }
+}
+
 void vm::api_debug(std::string s)
 {
     lol::msg::info("debug: %s\n", s.c_str());
@@ -112,7 +155,7 @@ void vm::api_fset(int n, int f, std::optional<int> v)
 
 void vm::api_cls(std::optional<int> c)
 {
-    memset(&m_ram.screen, (c.value() & 15) * 0x11, sizeof(m_ram.screen));
+    memset(&m_ram.screen, (c.value_or(0) & 15) * 0x11, sizeof(m_ram.screen));
 }
 
 void vm::api_cam(int x, int y)
@@ -125,30 +168,15 @@ void vm::api_map(int celx, int cely, int sx, int sy, int celw, int celh)
 {
     sx -= m_ram.camera.x;
     sy -= m_ram.camera.y;
-    for (int y = 0; y < celh; ++y)
-    for (int x = 0; x < celw; ++x)
+
+    auto const bp = draw_palette(m_ram);
+
+    for (int y = std::max(0, -cely); y < celh && cely + y < 64; ++y)
+    for (int x = std::max(0, -celx); x < celw && celx + x < 128; ++x)
     {
-        if (celx + x < 0 || celx + x >= 128 || cely + y < 0 || cely + y >= 64)
-            continue;
         int n = m_ram.map[cely + y][celx + x];
-        int startx = sx + x * 8, starty = sy + y * 8;
-        int sprx = n % 16 * 8, spry = n / 16 * 8;
-
-        for (int dy = 0; dy < 8; ++dy)
-        for (int dx = 0; dx < 8; ++dx)
-        {
-            if (startx + dx < 0 || startx + dx >= 128 ||
-                starty + dy < 0 || starty + dy >= 128)
-                continue;
-            if (sprx + dx < 0 || sprx + dx >= 128 ||
-                spry + dy < 0 || spry + dy >= 96)
-                continue;
-            auto c = m_ram.sprites.get(sprx + dx, spry + dy);
-            if (m_ram.palette[c].trans)
-                continue;
-            c = m_ram.palette[c].index;
-            m_ram.screen.safe_set(startx + dx, starty + dy, c);
-        }
+        blit(m_ram, bp, n % 16 * 8, n / 16 * 8, 8, 8,
+             sx + x * 8, sy + y * 8, false, false);
     }
 }
 
@@ -174,12 +202,13 @@ void vm::api_rect(int x, int y, int w, int h, int c)
     c = m_ram.palette[c & 0xf].index;
     int x0 = std::max(x, 0);
     int x1 = std::min(x + w, 127);
-    if (y >= 0 && y < 128)
-        for (int dx = x0; dx <= x1; ++dx)
-            m_ram.screen.set(dx, y, c);
-    if (y + h - 1 >= 0 && y + h - 1 < 128)
-        for (int dx = x0; dx <= x1; ++dx)
-            m_ram.screen.set(dx, y + h - 1, c);
+    if (x0 <= x1)
+    {
+        if (y >= 0 && y < 128)
+            raster::fill(m_ram.screen.data[y], x0, x1, c);
+        if (y + h - 1 >= 0 && y + h - 1 < 128)
+            raster::fill(m_ram.screen.data[y + h - 1], x0, x1, c);
+    }
     int y0 = std::max(y, 0);
     int y1 = std::min(y + h, 127);
     if (x >= 0 && x < 128)
@@ -199,9 +228,9 @@ void vm::api_rectfill(int x, int y, int w, int h, int c)
     int x1 = std::min(x + w, 127);
     int y0 = std::max(y, 0);
     int y1 = std::min(y + h, 127);
-    for (int dy = y0; dy <= y1; ++dy)
-        for (int dx = x0; dx <= x1; ++dx)
-            m_ram.screen.set(dx, dy, c);
+    if (x0 <= x1)
+        for (int dy = y0; dy <= y1; ++dy)
+            raster::fill(m_ram.screen.data[dy], x0, x1, c);
 }
 
 void vm::api_spr(int n, int x, int y,
@@ -213,21 +242,10 @@ void vm::api_spr(int n, int x, int y,
     int sx = n % 16 * 8, sy = n / 16 * 8 % 128;
     int sw = w.has_value() ? (int)(w.value() * 8) : 8;
     int sh = h.has_value() ? (int)(h.value() * 8) : 8;
-    int flip_x = fx.has_value() && fx.value();
-    int flip_y = fy.has_value() && fy.value();
-
-    for (int dy = 0; dy < sh; ++dy)
-        for (int dx = 0; dx < sw; ++dx)
-        {
-            if (x + dx < 0 || x + dx >= 128 || y + dy < 0 || y + dy >= 128)
-                continue;
-            auto c = m_ram.sprites.get(flip_x ? sx + sw - 1 - dx : sx + dx,
-                                       flip_y ? sy + sh - 1 - dy : sy + dy);
-            if (m_ram.palette[c].trans)
-                continue;
-            c = m_ram.palette[c].index;
-            m_ram.screen.set(x + dx, y + dy, c);
-        }
+    bool flip_x = fx.has_value() && fx.value();
+    bool flip_y = fy.has_value() && fy.value();
+
+    blit(m_ram, draw_palette(m_ram), sx, sy, sw, sh, x, y, flip_x, flip_y);
 }
 
 void vm::api_print(int x, int y, std::string str, int c)
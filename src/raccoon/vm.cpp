@@ -25,6 +25,7 @@ extern "C" {
 
 #include "zepto8.h"
 #include "raccoon/vm.h"
+#include "pico8/cache.h"
 #include "bios.h" // TODO: remove references to PICO-8 stuff
 #include "bindings/js.h"
 
@@ -43,10 +44,17 @@ vm::vm()
     m_ctx = JS_NewContext(m_rt);
 
     bindings::js::init(m_ctx, this);
+
+    m_init = JS_NewAtom(m_ctx, "init");
+    m_update = JS_NewAtom(m_ctx, "update");
+    m_draw = JS_NewAtom(m_ctx, "draw");
 }
 
 vm::~vm()
 {
+    JS_FreeAtom(m_ctx, m_init);
+    JS_FreeAtom(m_ctx, m_update);
+    JS_FreeAtom(m_ctx, m_draw);
 }
 
 void vm::load(std::string const &file)
@@ -162,19 +170,19 @@ void vm::run()
         "r = rnd; l = line; p = pset; c = cls; b = btn;\n";
     eval_buf(m_ctx, js_api, "<js_api>", JS_EVAL_TYPE_GLOBAL);
 
-    eval_buf(m_ctx, m_code, "<load_cart>", JS_EVAL_TYPE_GLOBAL);
-
-    std::string code =
-        "if (typeof init != 'undefined') init();\n";
-    eval_buf(m_ctx, code, "<run_code>", JS_EVAL_TYPE_GLOBAL);
+    eval_code();
+    call(m_init);
 }
 
 bool vm::step(float /* seconds */)
 {
-    std::string code =
-        "if (typeof update != 'undefined') update();\n"
-        "if (typeof draw != 'undefined') draw();\n";
-    eval_buf(m_ctx, code, "<step_code>", JS_EVAL_TYPE_GLOBAL);
+    if (call(m_update))
+    {
+        if (m_skip_frames > 0)
+            --m_skip_frames;
+        else
+            call(m_draw);
+    }
 
     m_ram.gamepad.prev_buttons = m_ram.gamepad.buttons;
     m_ram.gamepad.buttons.fill(0);
@@ -266,6 +274,74 @@ std::tuple<uint8_t *, size_t> vm::rom()
     return std::make_tuple(&m_rom[0], offsetof(decltype(m_rom), end_of_rom));
 }
 
+void vm::eval_code()
+{
+    // QuickJS refuses bytecode from another version, and the seed keeps
+    // keys apart from PICO-8 ones
+    uint64_t const key = hash64(m_code.data(), m_code.length(), 0x7263'6e6a'7362'6331);
+    auto &cache = pico8::code_cache::get();
+    std::string bytecode;
+
+    JSValue fn = JS_UNDEFINED;
+    if (cache.find(key, bytecode))
+    {
+        fn = JS_ReadObject(m_ctx, (uint8_t const *)bytecode.data(), bytecode.length(),
+                           JS_READ_OBJ_BYTECODE);
+        if (JS_IsException(fn))
+        {
+            JS_FreeValue(m_ctx, JS_GetException(m_ctx));
+            fn = JS_UNDEFINED;
+        }
+    }
+
+    if (JS_IsUndefined(fn))
+    {
+        fn = JS_Eval(m_ctx, m_code.c_str(), m_code.length(), "<load_cart>",
+                     JS_EVAL_TYPE_GLOBAL | JS_EVAL_FLAG_COMPILE_ONLY);
+        if (JS_IsException(fn))
+        {
+            dump_error(m_ctx);
+            return;
+        }
+
+        size_t size;
+        uint8_t *data = JS_WriteObject(m_ctx, &size, fn, JS_WRITE_OBJ_BYTECODE);
+        if (data)
+        {
+            cache.store(key, std::string((char const *)data, size));
+            js_free(m_ctx, data);
+        }
+    }
+
+    // JS_EvalFunction() takes ownership of the function
+    JSValue ret = JS_EvalFunction(m_ctx, fn);
+    if (JS_IsException(ret))
+        dump_error(m_ctx);
+    JS_FreeValue(m_ctx, ret);
+}
+
+bool vm::call(uint32_t atom)
+{
+    JSValue global = JS_GetGlobalObject(m_ctx);
+    JSValue fn = JS_GetProperty(m_ctx, global, atom);
+
+    bool ok = true;
+    if (JS_IsFunction(m_ctx, fn))
+    {
+        JSValue ret = JS_Call(m_ctx, fn, global, 0, nullptr);
+        if (JS_IsException(ret))
+        {
+            dump_error(m_ctx);
+            ok = false;
+        }
+        JS_FreeValue(m_ctx, ret);
+    }
+
+    JS_FreeValue(m_ctx, fn);
+    JS_FreeValue(m_ctx, global);
+    return ok;
+}
+
 static std::string get_property_str(JSContext *ctx, JSValue obj, char const *name)
 {
     JSValue prop = JS_GetPropertyStr(ctx, obj, name);
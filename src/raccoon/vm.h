@@ -33,6 +33,7 @@ public:
     virtual void load(std::string const &file);
     virtual void run();
     virtual bool step(float seconds);
+    virtual void skip_frames(int count) { m_skip_frames = count; }
 
     virtual void render(lol::u8vec4 *screen) const;
 
@@ -52,6 +53,11 @@ public:
 private:
     void js_wrap();
 
+    // Run the cart code, from cached bytecode if possible
+    void eval_code();
+    // Call a global function, if it exists; false if it threw
+    bool call(uint32_t atom);
+
 private:
     void api_debug(std::string s);
 
@@ -135,6 +141,11 @@ private:
     struct JSRuntime *m_rt;
     struct JSContext *m_ctx;
 
+    // Atoms for the names of the callbacks, which carts may reassign, so
+    // their values are looked up on each call
+    uint32_t m_init, m_update, m_draw;
+    int m_skip_frames = 0;
+
     std::string m_code;
     std::string m_name, m_link, m_host;
     int32_t m_version = -1;
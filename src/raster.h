@@ -0,0 +1,159 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <cstdint> // uint8_t
+#include <cstring> // memset()
+
+#if __SSSE3__
+#   include <tmmintrin.h>
+#endif
+#if __ARM_NEON && __aarch64__
+#   include <arm_neon.h>
+#endif
+
+// The raster kernels
+// ——————————————————
+// Span and blit kernels for rows of packed 4-bit pixels, two per byte with
+// the leftmost pixel in the low nibble, as stored by u4mat2. They are
+// shared by the VMs, which do the clipping and the bookkeeping and only
+// call these with coordinates inside the rows.
+//
+// The palette lookup used to render whole rows works on 16 bytes at a
+// time, which needs SSSE3 or AArch64; other targets use scalar code.
+
+namespace z8::raster
+{
+
+// Fill pixels x1…x2 of a row with a colour
+inline void fill(uint8_t *row, int x1, int x2, uint8_t color)
+{
+    if (x1 & 1)
+    {
+        row[x1 / 2] = (row[x1 / 2] & 0x0f) | (color << 4);
+        ++x1;
+    }
+
+    if ((x2 & 1) == 0)
+    {
+        row[x2 / 2] = (row[x2 / 2] & 0xf0) | color;
+        --x2;
+    }
+
+    if (x1 < x2)
+        ::memset(row + x1 / 2, color * 0x11, (x2 - x1 + 1) / 2);
+}
+
+// Unpack bytes of a row to one byte per pixel through a 16-entry table;
+// unpack_scalar() is the reference for the vector code, and also handles
+// the bytes that do not fill a vector
+inline void unpack_scalar(uint8_t *dst, uint8_t const *src, int bytes, uint8_t const pal[16])
+{
+    for (int i = 0; i < bytes; ++i)
+    {
+        dst[2 * i] = pal[src[i] & 0xf];
+        dst[2 * i + 1] = pal[src[i] >> 4];
+    }
+}
+
+inline void unpack(uint8_t *dst, uint8_t const *src, int bytes, uint8_t const pal[16])
+{
+    int i = 0;
+#if __SSSE3__
+    __m128i const lut = _mm_loadu_si128((__m128i const *)pal);
+    __m128i const low = _mm_set1_epi8(0x0f);
+    for ( ; i + 16 <= bytes; i += 16)
+    {
+        __m128i p = _mm_loadu_si128((__m128i const *)(src + i));
+        __m128i lo = _mm_shuffle_epi8(lut, _mm_and_si128(p, low));
+        __m128i hi = _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(p, 4), low));
+        _mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_unpacklo_epi8(lo, hi));
+        _mm_storeu_si128((__m128i *)(dst + 2 * i + 16), _mm_unpackhi_epi8(lo, hi));
+    }
+#elif __ARM_NEON && __aarch64__
+    uint8x16_t const lut = vld1q_u8(pal);
+    for ( ; i + 16 <= bytes; i += 16)
+    {
+        uint8x16_t p = vld1q_u8(src + i);
+        uint8x16x2_t v = { { vqtbl1q_u8(lut, vandq_u8(p, vdupq_n_u8(0x0f))),
+                             vqtbl1q_u8(lut, vshrq_n_u8(p, 4)) } };
+        vst2q_u8(dst + 2 * i, v);
+    }
+#endif
+    unpack_scalar(dst + 2 * i, src + i, bytes - i, pal);
+}
+
+// Colour mapping for blits: for each of the 16 source colours, the
+// destination colour and a write mask that is zero for transparent
+// colours, plus a mask of destination bits that are kept
+struct blit_palette
+{
+    // Blend source colour c into the pixel at x in the given byte
+    inline void blend(uint8_t &data, int x, uint8_t c) const
+    {
+        int const shift = 4 * (x & 1);
+        uint8_t w = write[c] << shift;
+        data = (data & ~w) | (((data & keep) | (color[c] << shift)) & w);
+    }
+
+    // Blend two packed source pixels into the given byte
+    inline void blend2(uint8_t &data, uint8_t s) const
+    {
+        uint8_t w = write[s & 0xf] | (write[s >> 4] << 4);
+        uint8_t c = color[s & 0xf] | (color[s >> 4] << 4);
+        data = (data & ~w) | (((data & keep) | c) & w);
+    }
+
+    uint8_t color[16], write[16], keep = 0;
+};
+
+// Blend pixels i0…i1-1 of a w pixel wide blit into a row: destination
+// pixel dx+i comes from source pixel sx+i, or sx+w-1-i when flipped.
+// Source pixels outside the width columns of src have colour 0.
+template<bool FLIP_X>
+inline void blit_row(uint8_t *dst, int dx, uint8_t const *src, int width,
+                     int sx, int w, int i0, int i1, blit_palette const &bp)
+{
+    // Packed rows can be copied directly when the source and destination
+    // pixels have the same parity and the source lies within the row.
+    if (!FLIP_X && ((sx ^ dx) & 1) == 0 && sx + i0 >= 0 && sx + i1 <= width)
+    {
+        int i = i0;
+
+        if ((dx + i) & 1)
+        {
+            bp.blend(dst[(dx + i) / 2], dx + i, src[(sx + i) / 2] >> 4);
+            ++i;
+        }
+
+        for ( ; i + 1 < i1; i += 2)
+            bp.blend2(dst[(dx + i) / 2], src[(sx + i) / 2]);
+
+        if (i < i1)
+            bp.blend(dst[(dx + i) / 2], dx + i, src[(sx + i) / 2] & 0xf);
+
+        return;
+    }
+
+    for (int i = i0; i < i1; ++i)
+    {
+        int const src_x = sx + (FLIP_X ? w - 1 - i : i);
+        uint8_t c = 0;
+        if (src_x >= 0 && src_x < width)
+            c = (src[src_x / 2] >> (4 * (src_x & 1))) & 0xf;
+        bp.blend(dst[(dx + i) / 2], dx + i, c);
+    }
+}
+
+} // namespace z8::raster
+
@@ -0,0 +1,227 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <lol/msg>   // lol::msg
+#include <algorithm> // std::equal_range, std::min, std::max
+#include <climits>   // INT_MAX
+#include <fstream>   // std::ifstream, std::ofstream
+#include <sstream>   // std::istringstream
+
+#include "recording.h"
+
+namespace z8
+{
+
+static char const *header = "# ZEPTO-8 input recording";
+
+void recording::start(vm_base &vm, uint32_t seed)
+{
+    m_seed = seed;
+    m_frames = 0;
+    m_events.clear();
+    m_hashes.clear();
+    m_audio_hashes.clear();
+    m_mouse = lol::ivec3(-1);
+    vm.set_deterministic(seed);
+}
+
+void recording::button(int index, int state)
+{
+    // Released buttons have no effect on the VM
+    if (state)
+        m_events.push_back({ m_frames, event::type::button, index, state, 0 });
+}
+
+void recording::mouse(lol::ivec2 coords, int buttons)
+{
+    lol::ivec3 mouse(coords, buttons);
+    if (mouse != m_mouse)
+        m_events.push_back({ m_frames, event::type::mouse, coords.x, coords.y, buttons });
+    m_mouse = mouse;
+}
+
+void recording::text(char ch)
+{
+    m_events.push_back({ m_frames, event::type::text, (uint8_t)ch, 0, 0 });
+}
+
+void recording::end_frame(vm_base const &vm, bool hash)
+{
+    if (hash)
+        m_hashes[m_frames] = vm.hash_screen();
+    ++m_frames;
+}
+
+void recording::restart(vm_base &vm) const
+{
+    vm.set_deterministic(m_seed);
+}
+
+void recording::replay(vm_base &vm, int frame) const
+{
+    // Events are stored in frame order
+    auto range = std::equal_range(m_events.begin(), m_events.end(),
+                                  event { frame, event::type::button, 0, 0, 0 },
+                                  [](event const &a, event const &b) { return a.frame < b.frame; });
+
+    for (auto it = range.first; it != range.second; ++it)
+    {
+        switch (it->type)
+        {
+        case event::type::button: vm.button(it->a, it->b); break;
+        case event::type::mouse: vm.mouse(lol::ivec2(it->a, it->b), it->c); break;
+        case event::type::text: vm.text((char)it->a); break;
+        }
+    }
+}
+
+bool recording::check(vm_base const &vm, int frame) const
+{
+    auto it = m_hashes.find(frame);
+    return it == m_hashes.end() || it->second == vm.hash_screen();
+}
+
+void recording::update(vm_base const &vm, int frame, int16_t const *audio, int count)
+{
+    m_hashes[frame] = vm.hash_screen();
+    m_audio_hashes[frame] = hash64(audio, count * sizeof(*audio));
+    m_frames = std::max(m_frames, frame + 1);
+}
+
+bool recording::check_audio(int frame, int16_t const *audio, int count) const
+{
+    auto it = m_audio_hashes.find(frame);
+    return it == m_audio_hashes.end() || it->second == hash64(audio, count * sizeof(*audio));
+}
+
+bool recording::load(std::string const &name)
+{
+    std::ifstream f(name);
+    std::string line;
+    if (!std::getline(f, line) || line != header)
+    {
+        lol::msg::error("%s is not a ZEPTO-8 input recording\n", name.c_str());
+        return false;
+    }
+
+    m_seed = 0;
+    m_frames = 0;
+    m_cart.clear();
+    m_events.clear();
+    m_hashes.clear();
+    m_audio_hashes.clear();
+
+    while (std::getline(f, line))
+    {
+        std::istringstream s(line);
+        std::string word;
+
+        if (line.rfind("seed ", 0) == 0)
+            s >> word >> m_seed;
+        else if (line.rfind("frames ", 0) == 0)
+            s >> word >> m_frames;
+        else if (line.rfind("cart ", 0) == 0)
+            m_cart = line.substr(5);
+        else
+        {
+            event e { 0, event::type::button, 0, 0, 0 };
+            s >> e.frame >> word;
+            if (word == "button")
+                s >> e.a >> e.b;
+            else if (word == "mouse")
+                e.type = event::type::mouse, s >> e.a >> e.b >> e.c;
+            else if (word == "text")
+                e.type = event::type::text, s >> e.a;
+            else if (word == "hash")
+            {
+                s >> std::hex >> m_hashes[e.frame];
+                continue;
+            }
+            else if (word == "audio")
+            {
+                s >> std::hex >> m_audio_hashes[e.frame];
+                continue;
+            }
+            else
+                continue;
+
+            if (!s.fail())
+                m_events.push_back(e);
+        }
+    }
+
+    // Keep events sorted by frame, in case the file was edited by hand
+    std::stable_sort(m_events.begin(), m_events.end(),
+                     [](event const &a, event const &b) { return a.frame < b.frame; });
+    return true;
+}
+
+bool recording::save(std::string const &name) const
+{
+    std::ofstream f(name);
+    if (!f)
+        return false;
+
+    f << header << '\n';
+    f << "seed " << m_seed << '\n';
+    f << "frames " << m_frames << '\n';
+    if (m_cart.length())
+        f << "cart " << m_cart << '\n';
+
+    // Write hashes in frame order, after the events of the same frame
+    auto hash = m_hashes.begin();
+    auto audio = m_audio_hashes.begin();
+    auto write_hashes = [&](int until)
+    {
+        for (;;)
+        {
+            int const a = hash == m_hashes.end() ? INT_MAX : hash->first;
+            int const b = audio == m_audio_hashes.end() ? INT_MAX : audio->first;
+            int const frame = std::min(a, b);
+            if (frame >= until)
+                break;
+            if (a == frame)
+                f << frame << " hash " << std::hex << (hash++)->second << std::dec << '\n';
+            if (b == frame)
+                f << frame << " audio " << std::hex << (audio++)->second << std::dec << '\n';
+        }
+    };
+
+    for (auto const &e : m_events)
+    {
+        write_hashes(e.frame);
+
+        switch (e.type)
+        {
+        case event::type::button:
+            f << e.frame << " button " << e.a << ' ' << e.b << '\n';
+            break;
+        case event::type::mouse:
+            f << e.frame << " mouse " << e.a << ' ' << e.b << ' ' << e.c << '\n';
+            break;
+        case event::type::text:
+            f << e.frame << " text " << e.a << '\n';
+            break;
+        }
+    }
+
+    write_hashes(INT_MAX);
+
+    return bool(f);
+}
+
+} // namespace z8
+
@@ -0,0 +1,93 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <lol/vector> // lol::ivec2
+#include <string>     // std::string
+#include <vector>     // std::vector
+#include <map>        // std::map
+
+#include "zepto8.h"
+
+// The recording class
+// ———————————————————
+// The input events sent to a VM, frame by frame, together with the seed
+// needed to run the VM deterministically and optional screen and audio
+// hashes to check that a replay produces the same output. A recording
+// with hashes for every frame acts as a golden reference for the VM.
+//
+// The file format is plain text: a header line, then “seed <n>”,
+// “frames <n>” and optionally “cart <file>”, then one event per line,
+// prefixed with its frame number:
+//     <frame> button <index> <state>
+//     <frame> mouse <x> <y> <buttons>
+//     <frame> text <char code>
+//     <frame> hash <screen hash>
+//     <frame> audio <audio hash>
+
+namespace z8
+{
+
+class recording
+{
+public:
+    // Recording: start() makes the VM deterministic, then input events
+    // are added before each step() and end_frame() is called after it.
+    void start(vm_base &vm, uint32_t seed);
+    void button(int index, int state);
+    void mouse(lol::ivec2 coords, int buttons);
+    void text(char ch);
+    void end_frame(vm_base const &vm, bool hash = false);
+
+    // Replay: restart() makes the VM deterministic with the recorded seed,
+    // then replay() sends a frame’s events before its step() and check()
+    // compares the screen with the recorded hash, if any, after it.
+    void restart(vm_base &vm) const;
+    void replay(vm_base &vm, int frame) const;
+    bool check(vm_base const &vm, int frame) const;
+
+    // Golden references: update() stores the hashes of a frame’s screen
+    // and of the audio generated during it, and check_audio() compares
+    // the audio with the stored hash, if any.
+    void update(vm_base const &vm, int frame, int16_t const *audio, int count);
+    bool check_audio(int frame, int16_t const *audio, int count) const;
+
+    int frames() const { return m_frames; }
+
+    // The cart this recording was made with, if known
+    void set_cart(std::string const &name) { m_cart = name; }
+    std::string const &cart() const { return m_cart; }
+
+    bool load(std::string const &name);
+    bool save(std::string const &name) const;
+
+private:
+    struct event
+    {
+        int frame;
+        enum class type : uint8_t { button, mouse, text } type;
+        int a, b, c;
+    };
+
+    uint32_t m_seed = 0;
+    int m_frames = 0;
+    std::string m_cart;
+    std::vector<event> m_events;
+    std::map<int, uint64_t> m_hashes, m_audio_hashes;
+
+    // Last mouse state sent, to only record changes
+    lol::ivec3 m_mouse = lol::ivec3(-1);
+};
+
+} // namespace z8
+
@@ -0,0 +1,277 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <algorithm> // std::max, std::min
+#include <cstdint>   // uint64_t
+#include <cstring>   // memcpy(), memset()
+
+#include "rewind.h"
+
+namespace z8
+{
+
+// Deltas newer than this are never merged, and merging stops when a delta
+// spans max_frames frames
+static int const recent_frames = 120;
+static int const max_frames = 32;
+
+rewind::rewind(size_t budget)
+  : m_budget(budget),
+    m_thread([this]() { compact(); })
+{
+}
+
+rewind::~rewind()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cv.notify_one();
+    m_thread.join();
+}
+
+void rewind::push(vm_base const &vm)
+{
+    size_t const capacity = vm.state_size();
+    if (capacity != m_capacity)
+    {
+        clear();
+        m_state.data.reset(new uint8_t[capacity]);
+        m_next.data.reset(new uint8_t[capacity]);
+        m_capacity = capacity;
+    }
+
+    m_next.size = capacity ? vm.save_state(m_next.data.get(), capacity) : 0;
+    if (!m_next.size)
+        return;
+
+    if (m_state.size)
+    {
+        auto d = std::make_shared<delta>();
+        encode(m_next.data.get(), m_next.size, m_state.data.get(), m_state.size, d->data);
+        d->size = m_state.size;
+        d->frames = 1;
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_memory += d->data.size();
+        m_deltas.push_back(d);
+        while (m_memory + m_next.size > m_budget && m_deltas.size())
+        {
+            m_memory -= m_deltas.front()->data.size();
+            m_deltas.pop_front();
+        }
+    }
+
+    std::swap(m_state, m_next);
+    m_cv.notify_one();
+}
+
+bool rewind::pop(vm_base &vm)
+{
+    std::shared_ptr<delta const> d;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_deltas.empty())
+            return false;
+        d = m_deltas.back();
+        m_deltas.pop_back();
+        m_memory -= d->data.size();
+    }
+
+    // The XOR covers both states, which are implicitly padded with zeroes
+    if (d->size > m_state.size)
+        ::memset(m_state.data.get() + m_state.size, 0, d->size - m_state.size);
+    decode(d->data, m_state.data.get(), std::max(m_state.size, d->size));
+    m_state.size = d->size;
+
+    return vm.load_state(m_state.data.get(), m_state.size);
+}
+
+void rewind::clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_deltas.clear();
+    m_memory = 0;
+    m_state.size = 0;
+}
+
+size_t rewind::size() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_deltas.size();
+}
+
+size_t rewind::memory() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_memory + m_state.size;
+}
+
+// The encoded XOR of a and b is a list of records, each made of the number
+// of zero bytes to skip, then a number of literal bytes and these bytes.
+// Numbers are stored 7 bits at a time, least significant bits first.
+void rewind::encode(uint8_t const *a, size_t a_size, uint8_t const *b, size_t b_size,
+                    std::vector<uint8_t> &out)
+{
+    size_t const common = std::min(a_size, b_size);
+    size_t const size = std::max(a_size, b_size);
+
+    auto get = [&](size_t i) -> uint8_t
+    {
+        return (i < a_size ? a[i] : 0) ^ (i < b_size ? b[i] : 0);
+    };
+
+    auto put = [&out](size_t n)
+    {
+        for ( ; n >= 0x80; n >>= 7)
+            out.push_back(uint8_t(n | 0x80));
+        out.push_back(uint8_t(n));
+    };
+
+    // Whether the XOR of eight bytes is zero, or false if unknown
+    auto zero8 = [&](size_t i)
+    {
+        if (i + 8 <= common)
+            return !::memcmp(a + i, b + i, 8);
+        uint8_t const *p = i >= b_size && i + 8 <= a_size ? a
+                         : i >= a_size && i + 8 <= b_size ? b : nullptr;
+        uint64_t x = 1;
+        if (p)
+            ::memcpy(&x, p + i, 8);
+        return x == 0;
+    };
+
+    out.clear();
+    for (size_t i = 0; i < size; )
+    {
+        // Skip identical bytes, eight at a time when possible
+        size_t const start = i;
+        for (;;)
+        {
+            while (zero8(i))
+                i += 8;
+            if (i >= size || get(i))
+                break;
+            ++i;
+        }
+
+        if (i >= size)
+            break;
+
+        // Literal bytes stop at the next run of four unchanged bytes
+        size_t const literal = i;
+        for (int zeroes = 0; i < size && zeroes < 4; ++i)
+            zeroes = get(i) ? 0 : zeroes + 1;
+        size_t end = i;
+        while (end > literal && !get(end - 1))
+            --end;
+        i = end;
+
+        put(literal - start);
+        put(end - literal);
+        for (size_t k = literal; k < end; ++k)
+            out.push_back(get(k));
+    }
+}
+
+void rewind::decode(std::vector<uint8_t> const &data, uint8_t *out, size_t size)
+{
+    auto p = data.begin();
+    auto get = [&p]()
+    {
+        size_t n = 0;
+        for (int shift = 0; ; shift += 7)
+        {
+            uint8_t byte = *p++;
+            n |= size_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return n;
+        }
+    };
+
+    for (size_t i = 0; p != data.end(); )
+    {
+        i += get();
+        size_t const count = get();
+        for (size_t k = 0; k < count; ++k, ++i)
+        {
+            uint8_t const byte = *p++;
+            if (i < size)
+                out[i] ^= byte;
+        }
+    }
+}
+
+// Find the oldest pair of adjacent deltas that can be merged, or -1
+int rewind::find_pair() const
+{
+    int const count = int(m_deltas.size()) - recent_frames;
+    for (int i = 0; i + 1 < count; ++i)
+        if (m_deltas[i]->frames == m_deltas[i + 1]->frames
+             && m_deltas[i]->frames < max_frames)
+            return i;
+    return -1;
+}
+
+// Background thread: merge two deltas into one that goes directly from
+// the newer state to the older one; the XOR of both is often smaller than
+// their sum since many bytes change back and forth.
+void rewind::compact()
+{
+    std::vector<uint8_t> tmp;
+
+    for (;;)
+    {
+        std::shared_ptr<delta const> older, newer;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this]() { return m_stop || find_pair() >= 0; });
+            if (m_stop)
+                return;
+
+            // The XOR covers the three states involved; the newest one is
+            // the older state of the following delta
+            int i = find_pair();
+            older = m_deltas[i];
+            newer = m_deltas[i + 1];
+            tmp.assign(std::max({ older->size, newer->size, m_deltas[i + 2]->size }), 0);
+        }
+
+        auto merged = std::make_shared<delta>();
+        decode(older->data, tmp.data(), tmp.size());
+        decode(newer->data, tmp.data(), tmp.size());
+        encode(tmp.data(), tmp.size(), nullptr, 0, merged->data);
+        merged->size = older->size;
+        merged->frames = older->frames + newer->frames;
+
+        // The pair may have been dropped or popped in the meantime
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (size_t i = 0; i + 1 < m_deltas.size(); ++i)
+        {
+            if (m_deltas[i] != older || m_deltas[i + 1] != newer)
+                continue;
+            m_memory += merged->data.size();
+            m_memory -= older->data.size() + newer->data.size();
+            m_deltas[i] = merged;
+            m_deltas.erase(m_deltas.begin() + i + 1);
+            break;
+        }
+    }
+}
+
+} // namespace z8
+
@@ -0,0 +1,96 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <vector>             // std::vector
+#include <deque>              // std::deque
+#include <memory>             // std::shared_ptr
+#include <thread>             // std::thread
+#include <mutex>              // std::mutex
+#include <condition_variable> // std::condition_variable
+
+#include "zepto8.h"
+
+// The rewind class
+// ————————————————
+// A history of VM snapshots within a memory budget. Only the latest
+// snapshot is kept in full; each older one is stored as the run-length
+// encoded XOR of itself with its successor, which is tiny since most of
+// the VM state does not change from one frame to the next.
+//
+// A background thread compacts the history by merging pairs of old deltas,
+// so that recent frames can be rewound one by one and older ones in larger
+// steps. When the budget is exceeded, the oldest deltas are dropped.
+
+namespace z8
+{
+
+class rewind
+{
+public:
+    rewind(size_t budget);
+    ~rewind();
+
+    // Save the state of the VM after a step
+    void push(vm_base const &vm);
+
+    // Restore the VM to the previous state in the history, or return false
+    // if there is none
+    bool pop(vm_base &vm);
+
+    void clear();
+
+    // Number of states that pop() can restore, and memory used
+    size_t size() const;
+    size_t memory() const;
+
+private:
+    struct delta
+    {
+        std::vector<uint8_t> data;
+        size_t size;  // size of the older state
+        int frames;   // number of frames between the two states
+    };
+
+    // Buffers are only allocated once and never cleared, since states are
+    // large but mostly unused
+    struct buffer
+    {
+        std::unique_ptr<uint8_t[]> data;
+        size_t size = 0;
+    };
+
+    static void encode(uint8_t const *a, size_t a_size, uint8_t const *b, size_t b_size,
+                       std::vector<uint8_t> &out);
+    static void decode(std::vector<uint8_t> const &data, uint8_t *out, size_t size);
+    int find_pair() const;
+    void compact();
+
+    size_t m_budget;
+
+    // The latest state, and a buffer for the next one
+    buffer m_state, m_next;
+    size_t m_capacity = 0;
+
+    // Deltas from the oldest to the newest, and their total size
+    std::deque<std::shared_ptr<delta const>> m_deltas;
+    size_t m_memory = 0;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_cv;
+    bool m_stop = false;
+    std::thread m_thread;
+};
+
+} // namespace z8
+
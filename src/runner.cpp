@@ -0,0 +1,75 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include "runner.h"
+
+namespace z8
+{
+
+vm_runner::~vm_runner()
+{
+    stop();
+}
+
+void vm_runner::start(std::function<void(int)> tick, float fps)
+{
+    stop();
+    m_stop = false;
+
+    m_scheduler.set_rate(fps);
+    m_scheduler.reset();
+
+    m_thread = std::thread([this, tick]()
+    {
+        while (!m_stop)
+        {
+            if (int steps = m_scheduler.update())
+                tick(steps);
+            m_scheduler.wait();
+        }
+    });
+}
+
+void vm_runner::stop()
+{
+    if (!m_thread.joinable())
+        return;
+
+    m_stop = true;
+    m_thread.join();
+}
+
+void vm_runner::publish(vm_base &vm)
+{
+    frame &f = m_frames.back();
+    f.colors = vm.render_indexed(f.pixels, f.palette);
+    f.profile = vm.get_profile();
+    f.stats = m_scheduler.get_stats();
+    if (m_memory_snapshots)
+    {
+        auto ram = vm.ram(), rom = vm.rom();
+        f.ram.assign(std::get<0>(ram), std::get<0>(ram) + std::get<1>(ram));
+        f.rom.assign(std::get<0>(rom), std::get<0>(rom) + std::get<1>(rom));
+    }
+    else
+    {
+        f.ram.clear();
+        f.rom.clear();
+    }
+    m_frames.publish();
+}
+
+} // namespace z8
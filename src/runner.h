@@ -0,0 +1,165 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <atomic>     // std::atomic
+#include <functional> // std::function
+#include <thread>     // std::thread
+#include <cstddef>    // size_t
+#include <vector>     // std::vector
+#include <cstdint>    // uint8_t, uint32_t
+
+#include "zepto8.h"
+#include "scheduler.h"
+
+namespace z8
+{
+
+// The triple_buffer class
+// ———————————————————————
+// Hands the latest of a stream of values from one thread to another
+// without locks: the producer fills back() then calls publish(), and the
+// consumer calls latest(). Neither ever waits, and the consumer skips the
+// values that were replaced before it looked.
+
+template<typename T>
+class triple_buffer
+{
+public:
+    T &back() { return m_slots[m_back]; }
+
+    void publish()
+    {
+        m_back = m_middle.exchange(uint8_t(m_back | fresh), std::memory_order_acq_rel) & 3;
+    }
+
+    // The value published last, or null if it was already returned
+    T const *latest()
+    {
+        if (!(m_middle.load(std::memory_order_relaxed) & fresh))
+            return nullptr;
+        m_front = m_middle.exchange(m_front, std::memory_order_acq_rel) & 3;
+        return &m_slots[m_front];
+    }
+
+private:
+    static uint8_t const fresh = 4;
+
+    T m_slots[3];
+    uint8_t m_back = 0, m_front = 1; // only used by their own thread
+    std::atomic<uint8_t> m_middle { 2 };
+};
+
+// The spsc_queue class
+// ————————————————————
+// A fixed-size lock-free queue with a single producer thread and a single
+// consumer thread; push() fails when the queue is full.
+
+template<typename T, size_t N>
+class spsc_queue
+{
+public:
+    bool push(T const &x)
+    {
+        size_t const head = m_head.load(std::memory_order_relaxed);
+        if (head - m_tail.load(std::memory_order_acquire) == N)
+            return false;
+        m_data[head % N] = x;
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T &x)
+    {
+        size_t const tail = m_tail.load(std::memory_order_relaxed);
+        if (tail == m_head.load(std::memory_order_acquire))
+            return false;
+        x = m_data[tail % N];
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    T m_data[N];
+    std::atomic<size_t> m_head { 0 }, m_tail { 0 };
+};
+
+// The vm_runner class
+// ———————————————————
+// Runs a VM on its own thread, paced by a frame_scheduler, so that a slow
+// cart never stalls the thread that polls input and draws the UI. Input
+// goes to the VM thread through a queue, and each completed frame comes back as
+// palette indices with their palette through a triple buffer, so the UI
+// always shows the latest frame at its own refresh rate. Frames can also
+// carry a copy of the VM’s RAM and ROM, for memory viewers, which must
+// never read or write the VM’s memory directly.
+
+class vm_runner
+{
+public:
+    struct input
+    {
+        enum class kind : uint8_t { button, mouse, text, profiling, sampling, poke, poke_rom };
+
+        kind type = kind::button;
+        int a = 0, b = 0, c = 0; // button index and state, mouse coords
+                                 // and buttons, character, flag, period,
+                                 // or RAM or ROM address and value
+    };
+
+    struct frame
+    {
+        uint8_t pixels[128 * 128];
+        uint32_t palette[256]; // xrgb8888
+        int colors;
+        z8::profile profile;
+        frame_scheduler::stats stats;
+        std::vector<uint8_t> ram, rom; // empty unless snapshots are enabled
+    };
+
+    ~vm_runner();
+
+    // Call tick() on a new thread until stop(), with the number of VM
+    // steps that are due at the given rate; tick() is expected to run
+    // them, skipping the frames given by scheduler(), and to call
+    // publish() when done
+    void start(std::function<void(int)> tick, float fps = 60.f);
+    void stop();
+
+    // Copy the VM’s RAM and ROM into each published frame
+    void set_memory_snapshots(bool enable) { m_memory_snapshots = enable; }
+
+    // From the UI thread: false if the queue is full and input was lost
+    bool send(input const &in) { return m_input.push(in); }
+
+    // From the VM thread
+    bool receive(input &in) { return m_input.pop(in); }
+    frame_scheduler &scheduler() { return m_scheduler; }
+    void publish(vm_base &vm);
+
+    // From the UI thread: the latest frame, or null if none was
+    // published since the last call
+    frame const *latest() { return m_frames.latest(); }
+
+private:
+    std::thread m_thread;
+    std::atomic<bool> m_stop { false };
+    std::atomic<bool> m_memory_snapshots { false };
+    frame_scheduler m_scheduler;
+
+    spsc_queue<input, 1024> m_input;
+    triple_buffer<frame> m_frames;
+};
+
+} // namespace z8
+
@@ -0,0 +1,109 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <algorithm> // std::max
+#include <cmath>     // std::floor
+#include <thread>    // std::this_thread
+
+#include "scheduler.h"
+
+namespace z8
+{
+
+frame_scheduler::frame_scheduler(float fps)
+{
+    set_rate(fps);
+    reset();
+}
+
+void frame_scheduler::set_rate(float fps)
+{
+    m_period = 1.0 / std::max(fps, 1.f);
+}
+
+void frame_scheduler::set_max_steps(int steps)
+{
+    m_max_steps = std::max(steps, 1);
+}
+
+void frame_scheduler::reset()
+{
+    m_elapsed = 0.0;
+    m_last = clock::now();
+}
+
+int frame_scheduler::update()
+{
+    auto const now = clock::now();
+    double const seconds = std::chrono::duration<double>(now - m_last).count();
+    m_last = now;
+    return update(seconds);
+}
+
+int frame_scheduler::update(double seconds)
+{
+    m_elapsed += std::max(seconds, 0.0);
+
+    // A tiny margin so that sleeping until the deadline is always enough,
+    // even with rounding errors
+    int steps = int(std::floor((m_elapsed + 1e-6) / m_period));
+    m_elapsed = std::max(m_elapsed - steps * m_period, 0.0);
+
+    if (steps > m_max_steps)
+    {
+        m_stats.lost += steps - m_max_steps;
+        steps = m_max_steps;
+    }
+
+    m_stats.steps += steps;
+    return steps;
+}
+
+int frame_scheduler::skip_frames(int steps, float draw_fps)
+{
+    int const skip = frames_to_skip(steps, draw_fps);
+    add_dropped(skip);
+    return skip;
+}
+
+int frame_scheduler::frames_to_skip(int steps, float draw_fps) const
+{
+    // Only count the frames that are certain to happen, so that the last
+    // one the cart draws is never skipped; e.g. a 30 fps cart draws one
+    // frame in two steps, or maybe two frames in three steps
+    int const frames = int(std::floor(steps * draw_fps * m_period + 1e-3));
+    return std::max(frames - 1, 0);
+}
+
+frame_scheduler::clock::time_point frame_scheduler::deadline() const
+{
+    auto const left = std::chrono::duration<double>(std::max(m_period - m_elapsed, 0.0));
+    return m_last + std::chrono::duration_cast<clock::duration>(left);
+}
+
+void frame_scheduler::wait() const
+{
+    auto const spin = std::chrono::milliseconds(2);
+    auto const end = deadline();
+
+    if (clock::now() + spin < end)
+        std::this_thread::sleep_until(end - spin);
+    while (clock::now() < end)
+        std::this_thread::yield();
+}
+
+} // namespace z8
+
@@ -0,0 +1,86 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <chrono>  // std::chrono
+#include <cstdint> // int64_t
+
+// The frame_scheduler class
+// —————————————————————————
+// Decides when to step a VM so that games keep their speed on a busy host.
+// Real time is accumulated and turned into whole VM steps; when the host
+// falls behind, several steps are run at once and the cart only draws the
+// last frame, and when it is ahead, wait() sleeps until the next step is
+// due. Past a few steps of delay the extra time is given up, so the game
+// slows down instead of running in bursts.
+//
+// The scheduler can be driven by the steady clock, or by elapsed times
+// measured elsewhere, which makes it deterministic.
+
+namespace z8
+{
+
+class frame_scheduler
+{
+public:
+    using clock = std::chrono::steady_clock;
+
+    struct stats
+    {
+        int64_t steps = 0;   // VM steps that were due
+        int64_t dropped = 0; // frames whose drawing was skipped to catch up
+        int64_t lost = 0;    // steps given up because the host lagged too far
+    };
+
+    frame_scheduler(float fps = 60.f);
+
+    // VM steps per second, and the most steps run in one update(); 1 means
+    // never catching up
+    void set_rate(float fps);
+    void set_max_steps(int steps);
+
+    // Forget the accumulated time and start counting from now
+    void reset();
+
+    // Account for the time elapsed since the previous call and return the
+    // number of VM steps that are now due, either from the steady clock or
+    // from a duration measured by the caller
+    int update();
+    int update(double seconds);
+
+    // How many of the frames the cart draws during these steps, at its
+    // own rate, should be skipped so that only the last one is drawn;
+    // skip_frames() also counts them as dropped. Hosts stepping several
+    // VMs on the same clock call frames_to_skip() for each of them, and
+    // count the dropped frames once per update with add_dropped().
+    int skip_frames(int steps, float draw_fps);
+    int frames_to_skip(int steps, float draw_fps) const;
+    void add_dropped(int frames) { m_stats.dropped += frames; }
+
+    // When the next step is due, and sleep until then; the last moments
+    // are spent spinning, because sleeping is not accurate enough
+    clock::time_point deadline() const;
+    void wait() const;
+
+    stats const &get_stats() const { return m_stats; }
+
+private:
+    double m_period, m_elapsed = 0.0;
+    int m_max_steps = 4;
+    clock::time_point m_last;
+
+    stats m_stats;
+};
+
+} // namespace z8
+
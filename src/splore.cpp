@@ -15,17 +15,39 @@
 #endif
 
 #include <lol/engine.h> // lol::old_image
-
-#include <string>
+#include <lol/msg>      // lol::msg
+#include <lol/utils>    // lol::ends_with
+#include <algorithm>    // std::sort, std::search
+#include <atomic>       // std::atomic
+#include <cctype>       // tolower()
+#include <cstring>      // memcmp(), memcpy()
+#include <filesystem>   // std::filesystem
+#include <fstream>      // std::ifstream, std::ofstream
+#include <iterator>     // std::istreambuf_iterator
+#include <map>          // std::map
+#include <memory>       // std::unique_ptr
+#include <string>       // std::string
+#include <thread>       // std::thread
+#include <unordered_map>
 
 #include "zepto8.h"
 #include "splore.h"
+#include "pico8/archive.h"
+#include "pico8/cart.h"
+#include "pico8/pico8.h"
+
+namespace fs = std::filesystem;
 
 namespace z8
 {
 
 using lol::PixelFormat;
 
+// Index files start with this magic and a version number, then the
+// number of entries; all values are little-endian.
+static char const magic[4] = { 'z', '8', 'i', 'x' };
+static uint32_t const version = 1;
+
 bool splore::dump(std::string const &filename)
 {
     // Open cartridge as PNG image
@@ -62,5 +84,352 @@ bool splore::dump(std::string const &filename)
     return true;
 }
 
-} // namespace z8
+bool splore::list(std::string const &filename)
+{
+    pico8::archive archive;
+    if (!archive.open(filename))
+        return false;
+
+    for (size_t n = 0; n < archive.size(); ++n)
+    {
+        auto const info = archive.get_info(n);
+        printf("%s: %s%s%s [%d tokens]\n", info.name, info.title,
+               *info.author ? " by " : "", info.author, info.tokens);
+    }
+
+    return true;
+}
+
+// Serialisation helpers for the index file
+static void put32(std::string &out, uint32_t x)
+{
+    out.append((char const *)&x, sizeof(x));
+}
+
+static void put64(std::string &out, uint64_t x)
+{
+    out.append((char const *)&x, sizeof(x));
+}
+
+static void put_bytes(std::string &out, void const *data, size_t size)
+{
+    put32(out, uint32_t(size));
+    out.append((char const *)data, size);
+}
+
+struct index_reader
+{
+    template<typename T> bool get(T &x)
+    {
+        if (size - pos < sizeof(T))
+            return false;
+        ::memcpy(&x, data + pos, sizeof(T));
+        pos += sizeof(T);
+        return true;
+    }
+
+    template<typename T> bool get_bytes(T &x)
+    {
+        uint32_t len;
+        if (!get(len) || size - pos < len)
+            return false;
+        x.assign((typename T::value_type const *)(data + pos), (typename T::value_type const *)(data + pos + len));
+        pos += len;
+        return true;
+    }
+
+    char const *data;
+    size_t size, pos;
+};
+
+bool splore::load_index(std::string const &filename)
+{
+    m_entries.clear();
+
+    std::ifstream f(filename, std::ios::binary);
+    if (!f)
+        return true;
+    std::string const data((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+
+    index_reader r { data.data(), data.length(), sizeof(magic) };
+    uint32_t file_version, count;
+    if (data.length() < sizeof(magic) || ::memcmp(data.data(), magic, sizeof(magic))
+         || !r.get(file_version) || file_version != version || !r.get(count))
+    {
+        lol::msg::error("%s: not a cart index\n", filename.c_str());
+        return false;
+    }
+
+    for (uint32_t n = 0; n < count; ++n)
+    {
+        entry e;
+        int32_t tokens, code_size, compressed_size;
+        if (!r.get_bytes(e.path) || !r.get_bytes(e.name) || !r.get_bytes(e.title)
+             || !r.get_bytes(e.author) || !r.get(e.mtime) || !r.get(e.size) || !r.get(e.hash)
+             || !r.get(tokens) || !r.get(code_size) || !r.get(compressed_size)
+             || !r.get_bytes(e.thumbnail))
+        {
+            lol::msg::error("%s: truncated cart index\n", filename.c_str());
+            m_entries.clear();
+            return false;
+        }
+        e.tokens = tokens;
+        e.code_size = code_size;
+        e.compressed_size = compressed_size;
+        m_entries.push_back(std::move(e));
+    }
+
+    return true;
+}
+
+bool splore::save_index(std::string const &filename) const
+{
+    std::string data(magic, sizeof(magic));
+    put32(data, version);
+    put32(data, uint32_t(m_entries.size()));
+    for (auto const &e : m_entries)
+    {
+        for (auto const *s : { &e.path, &e.name, &e.title, &e.author })
+            put_bytes(data, s->data(), s->length());
+        put64(data, uint64_t(e.mtime));
+        put64(data, e.size);
+        put64(data, e.hash);
+        put32(data, uint32_t(e.tokens));
+        put32(data, uint32_t(e.code_size));
+        put32(data, uint32_t(e.compressed_size));
+        put_bytes(data, e.thumbnail.data(), e.thumbnail.size());
+    }
+
+    // Replace the old index only once the new one is complete
+    std::string const tmp = filename + ".tmp";
+    {
+        std::ofstream f(tmp, std::ios::binary);
+        f.write(data.data(), data.length());
+        if (!f)
+        {
+            lol::msg::error("cannot write %s\n", tmp.c_str());
+            return false;
+        }
+    }
+
+    std::error_code ec;
+    fs::rename(tmp, filename, ec);
+    if (ec)
+    {
+        lol::msg::error("cannot write %s\n", filename.c_str());
+        fs::remove(tmp, ec);
+        return false;
+    }
+    return true;
+}
+
+// Everything the index knows about a cart, except where it comes from
+static void describe(pico8::cart &c, splore::entry &e)
+{
+    using namespace pico8;
 
+    std::string const &code = c.get_code();
+    archive::title_author(code, e.title, e.author);
+    e.tokens = code::count_tokens(code);
+    e.code_size = int(code.length());
+    e.compressed_size = int(c.get_compressed_code().size());
+
+    int const n = splore::thumbnail_size, step = LABEL_WIDTH / n;
+    auto const &label = c.get_label();
+    e.thumbnail.clear();
+    if (label.size() >= LABEL_WIDTH * LABEL_HEIGHT)
+        for (int y = 0; y < n; ++y)
+            for (int x = 0; x < n; ++x)
+                e.thumbnail.push_back(label[(y * step + step / 2) * LABEL_WIDTH + x * step + step / 2]);
+}
+
+bool splore::update(std::vector<std::string> const &sources, int jobs)
+{
+    // Carts and archives, with directories replaced by their contents
+    std::vector<std::string> files;
+    for (auto const &src : sources)
+    {
+        std::error_code ec;
+        if (!fs::is_directory(src, ec))
+        {
+            files.push_back(src);
+            continue;
+        }
+
+        std::vector<std::string> found;
+        for (auto const &e : fs::recursive_directory_iterator(src, ec))
+        {
+            std::string const file = e.path().string();
+            if (e.is_regular_file() && (lol::ends_with(file, ".p8") || lol::ends_with(file, ".png")
+                                         || lol::ends_with(file, ".z8a")))
+                found.push_back(file);
+        }
+        std::sort(found.begin(), found.end());
+        files.insert(files.end(), found.begin(), found.end());
+    }
+
+    // Previous entries, by location and by content
+    std::vector<entry> old;
+    std::swap(old, m_entries);
+    std::map<std::pair<std::string, std::string>, entry const *> by_path;
+    std::unordered_map<uint64_t, entry const *> by_hash;
+    for (auto const &e : old)
+    {
+        by_path[{ e.path, e.name }] = &e;
+        if (e.hash)
+            by_hash[e.hash] = &e;
+    }
+
+    // Entries that cannot be kept as they are; archive is -1 for cart files
+    struct task { size_t index; int archive; size_t cart; };
+    std::vector<task> tasks;
+    std::vector<std::unique_ptr<pico8::archive>> archives;
+    bool ok = true;
+
+    for (auto const &file : files)
+    {
+        std::error_code ec;
+        uint64_t const size = fs::file_size(file, ec);
+        int64_t const mtime = int64_t(fs::last_write_time(file, ec).time_since_epoch().count());
+        if (ec)
+        {
+            lol::msg::error("%s: cannot read file\n", file.c_str());
+            ok = false;
+            continue;
+        }
+
+        auto unchanged = [&](std::string const &name)
+        {
+            auto it = by_path.find({ file, name });
+            return it != by_path.end() && it->second->size == size && it->second->mtime == mtime
+                 ? it->second : nullptr;
+        };
+
+        if (!lol::ends_with(file, ".z8a"))
+        {
+            std::string const name = pico8::archive::cart_name(file);
+            if (auto e = unchanged(name))
+                m_entries.push_back(*e);
+            else
+            {
+                tasks.push_back(task { m_entries.size(), -1, 0 });
+                m_entries.emplace_back();
+                m_entries.back().path = file;
+                m_entries.back().name = name;
+            }
+            m_entries.back().size = size;
+            m_entries.back().mtime = mtime;
+            continue;
+        }
+
+        auto a = std::make_unique<pico8::archive>();
+        if (!a->open(file))
+        {
+            lol::msg::error("%s: cannot open archive\n", file.c_str());
+            ok = false;
+            continue;
+        }
+
+        for (size_t n = 0; n < a->size(); ++n)
+        {
+            std::string const name = a->get_info(n).name;
+            if (auto e = unchanged(name))
+                m_entries.push_back(*e);
+            else
+            {
+                tasks.push_back(task { m_entries.size(), int(archives.size()), n });
+                m_entries.emplace_back();
+                m_entries.back().path = file;
+                m_entries.back().name = name;
+                m_entries.back().size = size;
+                m_entries.back().mtime = mtime;
+            }
+        }
+        archives.push_back(std::move(a));
+    }
+
+    // Hash or decode the remaining carts on a pool of threads; each task
+    // only touches its own entry
+    std::atomic<size_t> next { 0 };
+    std::atomic<bool> failed { false };
+    auto worker = [&]()
+    {
+        for (size_t n; (n = next++) < tasks.size(); )
+        {
+            auto const &t = tasks[n];
+            entry &e = m_entries[t.index];
+            pico8::cart c;
+
+            if (t.archive >= 0)
+            {
+                if (!c.load(*archives[t.archive], t.cart))
+                {
+                    lol::msg::error("%s: cannot load cart %s\n", e.path.c_str(), e.name.c_str());
+                    e.path.clear();
+                    failed = true;
+                    continue;
+                }
+                describe(c, e);
+                continue;
+            }
+
+            std::ifstream f(e.path, std::ios::binary);
+            std::string const data((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+            e.hash = hash64(data.data(), data.length());
+
+            // Moved or touched carts keep their previous description
+            auto it = by_hash.find(e.hash);
+            if (it != by_hash.end())
+            {
+                entry const &prev = *it->second;
+                e.title = prev.title;
+                e.author = prev.author;
+                e.tokens = prev.tokens;
+                e.code_size = prev.code_size;
+                e.compressed_size = prev.compressed_size;
+                e.thumbnail = prev.thumbnail;
+                continue;
+            }
+
+            if (!c.load(data.data(), data.length()))
+            {
+                lol::msg::error("%s: cannot load cart\n", e.path.c_str());
+                e.path.clear();
+                failed = true;
+                continue;
+            }
+            describe(c, e);
+        }
+    };
+
+    int const threads = jobs > 0 ? jobs : std::max(1, (int)std::thread::hardware_concurrency());
+    std::vector<std::thread> pool;
+    for (int i = 0; i < std::min(threads, (int)tasks.size()); ++i)
+        pool.emplace_back(worker);
+    for (auto &t : pool)
+        t.join();
+
+    // Carts that failed to load are not indexed
+    m_entries.erase(std::remove_if(m_entries.begin(), m_entries.end(),
+                                   [](entry const &e) { return e.path.empty(); }),
+                    m_entries.end());
+
+    return ok && !failed;
+}
+
+std::vector<splore::entry const *> splore::query(std::string const &text) const
+{
+    auto contains = [&](std::string const &s)
+    {
+        auto same = [](char a, char b) { return tolower((uint8_t)a) == tolower((uint8_t)b); };
+        return std::search(s.begin(), s.end(), text.begin(), text.end(), same) != s.end();
+    };
+
+    std::vector<entry const *> ret;
+    for (auto const &e : m_entries)
+        if (contains(e.name) || contains(e.title) || contains(e.author))
+            ret.push_back(&e);
+    return ret;
+}
+
+} // namespace z8
@@ -12,9 +12,21 @@
 
 #pragma once
 
+#include <string>  // std::string
+#include <vector>  // std::vector
+#include <cstdint> // int64_t, uint64_t
+
 // The splore class
 // ————————————————
-// This will be a Splore implementation to access BBS games.
+// A catalogue of carts, for browsing them without touching the cart files
+// again. The index holds the title, author, size statistics and a label
+// thumbnail of carts found in files, directories and archives built with
+// `z8tool archive`, and is saved to a file.
+//
+// Updating the index only decodes carts whose file changed since the last
+// time: files with the same size and modification time are kept as they
+// are, and files with the same content as an indexed one reuse its entry.
+// Decoding is spread across a pool of threads.
 
 namespace z8
 {
@@ -22,10 +34,46 @@ namespace z8
 class splore
 {
 public:
+    static int const thumbnail_size = 32;
+
+    struct entry
+    {
+        std::string path; // cart file, or archive holding the cart
+        std::string name, title, author;
+
+        int64_t mtime = 0;
+        uint64_t size = 0, hash = 0; // of the file, for carts not in archives
+
+        int tokens = 0, code_size = 0, compressed_size = 0;
+
+        // thumbnail_size² label pixels as palette indices, or empty if
+        // the cart has no label
+        std::vector<uint8_t> thumbnail;
+    };
+
     splore()
     {}
 
+    // Print the cart info of a BBS listing image
     bool dump(std::string const &filename);
+    // Print the carts of an archive
+    bool list(std::string const &archive);
+
+    // A missing index file is an empty index
+    bool load_index(std::string const &filename);
+    bool save_index(std::string const &filename) const;
+
+    // Index these carts, directories of carts, and archives, and forget
+    // any other cart; jobs is the number of threads, or 0 for all cores
+    bool update(std::vector<std::string> const &sources, int jobs = 0);
+
+    std::vector<entry> const &entries() const { return m_entries; }
+
+    // Entries whose name, title or author contain the text, ignoring case
+    std::vector<entry const *> query(std::string const &text) const;
+
+private:
+    std::vector<entry> m_entries;
 };
 
 } // namespace z8
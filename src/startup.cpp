@@ -0,0 +1,78 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <chrono>  // std::chrono
+#include <mutex>   // std::mutex
+#include <vector>  // std::vector
+#include <cstdio>  // fprintf
+#include <cstdlib> // std::atexit
+#include <cstring> // strcmp
+
+#include "startup.h"
+
+namespace z8
+{
+
+using steady_clock = std::chrono::steady_clock;
+
+struct phase
+{
+    char const *name;
+    double ms;
+};
+
+static steady_clock::time_point const origin = steady_clock::now();
+static std::mutex mutex;
+static std::vector<phase> phases;
+static bool enabled = false;
+
+// Called with the mutex held
+static void print(size_t n)
+{
+    double const last = n ? phases[n - 1].ms : 0.0;
+    fprintf(stderr, "startup: %9.3f ms  +%8.3f ms  %s\n",
+            phases[n].ms, phases[n].ms - last, phases[n].name);
+}
+
+void startup::mark(char const *name)
+{
+    double const ms = std::chrono::duration<double, std::milli>(steady_clock::now() - origin).count();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto const &p : phases)
+        if (!strcmp(p.name, name))
+            return;
+
+    phases.push_back(phase { name, ms });
+    if (enabled)
+        print(phases.size() - 1);
+}
+
+void startup::enable()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (enabled)
+        return;
+
+    enabled = true;
+    for (size_t n = 0; n < phases.size(); ++n)
+        print(n);
+
+    std::atexit([]() { startup::mark("exit"); });
+}
+
+} // namespace z8
+
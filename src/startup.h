@@ -0,0 +1,42 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+// The startup class
+// —————————————————
+// Timestamps of the phases a process goes through before it does useful
+// work: library initialisation, BIOS loading, Lua state creation, loading
+// the cart and its first frame. Marks are cheap and always recorded, so
+// that phases reached before the command line is parsed are not lost, but
+// they are only printed to stderr once enable() was called.
+//
+// Each phase is only recorded the first time it is reached, so that
+// programs running many VMs report the cost of the first one. Times are
+// counted from the static initialisation of the program.
+
+namespace z8
+{
+
+class startup
+{
+public:
+    // Record that a phase just ended; phase must be a string literal
+    static void mark(char const *phase);
+
+    // Print the marks recorded so far and all the following ones, and the
+    // total time when the program exits
+    static void enable();
+};
+
+} // namespace z8
+
@@ -17,68 +17,230 @@
 #include "synth.h"
 
 #include <lol/noise> // lol::perlin_noise
-#include <cmath>     // std::fabs, std::fmod
+#include <cmath>     // std::fabs, std::fmod, std::floor
+#include <atomic>    // std::atomic
 
 namespace z8
 {
 
-float synth::waveform(int instrument, float advance)
+// Multipliers were measured from PICO-8 WAV exports. Waveforms are
+// inferred from those exports by guessing what the original formulas
+// could be. All functions take the phase t in [0,1[, except noise and
+// phaser which also need the unwrapped phase.
+
+static inline float triangle(float t)
 {
-    using std::fabs, std::fmod;
+    using std::fabs;
+    return 0.5f * (fabs(4.f * t - 2.0f) - 1.0f);
+}
 
-    float t = fmod(advance, 1.f);
+static inline float tilted_saw(float t)
+{
+    static float const a = 0.9f;
+    float ret = t < a ? 2.f * t / a - 1.f
+                      : 2.f * (1.f - t) / (1.f - a) - 1.f;
+    return ret * 0.5f;
+}
+
+static inline float saw(float t)
+{
+    return 0.653f * (t < 0.5f ? t : t - 1.f);
+}
+
+static inline float square(float t)
+{
+    return t < 0.5f ? 0.25f : -0.25f;
+}
+
+static inline float pulse(float t)
+{
+    return t < 1.f / 3 ? 0.25f : -0.25f;
+}
+
+static inline float organ(float t)
+{
+    using std::fabs;
+    float ret = t < 0.5f ? 3.f - fabs(24.f * t - 6.f)
+                         : 1.f - fabs(16.f * t - 12.f);
+    return ret / 9.f;
+}
+
+static inline float noise(float advance)
+{
+    // Spectral analysis indicates this is some kind of brown noise,
+    // but losing almost 10dB per octave. I thought using Perlin noise
+    // would be fun, but it’s definitely not accurate.
+    //
+    // This may help us create a correct filter:
+    // http://www.firstpr.com.au/dsp/pink-noise/
+    static lol::perlin_noise<1> const noise;
     float ret = 0.f;
+    for (float m = 1.75f, d = 1.f; m <= 128; m *= 2.25f, d *= 0.75f)
+        ret += d * noise.eval(lol::vec_t<float, 1>(m * advance));
+    return ret * 0.4f;
+}
 
-    // Multipliers were measured from PICO-8 WAV exports. Waveforms are
-    // inferred from those exports by guessing what the original formulas
-    // could be.
-    switch (instrument)
+static inline float phaser(float t, float advance)
+{
+    // This one has a subfrequency of freq/128 that appears
+    // to modulate two signals using a triangle wave
+    // FIXME: amplitude seems to be affected, too
+    using std::fabs, std::fmod;
+    float k = fabs(2.f * fmod(advance / 128.f, 1.f) - 1.f);
+    float u = fmod(t + 0.5f * k, 1.0f);
+    float ret = fabs(4.f * u - 2.f) - fabs(8.f * t - 4.f);
+    return ret / 6.f;
+}
+
+//
+// Wavetables
+//
+
+// One cycle of each periodic instrument is sampled at startup and played
+// back with linear interpolation. The tables are not band-limited on
+// purpose: PICO-8 itself aliases, and the multipliers above were matched
+// against its raw output.
+//
+// The noise instrument is not periodic, so we bake a long stretch of it
+// instead and loop it. It is generated from the same octave sum as the
+// analytic version, which keeps its spectral shape exactly. The last unit
+// of the table is crossfaded with the preceding stretch so that the loop
+// point is seamless.
+
+static int const wave_size = 2048;
+static int const noise_rate = 512;   // table entries per unit of advance
+static int const noise_period = 64;  // units of advance before looping
+static int const noise_size = noise_rate * noise_period;
+
+struct wavetables
+{
+    wavetables()
     {
-        case INST_TRIANGLE:
-            return 0.5f * (fabs(4.f * t - 2.0f) - 1.0f);
-        case INST_TILTED_SAW:
+        for (int i = 0; i <= wave_size; ++i)
         {
-            static float const a = 0.9f;
-            ret = t < a ? 2.f * t / a - 1.f
-                        : 2.f * (1.f - t) / (1.f - a) - 1.f;
-            return ret * 0.5f;
+            float t = float(i % wave_size) / wave_size;
+            wave[synth::INST_TRIANGLE][i] = triangle(t);
+            wave[synth::INST_TILTED_SAW][i] = tilted_saw(t);
+            wave[synth::INST_SAW][i] = saw(t);
+            wave[synth::INST_SQUARE][i] = square(t);
+            wave[synth::INST_PULSE][i] = pulse(t);
+            wave[synth::INST_ORGAN][i] = organ(t);
         }
-        case INST_SAW:
-            return 0.653f * (t < 0.5f ? t : t - 1.f);
-        case INST_SQUARE:
-            return t < 0.5f ? 0.25f : -0.25f;
-        case INST_PULSE:
-            return t < 1.f / 3 ? 0.25f : -0.25f;
-        case INST_ORGAN:
-            ret = t < 0.5f ? 3.f - fabs(24.f * t - 6.f)
-                           : 1.f - fabs(16.f * t - 12.f);
-            return ret / 9.f;
-        case INST_NOISE:
+
+        for (int i = 0; i < noise_size; ++i)
         {
-            // Spectral analysis indicates this is some kind of brown noise,
-            // but losing almost 10dB per octave. I thought using Perlin noise
-            // would be fun, but it’s definitely not accurate.
-            //
-            // This may help us create a correct filter:
-            // http://www.firstpr.com.au/dsp/pink-noise/
-            static lol::perlin_noise<1> noise;
-            for (float m = 1.75f, d = 1.f; m <= 128; m *= 2.25f, d *= 0.75f)
-                ret += d * noise.eval(lol::vec_t<float, 1>(m * advance));
-            return ret * 0.4f;
-        }
-        case INST_PHASER:
-        {   // This one has a subfrequency of freq/128 that appears
-            // to modulate two signals using a triangle wave
-            // FIXME: amplitude seems to be affected, too
-            float k = fabs(2.f * fmod(advance / 128.f, 1.f) - 1.f);
-            float u = fmod(t + 0.5f * k, 1.0f);
-            ret = fabs(4.f * u - 2.f) - fabs(8.f * t - 4.f);
-            return ret / 6.f;
+            float x = float(i) / noise_rate;
+            float fade = x - float(noise_period - 1);
+            noise_table[i] = fade <= 0.f ? noise(x)
+                           : noise(x) * (1.f - fade) + noise(x - noise_period) * fade;
         }
+        noise_table[noise_size] = noise_table[0];
+    }
+
+    // Interpolated lookup into a table of size n + 1, for x in [0,n[
+    static inline float lookup(float const *table, float x)
+    {
+        int i = int(x);
+        return table[i] + (x - i) * (table[i + 1] - table[i]);
+    }
+
+    float wave[synth::INST_NOISE][wave_size + 1];
+    float noise_table[noise_size + 1];
+};
+
+// Tables are built the first time they are needed
+static wavetables const &get_wavetables()
+{
+    static wavetables const tables;
+    return tables;
+}
+
+// Toggled by benchmarks while VMs may be synthesising on other threads
+static std::atomic<bool> use_wavetables { true };
+
+void synth::set_wavetables(bool enabled)
+{
+    use_wavetables = enabled;
+}
+
+float synth::waveform(int instrument, float advance)
+{
+    using std::fmod;
+
+    float t = fmod(advance, 1.f);
+
+    if (use_wavetables && instrument >= 0 && instrument <= INST_NOISE)
+    {
+        auto const &tables = get_wavetables();
+        if (instrument == INST_NOISE)
+            return tables.lookup(tables.noise_table,
+                                 fmod(advance / noise_period, 1.f) * noise_size);
+        return tables.lookup(tables.wave[instrument], t * wave_size);
+    }
+
+    switch (instrument)
+    {
+        case INST_TRIANGLE: return triangle(t);
+        case INST_TILTED_SAW: return tilted_saw(t);
+        case INST_SAW: return saw(t);
+        case INST_SQUARE: return square(t);
+        case INST_PULSE: return pulse(t);
+        case INST_ORGAN: return organ(t);
+        case INST_NOISE: return noise(advance);
+        case INST_PHASER: return phaser(t, advance);
     }
 
     return 0.0f;
 }
 
+void synth::waveform(int instrument, float const *advance, float *out, int count)
+{
+    using std::floor;
+
+    // The instrument is resolved once so that each loop is branch-free.
+    // Phases are never negative, so x - floor(x) is the same as fmod(x, 1)
+    // but can be vectorised.
+#define WAVEFORM_LOOP(expr) \
+    for (int i = 0; i < count; ++i) \
+    { \
+        float const t = advance[i] - floor(advance[i]); \
+        (void)t; \
+        out[i] = expr; \
+    } \
+    return;
+
+    if (use_wavetables && instrument >= 0 && instrument <= INST_NOISE)
+    {
+        auto const &tables = get_wavetables();
+        if (instrument == INST_NOISE)
+        {
+            // Dividing by a power of two is exact, so the wrapped position
+            // stays strictly below noise_size.
+            float const *table = tables.noise_table;
+            float const scale = 1.f / noise_period;
+            WAVEFORM_LOOP(tables.lookup(table, (advance[i] * scale - floor(advance[i] * scale)) * noise_size))
+        }
+        float const *table = tables.wave[instrument];
+        WAVEFORM_LOOP(tables.lookup(table, t * wave_size))
+    }
+
+    switch (instrument)
+    {
+        case INST_TRIANGLE: WAVEFORM_LOOP(triangle(t))
+        case INST_TILTED_SAW: WAVEFORM_LOOP(tilted_saw(t))
+        case INST_SAW: WAVEFORM_LOOP(saw(t))
+        case INST_SQUARE: WAVEFORM_LOOP(square(t))
+        case INST_PULSE: WAVEFORM_LOOP(pulse(t))
+        case INST_ORGAN: WAVEFORM_LOOP(organ(t))
+        case INST_NOISE: WAVEFORM_LOOP(noise(advance[i]))
+        case INST_PHASER: WAVEFORM_LOOP(phaser(t, advance[i]))
+    }
+
+#undef WAVEFORM_LOOP
+
+    for (int i = 0; i < count; ++i)
+        out[i] = 0.f;
+}
+
 } // namespace z8
 
@@ -35,6 +35,13 @@ public:
     };
 
     static float waveform(int instrument, float advance);
+
+    // Compute count samples of the given instrument, one for each of the
+    // phases in advance[], and store them in out[]
+    static void waveform(int instrument, float const *advance, float *out, int count);
+
+    // Use precomputed wavetables (the default) or the analytic formulas
+    static void set_wavetables(bool enabled);
 };
 
 } // namespace z8
@@ -0,0 +1,546 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#if HAVE_UNISTD_H
+
+#include <lol/msg>    // lol::msg
+#include <lol/utils>  // lol::ends_with
+#include <algorithm>  // std::max, std::remove_if
+#include <chrono>     // std::chrono
+#include <cerrno>     // errno
+#include <csignal>    // signal()
+#include <cstring>    // strerror()
+#include <future>     // std::async
+#include <vector>     // std::vector
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#if __linux__
+#   include <sys/epoll.h>
+#elif __APPLE__ || __FreeBSD__ || __OpenBSD__ || __NetBSD__
+#   define HAVE_KQUEUE 1
+#   include <sys/event.h>
+#else
+#   include <poll.h>
+#endif
+
+#include "telnet.h"
+#include "pico8/vm.h"
+#include "raccoon/vm.h"
+
+namespace z8
+{
+
+//
+// The poller class: epoll on Linux, kqueue on BSD systems, and poll()
+// everywhere else
+//
+
+class telnet::poller
+{
+public:
+    poller()
+    {
+#if __linux__
+        m_fd = epoll_create1(0);
+#elif HAVE_KQUEUE
+        m_fd = kqueue();
+#endif
+    }
+
+    ~poller()
+    {
+#if __linux__ || HAVE_KQUEUE
+        if (m_fd >= 0)
+            ::close(m_fd);
+#endif
+    }
+
+    void add(int fd)
+    {
+#if __linux__
+        epoll_event ev {};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(m_fd, EPOLL_CTL_ADD, fd, &ev);
+#elif HAVE_KQUEUE
+        struct kevent ev;
+        EV_SET(&ev, fd, EVFILT_READ, EV_ADD, 0, 0, nullptr);
+        kevent(m_fd, &ev, 1, nullptr, 0, nullptr);
+#else
+        m_fds.push_back(pollfd { fd, POLLIN, 0 });
+#endif
+    }
+
+    void watch_write(int fd, bool enable)
+    {
+#if __linux__
+        epoll_event ev {};
+        ev.events = enable ? EPOLLIN | EPOLLOUT : EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(m_fd, EPOLL_CTL_MOD, fd, &ev);
+#elif HAVE_KQUEUE
+        struct kevent ev;
+        EV_SET(&ev, fd, EVFILT_WRITE, enable ? EV_ADD : EV_DELETE, 0, 0, nullptr);
+        kevent(m_fd, &ev, 1, nullptr, 0, nullptr);
+#else
+        for (auto &p : m_fds)
+            if (p.fd == fd)
+                p.events = POLLIN | (enable ? POLLOUT : 0);
+#endif
+    }
+
+    void remove(int fd)
+    {
+#if __linux__
+        epoll_ctl(m_fd, EPOLL_CTL_DEL, fd, nullptr);
+#elif HAVE_KQUEUE
+        struct kevent ev[2];
+        EV_SET(&ev[0], fd, EVFILT_READ, EV_DELETE, 0, 0, nullptr);
+        EV_SET(&ev[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, nullptr);
+        kevent(m_fd, ev, 2, nullptr, 0, nullptr);
+#else
+        for (size_t i = 0; i < m_fds.size(); ++i)
+            if (m_fds[i].fd == fd)
+                m_fds.erase(m_fds.begin() + i--);
+#endif
+    }
+
+    // Wait at most timeout milliseconds, then call fn(fd, readable, writable)
+    // for every ready file descriptor
+    template<typename F> void wait(int timeout, F fn)
+    {
+#if __linux__
+        epoll_event events[64];
+        int n = epoll_wait(m_fd, events, 64, timeout);
+        for (int i = 0; i < n; ++i)
+            fn(events[i].data.fd, bool(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)),
+               bool(events[i].events & EPOLLOUT));
+#elif HAVE_KQUEUE
+        struct kevent events[64];
+        timespec ts { timeout / 1000, (timeout % 1000) * 1000000 };
+        int n = kevent(m_fd, nullptr, 0, events, 64, &ts);
+        for (int i = 0; i < n; ++i)
+            fn(int(events[i].ident), events[i].filter == EVFILT_READ,
+               events[i].filter == EVFILT_WRITE);
+#else
+        // Copy the list, since fn() may add or remove descriptors
+        std::vector<pollfd> fds = m_fds;
+        if (::poll(fds.data(), fds.size(), timeout) > 0)
+            for (auto const &p : fds)
+                if (p.revents)
+                    fn(p.fd, bool(p.revents & (POLLIN | POLLHUP | POLLERR)),
+                       bool(p.revents & POLLOUT));
+#endif
+    }
+
+private:
+#if __linux__ || HAVE_KQUEUE
+    int m_fd = -1;
+#else
+    std::vector<pollfd> m_fds;
+#endif
+};
+
+//
+// The telnet server
+//
+
+telnet::telnet()
+  : m_poller(std::make_unique<poller>())
+{
+}
+
+telnet::~telnet()
+{
+    for (auto &it : m_sessions)
+        if (it.second->in > STDERR_FILENO)
+            ::close(it.second->in);
+    if (m_listen >= 0)
+        ::close(m_listen);
+}
+
+void telnet::run(std::string const &cart)
+{
+    m_cart = cart;
+    open_session(STDIN_FILENO, STDOUT_FILENO);
+    loop();
+}
+
+bool telnet::serve(std::string const &cart, int port)
+{
+    m_cart = cart;
+
+    // Clients may disconnect at any time; write() reports it
+    signal(SIGPIPE, SIG_IGN);
+
+    m_listen = socket(AF_INET6, SOCK_STREAM, 0);
+    int const zero = 0, one = 1;
+    setsockopt(m_listen, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(m_listen, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+
+    sockaddr_in6 addr {};
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(uint16_t(port));
+
+    if (m_listen < 0 || bind(m_listen, (sockaddr *)&addr, sizeof(addr)) < 0
+         || listen(m_listen, SOMAXCONN) < 0)
+    {
+        lol::msg::error("cannot listen on port %d: %s\n", port, strerror(errno));
+        return false;
+    }
+
+    fcntl(m_listen, F_SETFL, fcntl(m_listen, F_GETFL) | O_NONBLOCK);
+    m_poller->add(m_listen);
+    m_accepting = true;
+    lol::msg::info("serving %s on port %d\n", cart.c_str(), port);
+    loop();
+    return true;
+}
+
+void telnet::loop()
+{
+    using clock = frame_scheduler::clock;
+    m_scheduler.reset();
+
+    while (m_listen >= 0 || m_sessions.size())
+    {
+        // All sessions share the same clock, and check for input between
+        // frames even when catching up
+        if (int steps = m_scheduler.update())
+        {
+            int dropped = 0;
+            for (auto &it : m_sessions)
+                dropped = std::max(dropped, step(*it.second, steps));
+            m_scheduler.add_dropped(dropped);
+        }
+
+        // Listen again after an accept() error
+        auto deadline = m_scheduler.deadline();
+        if (m_listen >= 0 && !m_accepting)
+        {
+            if (clock::now() >= m_accept_retry)
+            {
+                m_poller->add(m_listen);
+                m_accepting = true;
+            }
+            else
+                deadline = std::min(deadline, m_accept_retry);
+        }
+
+        auto const timeout = std::chrono::ceil<std::chrono::milliseconds>(deadline - clock::now());
+        m_poller->wait(std::max(int(timeout.count()), 0), [&](int fd, bool readable, bool writable)
+        {
+            if (fd == m_listen)
+            {
+                accept_clients();
+                return;
+            }
+
+            auto it = m_sessions.find(fd);
+            if (it == m_sessions.end())
+                return;
+            if (readable)
+                read_input(*it->second);
+            if (writable)
+                flush(*it->second);
+        });
+
+        // Clean up sessions that ended during this iteration
+        for (auto it = m_sessions.begin(); it != m_sessions.end(); )
+        {
+            if (it->second->closed)
+            {
+                close_session(*it->second);
+                if (it->second->loading.valid())
+                    m_closing.push_back(std::move(it->second));
+                it = m_sessions.erase(it);
+            }
+            else
+                ++it;
+        }
+
+        // Closed sessions are only destroyed once their cart is loaded,
+        // since destroying them would wait for it
+        m_closing.erase(std::remove_if(m_closing.begin(), m_closing.end(),
+                                       [&](std::unique_ptr<session> const &s) { return start_session(*s); }),
+                        m_closing.end());
+    }
+}
+
+void telnet::accept_clients()
+{
+    using clock = frame_scheduler::clock;
+
+    for (;;)
+    {
+        int client = accept(m_listen, nullptr, nullptr);
+        if (client >= 0)
+        {
+            open_session(client, client);
+            continue;
+        }
+
+        if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return;
+
+        // Errors such as EMFILE leave the client in the backlog, so the
+        // listening socket stays readable; stop polling it for a while
+        // instead of spinning
+        lol::msg::error("cannot accept client: %s\n", strerror(errno));
+        m_poller->remove(m_listen);
+        m_accepting = false;
+        m_accept_retry = clock::now() + std::chrono::milliseconds(500);
+        return;
+    }
+}
+
+void telnet::open_session(int in, int out)
+{
+    auto s = std::make_unique<session>();
+    s->in = in;
+    s->out = out;
+    s->ansi.set_truecolor(m_truecolor);
+
+    if (in > STDERR_FILENO)
+    {
+        int const one = 1;
+        fcntl(in, F_SETFL, fcntl(in, F_GETFL) | O_NONBLOCK);
+        setsockopt(in, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    // Loading the cart may take a while, and must not block other sessions
+    s->loading = std::async(std::launch::async, [cart = m_cart]()
+    {
+        std::unique_ptr<vm_base> vm;
+        if (lol::ends_with(cart, ".rcn.json"))
+            vm.reset((z8::vm_base *)new raccoon::vm());
+        else
+            vm.reset((z8::vm_base *)new pico8::vm());
+        vm->load(cart);
+        vm->run();
+        return vm;
+    });
+
+    static char const message[] =
+    {
+        '\xff', '\xfb', '\x03', // WILL suppress go ahead (no line buffering)
+        '\xff', '\xfe', '\x22', // DONT linemode (no idea what it does)
+        '\xff', '\xfb', '\x01', // WILL echo (actually disables local echo)
+        '\xff', '\xfd', '\x1f', // DO NAWS (window size negociation)
+    };
+    s->output.assign(message, sizeof(message));
+
+    m_poller->add(in);
+    flush(*s);
+    m_sessions[in] = std::move(s);
+}
+
+void telnet::close_session(session &s)
+{
+    // Restore the terminal state, if the client is still listening
+    s.output += s.ansi.finish();
+    flush(s);
+
+    m_poller->remove(s.in);
+    if (s.in > STDERR_FILENO)
+        ::close(s.in);
+}
+
+bool telnet::start_session(session &s)
+{
+    if (s.vm)
+        return true;
+    if (s.loading.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        return false;
+    s.vm = s.loading.get();
+    return true;
+}
+
+void telnet::read_input(session &s)
+{
+    uint8_t buf[1024];
+    ssize_t n = ::read(s.in, buf, sizeof(buf));
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+    {
+        s.closed = true;
+        return;
+    }
+
+    for (ssize_t i = 0; i < n && !s.closed; ++i)
+    {
+        int key = parse_key(s, buf[i]);
+        if (key < 0)
+            continue;
+
+        switch (key)
+        {
+            /* For now, Escape quits */
+            case 0x1b: s.closed = true; break;
+
+            case 0x144: s.buttons.set(0); break; // left
+            case 0x143: s.buttons.set(1); break; // right
+            case 0x141: s.buttons.set(2); break; // up
+            case 0x142: s.buttons.set(3); break; // down
+            case 'z': case 'Z':
+            case 'c': case 'C':
+            case 'n': case 'N': s.buttons.set(4); break;
+            case 'x': case 'X':
+            case 'v': case 'V':
+            case 'm': case 'M': s.buttons.set(5); break;
+            case '\r': case '\n': s.buttons.set(6); break;
+            case 's': case 'S': s.buttons.set(8); break;
+            case 'f': case 'F': s.buttons.set(9); break;
+            case 'e': case 'E': s.buttons.set(10); break;
+            case 'd': case 'D': s.buttons.set(11); break;
+            case 'a': case 'A': s.buttons.set(12); break;
+            case '\t':
+            case 'q': case 'Q': s.buttons.set(13); break;
+            default:
+                lol::msg::info("Got unknown key %02x\n", key);
+                break;
+        }
+    }
+}
+
+// Feed one byte of input; return a key, or -1 if there is none yet
+int telnet::parse_key(session &s, uint8_t ch)
+{
+    auto &seq = s.seq;
+
+    if (ch != 0x1b && ch != 0xff && seq.length() == 0)
+        return ch;
+
+    seq += char(ch);
+
+    // TELNET commands
+    if (seq[0] == '\xff') // telnet commands
+    {
+        if (seq.length() < 2)
+            return -1; // wait for more data
+
+        if (seq[1] >= '\xfb' && seq[1] <= '\xfe')
+        {
+            if (seq.length() < 3)
+                return -1; // wait for more data
+        }
+        else if (seq[1] == '\xfa') // subnegociation
+        {
+            if (seq.length() < 3)
+                return -1; // wait for more data
+            if (seq[2] == '\x1f')
+            {
+                if (seq.length() < 9)
+                    return -1; // wait for more data
+                s.ansi.set_size(lol::ivec2((uint8_t)seq[3] * 256 + (uint8_t)seq[4],
+                                           (uint8_t)seq[5] * 256 + (uint8_t)seq[6]));
+            }
+        }
+        else if (seq.length() < 3)
+        {
+            return -1;
+        }
+
+        seq.clear();
+        return -1;
+    }
+
+    // Escape sequences
+    if (seq.length() < 2)
+        return -1; // wait for more data
+
+    if (seq[1] == '\x5b')
+    {
+        if (seq.length() < 3)
+            return -1; // wait for more data
+        int ret = 0x100 + seq[2];
+        seq.clear();
+        return ret;
+    }
+
+    seq.clear();
+    return ch == 0x1b ? 0x1b : -1;
+}
+
+int telnet::step(session &s, int steps)
+{
+    if (s.closed || !start_session(s))
+        return 0;
+
+    int const skip = m_scheduler.frames_to_skip(steps, s.vm->get_frame_rate());
+    s.vm->skip_frames(skip);
+
+    for (int n = 0; n < steps; ++n)
+    {
+        for (int i = 0; i < 16; ++i)
+            s.vm->button(i, s.buttons[i]);
+        s.buttons.reset();
+
+        s.vm->step(1.f / 60.f);
+    }
+
+    // Skip this frame if the client has not received the previous one
+    // yet; the encoder only sends what changed since the last one sent
+    if (s.written < s.output.size())
+        return skip;
+
+    s.output += s.ansi.encode(*s.vm);
+    flush(s);
+    return skip;
+}
+
+void telnet::flush(session &s)
+{
+    while (s.written < s.output.size())
+    {
+        ssize_t n = ::write(s.out, s.output.data() + s.written, s.output.size() - s.written);
+        if (n > 0)
+            s.written += size_t(n);
+        else if (n < 0 && errno == EINTR)
+            continue;
+        else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        else
+        {
+            s.closed = true;
+            return;
+        }
+    }
+
+    if (s.written == s.output.size())
+    {
+        s.output.clear();
+        s.written = 0;
+    }
+
+    // Only wait for the socket to be writable when there is something left
+    bool const want_write = s.output.size() > 0;
+    if (want_write != s.want_write && s.in == s.out)
+        m_poller->watch_write(s.out, want_write);
+    s.want_write = want_write;
+}
+
+} // namespace z8
+
+#endif // HAVE_UNISTD_H
+
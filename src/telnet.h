@@ -12,201 +12,87 @@
 
 #pragma once
 
-#include <lol/msg>    // lol::msg
-#include <lol/utils>  // lol::ends_with
-#include <lol/thread> // lol::timer
-#include <lol/vector> // lol::ivec2
-#include <vector>     // std::vector
-
-#if HAVE_UNISTD_H
-#   include <unistd.h>
-#endif
-#if HAVE_SYS_SELECT_H
-#   include <sys/select.h>
-#endif
+#include <bitset>        // std::bitset
+#include <future>        // std::future
+#include <memory>        // std::unique_ptr
+#include <string>        // std::string
+#include <unordered_map> // std::unordered_map
+#include <vector>        // std::vector
 
 #include "zepto8.h"
-#include "pico8/vm.h"
-#include "raccoon/vm.h"
+#include "ansi.h"
+#include "scheduler.h"
 
 // The telnet class
 // ————————————————
-// This is a high-level telnet server that runs a ZEPTO-8 VM.
+// This is a high-level telnet server that runs ZEPTO-8 VMs: either one
+// session on stdin and stdout, for use with socat, or one session per
+// client of a TCP port.
+//
+// All sessions are served by a single event loop, and all VMs are stepped
+// by the same 60 Hz scheduler, catching up together after a slow frame.
+// Output is written without blocking; a session whose previous frame has
+// not been entirely sent yet skips rendering, so that a slow client loses
+// frames rather than stalling everyone else. For the same reason, carts
+// are loaded on another thread, and a session only starts stepping once
+// its VM is ready.
 
 namespace z8
 {
 
-struct telnet
+class telnet
 {
-    std::vector<uint8_t> m_screen;
-    lol::ivec2 m_term_size = lol::ivec2(128, 64);
+public:
+    telnet();
+    ~telnet();
 
-    void run(std::string const &cart)
-    {
-        disable_echo();
-
-        std::unique_ptr<z8::vm_base> vm;
-        if (lol::ends_with(cart, ".rcn.json"))
-            vm.reset((z8::vm_base *)new raccoon::vm());
-        else
-            vm.reset((z8::vm_base *)new pico8::vm());
-        vm->load(cart);
-        vm->run();
-
-        auto const &ram = vm->ram();
-
-        while (true)
-        {
-            lol::timer t;
-
-            for (int i = 0; i < 16; ++i)
-                vm->button(i, 0);
-
-            for (;;)
-            {
-                int key = get_key();
-                if (key < 0)
-                    break;
-
-                switch (key)
-                {
-                    /* For now, Escape quits */
-                    case 0x1b: return;
-
-                    case 0x144: vm->button(0, 1); break; // left
-                    case 0x143: vm->button(1, 1); break; // right
-                    case 0x141: vm->button(2, 1); break; // up
-                    case 0x142: vm->button(3, 1); break; // down
-                    case 'z': case 'Z':
-                    case 'c': case 'C':
-                    case 'n': case 'N': vm->button(4, 1); break;
-                    case 'x': case 'X':
-                    case 'v': case 'V':
-                    case 'm': case 'M': vm->button(5, 1); break;
-                    case '\r': case '\n': vm->button(6, 1); break;
-                    case 's': case 'S': vm->button(8, 1); break;
-                    case 'f': case 'F': vm->button(9, 1); break;
-                    case 'e': case 'E': vm->button(10, 1); break;
-                    case 'd': case 'D': vm->button(11, 1); break;
-                    case 'a': case 'A': vm->button(12, 1); break;
-                    case '\t':
-                    case 'q': case 'Q': vm->button(13, 1); break;
-                    default:
-                        lol::msg::info("Got unknown key %02x\n", key);
-                        break;
-                }
-            }
-
-            vm->step(1.f / 60.f);
-
-            vm->print_ansi(m_term_size,
-                           m_screen.empty() ? nullptr : m_screen.data());
-
-            // FIXME: PICO-8 specific
-            m_screen.resize(0x2000);
-            ::memcpy(m_screen.data(), std::get<0>(ram) + 0x6000, 0x2000);
-
-            t.wait(1.f / 60.f);
-        }
-    }
-
-    void disable_echo()
-    {
-#if HAVE_UNISTD_H
-        uint8_t const message[] =
-        {
-            0xff, 0xfb, 0x03, // WILL suppress go ahead (no line buffering)
-            0xff, 0xfe, 0x22, // DONT linemode (no idea what it does)
-            0xff, 0xfb, 0x01, // WILL echo (actually disables local echo)
-            0xff, 0xfd, 0x1f, // DO NAWS (window size negociation)
-        };
-
-        write(STDOUT_FILENO, message, sizeof(message));
-#endif
-    }
-
-    int get_key()
+    // Send 24-bit colours instead of the 256 xterm colours
+    void set_truecolor(bool enable) { m_truecolor = enable; }
+
+    // Serve the cart on stdin and stdout, until Escape or end of input
+    void run(std::string const &cart);
+
+    // Serve the cart to every client connecting to this port; only
+    // returns if the port cannot be opened
+    bool serve(std::string const &cart, int port);
+
+private:
+    struct session
     {
-#if HAVE_UNISTD_H
-        static std::string seq;
-
-        fd_set fds;
-        FD_ZERO(&fds);
-        FD_SET(STDIN_FILENO, &fds);
-
-        struct timeval tv;
-        tv.tv_sec = tv.tv_usec = 0;
-
-        select(STDIN_FILENO + 1, &fds, NULL, NULL, &tv);
-
-        if (!FD_ISSET(0, &fds))
-            return -1;
-
-        char ch;
-        if (read(STDIN_FILENO, &ch, 1) <= 0)
-            exit(EXIT_SUCCESS);
-
-        if (ch != '\x1b' && ch != '\xff' && seq.length() == 0)
-            return ch;
-
-        seq += ch;
-
-        // TELNET commands
-        if (seq[0] == '\xff') // telnet commands
-        {
-            if (seq[1] >= '\xfb' && seq[1] <= '\xfe')
-            {
-                if (seq[2] == 0)
-                    return -1; // wait for more data
-                goto reset;
-            }
-            else if (seq[1] == '\xfa') // subnegociation
-            {
-                if (seq[2] == 0)
-                    return -1; // wait for more data
-                if (seq[2] != '\x1f')
-                    goto reset; // can’t happen
-                if (seq.length() < 9)
-                    return -1; // wait for more data
-                m_term_size.x = (uint8_t)seq[3] * 256 + (uint8_t)seq[4];
-                m_term_size.y = (uint8_t)seq[5] * 256 + (uint8_t)seq[6];
-                printf("\x1b[2J"); // clear screen
-                m_screen.clear();
-                goto reset;
-            }
-            else if (seq.length() >= 3)
-            {
-                goto reset;
-            }
-
-            return -1;
-        }
-
-        // Escape sequences
-        if (seq[0] == '\x1b')
-        {
-            if (seq[1] == '\x5b')
-            {
-                if (seq[2] == 0)
-                    return -1; // wait for more data
-                int ret = 0x100 + seq[2];
-                seq = "";
-                return ret;
-            }
-            else if (seq[1] == '\x1b')
-            {
-                seq = "";
-                return '\x1b';
-            }
-
-            return -1;
-        }
-
-reset:
-        seq = "";
-#endif
-        return -1;
-    }
+        int in = -1, out = -1;
+        std::unique_ptr<vm_base> vm;
+        std::future<std::unique_ptr<vm_base>> loading;
+
+        ansi_encoder ansi;
+        std::string seq;         // incomplete telnet command or escape sequence
+        std::bitset<16> buttons; // buttons pressed since the last frame
+
+        std::string output;      // waiting to be written
+        size_t written = 0;
+        bool want_write = false, closed = false;
+    };
+
+    void accept_clients();
+    void open_session(int in, int out);
+    void close_session(session &s);
+    bool start_session(session &s); // returns whether the VM is ready
+    void read_input(session &s);
+    int parse_key(session &s, uint8_t ch);
+    int step(session &s, int steps); // returns the frames skipped
+    void flush(session &s);
+    void loop();
+
+    class poller;
+    std::unique_ptr<poller> m_poller;
+
+    std::string m_cart;
+    bool m_truecolor = false;
+    int m_listen = -1;
+    bool m_accepting = false;
+    frame_scheduler::clock::time_point m_accept_retry;
+    frame_scheduler m_scheduler;
+    std::unordered_map<int, std::unique_ptr<session>> m_sessions; // by input fd
+    std::vector<std::unique_ptr<session>> m_closing; // closed, still loading
 };
 
 } // namespace z8
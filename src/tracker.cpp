@@ -0,0 +1,164 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#if HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <algorithm> // std::min, std::max, std::sort, std::unique
+#include <cstring>   // memcmp, memcpy
+
+#include "tracker.h"
+
+namespace z8
+{
+
+// How many generations recent_lines() can look back
+static uint32_t const history_size = 120;
+
+void write_tracker::attach(uint8_t const *data, size_t size)
+{
+    m_data = data;
+    m_shadow.assign(data, data + size);
+    m_lines = std::vector<std::atomic<uint32_t>>((size + line_size - 1) / line_size);
+    m_generation = 0;
+    m_touched.clear();
+    m_stopped = false;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_active = m_watchpoints;
+    m_history.clear();
+    m_hit = hit {};
+}
+
+void write_tracker::record(size_t addr, size_t size)
+{
+    size_t const end = std::min(addr + size, m_shadow.size());
+    if (!m_data || addr >= end)
+        return;
+
+    uint32_t const generation = m_generation.load(std::memory_order_relaxed) + 1;
+    for (size_t line = addr / line_size; line * line_size < end; ++line)
+        touch(line, generation);
+
+    // Every byte written counts, even if its value did not change
+    for (auto const &w : m_active)
+        if (w.start < end && addr < w.end)
+            stop(std::max(w.start, addr), generation);
+
+    memcpy(m_shadow.data() + addr, m_data + addr, end - addr);
+}
+
+bool write_tracker::update(bool check)
+{
+    if (!m_data)
+        return false;
+
+    uint32_t const generation = m_generation.load(std::memory_order_relaxed) + 1;
+    size_t const size = m_shadow.size();
+
+    for (size_t line = 0, off = 0; off < size; ++line, off += line_size)
+    {
+        size_t const len = std::min(line_size, size - off);
+        if (!memcmp(m_data + off, m_shadow.data() + off, len))
+            continue;
+
+        touch(line, generation);
+
+        // Without a record() call, only bytes that changed are known
+        for (auto const &w : m_active)
+        {
+            size_t const start = std::max(w.start, off), end = std::min(w.end, off + len);
+            for (size_t n = start; check && n < end; ++n)
+                if (m_data[n] != m_shadow[n])
+                {
+                    stop(n, generation);
+                    break;
+                }
+        }
+
+        memcpy(m_shadow.data() + off, m_data + off, len);
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_history.emplace_back(generation, std::move(m_touched));
+    while (m_history.front().first + history_size <= generation)
+        m_history.pop_front();
+    m_touched.clear();
+    m_active = m_watchpoints;
+    m_generation.store(generation, std::memory_order_relaxed);
+    return m_stopped && m_hit.generation == generation;
+}
+
+void write_tracker::touch(size_t line, uint32_t generation)
+{
+    if (m_lines[line].load(std::memory_order_relaxed) == generation)
+        return;
+    m_lines[line].store(generation, std::memory_order_relaxed);
+    m_touched.push_back(line);
+}
+
+void write_tracker::stop(size_t address, uint32_t generation)
+{
+    // Only the first hit is kept until resume()
+    if (m_stopped)
+        return;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_hit = hit { address, m_shadow[address], m_data[address], generation };
+    m_stopped = true;
+}
+
+std::vector<size_t> write_tracker::recent_lines(uint32_t count) const
+{
+    std::vector<size_t> ret;
+    uint32_t const now = generation();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto const &h : m_history)
+        if (now - h.first < count)
+            ret.insert(ret.end(), h.second.begin(), h.second.end());
+    std::sort(ret.begin(), ret.end());
+    ret.erase(std::unique(ret.begin(), ret.end()), ret.end());
+    return ret;
+}
+
+void write_tracker::add_watchpoint(size_t start, size_t end)
+{
+    if (start >= end)
+        return;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_watchpoints.push_back(watchpoint { start, end });
+}
+
+void write_tracker::remove_watchpoint(size_t index)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (index < m_watchpoints.size())
+        m_watchpoints.erase(m_watchpoints.begin() + index);
+}
+
+std::vector<write_tracker::watchpoint> write_tracker::get_watchpoints() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_watchpoints;
+}
+
+bool write_tracker::get_hit(hit &h) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    h = m_hit;
+    return m_hit.generation != 0;
+}
+
+} // namespace z8
+
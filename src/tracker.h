@@ -0,0 +1,111 @@
+//
+//  ZEPTO-8 — Fantasy console emulator
+//
+//  Copyright © 2016—2020 Sam Hocevar <sam@hocevar.net>
+//
+//  This program is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <atomic>  // std::atomic
+#include <deque>   // std::deque
+#include <mutex>   // std::mutex
+#include <utility> // std::pair
+#include <vector>  // std::vector
+#include <cstddef> // size_t
+#include <cstdint> // uint8_t, uint32_t
+
+// The write_tracker class
+// ———————————————————————
+// Finds out which parts of a VM’s memory were written, for memory viewers
+// and watchpoints. The VM reports every write made through its memory
+// functions with record(), which stamps the written lines with the current
+// generation and checks watchpoints right away, even when the value
+// written is the one that was already there. Other writes, such as drawing
+// functions writing to the screen, are found by update() at the end of
+// each VM step, which compares the memory with a copy of it, one 16-byte
+// line at a time, and then starts a new generation.
+//
+// record() and update() run on the VM thread; generations, recent lines
+// and watchpoints can be accessed from any thread.
+
+namespace z8
+{
+
+class write_tracker
+{
+public:
+    static constexpr size_t line_size = 16;
+
+    struct watchpoint
+    {
+        size_t start, end; // byte range [start, end)
+    };
+
+    struct hit
+    {
+        size_t address;
+        uint8_t old_value, new_value;
+        uint32_t generation;
+    };
+
+    // Start tracking a memory area, which must not be in use by the VM
+    // thread yet; all lines are reset to generation 0
+    void attach(uint8_t const *data, size_t size);
+
+    // Report a write of size bytes at addr, after it happened; the first
+    // watchpoint hit stops the tracker until resume() is called
+    void record(size_t addr, size_t size);
+
+    // Find the writes that were not recorded and start a new generation;
+    // returns true if a watchpoint was hit during this generation.
+    // Watchpoints are ignored if check is false, e.g. when the VM state
+    // is restored.
+    bool update(bool check = true);
+
+    uint32_t generation() const { return m_generation.load(std::memory_order_relaxed); }
+    size_t lines() const { return m_lines.size(); }
+    uint32_t line_generation(size_t line) const { return m_lines[line].load(std::memory_order_relaxed); }
+
+    // The lines written during the last count generations, so that views
+    // only need to visit those
+    std::vector<size_t> recent_lines(uint32_t count) const;
+
+    void add_watchpoint(size_t start, size_t end);
+    void remove_watchpoint(size_t index);
+    std::vector<watchpoint> get_watchpoints() const;
+
+    // Whether a watchpoint stopped the VM, and the write that did it
+    bool stopped() const { return m_stopped; }
+    bool get_hit(hit &h) const;
+    void resume() { m_stopped = false; }
+
+private:
+    void touch(size_t line, uint32_t generation);
+    void stop(size_t address, uint32_t generation);
+
+    uint8_t const *m_data = nullptr;
+    std::vector<uint8_t> m_shadow;
+    std::vector<std::atomic<uint32_t>> m_lines;
+    std::atomic<uint32_t> m_generation { 0 };
+
+    // VM thread copy of the watchpoints, refreshed at each generation so
+    // that record() needs no lock, and lines written in this generation
+    std::vector<watchpoint> m_active;
+    std::vector<size_t> m_touched;
+
+    mutable std::mutex m_mutex;
+    std::vector<watchpoint> m_watchpoints;
+    // Lines written in each of the last generations, oldest first
+    std::deque<std::pair<uint32_t, std::vector<size_t>>> m_history;
+    hit m_hit {};
+    std::atomic<bool> m_stopped { false };
+};
+
+} // namespace z8
+
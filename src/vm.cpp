@@ -14,74 +14,182 @@
 #   include "config.h"
 #endif
 
-#include <lol/vector> // lol::ivec2
-#include <algorithm>  // std::swap, std::min
-#include <cstring>    // memcmp()
+#include <lol/vector>    // lol::ivec2
+#include <algorithm>     // std::swap, std::min, std::max, std::fill, std::sort
+#include <cstring>       // memcpy()
+#include <string>        // std::string, std::to_string
+#include <unordered_map> // std::unordered_map
+#include <vector>        // std::vector
 
 #include "zepto8.h"
 
 namespace z8
 {
 
-void vm_base::print_ansi(lol::ivec2 term_size,
-                         uint8_t const *prev_screen) const
+//
+// XXH64, as specified in https://github.com/Cyan4973/xxHash
+//
+
+static uint64_t const xxh_prime[] =
+{
+    11400714785074694791ull, 14029467366897019727ull, 1609587929392839161ull,
+    9650029242287828579ull, 2870177450012600261ull,
+};
+
+static inline uint64_t xxh_rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+    return xxh_rotl(acc + input * xxh_prime[1], 31) * xxh_prime[0];
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t val)
+{
+    return (acc ^ xxh_round(0, val)) * xxh_prime[0] + xxh_prime[3];
+}
+
+uint64_t hash64(void const *data, size_t size, uint64_t seed)
 {
-    using std::min;
+    // Words are little-endian, so that hashes are the same on every host
+    auto read32 = [](uint8_t const *p)
+    {
+        return uint64_t(p[0]) | uint64_t(p[1]) << 8 | uint64_t(p[2]) << 16 | uint64_t(p[3]) << 24;
+    };
+    auto read64 = [read32](uint8_t const *p) { return read32(p) | read32(p + 4) << 32; };
 
-    int palette[16];
-    for (int i = 0; i < 16; ++i)
-        palette[i] = get_ansi_color(i);
+    uint8_t const *p = (uint8_t const *)data, *end = p + size;
+    uint64_t h;
 
-    printf("\x1b[?25l"); // hide cursor
+    if (size >= 32)
+    {
+        uint64_t v[4] = { seed + xxh_prime[0] + xxh_prime[1], seed + xxh_prime[1],
+                          seed, seed - xxh_prime[0] };
+        for ( ; p + 32 <= end; p += 32)
+            for (int i = 0; i < 4; ++i)
+                v[i] = xxh_round(v[i], read64(p + 8 * i));
+
+        h = xxh_rotl(v[0], 1) + xxh_rotl(v[1], 7) + xxh_rotl(v[2], 12) + xxh_rotl(v[3], 18);
+        for (int i = 0; i < 4; ++i)
+            h = xxh_merge(h, v[i]);
+    }
+    else
+        h = seed + xxh_prime[4];
 
-    auto &screen = get_screen();
+    h += size;
 
-    for (int y = 0; y < 2 * min(64, term_size.y); y += 2)
+    for ( ; p + 8 <= end; p += 8)
+        h = xxh_rotl(h ^ xxh_round(0, read64(p)), 27) * xxh_prime[0] + xxh_prime[3];
+    if (p + 4 <= end)
     {
-        if (prev_screen && !memcmp(&screen.data[y],
-                                   &prev_screen[y * 64], 128))
-            continue;
+        h = xxh_rotl(h ^ (read32(p) * xxh_prime[0]), 23) * xxh_prime[1] + xxh_prime[2];
+        p += 4;
+    }
+    for ( ; p < end; ++p)
+        h = xxh_rotl(h ^ (*p * xxh_prime[4]), 11) * xxh_prime[0];
+
+    h = (h ^ (h >> 33)) * xxh_prime[1];
+    h = (h ^ (h >> 29)) * xxh_prime[2];
+    return h ^ (h >> 32);
+}
 
-        printf("\x1b[%d;1H", y / 2 + 1);
+uint64_t vm_base::hash_screen() const
+{
+    auto const &screen = get_screen();
+    return hash64(screen.data, sizeof(screen.data));
+}
 
-        int oldfg = -1, oldbg = -1;
+// Default implementations for packed pixel formats; they render to a
+// temporary buffer and convert each pixel.
+void vm_base::render_xrgb8888(uint32_t *screen) const
+{
+    std::vector<lol::u8vec4> tmp(SCREEN_WIDTH * SCREEN_HEIGHT);
+    render(tmp.data());
+    for (auto const &c : tmp)
+        *screen++ = uint32_t(c.r) << 16 | uint32_t(c.g) << 8 | uint32_t(c.b);
+}
 
-        for (int x = 0; x < min(128, term_size.x); ++x)
+void vm_base::render_rgb565(uint16_t *screen) const
+{
+    std::vector<lol::u8vec4> tmp(SCREEN_WIDTH * SCREEN_HEIGHT);
+    render(tmp.data());
+    for (auto const &c : tmp)
+        *screen++ = uint16_t((c.r >> 3) << 11 | (c.g >> 2) << 5 | (c.b >> 3));
+}
+
+int vm_base::render_indexed(uint8_t *screen, uint32_t *palette) const
+{
+    std::vector<uint32_t> tmp(SCREEN_WIDTH * SCREEN_HEIGHT);
+    render_xrgb8888(tmp.data());
+
+    // Colours beyond the 256th one share the last index
+    std::unordered_map<uint32_t, uint8_t> indices;
+    for (auto const &c : tmp)
+    {
+        auto it = indices.find(c);
+        if (it == indices.end())
         {
-            uint8_t fg = screen.get(x, y);
-            uint8_t bg = screen.get(x, y + 1);
-            char const *glyph = "▀";
-
-            if (fg < bg)
-            {
-                std::swap(fg, bg);
-                glyph = "▄";
-            }
-
-            if (fg == oldfg)
-            {
-                if (bg != oldbg)
-                    printf("\x1b[48;5;%dm", palette[bg]);
-            }
-            else
-            {
-                if (bg == oldbg)
-                    printf("\x1b[38;5;%dm", palette[fg]);
-                else
-                    printf("\x1b[38;5;%d;48;5;%dm", palette[fg], palette[bg]);
-            }
-
-            printf("%s", glyph);
-
-            oldfg = fg;
-            oldbg = bg;
+            int const n = (int)indices.size();
+            if (n < 256)
+                palette[n] = c;
+            it = indices.emplace(c, uint8_t(std::min(n, 255))).first;
         }
+        *screen++ = it->second;
+    }
+
+    return (int)std::min(indices.size(), size_t(256));
+}
 
-        printf("\x1b[0m\x1b[K"); // reset properties and clear to end of line
+// Default mixer using the per-channel streamers
+void vm_base::get_audio(int16_t *buffer, int frames, bool stereo)
+{
+    std::vector<int32_t> mix(frames, 0);
+    std::vector<int16_t> tmp(frames);
+    for (int chan = 0; chan < 4; ++chan)
+    {
+        std::fill(tmp.begin(), tmp.end(), 0);
+        get_streamer(chan)(tmp.data(), frames * (int)sizeof(int16_t));
+        for (int i = 0; i < frames; ++i)
+            mix[i] += tmp[i];
     }
 
-    printf("\x1b[?25h"); // show cursor
-    fflush(stdout);
+    for (int i = 0; buffer && i < frames; ++i)
+    {
+        int16_t sample = (int16_t)std::min(std::max(mix[i], -32768), 32767);
+        *buffer++ = sample;
+        if (stereo)
+            *buffer++ = sample;
+    }
+}
+
+std::string stack_samples::folded(std::string const &prefix) const
+{
+    std::string ret;
+    for (auto const &s : stacks)
+    {
+        if (prefix.length())
+            ret += prefix + ';';
+        ret += s.first + ' ' + std::to_string(s.second) + '\n';
+    }
+    return ret;
+}
+
+std::vector<std::pair<std::string, int64_t>> stack_samples::top(size_t count) const
+{
+    std::unordered_map<std::string, int64_t> self;
+    for (auto const &s : stacks)
+    {
+        auto const pos = s.first.rfind(';');
+        self[pos == std::string::npos ? s.first : s.first.substr(pos + 1)] += s.second;
+    }
+
+    std::vector<std::pair<std::string, int64_t>> ret(self.begin(), self.end());
+    std::sort(ret.begin(), ret.end(), [](auto const &a, auto const &b)
+    {
+        return a.second != b.second ? a.second > b.second : a.first < b.first;
+    });
+    if (ret.size() > count)
+        ret.resize(count);
+    return ret;
 }
 
 } // namespace z8
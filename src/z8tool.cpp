@@ -20,6 +20,17 @@
 #include <lol/utils>  // lol::ends_with
 #include <lol/thread> // lol::timer
 #include <fstream>    // std::ofstream
+#include <vector>     // std::vector
+#include <cmath>      // std::fabs
+#include <algorithm>  // std::sort, std::any_of, std::replace
+#include <map>        // std::map
+#include <atomic>     // std::atomic
+#include <thread>     // std::thread
+#include <mutex>      // std::mutex
+#include <functional> // std::function
+#include <filesystem> // std::filesystem
+#include <cstdlib>    // getenv()
+#include <cstring>    // strlen(), strcmp()
 #include <sstream>
 #include <iostream>
 #include <streambuf>
@@ -31,12 +42,23 @@
 #include "zepto8.h"
 #include "pico8/vm.h"
 #include "pico8/pico8.h"
+#include "pico8/archive.h"
+#include "pico8/logger.h"
+#include "pico8/codebench.h"
 #include "raccoon/vm.h"
+#include "ansi.h"
+#include "gif.h"
 #include "telnet.h"
 #include "splore.h"
 #include "dither.h"
 #include "minify.h"
 #include "compress.h"
+#include "synth.h"
+#include "recording.h"
+#include "scheduler.h"
+#include "batch.h"
+#include "startup.h"
+#include "raster.h"
 
 enum class mode
 {
@@ -47,16 +69,129 @@ enum class mode
     luamin,
     listlua,
     printast,
-    convert,
+    convert, archive,
     run, headless, telnet,
+    bench, batch,
 
     dither,
-    compress,
+    compress, codec,
     splore,
 };
 
+static std::unique_ptr<z8::vm_base> make_vm(std::string const &cart)
+{
+    std::unique_ptr<z8::vm_base> vm;
+    if (lol::ends_with(cart, ".rcn.json"))
+        vm.reset((z8::vm_base *)new z8::raccoon::vm());
+    else
+        vm.reset((z8::vm_base *)new z8::pico8::vm());
+    vm->load(cart);
+    return vm;
+}
+
+// Quote a string for JSON output
+static std::string json_string(std::string const &str)
+{
+    std::string ret = "\"";
+    for (char ch : str)
+    {
+        if ((unsigned char)ch < 0x20)
+            ret += lol::format("\\u%04x", ch);
+        else
+            ret += ch == '"' || ch == '\\' ? std::string("\\") + ch : std::string(1, ch);
+    }
+    return ret + "\"";
+}
+
+// Step a VM through one frame of a recording, then compare its screen and
+// the audio generated during the frame with the recorded hashes, or store
+// them in the recording if update is true. Audio is pulled at a fixed
+// rate so that music timing only depends on the frame number.
+static bool replay_frame(z8::vm_base &vm, z8::recording &rec, int frame,
+                         bool update, int &mismatches)
+{
+    rec.replay(vm, frame);
+    bool running = vm.step(1.f / 60.f);
+
+    int64_t const rate = vm.get_audio_rate();
+    int const count = int((frame + 1) * rate / 60 - frame * rate / 60);
+    std::vector<int16_t> audio(count);
+    vm.get_audio(audio.data(), count, false);
+
+    if (update)
+        rec.update(vm, frame, audio.data(), count);
+    else
+    {
+        bool const screen_ok = rec.check(vm, frame);
+        bool const audio_ok = rec.check_audio(frame, audio.data(), count);
+        if (!screen_ok || !audio_ok)
+        {
+            lol::msg::error("frame %d: %s differs from recording\n", frame,
+                            screen_ok ? "audio" : audio_ok ? "screen" : "screen and audio");
+            ++mismatches;
+        }
+    }
+
+    return running;
+}
+
+// Replay golden recordings on their carts; return false if any of them
+// produced different output
+static bool test_golden(std::vector<std::string> const &recordings)
+{
+    int failures = 0;
+    for (auto const &name : recordings)
+    {
+        z8::recording rec;
+        if (!rec.load(name) || rec.cart().empty())
+        {
+            lol::msg::error("%s: no cart to check against\n", name.c_str());
+            ++failures;
+            continue;
+        }
+
+        auto vm = make_vm(rec.cart());
+        rec.restart(*vm);
+        vm->run();
+
+        lol::timer t;
+        int mismatches = 0, frame = 0;
+        while (frame < rec.frames() && replay_frame(*vm, rec, frame, false, mismatches))
+            ++frame;
+
+        printf("%s: %s, %d frames in %.2fs\n", name.c_str(),
+               mismatches ? "FAIL" : "ok", frame, t.get());
+        failures += mismatches ? 1 : 0;
+    }
+    return failures == 0;
+}
+
+// Compare the vector raster kernels with their scalar reference, on rows
+// of every length and alignment, so that the vector tails are covered
+static void test_raster()
+{
+    uint8_t src[80], pal[16], out[2][160];
+    int mismatches = 0;
+    for (int k = 0; k < 1000; ++k)
+    {
+        for (auto &b : src)
+            b = uint8_t(lol::rand(256));
+        for (auto &c : pal)
+            c = uint8_t(lol::rand(256));
+
+        int const offset = k % 16, bytes = k % 65;
+        ::memset(out, 0, sizeof(out));
+        z8::raster::unpack(out[0], src + offset, bytes, pal);
+        z8::raster::unpack_scalar(out[1], src + offset, bytes, pal);
+        mismatches += ::memcmp(out[0], out[1], sizeof(out[0])) ? 1 : 0;
+    }
+    printf("raster: unpack %s\n", mismatches ? "MISMATCH" : "ok");
+}
+
 void test()
 {
+    test_raster();
+
 #if 1
     int const foo[] = { 2, 4, 8, 10, 16, 26, 41, 48, 64, 85, 112, 128, 224, 256 };
     for (int as : foo)
@@ -169,43 +304,619 @@ void test()
         }
     }
 #endif
+
+    // Drawing primitives
+    z8::pico8::vm().bench_tline();
+    z8::pico8::vm().bench_bindings();
+
+    // Compare analytic and wavetable synthesis on ten seconds of audio
+    for (int inst = 0; inst < 8; ++inst)
+    {
+        int const count = 22050 * 10;
+        std::vector<float> phi(count), out[2] = { std::vector<float>(count), std::vector<float>(count) };
+        for (int i = 0; i < count; ++i)
+            phi[i] = 440.f * i / 22050;
+
+        float time[2];
+        for (int k = 0; k < 2; ++k)
+        {
+            z8::synth::set_wavetables(k == 1);
+            lol::timer t;
+            for (int i = 0; i < count; i += 256)
+                z8::synth::waveform(inst, phi.data() + i, out[k].data() + i, std::min(256, count - i));
+            time[k] = t.get();
+        }
+        z8::synth::set_wavetables(true);
+
+        float maxdiff = 0.f;
+        for (int i = 0; i < count; ++i)
+            maxdiff = std::max(maxdiff, std::fabs(out[0][i] - out[1][i]));
+        printf("instrument %d\tanalytic %.2fms\twavetable %.2fms\tmax diff %f\n",
+               inst, time[0] * 1000.f, time[1] * 1000.f, maxdiff);
+    }
+}
+
+// Run carts for a given number of frames as fast as possible, and report
+// frame rate, frame time percentiles and the step/render/audio breakdown.
+static void bench(std::vector<std::string> const &carts, int frames,
+                  std::string const &script, std::string const &replay, bool json,
+                  std::string const &flame, int period)
+{
+    auto const input = z8::batch::load_input(script);
+
+    z8::recording rec;
+    if (replay.length() && !rec.load(replay))
+        return;
+
+    if (json)
+        printf("[\n");
+
+    // Stacks of all carts, each under a root frame named after the cart
+    std::string stacks;
+
+    for (size_t n = 0; n < carts.size(); ++n)
+    {
+        auto const &name = carts[n];
+
+        auto vm = make_vm(name);
+        if (replay.length())
+            rec.restart(*vm);
+        if (flame.length())
+            vm->set_sampling(period);
+        vm->run();
+
+        std::vector<uint32_t> screen(128 * 128);
+        std::vector<int16_t> audio;
+        std::vector<float> times;
+        float step_time = 0.f, render_time = 0.f, audio_time = 0.f;
+        uint64_t buttons = 0;
+        int remainder = 0;
+
+        lol::timer total;
+        for (bool running = true; running && (int)times.size() < frames; )
+        {
+            auto it = input.find((int)times.size());
+            if (it != input.end())
+                buttons = it->second;
+            for (int i = 0; i < 64; ++i)
+                if ((buttons >> i) & 1)
+                    vm->button(i, 1);
+            if (replay.length())
+                rec.replay(*vm, (int)times.size());
+
+            lol::timer t;
+            running = vm->step(1.f / 60.f);
+            float const step = t.get();
+
+            vm->render_xrgb8888(screen.data());
+            vm->clear_dirty();
+            float const render = t.get();
+
+            int const rate = vm->get_audio_rate();
+            int const count = (rate + remainder) / 60;
+            remainder = (rate + remainder) % 60;
+            audio.resize(2 * count);
+            vm->get_audio(audio.data(), count, true);
+            float const sound = t.get();
+
+            step_time += step;
+            render_time += render;
+            audio_time += sound;
+            times.push_back(step + render + sound);
+        }
+        float const elapsed = total.get();
+
+        if (flame.length())
+        {
+            std::string root = std::filesystem::path(name).filename().string();
+            std::replace(root.begin(), root.end(), ';', '_');
+            std::replace(root.begin(), root.end(), ' ', '_');
+            stacks += vm->get_samples().folded(root);
+        }
+
+        int const count = (int)times.size();
+        std::sort(times.begin(), times.end());
+        float const p50 = count ? times[count / 2] : 0.f;
+        float const p99 = count ? times[std::min(count - 1, count * 99 / 100)] : 0.f;
+        float const fps = elapsed > 0.f ? count / elapsed : 0.f;
+        float const scale = count ? 1000.f / count : 0.f;
+
+        if (json)
+        {
+            printf("  { \"cart\": %s, \"frames\": %d, \"fps\": %.1f, "
+                   "\"p50_ms\": %.4f, \"p99_ms\": %.4f, \"step_ms\": %.4f, "
+                   "\"render_ms\": %.4f, \"audio_ms\": %.4f }%s\n",
+                   json_string(name).c_str(), count, fps, p50 * 1000.f, p99 * 1000.f,
+                   step_time * scale, render_time * scale, audio_time * scale,
+                   n + 1 < carts.size() ? "," : "");
+        }
+        else
+        {
+            printf("%s: %d frames, %.1f fps, frame p50 %.3fms p99 %.3fms, "
+                   "step %.3fms render %.3fms audio %.3fms per frame\n",
+                   name.c_str(), count, fps, p50 * 1000.f, p99 * 1000.f,
+                   step_time * scale, render_time * scale, audio_time * scale);
+        }
+    }
+
+    if (json)
+        printf("]\n");
+
+    if (flame.length() && !(std::ofstream(flame, std::ios::binary) << stacks))
+        lol::msg::error("cannot write %s\n", flame.c_str());
+}
+
+// Collects the screen and audio hashes of one batch job, and writes them
+// to a file if requested
+class hash_sink : public z8::batch_sink
+{
+public:
+    hash_sink(std::string const &output) : m_output(output) {}
+
+    virtual void frame(int frame, z8::vm_base const &vm, int16_t const *audio, int count) override
+    {
+        m_screen = vm.hash_screen();
+        m_audio = z8::hash64(audio, count * sizeof(*audio), m_audio);
+        if (m_output.length())
+            m_lines += lol::format("%d %016llx %016llx\n", frame, (unsigned long long)m_screen,
+                                   (unsigned long long)z8::hash64(audio, count * sizeof(*audio)));
+    }
+
+    virtual void done(int frames) override
+    {
+        m_frames = frames;
+        if (m_output.length())
+            std::ofstream(m_output) << m_lines;
+        m_lines.clear();
+    }
+
+    int m_frames = 0;
+    uint64_t m_screen = 0, m_audio = 0;
+
+private:
+    std::string m_output, m_lines;
+};
+
+// Run many carts in parallel, each with its own optional input script
+// given as "cart,script", and report the final screen hash and a hash of
+// all the audio produced for each of them.
+static void batch(std::vector<std::string> const &carts, int frames, int jobs,
+                  std::string const &script, std::string const &output)
+{
+    auto const input = z8::batch::load_input(script);
+
+    std::vector<z8::batch_job> list;
+    std::vector<std::shared_ptr<hash_sink>> sinks;
+    for (auto const &arg : carts)
+    {
+        z8::batch_job job;
+        auto comma = arg.find(',');
+        job.cart = arg.substr(0, comma);
+        job.input = comma == std::string::npos ? input
+                  : z8::batch::load_input(arg.substr(comma + 1));
+        job.frames = frames;
+
+        std::string file;
+        if (output.length())
+        {
+            auto slash = job.cart.find_last_of("/\\");
+            file = output + "/" + job.cart.substr(slash == std::string::npos ? 0 : slash + 1)
+                 + lol::format(".%d.hash", (int)list.size());
+        }
+        sinks.push_back(std::make_shared<hash_sink>(file));
+        job.sink = sinks.back();
+        list.push_back(job);
+    }
+
+    lol::timer t;
+    z8::batch(jobs).run(list);
+    float const elapsed = t.get();
+
+    int total = 0;
+    for (size_t n = 0; n < list.size(); ++n)
+    {
+        printf("%s: %d frames, screen %016llx, audio %016llx\n", list[n].cart.c_str(),
+               sinks[n]->m_frames, (unsigned long long)sinks[n]->m_screen,
+               (unsigned long long)sinks[n]->m_audio);
+        total += sinks[n]->m_frames;
+    }
+    printf("%d frames in %.3fs, %.1f fps\n", total, elapsed,
+           elapsed > 0.f ? total / elapsed : 0.f);
+}
+
+// Convert a cart to the format given by the extension of the output file,
+// optionally replacing its data section with the content of a file
+static bool convert_cart(std::string const &in, std::string const &out,
+                         std::string const &data, bool fast)
+{
+    z8::pico8::cart cart;
+    if (!cart.load(in))
+        return false;
+    if (fast)
+        cart.set_compression(z8::pico8::code::format::pxa_fast);
+
+    if (data.length())
+    {
+        std::string s;
+        if (lol::file::read(lol::sys::get_data_path(data), s))
+        {
+            lol::msg::debug("loaded file %s (%d bytes, max %d)\n",
+                            data.c_str(), int(s.length()), 0x4300);
+            using std::min;
+            memcpy(&cart.get_rom(), s.c_str(), min(s.length(), size_t(0x4300)));
+        }
+    }
+
+    if (lol::ends_with(out, ".bin"))
+    {
+        std::ofstream f(out, std::ios::binary);
+        auto const &bin = cart.get_bin();
+        f.write((char const *)bin.data(), bin.size());
+        return bool(f);
+    }
+    else if (lol::ends_with(out, ".png"))
+        return cart.save_png(out);
+    else
+        return cart.save_p8(out);
+}
+
+// Call fn() for every index in [0, count), on a pool of threads
+static void run_jobs(size_t count, int jobs, std::function<void(size_t)> const &fn)
+{
+    std::atomic<size_t> next { 0 };
+    auto worker = [&]()
+    {
+        for (size_t n; (n = next++) < count; )
+            fn(n);
+    };
+
+    int const threads = jobs > 0 ? jobs : std::max(1, (int)std::thread::hardware_concurrency());
+    std::vector<std::thread> pool;
+    for (int i = 0; i < std::min(threads, (int)count); ++i)
+        pool.emplace_back(worker);
+    for (auto &t : pool)
+        t.join();
+}
+
+// Same as run_jobs(), also writing the text that fn() returns for each index
+// to stdout, in index order and as soon as all previous indices are done
+static void run_jobs_ordered(size_t count, int jobs, std::function<std::string(size_t)> const &fn)
+{
+    std::mutex mutex;
+    std::vector<std::string> results(count);
+    std::vector<bool> done(count);
+    size_t next = 0;
+
+    run_jobs(count, jobs, [&](size_t n)
+    {
+        std::string text = fn(n);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        results[n] = std::move(text);
+        done[n] = true;
+        for ( ; next < count && done[next]; ++next)
+        {
+            fwrite(results[next].data(), 1, results[next].size(), stdout);
+            std::string().swap(results[next]);
+        }
+        fflush(stdout);
+    });
+}
+
+// Convert many carts to a directory, several at a time since compressing
+// the code dominates and each cart is independent. With json, each cart
+// gets one line of JSON with its result and the time it took.
+static bool convert_carts(std::vector<std::string> const &carts, std::string const &dir,
+                          std::string const &ext, std::string const &data, bool fast,
+                          bool json, int jobs)
+{
+    std::error_code ec;
+    std::filesystem::create_directories(dir, ec);
+
+    std::atomic<int> failures { 0 };
+    run_jobs_ordered(carts.size(), jobs, [&](size_t n)
+    {
+        lol::timer t;
+        std::string const name = z8::pico8::archive::cart_name(carts[n]);
+        std::string const out = dir + "/" + name + (ext == "png" ? ".p8.png" : "." + ext);
+        bool const ok = convert_cart(carts[n], out, data, fast);
+        failures += ok ? 0 : 1;
+
+        if (json)
+            return lol::format("{ \"cart\": %s, \"output\": %s, \"ok\": %s, \"wall_ms\": %.3f }\n",
+                               json_string(carts[n]).c_str(), json_string(out).c_str(),
+                               ok ? "true" : "false", t.get() * 1000.f);
+        if (!ok)
+            lol::msg::error("%s: conversion failed\n", carts[n].c_str());
+        return std::string();
+    });
+
+    if (!json)
+        printf("%d carts converted, %d failed\n", int(carts.size()) - failures, int(failures));
+    return failures == 0;
+}
+
+// Replace directories with the files they contain that have one of the
+// given extensions
+static std::vector<std::string> find_files(std::vector<std::string> const &args,
+                                           std::vector<char const *> const &exts)
+{
+    std::vector<std::string> ret;
+    for (auto const &arg : args)
+    {
+        std::error_code ec;
+        if (!std::filesystem::is_directory(arg, ec))
+        {
+            ret.push_back(arg);
+            continue;
+        }
+
+        std::vector<std::string> files;
+        for (auto const &e : std::filesystem::recursive_directory_iterator(arg, ec))
+        {
+            std::string const file = e.path().string();
+            if (e.is_regular_file() && std::any_of(exts.begin(), exts.end(),
+                                                   [&](char const *ext) { return lol::ends_with(file, ext); }))
+                files.push_back(file);
+        }
+        std::sort(files.begin(), files.end());
+        ret.insert(ret.end(), files.begin(), files.end());
+    }
+    return ret;
+}
+
+static std::vector<std::string> find_carts(std::vector<std::string> const &args)
+{
+    return find_files(args, { ".p8", ".png" });
+}
+
+// Token count and code sizes of carts, in the p8tool format or as one line
+// of JSON per cart, which also reports the time spent loading the cart and
+// the whole time spent on it
+static bool cart_stats(std::vector<std::string> const &carts, bool json, int jobs)
+{
+    std::atomic<int> failures { 0 };
+    run_jobs_ordered(carts.size(), jobs, [&](size_t n)
+    {
+        lol::timer t;
+        z8::pico8::cart cart;
+        bool const ok = cart.load(carts[n]);
+        float const load_time = t.get();
+
+        if (!ok)
+        {
+            ++failures;
+            if (json)
+                return lol::format("{ \"cart\": %s, \"error\": \"cannot load cart\", \"wall_ms\": %.3f }\n",
+                                   json_string(carts[n]).c_str(), load_time * 1000.f);
+            lol::msg::error("%s: cannot load cart\n", carts[n].c_str());
+            return std::string();
+        }
+
+        auto const &code = cart.get_code();
+        auto const &original_code = cart.get_rom().code();
+        int const tokens = z8::pico8::code::count_tokens(code);
+        int const compressed = int(cart.get_compressed_code().size());
+        int const capacity = int(sizeof(original_code));
+
+        // Carts compressed with PXA store the size of the compressed code
+        int stored = -1;
+        if (original_code[0] == '\0' && original_code[1] == 'p'
+             && original_code[2] == 'x' && original_code[3] == 'a')
+            stored = original_code[6] * 256 + original_code[7];
+
+        float const wall_time = load_time + t.get();
+
+        if (json)
+            return lol::format("{ \"cart\": %s, \"token_count\": %d, \"code_size\": %d, "
+                               "\"compressed_code_size\": %d, \"stored_code_size\": %s, "
+                               "\"load_ms\": %.3f, \"wall_ms\": %.3f }\n",
+                               json_string(carts[n]).c_str(), tokens, int(code.size()), compressed,
+                               stored < 0 ? "null" : std::to_string(stored).c_str(),
+                               load_time * 1000.f, wall_time * 1000.f);
+
+        std::string ret = lol::format("file_name: %s\n", carts[n].c_str());
+        ret += lol::format("token_count: %d [8192]\n", tokens);
+        ret += lol::format("code_size: %d [65535]\n", int(code.size()));
+        if (stored >= 0)
+            ret += lol::format("stored_code_size: %d [%d]\n", stored, capacity);
+        ret += lol::format("compressed_code_size: %d [%d]\n", compressed, capacity);
+        return ret + "\n";
+    });
+    return failures == 0;
+}
+
+// Print the code of carts, or its syntax tree; when there are several
+// carts, each one starts with a comment naming it
+static bool print_code(std::vector<std::string> const &carts, bool ast, int jobs)
+{
+    std::atomic<int> failures { 0 };
+    run_jobs_ordered(carts.size(), jobs, [&](size_t n)
+    {
+        z8::pico8::cart cart;
+        if (!cart.load(carts[n]))
+        {
+            lol::msg::error("%s: cannot load cart\n", carts[n].c_str());
+            ++failures;
+            return std::string();
+        }
+
+        std::string ret = carts.size() > 1 ? "-- " + carts[n] + "\n" : "";
+        return ret + (ast ? z8::pico8::code::ast(cart.get_code()) : cart.get_code());
+    });
+    return failures == 0;
+}
+
+// Dither one image to a file, using all cores, or many images to a
+// directory, one image per core
+static bool dither_images(std::vector<std::string> const &args, std::string const &out,
+                          std::string const &palette, bool hicolor, bool error_diffusion, int jobs)
+{
+    std::error_code ec;
+    if (args.size() == 1 && !std::filesystem::is_directory(args[0], ec))
+        return z8::dither(args[0], out, palette, hicolor, error_diffusion, jobs);
+
+    if (out.empty())
+    {
+        lol::msg::error("an output directory is needed for several images\n");
+        return false;
+    }
+
+    auto const images = find_files(args, { ".png", ".jpg", ".jpeg", ".bmp" });
+    std::filesystem::create_directories(out, ec);
+
+    std::atomic<int> failures { 0 };
+    run_jobs(images.size(), jobs, [&](size_t n)
+    {
+        std::string const name = std::filesystem::path(images[n]).stem().string();
+        if (!z8::dither(images[n], out + "/" + name + ".png", palette, hicolor, error_diffusion, 1))
+            ++failures;
+    });
+
+    printf("%d images dithered, %d failed\n", int(images.size()) - failures, int(failures));
+    return failures == 0;
+}
+
+// Minify the code of carts and report the token count, the code size and
+// the compressed code size before and after. With no directory, the code
+// of the only cart is printed instead of being saved.
+static bool minify_carts(std::vector<std::string> const &carts, std::string const &dir,
+                         std::string const &ext, int jobs)
+{
+    struct sizes { int tokens, chars, compressed; };
+    struct result { bool ok; sizes before, after; std::string code; };
+    std::vector<result> results(carts.size());
+
+    if (dir.length())
+    {
+        std::error_code ec;
+        std::filesystem::create_directories(dir, ec);
+    }
+
+    auto measure = [](std::string const &code)
+    {
+        return sizes { z8::pico8::code::count_tokens(code), int(code.length()),
+                       int(z8::pico8::code::compress(code, z8::pico8::code::format::pxa).size()) };
+    };
+
+    run_jobs(carts.size(), jobs, [&](size_t n)
+    {
+        auto &r = results[n];
+        z8::pico8::cart cart;
+        if (!(r.ok = cart.load(carts[n])))
+            return;
+
+        r.code = z8::minify(cart.get_code());
+        r.before = measure(cart.get_code());
+        r.after = measure(r.code);
+
+        if (dir.length())
+        {
+            cart.set_code(r.code);
+            std::string const name = dir + "/" + z8::pico8::archive::cart_name(carts[n]);
+            if (ext == "png")
+                r.ok = cart.save_png(name + ".p8.png");
+            else
+                r.ok = cart.save_p8(name + ".p8");
+        }
+    });
+
+    int failures = 0;
+    for (size_t n = 0; n < carts.size(); ++n)
+    {
+        auto const &r = results[n];
+        if (!r.ok)
+        {
+            lol::msg::error("%s: minification failed\n", carts[n].c_str());
+            ++failures;
+            continue;
+        }
+
+        // Keep stdout for the code when printing it
+        FILE *f = dir.length() ? stdout : stderr;
+        fprintf(f, "%s: tokens %d -> %d, chars %d -> %d, compressed %d -> %d\n", carts[n].c_str(),
+                r.before.tokens, r.after.tokens, r.before.chars, r.after.chars,
+                r.before.compressed, r.after.compressed);
+        if (dir.empty())
+            printf("%s\n", r.code.c_str());
+    }
+
+    return failures == 0;
 }
 
 int main(int argc, char **argv)
 {
     lol::sys::init(argc, argv);
+    z8::startup::mark("lol::sys::init");
 
     mode run_mode = mode::none, override_mode = mode::none;
-    std::string in, out, data, palette;
+    std::string in, out, data, palette, outdir, ext = "png";
+    std::vector<std::string> carts;
+    std::string replay, gif, index, query, flame;
+    int frames = 1800, jobs = 0, port = 0, scale = 1, period = 10000;
+    bool json = false, update = false, fast = false, truecolor = false;
+    bool startup_profile = false;
+    int printh_rate = 0;
+    size_t printh_size = 0;
+    bool printh_tags = false;
     size_t raw = 0, skip = 0;
     bool hicolor = false;
     bool error_diffusion = false;
+    int passes = 3, iterations = 0;
+    uint32_t seed = 0;
 
     lol::cli::app app("z8tool");
+    app.add_flag("--startup-profile", startup_profile, "Print the time spent in each startup phase to stderr");
+
+    // For commands that may run many carts, or chatty ones
+    auto add_printh_options = [&](auto *cmd)
+    {
+        cmd->add_option("--printh-rate", printh_rate, "Lines per second each cart may print with printh() (default: no limit)");
+        cmd->add_option("--printh-size", printh_size, "Bytes each cart may print with printh() (default: no limit)");
+        cmd->add_flag("--printh-tags", printh_tags, "Prefix printh() lines with the VM id and frame number");
+    };
 
     // Compatibility with p8tool
-    app.add_subcommand("stats", "Print statistics about a cart")
-        ->callback([&]() { run_mode = mode::stats; })
-        ->add_option("cart", in, "Cartridge to load")->required();
+    auto stats = app.add_subcommand("stats", "Print statistics about carts")
+                     ->callback([&]() { run_mode = mode::stats; });
+    stats->add_flag("--json", json, "Output one line of JSON per cart");
+    stats->add_option("-j,--jobs", jobs, "Number of carts processed in parallel (default: all cores)");
+    stats->add_option("carts", carts, "Cartridges or directories of cartridges")->required();
 
-    app.add_subcommand("listlua", "Extract Lua code from a cart")
-        ->callback([&]() { run_mode = mode::listlua; })
-        ->add_option("cart", in, "Cartridge to load")->required();
+    auto listlua = app.add_subcommand("listlua", "Extract Lua code from carts")
+                       ->callback([&]() { run_mode = mode::listlua; });
+    listlua->add_option("-j,--jobs", jobs, "Number of carts processed in parallel (default: all cores)");
+    listlua->add_option("carts", carts, "Cartridges or directories of cartridges")->required();
 
-    app.add_subcommand("luamin", "Minify the Lua code of a cart")
-        ->callback([&]() { run_mode = mode::luamin; })
-        ->add_option("cart", in, "Cartridge to load")->required();
+    auto luamin = app.add_subcommand("luamin", "Minify the Lua code of carts")
+                      ->callback([&]() { run_mode = mode::luamin; });
+    luamin->add_option("-o,--output-dir", outdir, "Save minified carts to this directory");
+    luamin->add_option("--format", ext, "Format of minified carts: p8 or png (default png)");
+    luamin->add_option("-j,--jobs", jobs, "Number of carts minified in parallel (default: all cores)");
+    luamin->add_option("carts", carts, "Cartridges or directories of cartridges")->required();
 
-    app.add_subcommand("printast", "Print an abstract syntax tree of the code of a cart")
-        ->callback([&]() { run_mode = mode::printast; })
-        ->add_option("cart", in, "Cartridge to load")->required();
+    auto printast = app.add_subcommand("printast", "Print an abstract syntax tree of the code of carts")
+                        ->callback([&]() { run_mode = mode::printast; });
+    printast->add_option("-j,--jobs", jobs, "Number of carts processed in parallel (default: all cores)");
+    printast->add_option("carts", carts, "Cartridges or directories of cartridges")->required();
 
     // Exists as writep8 in p8tool
     auto convert = app.add_subcommand("convert", "Convert a cart to a different format")
                        ->callback([&]() { run_mode = mode::convert; });
     convert->add_option("--data", data, "Binary file to store in the data section");
-    convert->add_option("cart", in, "Source cartridge")->required();
-    convert->add_option("output", out, "Destination cartridge")->required();
+    convert->add_flag("--fast", fast, "Use the fast code compressor");
+    convert->add_option("-o,--output-dir", outdir, "Convert all carts to this directory");
+    convert->add_option("--format", ext, "Format when converting to a directory: p8, png or bin (default png)");
+    convert->add_option("-j,--jobs", jobs, "Number of carts converted in parallel (default: all cores)");
+    convert->add_flag("--json", json, "With --output-dir, output one line of JSON per cart");
+    convert->add_option("carts", carts, "Source and destination cartridges, or source cartridges with --output-dir")
+           ->required();
+
+    // Pack carts into an archive
+    auto archive = app.add_subcommand("archive", "Pack carts into an archive for fast loading")
+                       ->callback([&]() { run_mode = mode::archive; });
+    archive->add_option("-o,--output", out, "Archive file to write")->required();
+    archive->add_option("carts", carts, "Cartridges to add")->required();
 
     // Not in p8tool
     auto run = app.add_subcommand("run", "Run a cart in the terminal")
@@ -213,17 +924,49 @@ int main(int argc, char **argv)
 #if HAVE_UNISTD_H
     run->add_flag_function("--telnet", [&](int64_t) { override_mode = mode::telnet; },
                             "Act as telnet server");
+    run->add_option("--port", port, "With --telnet, serve every client of this TCP port");
 #endif
+    run->add_flag("--truecolor", truecolor, "Use 24-bit colours (default if COLORTERM says so)");
     run->add_flag_function("--headless", [&](int64_t) { override_mode = mode::headless; },
                             "Run without any output");
-    run->add_option("cart", in, "Cartridge to load")->required();;
+    run->add_option("--replay", replay, "Replay input from a recording and check its screen and audio hashes");
+    run->add_flag("--update", update, "Store screen and audio hashes in the recording instead of checking them");
+    run->add_option("-n,--frames", frames, "Number of frames when creating a recording or without --replay a GIF (default 1800)");
+    run->add_option("--gif", gif, "Record the screen to an animated GIF file");
+    run->add_option("--gif-scale", scale, "Scale factor of the GIF (default 1)");
+    add_printh_options(run);
+    run->add_option("cart", in, "Cartridge to load")->required();
+
+    // Benchmark carts
+    auto bench = app.add_subcommand("bench", "Run carts as fast as possible and report timings")
+                     ->callback([&]() { run_mode = mode::bench; });
+    bench->add_option("-n,--frames", frames, "Number of frames to run (default 1800)");
+    bench->add_option("--input", data, "Input script: lines of frame number and button mask");
+    bench->add_option("--replay", replay, "Replay input from a recording");
+    bench->add_flag("--json", json, "Output results as JSON");
+    bench->add_option("--flame", flame, "Write sampled Lua call stacks to a file, for flame graph tools");
+    bench->add_option("--sample-period", period, "Lua instructions between two stack samples (default 10000)");
+    bench->add_option("carts", carts, "Cartridges to load")->required();
 
-#if 0
-    // TODO: splore
-    auto splore = app.add_subcommand("splore", "XXXXX")
+    // Run many carts in parallel
+    auto batch = app.add_subcommand("batch", "Run many carts headless on a pool of threads")
+                     ->callback([&]() { run_mode = mode::batch; });
+    batch->add_option("-j,--jobs", jobs, "Number of worker threads (default: all cores)");
+    batch->add_option("-n,--frames", frames, "Number of frames to run (default 1800)");
+    batch->add_option("--input", data, "Default input script for carts without one");
+    batch->add_option("-o,--output", out, "Directory where per-frame hashes are written");
+    add_printh_options(batch);
+    batch->add_option("carts", carts, "Cartridges to load, each optionally followed by ,<script>")
+         ->required();
+
+    // Browse carts, or keep an index of them
+    auto splore = app.add_subcommand("splore", "List the carts of an archive, or index carts")
                       ->callback([&]() { run_mode = mode::splore; });
-    splore->add_option("-o", out, "file")->required();
-#endif
+    splore->add_option("--index", index, "Index file to update with the given carts, then list");
+    splore->add_option("-q,--query", query, "With --index, only list carts whose name, title or author match");
+    splore->add_option("-j,--jobs", jobs, "Number of carts indexed in parallel (default: all cores)");
+    splore->add_option("carts", carts, "Archive or BBS listing to browse, or with --index, carts, "
+                                       "directories and archives to index");
 
     // Dither an image
     auto dither = app.add_subcommand("dither", "Convert image to a PICO-8 friendly format")
@@ -232,7 +975,9 @@ int main(int argc, char **argv)
           ->type_name("<string>");
     dither->add_flag("--hicolor", hicolor, "High color mode");
     dither->add_flag("--error-diffusion", error_diffusion, "Use Floyd-Steinberg error diffusion");
-    dither->add_option("image", in, "Image to load")->required();
+    dither->add_option("-o,--output", out, "Image to save (default test.png), or directory for several images");
+    dither->add_option("-j,--jobs", jobs, "Number of threads (default: all cores)");
+    dither->add_option("images", carts, "Images or directories of images to load")->required();
 
     // Compress a file
     auto compress = app.add_subcommand("compress", "Compress a stream of data")
@@ -240,112 +985,172 @@ int main(int argc, char **argv)
     compress->add_option("--skip", skip, "Number of source bytes to skip");
     compress->add_option("--raw", raw, "Number of raw bytes to store");
 
+    // Benchmark and fuzz the code compressors
+    auto codec = app.add_subcommand("codec", "Benchmark the code compressors on carts, or fuzz them")
+                     ->callback([&]() { run_mode = mode::codec; });
+    codec->add_option("--passes", passes, "Number of times each cart is compressed (default 3)");
+    codec->add_option("--fuzz", iterations, "Number of fuzzing round trips; carts are then mutated instead of measured");
+    codec->add_option("--seed", seed, "Seed of the fuzzer (default 0)");
+    codec->add_option("-o,--output", out, "Directory where inputs that fail are saved");
+    codec->add_option("carts", carts, "Cartridges or directories of cartridges");
+
     // Internal test suite
     app.add_subcommand("test", "Run the test suite")
-        ->callback([&]() { run_mode = mode::test; });
+        ->callback([&]() { run_mode = mode::test; })
+        ->add_option("recordings", carts, "Golden recordings to check");
 
     CLI11_PARSE(app, argc, argv);
+    z8::startup::mark("command line");
+    if (startup_profile)
+        z8::startup::enable();
 
     if (override_mode != mode::none)
         run_mode = override_mode;
 
-    // Most commands manipulate a cart, so get it right now
-    z8::pico8::cart cart;
+    auto &log = z8::pico8::logger::get();
+    log.set_rate(printh_rate);
+    log.set_max_size(printh_size);
+    log.set_tags(printh_tags);
 
     switch (run_mode)
     {
     case mode::test:
+        if (carts.size())
+            return test_golden(carts) ? EXIT_SUCCESS : EXIT_FAILURE;
         test();
         break;
 
-    case mode::stats: {
-        printf("file_name: %s\n", in.c_str());
-        cart.load(in);
-        auto &code = cart.get_code();
-        int tokens = z8::pico8::code::count_tokens(code);
-
-        printf("token_count: %d [8192]\n", tokens);
-        printf("code_size: %d [65535]\n", int(code.size()));
-        auto const &original_code = cart.get_rom().code();
-        if (original_code[0] == '\0' && original_code[1] == 'p'
-             && original_code[2] == 'x'  && original_code[3] == 'a')
-        {
-            printf("stored_code_size: %d [%d]\n",
-               int(original_code[6] * 256 + original_code[7]), int(sizeof(cart.get_rom().code())));
-        }
-        printf("compressed_code_size: %d [%d]\n",
-               int(cart.get_compressed_code().size()), int(sizeof(cart.get_rom().code())));
+    case mode::stats:
+        return cart_stats(find_carts(carts), json, jobs) ? EXIT_SUCCESS : EXIT_FAILURE;
 
-        printf("\n");
-        break;
-    }
     case mode::listlua:
-        cart.load(in);
-        printf("%s", cart.get_code().c_str());
-        break;
+        return print_code(find_carts(carts), false, jobs) ? EXIT_SUCCESS : EXIT_FAILURE;
 
     case mode::luamin:
-        cart.load(in);
-        std::cout << z8::minify(cart.get_code()) << '\n';
-        break;
-
-    case mode::printast: {
-        cart.load(in);
-        auto &code = cart.get_code();
-        printf("%s", z8::pico8::code::ast(code).c_str());
-        break;
-    }
-    case mode::convert:
-        cart.load(in);
-        if (data.length())
+        carts = find_carts(carts);
+        if (outdir.empty() && carts.size() != 1)
         {
-            std::string s;
-            if (lol::file::read(lol::sys::get_data_path(data), s))
-            {
-                lol::msg::debug("loaded file %s (%d bytes, max %d)\n",
-                                data.c_str(), int(s.length()), 0x4300);
-                using std::min;
-                memcpy(&cart.get_rom(), s.c_str(), min(s.length(), size_t(0x4300)));
-            }
+            lol::msg::error("expected a single cartridge without --output-dir\n");
+            return EXIT_FAILURE;
         }
+        return minify_carts(carts, outdir, ext, jobs) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    case mode::printast:
+        return print_code(find_carts(carts), true, jobs) ? EXIT_SUCCESS : EXIT_FAILURE;
 
-        if (lol::ends_with(out, ".bin"))
+    case mode::convert:
+        if (outdir.empty() && carts.size() != 2)
         {
-            std::ofstream f(out, std::ios::binary);
-            auto const &bin = cart.get_bin();
-            f.write((char const *)bin.data(), bin.size());
+            lol::msg::error("expected a source and a destination cartridge\n");
+            return EXIT_FAILURE;
         }
-        else if (lol::ends_with(out, ".png"))
-            cart.save_png(out);
-        else
-            cart.save_p8(out);
+        if (outdir.empty())
+            return convert_cart(carts[0], carts[1], data, fast) ? EXIT_SUCCESS : EXIT_FAILURE;
+        return convert_carts(find_carts(carts), outdir, ext, data, fast, json, jobs)
+                   ? EXIT_SUCCESS : EXIT_FAILURE;
 
-        break;
+    case mode::archive:
+        return z8::pico8::archive::build(out, carts) ? EXIT_SUCCESS : EXIT_FAILURE;
 
     case mode::headless:
     case mode::run: {
-        std::unique_ptr<z8::vm_base> vm;
-        if (lol::ends_with(in, ".rcn.json"))
-            vm.reset((z8::vm_base *)new z8::raccoon::vm());
-        else
-            vm.reset((z8::vm_base *)new z8::pico8::vm());
-        vm->load(in);
+        auto vm = make_vm(in);
+
+        // When replaying, stop at the end of the recording and report
+        // frames that differ from it. When updating, a missing recording
+        // is created without any input.
+        z8::recording rec;
+        if (replay.length())
+        {
+            if (update && !std::ifstream(replay))
+            {
+                rec.start(*vm, 0);
+                rec.set_cart(in);
+            }
+            else if (rec.load(replay))
+                rec.restart(*vm);
+            else
+                return EXIT_FAILURE;
+
+            if (update && rec.cart().empty())
+                rec.set_cart(in);
+        }
+        int const last = replay.length() ? (rec.frames() ? rec.frames() : frames)
+                       : gif.length() ? frames : -1;
+
+        z8::gif_recorder recorder;
+        if (gif.length() && !recorder.start(gif, scale))
+            return EXIT_FAILURE;
+
+        char const *colorterm = getenv("COLORTERM");
+        z8::ansi_encoder ansi;
+        ansi.set_truecolor(truecolor || (colorterm && (!strcmp(colorterm, "truecolor")
+                                                        || !strcmp(colorterm, "24bit"))));
+
+        // Headless runs go as fast as possible; otherwise the scheduler
+        // keeps the game speed, and skips frames to catch up unless they
+        // are all needed for the replay or the video
+        z8::frame_scheduler scheduler;
+        bool const can_skip = replay.empty() && gif.empty();
+
+        // Loading the cart takes time that the game must not catch up on
         vm->run();
-        for (bool running = true; running; )
+        scheduler.reset();
+        int mismatches = 0;
+        bool running = true;
+        for (int frame = 0; running && frame != last; )
         {
-            lol::timer t;
-            running = vm->step(1.f / 60.f);
+            int steps = 1;
             if (run_mode != mode::headless)
             {
-                vm->print_ansi(lol::ivec2(128, 64), nullptr);
-                t.wait(1.f / 60.f);
+                scheduler.wait();
+                steps = scheduler.update();
+                if (can_skip)
+                    vm->skip_frames(scheduler.skip_frames(steps, vm->get_frame_rate()));
+            }
+
+            for (int n = 0; running && n < steps && frame != last; ++n, ++frame)
+            {
+                running = replay.length() ? replay_frame(*vm, rec, frame, update, mismatches)
+                                          : vm->step(1.f / 60.f);
+                recorder.add_frame(*vm, 1.f / 60.f);
+            }
+
+            if (run_mode != mode::headless && steps)
+            {
+                auto const &s = ansi.encode(*vm);
+                fwrite(s.data(), 1, s.length(), stdout);
+                fflush(stdout);
             }
         }
+
+        if (run_mode != mode::headless)
+        {
+            auto const &s = ansi.finish();
+            fwrite(s.data(), 1, s.length(), stdout);
+            fflush(stdout);
+        }
+
+        if (!recorder.stop())
+            return EXIT_FAILURE;
+        if (update && replay.length() && !rec.save(replay))
+            return EXIT_FAILURE;
+        if (mismatches)
+            return EXIT_FAILURE;
         break;
     }
 
+    case mode::bench:
+        ::bench(carts, frames, data, replay, json, flame, period);
+        break;
+
+    case mode::batch:
+        ::batch(carts, frames, jobs, data, out);
+        break;
+
     case mode::dither:
-        z8::dither(in, out, palette, hicolor, error_diffusion);
+        if (!dither_images(carts, out, palette, hicolor, error_diffusion, jobs))
+            return EXIT_FAILURE;
         break;
 
     case mode::compress: {
@@ -373,14 +1178,48 @@ int main(int argc, char **argv)
         }
         break;
     }
+    case mode::codec: {
+        z8::pico8::code_bench bench;
+        if (!bench.load(find_carts(carts)))
+            return EXIT_FAILURE;
+        if (iterations > 0)
+            return bench.fuzz(iterations, seed, out) ? EXIT_SUCCESS : EXIT_FAILURE;
+        return bench.bench(passes) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
     case mode::splore: {
         z8::splore splore;
-        splore.dump(in);
-        break;
+        if (index.empty())
+        {
+            if (carts.size() != 1)
+            {
+                lol::msg::error("expected a single archive or listing without --index\n");
+                return EXIT_FAILURE;
+            }
+            in = carts[0];
+            if (lol::ends_with(in, ".z8a") ? !splore.list(in) : !splore.dump(in))
+                return EXIT_FAILURE;
+            break;
+        }
+
+        // Without carts, only query the index
+        if (!splore.load_index(index))
+            return EXIT_FAILURE;
+        bool const ok = carts.empty() || splore.update(carts, jobs);
+        if (carts.size() && !splore.save_index(index))
+            return EXIT_FAILURE;
+
+        for (auto const *e : splore.query(query))
+            printf("%s: %s%s%s [%d tokens, %d chars, %d compressed]\n", e->name.c_str(),
+                   e->title.c_str(), e->author.empty() ? "" : " by ", e->author.c_str(),
+                   e->tokens, e->code_size, e->compressed_size);
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
     }
 #if HAVE_UNISTD_H
     case mode::telnet: {
         z8::telnet telnet;
+        telnet.set_truecolor(truecolor);
+        if (port > 0)
+            return telnet.serve(in, port) ? EXIT_SUCCESS : EXIT_FAILURE;
         telnet.run(in);
         break;
     }
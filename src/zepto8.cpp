@@ -18,16 +18,24 @@
 #include <lol/cli>   // lol::cli
 #include <lol/utils> // lol:ends_with
 #include <iostream>  // std::cout
+#include <algorithm> // std::max
 
 #include "zepto8.h"
 #include "player.h"
 #include "raccoon/vm.h"
+#include "pico8/cache.h"
+#include "pico8/bbs.h"
+#include "pico8/cartdata.h"
+#include "startup.h"
 
 int main(int argc, char **argv)
 {
     lol::sys::init(argc, argv);
+    z8::startup::mark("lol::sys::init");
 
-    std::optional<std::string> cart;
+    std::optional<std::string> cart, record, replay, cache, bbs, cartdata;
+    int rewind = 0;
+    bool watch = false, gpu = false, startup_profile = false;
     lol::ivec2 win_size(144 * 4, 144 * 4);
 
     lol::cli::app opts("zepto8");
@@ -43,6 +51,15 @@ int main(int argc, char **argv)
     // -preblit_scale n
     // -draw_rect x,y,w,h
     opts.add_option("-run", cart, "Load and run a cartridge")->type_name("<cart>");
+    opts.add_option("-record", record, "Record input to a file")->type_name("<file>");
+    opts.add_option("-replay", replay, "Replay input from a file")->type_name("<file>");
+    opts.add_option("-rewind", rewind, "Memory budget for rewinding with F5, in MiB")->type_name("<int>");
+    opts.add_option("-cache", cache, "Keep compiled cart code in a directory")->type_name("<dir>");
+    opts.add_option("-bbs", bbs, "Keep downloaded BBS carts in a directory")->type_name("<dir>");
+    opts.add_option("-cartdata", cartdata, "Keep cart persistent data in a directory")->type_name("<dir>");
+    opts.add_flag("-watch", watch, "Hot reload the cartridge when its file changes");
+    opts.add_flag("-gpu", gpu, "Look up the palette and scale the screen on the GPU");
+    opts.add_flag("-startup_profile", startup_profile, "Print the time spent in each startup phase");
     // -x filename
     // -export param_str
     // -p param_str
@@ -61,16 +78,34 @@ int main(int argc, char **argv)
     // -accept_future n
 
     CLI11_PARSE(opts, argc, argv);
+    z8::startup::mark("command line");
+    if (startup_profile)
+        z8::startup::enable();
+
+    if (cache)
+        z8::pico8::code_cache::get().set_directory(*cache);
+    if (bbs)
+        z8::pico8::bbs::get().set_directory(*bbs);
+    if (cartdata)
+        z8::pico8::cartdata_store::get().set_directory(*cartdata);
 
     lol::Application app("zepto8", win_size, 60.0f);
+    z8::startup::mark("window");
 
     bool is_raccoon = cart && lol::ends_with(*cart, ".rcn.json");
 
     z8::player *player = new z8::player(false, is_raccoon);
+    player->set_rewind(size_t(std::max(rewind, 0)) << 20);
+    player->set_watch(watch);
+    player->set_gpu_palette(gpu);
 
     if (cart)
     {
         player->load(*cart);
+        if (replay)
+            player->replay(*replay);
+        else if (record)
+            player->record(*record);
         player->run();
     }
 
@@ -15,10 +15,13 @@
 #include <lol/vector> // lol::ivec2
 #include <string>     // std::string
 #include <tuple>      // std::tuple
+#include <bitset>     // std::bitset
 #include <functional> // std::function
 #include <cassert>    // assert()
 #include <cstddef>
-#include <memory>     // std::unique_ptr
+#include <memory>     // std::unique_ptr, std::shared_ptr
+#include <map>        // std::map
+#include <vector>     // std::vector
 
 // The ZEPTO-8 types
 // —————————————————
@@ -32,6 +35,8 @@ namespace pico8
     class bios; // TODO: get rid of this
 }
 
+class write_tracker;
+
 //
 // A simple 4-bit 2D array
 //
@@ -68,6 +73,61 @@ public:
     uint8_t data[H][W / 2];
 };
 
+//
+// Fast non-cryptographic hash (XXH64), used to compare VM output with
+// golden values; data is read as little-endian words
+//
+
+uint64_t hash64(void const *data, size_t size, uint64_t seed = 0);
+
+//
+// Profiling data for one VM frame
+//
+
+struct profile
+{
+    struct call
+    {
+        std::string name;
+        int count;
+        float time;
+    };
+
+    // Wall-clock seconds spent in the whole frame, in Lua code, and in
+    // each family of API functions. Garbage collection is counted
+    // separately: the work done at the end of the frame, and collections
+    // triggered by the VM inside whichever call caused them.
+    float frame = 0.f, lua = 0.f;
+    float gfx = 0.f, sfx = 0.f, mem = 0.f, other = 0.f;
+    float gc = 0.f;
+
+    // Pixels processed by drawing functions, and audio samples
+    // synthesised by all channels
+    int64_t pixels = 0, samples = 0;
+
+    // Exported functions called during the frame
+    std::vector<call> calls;
+};
+
+//
+// Call stacks of cart code sampled by a VM
+//
+
+struct stack_samples
+{
+    // Number of samples for each stack, whose frames are listed from the
+    // outermost one and separated by semicolons
+    std::map<std::string, int64_t> stacks;
+    int64_t total = 0;
+
+    // The folded stack format of flame graph tools: one line per stack,
+    // followed by its count; frames get the prefix if it is not empty
+    std::string folded(std::string const &prefix = "") const;
+
+    // The functions most often at the top of the stack, with their counts
+    std::vector<std::pair<std::string, int64_t>> top(size_t count) const;
+};
+
 //
 // The generic VM interface
 //
@@ -84,16 +144,86 @@ public:
     virtual void run() = 0;
     virtual bool step(float seconds) = 0;
 
+    // Hot reload: load a new version of the running cart without starting
+    // it again. ROM sections that changed are copied to RAM, and the new
+    // code replaces the cart’s functions but not the values of its other
+    // globals. Returns false if nothing was reloaded, in which case the
+    // cart goes on unchanged; the default is to not support it.
+    virtual bool hot_reload(std::string const &name) { return false; }
+
+    // Make runs reproducible: seed the random number generator, and derive
+    // the clock from the number of calls to step() instead of real time.
+    // This must be called before run().
+    virtual void set_deterministic(uint32_t seed) {}
+
+    // Frame skipping: the cart’s drawing code is not run for the next
+    // count frames it would draw, so that the game logic can catch up on
+    // a slow host; get_frame_rate() is how many frames per second the cart
+    // draws, while step() is always called 60 times per second.
+    virtual void skip_frames(int count) {}
+    virtual float get_frame_rate() const { return 60.f; }
+
     // Rendering
     virtual void render(lol::u8vec4 *screen) const = 0;
+    virtual void render_xrgb8888(uint32_t *screen) const;
+    virtual void render_rgb565(uint16_t *screen) const;
+    // Render the screen as 8-bit indices into a palette of at most 256
+    // xrgb8888 colours, and return the palette size
+    virtual int render_indexed(uint8_t *screen, uint32_t *palette) const;
     virtual u4mat2<128, 128> const &get_screen() const = 0;
     virtual int get_ansi_color(uint8_t c) const = 0;
     // FIXME: get_ansi_color() should be get_rgb(), and render()
     // should be removed in favour of a generic function that
     // uses get_rgb() too.
 
-    void print_ansi(lol::ivec2 term_size = lol::ivec2(128, 64),
-                    uint8_t const *prev_screen = nullptr) const;
+    // Dirty region: bit n is set if row n of the rendered screen may have
+    // changed since the last call to clear_dirty(). Writes made directly
+    // through ram() are not tracked. The default is to report every row.
+    virtual std::bitset<128> get_dirty() const { return std::bitset<128>().set(); }
+    virtual void clear_dirty() {}
+
+    // Report writes made by the cart through its memory functions to a
+    // tracker, or stop if tracker is null. The default reports nothing.
+    virtual void set_write_tracker(write_tracker *tracker) {}
+
+    // Hash of everything that affects the rendered screen; cheaper than
+    // rendering it. The default only hashes get_screen().
+    virtual uint64_t hash_screen() const;
+
+    // Profiling: when enabled, get_profile() describes the last complete
+    // call to step(). The default is to report nothing.
+    virtual void set_profiling(bool enable) {}
+    virtual profile get_profile() const { return profile(); }
+
+    // Sampling profiler: record the call stack of the cart code about once
+    // every period instructions, or stop if period is 0; samples are kept
+    // until sampling is started again. The default is to record nothing.
+    virtual void set_sampling(int period) {}
+    virtual stack_samples get_samples() const { return stack_samples(); }
+
+    // Snapshots: save_state() writes the complete VM state to a buffer of
+    // at least state_size() bytes and returns the number of bytes used, or
+    // 0 on failure; load_state() restores such a state, provided it was
+    // saved by the same build running the same cart, and leaves the VM
+    // untouched otherwise. The default is to not support snapshots.
+    virtual size_t state_size() const { return 0; }
+    virtual size_t save_state(void *data, size_t size) const { return 0; }
+    virtual bool load_state(void const *data, size_t size) { return false; }
+
+    // Checkpoints: in-process copies of the VM state, for exploring many
+    // futures from the same point, e.g. when searching over inputs. They
+    // are not serialised, and successive checkpoints share the memory that
+    // did not change. A checkpoint can be restored into the VM that created
+    // it, or into another VM running the same cart.
+    // The default is to not support checkpoints.
+    class checkpoint
+    {
+    public:
+        virtual ~checkpoint() = default;
+    };
+
+    virtual std::shared_ptr<checkpoint const> save_checkpoint() const { return nullptr; }
+    virtual bool restore_checkpoint(checkpoint const &c) { return false; }
 
     // Code
     virtual std::string const &get_code() const = 0;
@@ -101,6 +231,14 @@ public:
     // Audio streaming
     virtual std::function<void(void *, int)> get_streamer(int channel) = 0;
 
+    // Mixed audio from all channels: frames of interleaved signed 16-bit
+    // samples at get_audio_rate() Hz, one per frame or two if stereo is
+    // true. If buffer is null, the audio state advances as usual but VMs
+    // may skip synthesis. VMs that cannot resample ignore set_audio_rate().
+    virtual void get_audio(int16_t *buffer, int frames, bool stereo);
+    virtual void set_audio_rate(int rate) {}
+    virtual int get_audio_rate() const { return 22050; }
+
     // IO
     virtual void button(int index, int state) = 0;
     virtual void mouse(lol::ivec2 coords, int buttons) = 0;
@@ -110,8 +248,14 @@ public:
     virtual std::tuple<uint8_t *, size_t> ram() = 0;
     virtual std::tuple<uint8_t *, size_t> rom() = 0;
 
+    // Memory that carts keep between runs, for frontends that save it
+    // themselves: in deterministic mode, carts find there what the
+    // frontend restored instead of what the cartdata store holds. The
+    // default is to have none.
+    virtual std::tuple<uint8_t *, size_t> save_ram() { return std::make_tuple(nullptr, 0); }
+
 protected:
-    std::unique_ptr<pico8::bios> m_bios; // TODO: get rid of this
+    std::shared_ptr<pico8::bios const> m_bios; // TODO: get rid of this
 };
 
 enum